@@ -0,0 +1,2014 @@
+/*
+ * Benchmarks for the screamer_tools data paths.
+ *
+ * deframe: fpga_tlp_receive with each deframer implementation
+ * vs the original DWORD-at-a-time state machine, on identical
+ * synthetic LeechCore streams, plus fpga_tlp_receive_batch, with
+ * and without a TLP filter (-f), plus the same stream with bursts
+ * of garbage between frames to time resyncing. Runs without a
+ * Screamer attached.
+ *
+ * codec: decoding TLP headers and encoding completions with
+ * tlp_view (what sac uses), with tlp_decode / tlp_encode, and with
+ * the bitfield structs they replaced, and header length lookups
+ * both ways.
+ *
+ * loopback: what the FT601 link sustains, driving the FPGA's
+ * loopback frame type over a sweep of transfer sizes and queue
+ * depths. Needs a Screamer, or "-n emulate" for an in-process
+ * stand-in (which only measures this side).
+ *
+ * usbfs: the same sweep over the libusb and the usbfs data
+ * paths in turn, looping a recorded stream (-R) through the
+ * FPGA, for the CPU time each takes per MB moved.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+#include <sys/resource.h>
+
+static bool verbose;
+static char *device_spec = "0";
+static bool trust_chip_config;
+static char *loop_sizes = "16,64,256,1024";
+static char *loop_depths = "1,2,4,8";
+static unsigned loop_duration_ms = 1000;
+static char *loop_replay_path;
+static uint32_t *loop_pattern;
+static size_t loop_pattern_dws;
+static char *filter_expr = "type CfgRd0 and reg 0x10 and bus 0";
+
+static int
+parse_opts (int argc,
+            char **argv,
+            char **mode,
+            unsigned *tlp_count,
+            unsigned *iterations,
+            unsigned *transfer_size,
+            char **out_path)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:t:i:s:o:vf:n:FS:q:d:R:")) != -1) {
+    switch (opt) {
+    case 'm':
+      *mode = optarg;
+      break;
+    case 'f':
+      filter_expr = optarg;
+      break;
+    case 't':
+      *tlp_count = strtoul (optarg, NULL, 10);
+      break;
+    case 'i':
+      *iterations = strtoul (optarg, NULL, 10);
+      break;
+    case 's':
+      *transfer_size = strtoul (optarg, NULL, 10) * 1024;
+      break;
+    case 'o':
+      *out_path = optarg;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'n':
+      device_spec = optarg;
+      break;
+    case 'F':
+      trust_chip_config = true;
+      break;
+    case 'S':
+      loop_sizes = optarg;
+      break;
+    case 'q':
+      loop_depths = optarg;
+      break;
+    case 'd':
+      loop_duration_ms = strtoul (optarg, NULL, 10);
+      break;
+    case 'R':
+      loop_replay_path = optarg;
+      break;
+    default: /* '?' */
+      fprintf(stderr, "Usage: %s [-m deframe] [-t tlps] [-i iterations] "
+              "[-s transfer_KiB] [-o stream_file] [-f filter] [-v]\n"
+              "       %s -m codec [-i iterations]\n"
+              "       %s -m loopback [-n index|bus:address|serial:number|emulate] "
+              "[-F] [-S transfer_KiB,...] [-q depth,...] [-d ms_per_point]\n"
+              "       %s -m usbfs [-n index|bus:address|serial:number] "
+              "[-F] [-S transfer_KiB,...] [-q depth,...] [-d ms_per_point] "
+              "[-R replay_file]\n",
+              argv[0], argv[0], argv[0], argv[0]);
+      return -1;
+    }
+  }
+
+  if (*tlp_count == 0 || *iterations == 0 || *transfer_size == 0) {
+    fprintf (stderr, "Bad benchmark parameters\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static uint32_t
+bench_rand (uint64_t *state)
+{
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return (uint32_t) (x >> 16);
+}
+
+static uint32_t
+bench_hash (uint32_t h,
+            const void *data,
+            uint32_t size)
+{
+  uint32_t i;
+  const uint8_t *b = data;
+
+  for (i = 0; i < size; i++) {
+    h = (h ^ b[i]) * 16777619;
+  }
+
+  return h;
+}
+
+/*
+ * Synthetic LeechCore RX stream: a mix of MRd32, CfgRd0, CplD
+ * and MWr64 TLPs, each starting a fresh frame with the unused
+ * slots after LAST marked as idle padding, and the odd run of
+ * FTDI fillers between frames. That is the layout the original
+ * state machine copes with, so both see identical TLPs.
+ */
+static uint32_t *
+bench_stream (unsigned tlp_count,
+              size_t *dword_count)
+{
+  unsigned i;
+  unsigned j;
+  unsigned slot;
+  unsigned len;
+  unsigned payload;
+  size_t cap;
+  size_t n;
+  size_t status_at;
+  uint32_t hdr[4];
+  uint32_t *s;
+  uint64_t rng = 0x5c4ea3e4;
+
+  cap = 1024;
+  n = 0;
+  s = malloc (cap * sizeof (uint32_t));
+  if (s == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < tlp_count; i++) {
+    payload = 0;
+    switch (bench_rand (&rng) % 4) {
+    case 0:
+      hdr[0] = 0x00000001;
+      hdr[1] = 0x01000f0f;
+      hdr[2] = 0xfee00000;
+      len = 3;
+      break;
+    case 1:
+      hdr[0] = 0x04000001;
+      hdr[1] = 0x0000010f;
+      hdr[2] = 0x01000010;
+      len = 3;
+      break;
+    case 2:
+      payload = 1 + bench_rand (&rng) % 32;
+      hdr[0] = 0x4a000000 | payload;
+      hdr[1] = 0x01000004;
+      hdr[2] = 0x00000000;
+      len = 3;
+      break;
+    default:
+      payload = 1 + bench_rand (&rng) % 64;
+      hdr[0] = 0x60000000 | payload;
+      hdr[1] = 0x0000ff0f;
+      hdr[2] = 0;
+      hdr[3] = 0x1000;
+      len = 4;
+      break;
+    }
+
+    len += payload;
+    if (n + (len / 7 + 2) * 8 + 8 > cap) {
+      cap = cap * 2 + len * 2;
+      s = realloc (s, cap * sizeof (uint32_t));
+      if (s == NULL) {
+        return NULL;
+      }
+    }
+
+    if (bench_rand (&rng) % 8 == 0) {
+      j = 1 + bench_rand (&rng) % 5;
+      while (j--) {
+        s[n++] = 0x55556666;
+      }
+    }
+
+    status_at = 0;
+    for (j = 0, slot = 7; j < len; j++, slot++) {
+      if (slot == 7) {
+        status_at = n++;
+        s[status_at] = 0xe0000000;
+        slot = 0;
+      }
+
+      if (j < 4 && j < len - payload) {
+        s[n++] = htobe32 (hdr[j]);
+      } else {
+        s[n++] = bench_rand (&rng);
+      }
+
+      if (j == len - 1) {
+        s[status_at] |= 0x4 << (slot * 4);
+      }
+    }
+
+    for (; slot < 7; slot++) {
+      s[status_at] |= 0xf << (slot * 4);
+      s[n++] = 0;
+    }
+  }
+
+  *dword_count = n;
+  return s;
+}
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t off;
+} mem_dev;
+
+static int
+mem_open (transport_t *t,
+          const char *spec)
+{
+  (void) t;
+  (void) spec;
+  return 0;
+}
+
+static void
+mem_close (transport_t *t)
+{
+  (void) t;
+}
+
+static int
+mem_read (transport_t *t,
+          void **data,
+          int *transferred)
+{
+  size_t len;
+  mem_dev *dev = t->priv;
+
+  if (dev->off == dev->size) {
+    return TRANSPORT_EOF;
+  }
+
+  len = dev->size - dev->off;
+  if (len > t->params.rx_size) {
+    len = t->params.rx_size;
+  }
+
+  *data = dev->data + dev->off;
+  *transferred = len;
+  dev->off += len;
+  return 0;
+}
+
+static int
+mem_write (transport_t *t,
+           void *data,
+           int size,
+           transport_write_cb cb,
+           void *opaque)
+{
+  (void) t;
+  (void) data;
+  (void) size;
+
+  if (cb != NULL) {
+    cb (opaque, 0);
+  }
+  return 0;
+}
+
+static int
+mem_wait (transport_t *t,
+          int *completed)
+{
+  (void) t;
+  return *completed ? 0 : -1;
+}
+
+static const transport_ops mem_transport_ops = {
+  .name = "mem",
+  .open = mem_open,
+  .close = mem_close,
+  .read = mem_read,
+  .write = mem_write,
+  .wait = mem_wait,
+};
+
+/*
+ * The receive state machine fpga_tlp_receive used before the
+ * table-driven deframer, kept as the baseline.
+ */
+typedef enum {
+  STATE_STATUS,
+  STATE_DATA,
+  STATE_REM,
+  STATE_TLP_COMPLETE,
+} legacy_state_t;
+
+typedef struct {
+  uint32_t *p;
+  uint32_t *e;
+  legacy_state_t state;
+  uint32_t status_field;
+  int status_index;
+} legacy_context;
+
+static uint32_t legacy_tlp_dwords[(16 + 1024) / sizeof (uint32_t)];
+
+static tlp_receive_result_t
+legacy_tlp_receive (transport_t *t,
+                    legacy_context *c,
+                    void **tlp_data,
+                    uint32_t *tlp_size)
+{
+  int err;
+  int tlp_dword_index;
+  int tlp_dword_count;
+  bool tlp_header_seen;
+
+  tlp_dword_index = 0;
+  tlp_dword_count = 0;
+  tlp_header_seen = false;
+
+  while (1) {
+    if (c->p == c->e) {
+      int transferred;
+      void *buf;
+
+      err = t->ops->read (t, &buf, &transferred);
+      if (err == TRANSPORT_EOF) {
+        return TLP_END_OF_STREAM;
+      }
+      if (err != 0) {
+        continue;
+      }
+
+      c->p = buf;
+      c->e = c->p + transferred / sizeof (uint32_t);
+      if (c->p == c->e) {
+        if (!tlp_header_seen) {
+          break;
+        }
+        continue;
+      }
+    }
+
+    while (1) {
+      if (c->state == STATE_STATUS) {
+        c->status_index = 0;
+        while (c->p < c->e && *c->p == 0x55556666) {
+          c->p++;
+        }
+
+        if (c->p == c->e) {
+          break;
+        }
+
+        c->status_field = *c->p++;
+        if ((c->status_field & 0xf0000000) != 0xe0000000) {
+          return TLP_OUT_OF_SYNC;
+        } else {
+          c->state = STATE_DATA;
+        }
+      } else if (c->state == STATE_DATA) {
+        if (c->status_index == 7) {
+          c->state = STATE_STATUS;
+          continue;
+        }
+
+        if (!tlp_header_seen) {
+          while (c->p < c->e && *c->p == 0x55556666) {
+            c->p++;
+          }
+        }
+
+        if (c->p == c->e) {
+          break;
+        }
+
+        c->status_index++;
+        if ((c->status_field & 0x03) == 0x00) {
+          legacy_tlp_dwords[tlp_dword_index] = *c->p++;
+
+          if (!tlp_header_seen) {
+            uint32_t len_dw;
+            uint32_t dw = legacy_tlp_dwords[tlp_dword_index];
+
+            len_dw = tlp_packet_len_dws (dw, NULL);
+            tlp_dword_count += len_dw;
+
+            if (len_dw > 1) {
+              tlp_header_seen = true;
+            }
+          }
+          tlp_dword_index++;
+        }
+
+        if ((c->status_field & 0x07) == 0x04) {
+          c->state = STATE_TLP_COMPLETE;
+        }
+
+        c->status_field >>= 4;
+      } else if (c->state == STATE_REM) {
+        if (c->status_index == 7) {
+          c->state = STATE_STATUS;
+          continue;
+        }
+
+        if (c->p == c->e) {
+          break;
+        }
+
+        c->p++;
+        c->status_index++;
+        c->status_field >>= 4;
+      } else if (c->state == STATE_TLP_COMPLETE) {
+        *tlp_data = legacy_tlp_dwords;
+        *tlp_size = tlp_dword_index << 2;
+        c->state = STATE_STATUS;
+        return tlp_dword_index == tlp_dword_count ?
+          TLP_COMPLETE : TLP_CORRUPT;
+      }
+    }
+  }
+
+  return TLP_NO_DATA;
+}
+
+typedef struct {
+  uint64_t tlps;
+  uint64_t corrupt;
+  uint64_t out_of_sync;
+  uint32_t hash;
+  uint64_t ns;
+  uint64_t resync_bytes;
+  uint64_t resync_tlps;
+} bench_result;
+
+static void
+bench_deframe_run (fpga_dev_t *f,
+                   transport_t *t,
+                   mem_dev *dev,
+                   const char *impl,
+                   unsigned iterations,
+                   bench_result *res)
+{
+  unsigned i;
+  void *tlp_data;
+  uint32_t tlp_size;
+  uint64_t start;
+  tlp_receive_result_t state;
+  static tlp_receive_context context;
+  legacy_context legacy;
+
+  memset (res, 0, sizeof (*res));
+  res->hash = 2166136261u;
+
+  for (i = 0; i < iterations; i++) {
+    dev->off = 0;
+    memset (&context, 0, sizeof (context));
+    fpga_rx_context_init (&context, f, NULL);
+    memset (&legacy, 0, sizeof (legacy));
+
+    start = time_now_ns ();
+    do {
+      if (impl == NULL) {
+        state = legacy_tlp_receive (t, &legacy, &tlp_data, &tlp_size);
+      } else {
+        state = fpga_tlp_receive (&context, &tlp_data, &tlp_size);
+      }
+
+      if (state == TLP_COMPLETE) {
+        res->tlps++;
+        if (i == 0) {
+          res->hash = bench_hash (res->hash, tlp_data, tlp_size);
+        }
+      } else if (state == TLP_CORRUPT) {
+        res->corrupt++;
+      } else if (state == TLP_OUT_OF_SYNC) {
+        res->out_of_sync++;
+      }
+    } while (state != TLP_END_OF_STREAM);
+    res->ns += time_now_ns () - start;
+    res->resync_bytes += context.d.resync_dws * sizeof (uint32_t);
+    res->resync_tlps += context.d.resync_tlps;
+  }
+}
+
+/*
+ * Same stream through fpga_tlp_receive_batch, also counting how
+ * many TLPs had to be copied rather than pointed at.
+ */
+static void
+bench_batch_run (fpga_dev_t *f,
+                 mem_dev *dev,
+                 unsigned iterations,
+                 bench_result *res,
+                 uint64_t *copied)
+{
+  int n;
+  int k;
+  unsigned i;
+  uint64_t start;
+  static tlp_receive_context context;
+  static tlp_desc_t descs[256];
+
+  memset (res, 0, sizeof (*res));
+  res->hash = 2166136261u;
+  *copied = 0;
+  fpga_rx_context_init (&context, f, NULL);
+
+  for (i = 0; i < iterations; i++) {
+    dev->off = 0;
+
+    start = time_now_ns ();
+    while ((n = fpga_tlp_receive_batch (&context, descs, 256)) >= 0) {
+      for (k = 0; k < n; k++) {
+        if ((descs[k].flags & TLP_DESC_CORRUPT) != 0) {
+          res->corrupt++;
+          continue;
+        }
+        if ((descs[k].flags & TLP_DESC_RESYNC) != 0) {
+          res->out_of_sync++;
+        }
+
+        res->tlps++;
+        if (i == 0) {
+          res->hash = bench_hash (res->hash, descs[k].data, descs[k].size);
+          if ((descs[k].flags & TLP_DESC_COPIED) != 0) {
+            (*copied)++;
+          }
+        }
+      }
+      fpga_tlp_release (descs, n);
+    }
+    res->ns += time_now_ns () - start;
+  }
+}
+
+/*
+ * Copy of a bench_stream with a burst of 1 to 64 random DWORDs
+ * after about one frame in 256, up to a quarter of the stream.
+ * Returns how many DWORDs it added in *garbage.
+ */
+static uint32_t *
+bench_garble (const uint32_t *stream,
+              size_t dwords,
+              size_t *out_dwords,
+              size_t *garbage)
+{
+  size_t i;
+  size_t n;
+  unsigned j;
+  unsigned len;
+  uint32_t *s;
+  uint64_t rng = 0x9e3779b9;
+
+  s = malloc ((dwords + dwords / 4) * sizeof (uint32_t));
+  if (s == NULL) {
+    return NULL;
+  }
+
+  n = 0;
+  *garbage = 0;
+  for (i = 0; i < dwords; ) {
+    if (stream[i] == 0x55556666) {
+      s[n++] = stream[i++];
+      continue;
+    }
+
+    memcpy (s + n, stream + i, 8 * sizeof (uint32_t));
+    n += 8;
+    i += 8;
+
+    len = 1 + bench_rand (&rng) % 64;
+    if (bench_rand (&rng) % 256 == 0 && *garbage + len <= dwords / 4) {
+      for (j = 0; j < len; j++) {
+        s[n++] = bench_rand (&rng) ^ (bench_rand (&rng) << 16);
+      }
+      *garbage += len;
+    }
+  }
+
+  *out_dwords = n;
+  return s;
+}
+
+/*
+ * Prints one row of the deframe table: throughput and counts per
+ * iteration, then, as given, the hash, the speedup over base, a
+ * MISMATCH if the TLPs differ from expect's, and detail.
+ */
+static void
+bench_report (const char *label,
+              size_t bytes,
+              unsigned iterations,
+              const bench_result *res,
+              bool show_hash,
+              const bench_result *base,
+              const bench_result *expect,
+              const char *detail)
+{
+  printf ("%-8s %8.1f MB/s %10" PRIu64 " TLPs  %6" PRIu64 " corrupt  "
+          "%8" PRIu64 " out-of-sync",
+          label, (double) bytes * iterations * 1000 / res->ns,
+          res->tlps / iterations, res->corrupt / iterations,
+          res->out_of_sync / iterations);
+  if (show_hash) {
+    printf ("  hash %08x", res->hash);
+  }
+  if (base != NULL) {
+    printf ("  %.2fx", (double) base->ns / res->ns);
+  }
+  if (expect != NULL &&
+      (res->hash != expect->hash || res->tlps != expect->tlps)) {
+    printf ("  MISMATCH");
+  }
+  if (detail != NULL) {
+    printf ("  (%s)", detail);
+  }
+  putchar ('\n');
+}
+
+static int
+bench_deframe (unsigned tlp_count,
+               unsigned iterations,
+               unsigned transfer_size,
+               char *out_path)
+{
+  unsigned i;
+  size_t dwords;
+  uint32_t *stream;
+  mem_dev dev;
+  fpga_dev_t *f;
+  transport_t *t;
+  transport_params params;
+  bench_result base;
+  bench_result res;
+  const char *name;
+  char detail[256];
+  static const deframe_kind kinds[] = {
+    DEFRAME_SCALAR,
+    DEFRAME_SSE2,
+    DEFRAME_AVX2,
+  };
+
+  stream = bench_stream (tlp_count, &dwords);
+  if (stream == NULL) {
+    fprintf (stderr, "Couldn't generate stream\n");
+    return -1;
+  }
+
+  printf ("%u TLPs, %zu bytes of stream, %u KiB transfers, %u iterations\n",
+          tlp_count, dwords * sizeof (uint32_t),
+          transfer_size / 1024, iterations);
+
+  if (out_path != NULL) {
+    FILE *out = fopen (out_path, "wb");
+
+    if (out == NULL ||
+        fwrite (stream, sizeof (uint32_t), dwords, out) != dwords) {
+      fprintf (stderr, "Couldn't write %s\n", out_path);
+    }
+    if (out != NULL) {
+      fclose (out);
+    }
+  }
+
+  memset (&params, 0, sizeof (params));
+  params.rx_size = transfer_size;
+  t = transport_open (&mem_transport_ops, "", &params);
+  if (t == NULL) {
+    return -1;
+  }
+
+  dev.data = (void *) stream;
+  dev.size = dwords * sizeof (uint32_t);
+  t->priv = &dev;
+  f = fpga_attach (t, 0);
+  if (f == NULL) {
+    transport_close (t);
+    return -1;
+  }
+
+  bench_deframe_run (f, t, &dev, NULL, iterations, &base);
+  bench_report ("legacy", dev.size, iterations, &base, true, NULL, NULL,
+                NULL);
+
+  for (i = 0; i < sizeof (kinds) / sizeof (kinds[0]); i++) {
+    name = deframe_select (kinds[i]);
+    if (name == NULL) {
+      continue;
+    }
+
+    bench_deframe_run (f, t, &dev, name, iterations, &res);
+    bench_report (name, dev.size, iterations, &res, true, &base, &base,
+                  NULL);
+  }
+
+  {
+    uint64_t copied;
+
+    name = deframe_select (DEFRAME_AUTO);
+    bench_batch_run (f, &dev, iterations, &res, &copied);
+    snprintf (detail, sizeof (detail), "batch/%s, %.1f%% copied", name,
+              res.tlps != 0 ? copied * 100.0 * iterations / res.tlps : 0);
+    bench_report ("batch", dev.size, iterations, &res, true, &base, &base,
+                  detail);
+  }
+
+  {
+    uint64_t copied;
+    tlp_filter *filter;
+
+    filter = tlp_filter_compile (filter_expr);
+    if (filter != NULL) {
+      fpga_set_filter (f, filter);
+      bench_batch_run (f, &dev, iterations, &res, &copied);
+      fpga_set_filter (f, NULL);
+      tlp_filter_free (filter);
+      snprintf (detail, sizeof (detail), "batch/%s, %.1f%% copied, \"%s\"",
+                name,
+                res.tlps != 0 ? copied * 100.0 * iterations / res.tlps : 0,
+                filter_expr);
+      bench_report ("filter", dev.size, iterations, &res, true, &base, NULL,
+                    detail);
+    }
+  }
+
+  {
+    size_t garbage;
+    size_t garbled_dwords;
+    uint32_t *garbled;
+
+    garbled = bench_garble (stream, dwords, &garbled_dwords, &garbage);
+    if (garbled == NULL) {
+      fprintf (stderr, "Couldn't generate stream\n");
+    } else {
+      dev.data = (void *) garbled;
+      dev.size = garbled_dwords * sizeof (uint32_t);
+      bench_deframe_run (f, t, &dev, name, iterations, &res);
+      snprintf (detail, sizeof (detail), "%s, %zu bytes of garbage, "
+                "%" PRIu64 " bytes skipped, %" PRIu64 " TLPs dropped",
+                name, garbage * sizeof (uint32_t),
+                res.resync_bytes / iterations, res.resync_tlps / iterations);
+      bench_report ("resync", dev.size, iterations, &res, false, NULL, NULL,
+                    detail);
+      free (garbled);
+    }
+  }
+
+  fpga_detach (f);
+  t->priv = NULL;
+  transport_close (t);
+  free (stream);
+  return 0;
+}
+
+/*
+ * The bitfield structs screamer.h used to describe TLP headers
+ * with, and the functions that went with them, to compare
+ * tlp_decode / tlp_encode against. The layout only holds on
+ * little-endian hosts whose compiler allocates bitfields from the
+ * low bit up.
+ */
+typedef union {
+  uint32_t _dw;
+  struct {
+    uint16_t length : 10;
+    uint16_t at : 2;
+    uint16_t attr : 2;
+    uint16_t ep : 1;
+    uint16_t td : 1;
+    uint8_t r1 : 4;
+    uint8_t tc : 3;
+    uint8_t r2 : 1;
+    union {
+      uint8_t _fmt_type;
+      struct {
+        uint8_t type : 5;
+        uint8_t fmt : 3;
+      };
+    };
+  };
+} legacy_tlp_header_t;
+
+typedef struct {
+  legacy_tlp_header_t hdr;
+  uint8_t first_be : 4;
+  uint8_t last_be : 4;
+  uint8_t tag;
+  union {
+    uint16_t _rid;
+    struct {
+      uint8_t rid_fn : 3;
+      uint8_t rid_dev : 5;
+      uint8_t rid_bus;
+    };
+  };
+  uint8_t r1 : 2;
+  uint8_t reg_num : 6;
+  uint8_t ext_reg_num : 4;
+  uint8_t r2 : 4;
+  union {
+    uint16_t _cid;
+    struct {
+      uint8_t cid_fn : 3;
+      uint8_t cid_dev : 5;
+      uint8_t cid_bus;
+    };
+  };
+} legacy_tlp_cfg_t;
+
+typedef struct {
+  legacy_tlp_header_t hdr;
+  uint8_t first_be : 4;
+  uint8_t last_be : 4;
+  uint8_t tag;
+  union {
+    uint16_t _rid;
+    struct {
+      uint8_t rid_fn : 3;
+      uint8_t rid_dev : 5;
+      uint8_t rid_bus;
+    };
+  };
+  uint32_t address;
+} legacy_tlp_mrd32_t;
+
+typedef struct {
+  legacy_tlp_header_t hdr;
+  uint16_t byte_count : 12;
+  uint16_t bcm : 1;
+  uint16_t status : 3;
+  union {
+    uint16_t _cid;
+    struct {
+      uint8_t cid_fn : 3;
+      uint8_t cid_dev : 5;
+      uint8_t cid_bus;
+    };
+  };
+  uint8_t lower_address : 7;
+  uint8_t r1 : 1;
+  uint8_t tag;
+  union {
+    uint16_t _rid;
+    struct {
+      uint8_t rid_fn : 3;
+      uint8_t rid_dev : 5;
+      uint8_t rid_bus;
+    };
+  };
+} legacy_tlp_cpl_t;
+
+/*
+ * legacy_packet_to_host copies a TLP digest along with the
+ * header, hence _dws.
+ */
+typedef union {
+  legacy_tlp_header_t hdr;
+  legacy_tlp_cfg_t    cfg;
+  legacy_tlp_cpl_t    cpl;
+  legacy_tlp_mrd32_t  mrd32;
+  uint32_t            _dws[TLP_MAX_HEADER_DWS + 1];
+} legacy_tlp_t;
+
+static int
+legacy_hdr_len_dws (legacy_tlp_header_t *tlp_header,
+                    int *payload_len_dws)
+{
+  int len;
+  int count;
+
+  if (tlp_header->fmt == 4) {
+    *payload_len_dws = 0;
+    return 1;
+  }
+
+  count = 0;
+  len = tlp_header->length;
+  if (len == 0) {
+    len = 0x400;
+  }
+
+  switch (tlp_header->fmt) {
+  case 0:
+    count = 3;
+    *payload_len_dws = 0;
+    break;
+  case 1:
+    count = 4;
+    *payload_len_dws = 0;
+    break;
+  case 2:
+    count = 3 + len;
+    *payload_len_dws = len;
+    break;
+  case 3:
+    count = 4 + len;
+    *payload_len_dws = len;
+  }
+
+  return count + tlp_header->td;
+}
+
+static void *
+legacy_packet_to_host (void *data,
+                       legacy_tlp_t *tlp,
+                       int *payload_len_dws)
+{
+  int i;
+  int len_dws;
+  uint32_t *s = data;
+  uint32_t *d = (void *) tlp;
+  legacy_tlp_header_t hdr;
+
+  do {
+    hdr._dw = be32toh (*s);
+    len_dws = legacy_hdr_len_dws (&hdr, payload_len_dws);
+  } while (len_dws == 1 && s++);
+
+  len_dws -= *payload_len_dws;
+  for (i = 0; i < len_dws; i++) {
+    *d++ = be32toh (*s++);
+  }
+
+  return s;
+}
+
+static void *
+legacy_host_to_packet (legacy_tlp_t *tlp,
+                       void *out)
+{
+  int i;
+  int len_dws;
+  int payload_len_dws;
+  uint32_t *s = (void *) tlp;
+  uint32_t *d = out;
+
+  len_dws = legacy_hdr_len_dws (&tlp->hdr, &payload_len_dws);
+  len_dws -= payload_len_dws;
+  for (i = 0; i < len_dws; i++) {
+    *d++ = htobe32 (*s++);
+  }
+
+  return d;
+}
+
+#define BENCH_CODEC_TLPS    4096
+
+/*
+ * Random MRd32, CfgRd0, CfgWr0, Cpl and CplD headers (the types
+ * the bitfield structs model), one per 4-DWORD slot, as received.
+ */
+static void
+bench_codec_tlps (uint32_t *tlps)
+{
+  unsigned i;
+  uint32_t *h;
+  uint64_t rng = 0x7f4a7c15;
+
+  for (i = 0; i < BENCH_CODEC_TLPS; i++) {
+    h = &tlps[i * 4];
+    h[1] = bench_rand (&rng) | (bench_rand (&rng) << 16);
+    h[2] = bench_rand (&rng) | (bench_rand (&rng) << 16);
+    h[3] = 0;
+    switch (bench_rand (&rng) % 5) {
+    case 0:
+      h[0] = (TLP_MRd32 << 24) | (bench_rand (&rng) & 0x3ff);
+      break;
+    case 1:
+      h[0] = (TLP_CfgRd0 << 24) | 1;
+      h[2] &= 0xffff0ffc;
+      break;
+    case 2:
+      h[0] = (TLP_CfgWr0 << 24) | 1;
+      h[2] &= 0xffff0ffc;
+      break;
+    case 3:
+      h[0] = (TLP_Cpl << 24);
+      h[2] &= 0xffffff7f;
+      break;
+    default:
+      h[0] = (TLP_CplD << 24) | (1 + bench_rand (&rng) % 32);
+      h[2] &= 0xffffff7f;
+      break;
+    }
+    h[0] |= (bench_rand (&rng) & 0x7) << 20;
+    h[0] |= (bench_rand (&rng) & 0x3) << 12;
+    h[0] |= (bench_rand (&rng) & 0x1) << 15;
+
+    h[0] = htobe32 (h[0]);
+    h[1] = htobe32 (h[1]);
+    h[2] = htobe32 (h[2]);
+  }
+}
+
+static inline uint32_t
+bench_mix (uint32_t h,
+           uint32_t v)
+{
+  return (h ^ v) * 16777619;
+}
+
+/*
+ * Decodes each header, folds in the fields a consumer would look
+ * at, and encodes a completion for config requests, as sac does.
+ */
+static uint32_t
+bench_codec_bitfield (const uint32_t *tlps)
+{
+  unsigned i;
+  int payload_len_dws = 0;
+  uint32_t h = 2166136261u;
+  uint32_t out[4];
+  uint32_t *e;
+  legacy_tlp_t tlp;
+  legacy_tlp_t cpl;
+
+  for (i = 0; i < BENCH_CODEC_TLPS; i++) {
+    legacy_packet_to_host ((void *) &tlps[i * 4], &tlp, &payload_len_dws);
+    h = bench_mix (h, tlp.hdr._fmt_type);
+    h = bench_mix (h, tlp.hdr.tc);
+    h = bench_mix (h, tlp.hdr.attr);
+    h = bench_mix (h, payload_len_dws);
+
+    switch (tlp.hdr._fmt_type) {
+    case TLP_MRd32:
+      h = bench_mix (h, tlp.mrd32._rid);
+      h = bench_mix (h, tlp.mrd32.tag);
+      h = bench_mix (h, tlp.mrd32.first_be | (tlp.mrd32.last_be << 4));
+      h = bench_mix (h, tlp.mrd32.address & ~3u);
+      break;
+    case TLP_CfgRd0:
+    case TLP_CfgWr0:
+      h = bench_mix (h, tlp.cfg._rid);
+      h = bench_mix (h, tlp.cfg.tag);
+      h = bench_mix (h, tlp.cfg._cid);
+      h = bench_mix (h, ((unsigned) tlp.cfg.ext_reg_num << 8) |
+                     ((unsigned) tlp.cfg.reg_num << 2));
+
+      memset (&cpl, 0, sizeof (cpl.cpl));
+      cpl.hdr._fmt_type = TLP_CplD;
+      cpl.hdr.length = 1;
+      cpl.hdr.tc = tlp.hdr.tc;
+      cpl.hdr.attr = tlp.hdr.attr;
+      cpl.cpl._cid = tlp.cfg._cid;
+      cpl.cpl._rid = tlp.cfg._rid;
+      cpl.cpl.tag = tlp.cfg.tag;
+      cpl.cpl.byte_count = 4;
+      e = legacy_host_to_packet (&cpl, out);
+      h = bench_hash (h, out, (e - out) * sizeof (uint32_t));
+      break;
+    default:
+      h = bench_mix (h, tlp.cpl._cid);
+      h = bench_mix (h, tlp.cpl.status);
+      h = bench_mix (h, tlp.cpl.byte_count);
+      h = bench_mix (h, tlp.cpl._rid);
+      h = bench_mix (h, tlp.cpl.tag);
+      h = bench_mix (h, tlp.cpl.lower_address);
+      break;
+    }
+  }
+
+  return h;
+}
+
+static uint32_t
+bench_codec_decode (const uint32_t *tlps)
+{
+  unsigned i;
+  uint32_t h = 2166136261u;
+  uint32_t out[4];
+  uint32_t *e;
+  tlp_hdr tlp;
+  tlp_hdr cpl;
+
+  for (i = 0; i < BENCH_CODEC_TLPS; i++) {
+    tlp_decode (&tlps[i * 4], 4, &tlp);
+    h = bench_mix (h, tlp.fmt_type);
+    h = bench_mix (h, tlp.tc);
+    h = bench_mix (h, tlp.attr);
+    h = bench_mix (h, tlp_hdr_payload_dws (&tlp));
+
+    switch (tlp.fmt_type) {
+    case TLP_MRd32:
+      h = bench_mix (h, tlp.requester);
+      h = bench_mix (h, tlp.tag);
+      h = bench_mix (h, tlp.first_be | (tlp.last_be << 4));
+      h = bench_mix (h, tlp.address_lo);
+      break;
+    case TLP_CfgRd0:
+    case TLP_CfgWr0:
+      h = bench_mix (h, tlp.requester);
+      h = bench_mix (h, tlp.tag);
+      h = bench_mix (h, tlp.target);
+      h = bench_mix (h, tlp.reg);
+
+      memset (&cpl, 0, sizeof (cpl));
+      cpl.fmt_type = TLP_CplD;
+      cpl.length = 1;
+      cpl.tc = tlp.tc;
+      cpl.attr = tlp.attr;
+      cpl.completer = tlp.target;
+      cpl.requester = tlp.requester;
+      cpl.tag = tlp.tag;
+      cpl.byte_count = 4;
+      e = tlp_encode (&cpl, out, 4);
+      h = bench_hash (h, out, (e - out) * sizeof (uint32_t));
+      break;
+    default:
+      h = bench_mix (h, tlp.completer);
+      h = bench_mix (h, tlp.status);
+      h = bench_mix (h, tlp.byte_count);
+      h = bench_mix (h, tlp.requester);
+      h = bench_mix (h, tlp.tag);
+      h = bench_mix (h, tlp.lower_address);
+      break;
+    }
+  }
+
+  return h;
+}
+
+/*
+ * Only the fields looked at get extracted, and the completion is
+ * built straight from the request.
+ */
+static uint32_t
+bench_codec_view (const uint32_t *tlps)
+{
+  unsigned i;
+  uint32_t h = 2166136261u;
+  uint32_t out[4];
+  uint32_t *e;
+  tlp_view tlp;
+
+  for (i = 0; i < BENCH_CODEC_TLPS; i++) {
+    if (tlp_view_init (&tlp, &tlps[i * 4], 4) == NULL) {
+      continue;
+    }
+    h = bench_mix (h, tlp_view_fmt_type (&tlp));
+    h = bench_mix (h, tlp_view_tc (&tlp));
+    h = bench_mix (h, tlp_view_attr (&tlp));
+    h = bench_mix (h, tlp_view_payload_dws (&tlp));
+
+    switch (tlp_view_fmt_type (&tlp)) {
+    case TLP_MRd32:
+      h = bench_mix (h, tlp_view_requester (&tlp));
+      h = bench_mix (h, tlp_view_tag (&tlp));
+      h = bench_mix (h, tlp_view_first_be (&tlp) |
+                     (tlp_view_last_be (&tlp) << 4));
+      h = bench_mix (h, tlp_view_address (&tlp));
+      break;
+    case TLP_CfgRd0:
+    case TLP_CfgWr0:
+      h = bench_mix (h, tlp_view_requester (&tlp));
+      h = bench_mix (h, tlp_view_tag (&tlp));
+      h = bench_mix (h, tlp_view_target (&tlp));
+      h = bench_mix (h, tlp_view_reg (&tlp));
+
+      e = tlp_encode_cpl (&tlp, tlp_view_target (&tlp), TLP_CPL_STATUS_SC,
+                          4, 0, 1, out);
+      h = bench_hash (h, out, (e - out) * sizeof (uint32_t));
+      break;
+    default:
+      h = bench_mix (h, tlp_view_completer (&tlp));
+      h = bench_mix (h, tlp_view_status (&tlp));
+      h = bench_mix (h, tlp_view_byte_count (&tlp));
+      h = bench_mix (h, tlp_view_requester (&tlp));
+      h = bench_mix (h, tlp_view_tag (&tlp));
+      h = bench_mix (h, tlp_view_lower_address (&tlp));
+      break;
+    }
+  }
+
+  return h;
+}
+
+/*
+ * Header lengths, as the deframer and receive path look them up.
+ */
+static uint32_t
+bench_len_bitfield (const uint32_t *tlps)
+{
+  unsigned i;
+  int payload_len_dws;
+  uint32_t h = 0;
+  legacy_tlp_header_t hdr;
+
+  for (i = 0; i < BENCH_CODEC_TLPS; i++) {
+    hdr._dw = be32toh (tlps[i * 4]);
+    h = h * 31 + legacy_hdr_len_dws (&hdr, &payload_len_dws);
+  }
+
+  return h;
+}
+
+static uint32_t
+bench_len_table (const uint32_t *tlps)
+{
+  unsigned i;
+  uint32_t h = 0;
+
+  for (i = 0; i < BENCH_CODEC_TLPS; i++) {
+    h = h * 31 + tlp_packet_len_dws (tlps[i * 4], NULL);
+  }
+
+  return h;
+}
+
+static void
+bench_codec_row (const char *name,
+                 uint32_t (*fn) (const uint32_t *),
+                 const uint32_t *tlps,
+                 unsigned iterations,
+                 uint32_t *hash,
+                 uint64_t *ns)
+{
+  unsigned i;
+  uint64_t start;
+  uint32_t h;
+
+  h = 0;
+  start = time_now_ns ();
+  for (i = 0; i < iterations; i++) {
+    h ^= fn (tlps);
+  }
+  *ns = time_now_ns () - start;
+  *hash = fn (tlps);
+
+  printf ("%-16s %8.2f ns/TLP  hash %08x\n", name,
+          (double) *ns / ((uint64_t) iterations * BENCH_CODEC_TLPS), *hash);
+  if (h == 0x12345678) {
+    putchar ('\n');
+  }
+}
+
+/*
+ * tlp_view and tlp_decode / tlp_encode against the old bitfield
+ * structs, on the same headers.
+ */
+static int
+bench_codec (unsigned iterations)
+{
+  unsigned i;
+  uint32_t *tlps;
+  uint32_t hash[5];
+  uint64_t ns[5];
+  static const struct {
+    const char *name;
+    uint32_t (*fn) (const uint32_t *);
+  } rows[] = {
+    { "bitfield codec", bench_codec_bitfield },
+    { "view codec", bench_codec_view },
+    { "decode codec", bench_codec_decode },
+    { "bitfield length", bench_len_bitfield },
+    { "table length", bench_len_table },
+  };
+
+  tlps = malloc (BENCH_CODEC_TLPS * 4 * sizeof (uint32_t));
+  if (tlps == NULL) {
+    return -1;
+  }
+  bench_codec_tlps (tlps);
+
+  printf ("%u headers, %u iterations\n", BENCH_CODEC_TLPS, iterations);
+  for (i = 0; i < 5; i++) {
+    bench_codec_row (rows[i].name, rows[i].fn, tlps, iterations,
+                     &hash[i], &ns[i]);
+  }
+  printf ("codec %.2fx%s (full decode %.2fx%s), length %.2fx%s\n",
+          (double) ns[0] / ns[1], hash[0] == hash[1] ? "" : " MISMATCH",
+          (double) ns[0] / ns[2], hash[0] == hash[2] ? "" : " MISMATCH",
+          (double) ns[3] / ns[4], hash[3] == hash[4] ? "" : " MISMATCH");
+
+  free (tlps);
+  return 0;
+}
+
+/*
+ * Stand-in for a Screamer in loopback: writes are taken apart
+ * and their loopback DWORDs framed up again on read, 7 to a
+ * frame, with a run of FTDI fillers every 16 frames. Reads with
+ * nothing to send return just fillers. A write only completes
+ * once its DWORDs fit in the FIFO, as the FT601 would hold it
+ * off.
+ */
+#define EMU_QUEUE_DWORDS    (1u << 20)
+#define EMU_PARKED          64
+
+typedef struct {
+  uint32_t *cmd;
+  int size;
+  transport_write_cb cb;
+  void *opaque;
+} emu_write_req;
+
+typedef struct {
+  uint32_t *queue;
+  size_t head;
+  size_t tail;
+  uint32_t *rx;
+  emu_write_req parked[EMU_PARKED];
+  unsigned parked_count;
+} emu_dev;
+
+static int
+emu_open (transport_t *t,
+          const char *spec)
+{
+  emu_dev *dev;
+
+  (void) spec;
+
+  dev = calloc (1, sizeof (*dev));
+  if (dev == NULL) {
+    return -1;
+  }
+
+  dev->queue = malloc (EMU_QUEUE_DWORDS * sizeof (uint32_t));
+  dev->rx = malloc (t->params.rx_size);
+  if (dev->queue == NULL || dev->rx == NULL) {
+    free (dev->queue);
+    free (dev->rx);
+    free (dev);
+    return -1;
+  }
+
+  t->priv = dev;
+  return 0;
+}
+
+static void
+emu_close (transport_t *t)
+{
+  emu_dev *dev = t->priv;
+
+  free (dev->queue);
+  free (dev->rx);
+  free (dev);
+}
+
+/*
+ * Moves parked writes into the FIFO while they fit.
+ */
+static bool
+emu_take (emu_dev *dev)
+{
+  int i;
+  emu_write_req req;
+
+  if (dev->parked_count == 0 ||
+      EMU_QUEUE_DWORDS - (dev->tail - dev->head) <
+      dev->parked[0].size / (2 * sizeof (uint32_t))) {
+    return false;
+  }
+
+  req = dev->parked[0];
+  memmove (dev->parked, dev->parked + 1,
+           --dev->parked_count * sizeof (dev->parked[0]));
+
+  for (i = 0; i + 1 < req.size / (int) sizeof (uint32_t); i += 2) {
+    if (req.cmd[i + 1] == FPGA_TX_LOOPBACK) {
+      dev->queue[dev->tail++ % EMU_QUEUE_DWORDS] = req.cmd[i];
+    }
+  }
+
+  if (req.cb != NULL) {
+    req.cb (req.opaque, 0);
+  }
+  return true;
+}
+
+static int
+emu_read (transport_t *t,
+          void **data,
+          int *transferred)
+{
+  unsigned n;
+  unsigned j;
+  unsigned frames;
+  unsigned room;
+  uint32_t *p;
+  emu_dev *dev = t->priv;
+
+  p = dev->rx;
+  room = t->params.rx_size / sizeof (uint32_t);
+  frames = 0;
+  while (dev->head != dev->tail && room >= 8) {
+    p[0] = 0xe0000000;
+    for (j = 0; j < 7; j++) {
+      if (dev->head != dev->tail) {
+        p[0] |= DEFRAME_LOOPBACK << (j * 4);
+        p[j + 1] = dev->queue[dev->head++ % EMU_QUEUE_DWORDS];
+      } else {
+        p[0] |= 0xf << (j * 4);
+        p[j + 1] = 0;
+      }
+    }
+    p += 8;
+    room -= 8;
+
+    if (++frames % 16 == 0) {
+      for (n = 0; n < 4 && room != 0; n++, room--) {
+        *p++ = 0x55556666;
+      }
+    }
+  }
+
+  if (p == dev->rx) {
+    for (n = 0; n < 4 && room != 0; n++, room--) {
+      *p++ = 0x55556666;
+    }
+  }
+
+  *data = dev->rx;
+  *transferred = (p - dev->rx) * sizeof (uint32_t);
+  t->rx_ns = time_now_ns ();
+
+  while (emu_take (dev)) {
+  }
+  return 0;
+}
+
+static int
+emu_write (transport_t *t,
+           void *data,
+           int size,
+           transport_write_cb cb,
+           void *opaque)
+{
+  emu_dev *dev = t->priv;
+
+  if (dev->parked_count == EMU_PARKED ||
+      size / (2 * sizeof (uint32_t)) > EMU_QUEUE_DWORDS) {
+    return -1;
+  }
+
+  dev->parked[dev->parked_count++] = (emu_write_req) {
+    data, size, cb, opaque,
+  };
+  while (emu_take (dev)) {
+  }
+
+  return 0;
+}
+
+/*
+ * Nobody reads while we wait, so what's in the FIFO goes.
+ */
+static int
+emu_wait (transport_t *t,
+          int *completed)
+{
+  emu_dev *dev = t->priv;
+
+  while (!*completed && dev->parked_count != 0) {
+    dev->head = dev->tail;
+    emu_take (dev);
+  }
+
+  return *completed ? 0 : -1;
+}
+
+static const transport_ops emu_transport_ops = {
+  .name = "emulate",
+  .open = emu_open,
+  .close = emu_close,
+  .read = emu_read,
+  .write = emu_write,
+  .wait = emu_wait,
+};
+
+/*
+ * Loopback run at one transfer size and queue depth. TX sends
+ * consecutive sequence numbers (or, given loop_pattern, the
+ * recorded stream over and over), chunk_dws of them per
+ * transfer; the first DWORD of each transfer times a round
+ * trip.
+ */
+#define LOOP_CHUNK_RING     4096
+#define LOOP_RTT_MAX        (1u << 18)
+
+typedef struct loop_bench loop_bench;
+
+typedef struct {
+  loop_bench *b;
+  uint32_t *cmd;
+  bool busy;
+} loop_tx;
+
+struct loop_bench {
+  transport_t *t;
+  unsigned chunk_dws;
+  unsigned depth;
+  loop_tx *tx;
+  uint32_t *payload;
+  unsigned tx_busy;
+  int tx_idle;
+  uint32_t tx_seq;
+  uint64_t chunk_ns[LOOP_CHUNK_RING];
+
+  /*
+   * RX: frame being put together, and what came back.
+   */
+  uint32_t frame[8];
+  unsigned frame_len;
+  uint32_t rx_seq;
+  uint64_t tx_bytes;
+  uint64_t rx_bytes;
+  uint64_t filler_bytes;
+  uint64_t loop_dws;
+  uint64_t lost;
+  uint64_t reordered;
+  uint64_t *rtt_ns;
+  unsigned rtt_count;
+};
+
+static void
+loop_tx_done (void *opaque,
+              int status)
+{
+  loop_tx *tx = opaque;
+  loop_bench *b = tx->b;
+
+  if (status != 0) {
+    fprintf (stderr, "Loopback TX failed\n");
+  } else {
+    b->tx_bytes += b->chunk_dws * 2 * sizeof (uint32_t);
+  }
+
+  tx->busy = false;
+  if (--b->tx_busy == 0) {
+    b->tx_idle = 1;
+  }
+}
+
+static int
+loop_tx_submit (loop_bench *b,
+                loop_tx *tx)
+{
+  int err;
+  unsigned i;
+  unsigned len;
+
+  for (i = 0; i < b->chunk_dws; i++) {
+    b->payload[i] = loop_pattern != NULL ?
+      loop_pattern[(b->tx_seq + i) % loop_pattern_dws] : b->tx_seq + i;
+  }
+  len = fpga_loopback_encode (tx->cmd, b->payload, b->chunk_dws);
+
+  b->chunk_ns[(b->tx_seq / b->chunk_dws) % LOOP_CHUNK_RING] = time_now_ns ();
+  b->tx_seq += b->chunk_dws;
+
+  tx->busy = true;
+  b->tx_busy++;
+  b->tx_idle = 0;
+  err = b->t->ops->write (b->t, tx->cmd, len * sizeof (uint32_t),
+                          loop_tx_done, tx);
+  if (err != 0) {
+    loop_tx_done (tx, -1);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void
+loop_rx_dw (loop_bench *b,
+            uint32_t dw,
+            uint64_t rx_ns)
+{
+  uint32_t seq;
+
+  b->loop_dws++;
+  if (loop_pattern != NULL) {
+    /*
+     * Recorded data doesn't say where it belongs, so it's taken
+     * to be next; a mismatch counts as lost.
+     */
+    seq = b->rx_seq;
+    if (dw != loop_pattern[seq % loop_pattern_dws]) {
+      b->lost++;
+    }
+  } else {
+    seq = dw;
+    if (dw != b->rx_seq) {
+      if ((int32_t) (dw - b->rx_seq) > 0) {
+        b->lost += dw - b->rx_seq;
+      } else {
+        b->reordered++;
+      }
+    }
+  }
+  b->rx_seq = seq + 1;
+
+  if (seq % b->chunk_dws == 0 && b->rtt_count < LOOP_RTT_MAX) {
+    b->rtt_ns[b->rtt_count++] =
+      rx_ns - b->chunk_ns[(seq / b->chunk_dws) % LOOP_CHUNK_RING];
+  }
+}
+
+/*
+ * A DWORD at a time: the link, not this, is what's measured.
+ */
+static void
+loop_rx (loop_bench *b,
+         const uint32_t *p,
+         const uint32_t *e,
+         uint64_t rx_ns)
+{
+  unsigned j;
+  unsigned type;
+
+  b->rx_bytes += (e - p) * sizeof (uint32_t);
+  for (; p < e; p++) {
+    if (b->frame_len == 0) {
+      if (*p == 0x55556666) {
+        b->filler_bytes += sizeof (uint32_t);
+        continue;
+      }
+      if ((*p & 0xf0000000) != 0xe0000000) {
+        continue;
+      }
+    }
+
+    b->frame[b->frame_len++] = *p;
+    if (b->frame_len < 8) {
+      continue;
+    }
+    b->frame_len = 0;
+
+    for (j = 0; j < 7; j++) {
+      type = (b->frame[0] >> (j * 4)) & 0xf;
+      if (type == DEFRAME_LOOPBACK) {
+        loop_rx_dw (b, b->frame[j + 1], rx_ns);
+      }
+    }
+  }
+}
+
+static int
+loop_cmp_u64 (const void *a,
+              const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+loop_percentile_us (loop_bench *b,
+                    unsigned pct)
+{
+  if (b->rtt_count == 0) {
+    return 0;
+  }
+
+  return b->rtt_ns[(uint64_t) (b->rtt_count - 1) * pct / 100] / 1e3;
+}
+
+static uint64_t
+bench_cpu_ns (void)
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+static int
+bench_loopback_point (bool emulate,
+                      bool usbfs,
+                      const char *label,
+                      unsigned size,
+                      unsigned depth,
+                      uint64_t *rtt_ns)
+{
+  int err;
+  int len;
+  unsigned i;
+  void *data;
+  uint64_t start;
+  uint64_t elapsed;
+  uint64_t deadline;
+  uint64_t tx_bytes;
+  uint64_t rx_bytes;
+  uint64_t loop_dws;
+  uint64_t cpu_start;
+  uint64_t cpu_ns;
+  transport_params params;
+  static loop_bench b;
+
+  memset (&b, 0, sizeof (b));
+  b.depth = depth;
+  b.chunk_dws = size / (2 * sizeof (uint32_t));
+  b.rtt_ns = rtt_ns;
+  b.tx_idle = 1;
+
+  memset (&params, 0, sizeof (params));
+  params.rx_count = depth;
+  params.rx_size = size;
+  params.trust_chip_config = trust_chip_config;
+  params.usbfs = usbfs;
+  b.t = transport_open (emulate ? &emu_transport_ops : &ftdi_transport_ops,
+                        device_spec, &params);
+  if (b.t == NULL) {
+    fprintf (stderr, "Couldn't open %s\n", device_spec);
+    return -1;
+  }
+
+  b.tx = calloc (depth, sizeof (*b.tx));
+  b.payload = malloc (b.chunk_dws * sizeof (uint32_t));
+  err = b.tx == NULL || b.payload == NULL ? -1 : 0;
+  for (i = 0; err == 0 && i < depth; i++) {
+    b.tx[i].b = &b;
+    b.tx[i].cmd = malloc (size);
+    if (b.tx[i].cmd == NULL) {
+      err = -1;
+    }
+  }
+
+  start = time_now_ns ();
+  cpu_start = bench_cpu_ns ();
+  deadline = start + loop_duration_ms * 1000000ull;
+  tx_bytes = rx_bytes = loop_dws = 0;
+  cpu_ns = 0;
+  elapsed = 0;
+  while (err == 0) {
+    uint64_t now = time_now_ns ();
+
+    if (elapsed == 0 && now >= deadline) {
+      /*
+       * End of the timed part; give what's still in flight a
+       * moment to come back, for the loss count.
+       */
+      elapsed = now - start;
+      cpu_ns = bench_cpu_ns () - cpu_start;
+      tx_bytes = b.tx_bytes;
+      rx_bytes = b.rx_bytes;
+      loop_dws = b.loop_dws;
+      deadline = now + 100000000ull;
+    }
+    if (elapsed != 0 && (now >= deadline || b.rx_seq == b.tx_seq)) {
+      break;
+    }
+
+    for (i = 0; elapsed == 0 && err == 0 && i < depth; i++) {
+      if (!b.tx[i].busy) {
+        err = loop_tx_submit (&b, &b.tx[i]);
+      }
+    }
+    if (err != 0) {
+      break;
+    }
+
+    err = b.t->ops->read (b.t, &data, &len);
+    if (err != 0) {
+      break;
+    }
+
+    loop_rx (&b, data, (uint32_t *) data + len / sizeof (uint32_t),
+             b.t->rx_ns);
+    transport_release (b.t, data);
+  }
+
+  if (b.tx_busy != 0) {
+    b.t->ops->wait (b.t, &b.tx_idle);
+  }
+
+  if (err == 0) {
+    qsort (b.rtt_ns, b.rtt_count, sizeof (uint64_t), loop_cmp_u64);
+    printf ("%s%8u %5u %9.1f %9.1f %9.1f %7.1f%% %9.1f %9.1f %9.1f %9.1f "
+            "%8" PRIu64 " %9.1f\n",
+            label, size / 1024, depth,
+            tx_bytes * 1e3 / elapsed,
+            rx_bytes * 1e3 / elapsed,
+            loop_dws * sizeof (uint32_t) * 1e3 / elapsed,
+            b.rx_bytes != 0 ? b.filler_bytes * 100.0 / b.rx_bytes : 0,
+            loop_percentile_us (&b, 50),
+            loop_percentile_us (&b, 90),
+            loop_percentile_us (&b, 99),
+            loop_percentile_us (&b, 100),
+            b.tx_seq - b.rx_seq + b.lost,
+            tx_bytes + rx_bytes != 0 ?
+            cpu_ns / 1e3 / ((tx_bytes + rx_bytes) / 1e6) : 0);
+    if (verbose) {
+      printf ("    %u round trips, %" PRIu64 " reordered\n",
+              b.rtt_count, b.reordered);
+    }
+  }
+
+  for (i = 0; b.tx != NULL && i < depth; i++) {
+    free (b.tx[i].cmd);
+  }
+  free (b.tx);
+  free (b.payload);
+  transport_close (b.t);
+  return err;
+}
+
+static unsigned
+bench_parse_list (const char *s,
+                  unsigned *out,
+                  unsigned max)
+{
+  unsigned n;
+  char *end;
+
+  for (n = 0; n < max && *s != '\0'; n++) {
+    out[n] = strtoul (s, &end, 10);
+    if (end == s || out[n] == 0) {
+      return 0;
+    }
+    s = *end == ',' ? end + 1 : end;
+  }
+
+  return n;
+}
+
+/*
+ * The stream in a recording, as DWORDs to loop back.
+ */
+static int
+bench_load_pattern (const char *path)
+{
+  int err;
+  int len;
+  void *data;
+  uint32_t *dws;
+  size_t max;
+  transport_t *t;
+  transport_params params;
+
+  memset (&params, 0, sizeof (params));
+  params.rx_size = 1024 * 1024;
+  t = transport_open (&replay_transport_ops, path, &params);
+  if (t == NULL) {
+    fprintf (stderr, "Couldn't open %s\n", path);
+    return -1;
+  }
+
+  max = 0;
+  loop_pattern_dws = 0;
+  while ((err = t->ops->read (t, &data, &len)) == 0) {
+    len /= sizeof (uint32_t);
+    if (loop_pattern_dws + len > max) {
+      max = (loop_pattern_dws + len) * 2;
+      dws = realloc (loop_pattern, max * sizeof (uint32_t));
+      if (dws == NULL) {
+        err = -1;
+        break;
+      }
+      loop_pattern = dws;
+    }
+    memcpy (loop_pattern + loop_pattern_dws, data, len * sizeof (uint32_t));
+    loop_pattern_dws += len;
+  }
+  transport_close (t);
+
+  if (err != TRANSPORT_EOF || loop_pattern_dws == 0) {
+    fprintf (stderr, "Nothing to loop back in %s\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+bench_loopback (bool compare)
+{
+  unsigned i;
+  unsigned j;
+  unsigned k;
+  unsigned size_count;
+  unsigned depth_count;
+  unsigned sizes[16];
+  unsigned depths[16];
+  uint64_t *rtt_ns;
+  bool emulate;
+
+  size_count = bench_parse_list (loop_sizes, sizes, 16);
+  depth_count = bench_parse_list (loop_depths, depths, 16);
+  if (size_count == 0 || depth_count == 0) {
+    fprintf (stderr, "Bad transfer size or depth list\n");
+    return -1;
+  }
+
+  rtt_ns = malloc (LOOP_RTT_MAX * sizeof (uint64_t));
+  if (rtt_ns == NULL) {
+    return -1;
+  }
+
+  emulate = strcmp (device_spec, "emulate") == 0;
+  if (compare && emulate) {
+    fprintf (stderr, "Comparing data paths needs a Screamer\n");
+    free (rtt_ns);
+    return -1;
+  }
+  if (loop_replay_path != NULL &&
+      bench_load_pattern (loop_replay_path) != 0) {
+    free (rtt_ns);
+    return -1;
+  }
+
+  printf ("Loopback over %s, %u ms per point. MB/s are 10^6 bytes; TX counts "
+          "command bytes, RX everything read, loop the echoed data; CPU is "
+          "user+sys per MB of TX+RX.\n",
+          emulate ? "emulated link" : "FT601", loop_duration_ms);
+  if (loop_pattern != NULL) {
+    printf ("Looping %zu DWORDs from %s; lost counts mismatches.\n",
+            loop_pattern_dws, loop_replay_path);
+  }
+  printf ("%sxfer KiB depth   TX MB/s   RX MB/s loop MB/s  fillers "
+          "   p50 us    p90 us    p99 us    max us     lost CPU us/MB\n",
+          compare ? "path   " : "");
+  for (i = 0; i < size_count; i++) {
+    for (j = 0; j < depth_count; j++) {
+      for (k = 0; k < (compare ? 2u : 1u); k++) {
+        if (bench_loopback_point (emulate, k == 1,
+                                  !compare ? "" : k == 1 ? "usbfs  " : "libusb ",
+                                  sizes[i] * 1024, depths[j], rtt_ns) != 0) {
+          free (rtt_ns);
+          return -1;
+        }
+      }
+    }
+  }
+
+  free (rtt_ns);
+  return 0;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  int err;
+  char *mode;
+  char *out_path;
+  unsigned tlp_count;
+  unsigned iterations;
+  unsigned transfer_size;
+
+  mode = "deframe";
+  out_path = NULL;
+  tlp_count = 200000;
+  iterations = 10;
+  transfer_size = 256 * 1024;
+  err = parse_opts (argc, argv, &mode, &tlp_count, &iterations,
+                    &transfer_size, &out_path);
+  if (err != 0) {
+    return -1;
+  }
+
+  if (strcmp (mode, "deframe") == 0) {
+    err = bench_deframe (tlp_count, iterations, transfer_size, out_path);
+  } else if (strcmp (mode, "codec") == 0) {
+    err = bench_codec (iterations * 100);
+  } else if (strcmp (mode, "loopback") == 0) {
+    err = bench_loopback (false);
+  } else if (strcmp (mode, "usbfs") == 0) {
+    err = bench_loopback (true);
+  } else {
+    fprintf (stderr, "Unknown mode '%s'\n", mode);
+    err = -1;
+  }
+
+  return err == 0 ? 0 : -1;
+}
@@ -0,0 +1,1278 @@
+/*
+ * Collects TLP exports (see export.c) from any number of
+ * screamer_scope instances over UDP, and with -t or -u over TCP
+ * or Unix socket streams (-E), into one capture file.
+ *
+ * Datagrams are received a batch per recvmmsg straight into the
+ * slots of a ring. Streams are read into a buffer per
+ * connection, and whatever complete records it holds go into a
+ * slot as if they had come in one datagram. A writer thread
+ * drains the ring: it tells senders apart by address, counts
+ * the TLPs missing from each one's sequence numbers, and packs
+ * the records into blocks that are deflated as they fill (or
+ * after a second). Closing the capture appends an index of the
+ * blocks' offsets and time spans, and what's known of each
+ * sender.
+ *
+ * -r reads a capture back: a summary, or with -o the TLPs
+ * between -s and -e seconds into it as a pcapng file (one
+ * interface per sender and device) for Wireshark, only
+ * decompressing the blocks that overlap.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* recvmmsg */
+#endif
+#include "screamer.h"
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <zlib.h>
+
+#define COLLECT_SLOTS 4096
+#define COLLECT_DGRAM_BYTES (16u << 10)
+#define COLLECT_BATCH 64
+#define COLLECT_MAX_SENDERS 256
+#define COLLECT_MAX_DEVICES 32
+#define COLLECT_BLOCK_BYTES (1u << 20)
+#define COLLECT_BLOCK_MS 1000
+#define COLLECT_RCVBUF (64 << 20)
+#define COLLECT_MAX_CONNS 64
+#define COLLECT_POLL_MS 100
+
+/*
+ * Capture file: a cap_file_hdr, then blocks (a cap_block_hdr and
+ * zlen bytes deflating to len bytes of records), then the index:
+ * cap_index entries, cap_sender entries and a cap_trailer, which
+ * is what a reader looks for first. A capture cut short has no
+ * index, but its blocks can still be walked. Records are a
+ * big-endian u16 sender followed by the export_rec and TLP as
+ * received; the rest is host order, like raw recordings.
+ */
+#define CAP_MAGIC "SCRMCAP1"
+#define CAP_INDEX_MAGIC "SCRMIDX1"
+#define CAP_BLOCK_MAGIC 0x4b4c4253      /* "SBLK" */
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+} cap_file_hdr;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t zlen;
+  uint32_t len;
+  uint32_t count;
+  uint64_t first_ns;
+  uint64_t last_ns;
+} cap_block_hdr;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t first_ns;
+  uint64_t last_ns;
+  uint32_t count;
+  uint32_t reserved;
+} cap_index;
+
+typedef struct {
+  char addr[INET_ADDRSTRLEN];
+  uint16_t port;
+  uint16_t reserved;
+  uint32_t devices;
+  uint64_t tlps;
+  uint64_t missing;
+  uint64_t gaps;
+  uint64_t late;
+} cap_sender;
+
+typedef struct {
+  uint64_t index_offset;
+  uint32_t block_count;
+  uint32_t sender_count;
+  char magic[8];
+} cap_trailer;
+
+typedef struct {
+  uint64_t rx_ns;
+  struct sockaddr_in from;
+  uint32_t len;
+  bool truncated;
+  uint8_t data[COLLECT_DGRAM_BYTES];
+} collect_slot;
+
+typedef struct {
+  struct sockaddr_in from;
+  uint32_t next_seq;
+  bool seen;
+} collect_peer;
+
+/*
+ * A stream sender: its records, in a buffer small enough that
+ * they all fit in a slot behind a datagram header.
+ */
+typedef struct {
+  int fd;
+  struct sockaddr_in from;
+  bool started;
+  unsigned len;
+  uint8_t buf[COLLECT_DGRAM_BYTES - sizeof (export_dgram)];
+} collect_conn;
+
+typedef struct {
+  FILE *f;
+  uint64_t offset;
+
+  collect_peer peers[COLLECT_MAX_SENDERS];
+  cap_sender senders[COLLECT_MAX_SENDERS];
+  unsigned sender_count;
+  unsigned last_sender;
+
+  uint8_t *block;
+  unsigned block_len;
+  uint8_t *zblock;
+  uLong zblock_size;
+  cap_block_hdr hdr;
+  uint64_t block_start_ns;
+
+  cap_index *index;
+  unsigned index_count;
+  unsigned index_size;
+
+  uint64_t dgrams;
+  uint64_t bad_dgrams;
+  uint64_t unknown_senders;
+  uint64_t raw_bytes;
+  int err;
+} collect_writer;
+
+static volatile bool stop;
+static volatile bool received_all;
+static spsc_ring ring;
+static char *bind_addr = "0.0.0.0";
+static in_port_t bind_port = 9999;
+static bool listen_tcp;
+static char *unix_path;
+static collect_conn *conns[COLLECT_MAX_CONNS];
+static unsigned conn_count;
+static unsigned unix_conns;
+static char *read_path;
+static char *out_path;
+static double from_s;
+static double to_s = -1;
+
+static void
+on_sigint (int sig)
+{
+  (void) sig;
+
+  stop = true;
+  spsc_wake (&ring);
+}
+
+static int
+collect_block_write (collect_writer *w)
+{
+  int err;
+  uLongf zlen;
+  cap_index *index;
+
+  if (w->hdr.count == 0) {
+    return 0;
+  }
+
+  zlen = w->zblock_size;
+  err = compress2 (w->zblock, &zlen, w->block, w->block_len, Z_BEST_SPEED);
+  if (err != Z_OK) {
+    fprintf (stderr, "Couldn't compress block: %s\n", zError (err));
+    return -1;
+  }
+
+  if (w->index_count == w->index_size) {
+    w->index_size = w->index_size != 0 ? w->index_size * 2 : 1024;
+    index = realloc (w->index, w->index_size * sizeof (*index));
+    if (index == NULL) {
+      return -1;
+    }
+    w->index = index;
+  }
+  index = &w->index[w->index_count++];
+  index->offset = w->offset;
+  index->first_ns = w->hdr.first_ns;
+  index->last_ns = w->hdr.last_ns;
+  index->count = w->hdr.count;
+  index->reserved = 0;
+
+  w->hdr.magic = CAP_BLOCK_MAGIC;
+  w->hdr.zlen = zlen;
+  w->hdr.len = w->block_len;
+  if (fwrite (&w->hdr, sizeof (w->hdr), 1, w->f) != 1 ||
+      fwrite (w->zblock, zlen, 1, w->f) != 1) {
+    fprintf (stderr, "Couldn't write capture: %s\n", strerror (errno));
+    return -1;
+  }
+  w->offset += sizeof (w->hdr) + zlen;
+
+  w->block_len = 0;
+  memset (&w->hdr, 0, sizeof (w->hdr));
+  return 0;
+}
+
+static int
+collect_sender (collect_writer *w,
+                const struct sockaddr_in *from)
+{
+  unsigned i;
+  collect_peer *p;
+
+  p = &w->peers[w->last_sender];
+  if (w->sender_count != 0 &&
+      p->from.sin_port == from->sin_port &&
+      p->from.sin_addr.s_addr == from->sin_addr.s_addr) {
+    return w->last_sender;
+  }
+
+  for (i = 0; i < w->sender_count; i++) {
+    p = &w->peers[i];
+    if (p->from.sin_port == from->sin_port &&
+        p->from.sin_addr.s_addr == from->sin_addr.s_addr) {
+      w->last_sender = i;
+      return i;
+    }
+  }
+
+  if (w->sender_count == COLLECT_MAX_SENDERS) {
+    return -1;
+  }
+
+  i = w->sender_count++;
+  w->peers[i].from = *from;
+  inet_ntop (AF_INET, &from->sin_addr, w->senders[i].addr,
+             sizeof (w->senders[i].addr));
+  w->senders[i].port = ntohs (from->sin_port);
+  printf ("New sender %s:%u\n", w->senders[i].addr, w->senders[i].port);
+  w->last_sender = i;
+  return i;
+}
+
+/*
+ * Accounts for the sequence number of a sender's TLP: gaps count
+ * as missing until (if ever) their TLPs turn up late.
+ */
+static inline void
+collect_seq (collect_peer *p,
+             cap_sender *s,
+             uint32_t seq)
+{
+  int32_t ahead;
+
+  ahead = (int32_t) (seq - p->next_seq);
+  if (!p->seen || ahead == 0) {
+    p->seen = true;
+    p->next_seq = seq + 1;
+  } else if (ahead > 0) {
+    s->missing += ahead;
+    s->gaps++;
+    p->next_seq = seq + 1;
+  } else {
+    s->late++;
+    if (s->missing != 0) {
+      s->missing--;
+    }
+  }
+}
+
+static void
+collect_dgram (collect_writer *w,
+               collect_slot *slot)
+{
+  int sender;
+  unsigned i;
+  unsigned n;
+  unsigned count;
+  unsigned offset;
+  uint16_t be_sender;
+  uint64_t ts;
+  export_dgram d;
+  export_rec rec;
+  cap_sender *s;
+
+  if (w->err != 0) {
+    return;
+  }
+
+  memcpy (&d, slot->data, sizeof (d));
+  if (slot->truncated || slot->len < sizeof (d) ||
+      ntohl (d.magic) != EXPORT_MAGIC || d.version != EXPORT_VERSION) {
+    w->bad_dgrams++;
+    return;
+  }
+
+  sender = collect_sender (w, &slot->from);
+  if (sender < 0) {
+    w->unknown_senders++;
+    return;
+  }
+  s = &w->senders[sender];
+  be_sender = htons (sender);
+  w->dgrams++;
+
+  count = ntohs (d.count);
+  offset = sizeof (d);
+  for (i = 0; i < count; i++) {
+    if (offset + sizeof (rec) > slot->len) {
+      w->bad_dgrams++;
+      return;
+    }
+    memcpy (&rec, slot->data + offset, sizeof (rec));
+    n = sizeof (rec) + ntohs (rec.size);
+    if (offset + n > slot->len) {
+      w->bad_dgrams++;
+      return;
+    }
+
+    collect_seq (&w->peers[sender], s, ntohl (rec.seq));
+    s->tlps++;
+    if (rec.dev < COLLECT_MAX_DEVICES) {
+      s->devices |= 1u << rec.dev;
+    }
+
+    if (w->block_len + sizeof (be_sender) + n > COLLECT_BLOCK_BYTES) {
+      if (collect_block_write (w) != 0) {
+        w->err = -1;
+        stop = true;
+        spsc_wake (&ring);
+        return;
+      }
+    }
+    if (w->hdr.count == 0) {
+      w->block_start_ns = slot->rx_ns;
+    }
+
+    ts = be64toh (rec.ts_ns);
+    if (w->hdr.count == 0 || ts < w->hdr.first_ns) {
+      w->hdr.first_ns = ts;
+    }
+    if (ts > w->hdr.last_ns) {
+      w->hdr.last_ns = ts;
+    }
+    w->hdr.count++;
+    memcpy (w->block + w->block_len, &be_sender, sizeof (be_sender));
+    memcpy (w->block + w->block_len + sizeof (be_sender),
+            slot->data + offset, n);
+    w->block_len += sizeof (be_sender) + n;
+    w->raw_bytes += n;
+    offset += n;
+  }
+}
+
+/*
+ * A quiet link still gets its TLPs on disk within a second or so.
+ */
+static void
+collect_idle (void *opaque)
+{
+  collect_writer *w = opaque;
+
+  if (w->hdr.count != 0 &&
+      time_now_ns () - w->block_start_ns > COLLECT_BLOCK_MS * 1000000ull &&
+      collect_block_write (w) != 0) {
+    w->err = -1;
+    stop = true;
+    spsc_wake (&ring);
+  }
+}
+
+static void *
+collect_writer_run (void *opaque)
+{
+  collect_writer *w = opaque;
+  collect_slot *slot;
+
+  while ((slot = spsc_pop_wait (&ring, &received_all, collect_idle,
+                                w)) != NULL) {
+    collect_dgram (w, slot);
+    spsc_pop_commit (&ring);
+  }
+
+  return NULL;
+}
+
+static int
+collect_finish (collect_writer *w)
+{
+  cap_trailer t;
+
+  if (collect_block_write (w) != 0) {
+    return -1;
+  }
+
+  memset (&t, 0, sizeof (t));
+  t.index_offset = w->offset;
+  t.block_count = w->index_count;
+  t.sender_count = w->sender_count;
+  memcpy (t.magic, CAP_INDEX_MAGIC, sizeof (t.magic));
+  if ((w->index_count != 0 &&
+       fwrite (w->index, sizeof (*w->index), w->index_count, w->f) !=
+       w->index_count) ||
+      (w->sender_count != 0 &&
+       fwrite (w->senders, sizeof (*w->senders), w->sender_count, w->f) !=
+       w->sender_count) ||
+      fwrite (&t, sizeof (t), 1, w->f) != 1) {
+    fprintf (stderr, "Couldn't write index: %s\n", strerror (errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static void
+collect_print_senders (const cap_sender *senders,
+                       unsigned count,
+                       FILE *f)
+{
+  unsigned i;
+  const cap_sender *s;
+
+  for (i = 0; i < count; i++) {
+    s = &senders[i];
+    fprintf (f, "Sender %u, %s:%u: %" PRIu64 " TLPs, %" PRIu64 " missing "
+             "in %" PRIu64 " gaps, %" PRIu64 " late, devices 0x%x\n",
+             i, s->addr, s->port, s->tlps, s->missing, s->gaps, s->late,
+             s->devices);
+  }
+}
+
+/*
+ * One recvmmsg's worth of the datagrams waiting on fd, as many as
+ * there are free slots for.
+ */
+static int
+collect_receive_dgrams (int fd)
+{
+  int n;
+  unsigned i;
+  unsigned free;
+  uint64_t now;
+  collect_slot *slot;
+  struct mmsghdr msgs[COLLECT_BATCH];
+  struct iovec iovs[COLLECT_BATCH];
+
+  free = spsc_push_free (&ring);
+  if (free == 0) {
+    if (spsc_push_wait (&ring, &stop, NULL, NULL) == NULL) {
+      return 0;
+    }
+    free = spsc_push_free (&ring);
+  }
+  if (free > COLLECT_BATCH) {
+    free = COLLECT_BATCH;
+  }
+
+  memset (msgs, 0, free * sizeof (msgs[0]));
+  for (i = 0; i < free; i++) {
+    slot = spsc_slot (&ring, ring.p.head + i);
+    iovs[i].iov_base = slot->data;
+    iovs[i].iov_len = sizeof (slot->data);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &slot->from;
+    msgs[i].msg_hdr.msg_namelen = sizeof (slot->from);
+  }
+
+  n = recvmmsg (fd, msgs, free, MSG_DONTWAIT, NULL);
+  if (n < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
+    fprintf (stderr, "recvmmsg: %s\n", strerror (errno));
+    return -1;
+  }
+
+  now = time_now_ns ();
+  for (i = 0; i < (unsigned) n; i++) {
+    slot = spsc_slot (&ring, ring.p.head);
+    slot->rx_ns = now;
+    slot->len = msgs[i].msg_len;
+    slot->truncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+    spsc_push_commit (&ring);
+  }
+
+  return 0;
+}
+
+static void
+collect_conn_close (unsigned i)
+{
+  char addr[INET_ADDRSTRLEN];
+  collect_conn *c = conns[i];
+
+  inet_ntop (AF_INET, &c->from.sin_addr, addr, sizeof (addr));
+  printf ("Stream from %s:%u ended\n", addr, ntohs (c->from.sin_port));
+  close (c->fd);
+  free (c);
+  conns[i] = conns[--conn_count];
+}
+
+static void
+collect_accept (int fd)
+{
+  int cfd;
+  socklen_t len;
+  collect_conn *c;
+  struct sockaddr_storage ss;
+
+  len = sizeof (ss);
+  cfd = accept (fd, (struct sockaddr *) &ss, &len);
+  if (cfd < 0) {
+    return;
+  }
+  if (conn_count == COLLECT_MAX_CONNS ||
+      (c = calloc (1, sizeof (*c))) == NULL) {
+    fprintf (stderr, "Too many streams, refusing another\n");
+    close (cfd);
+    return;
+  }
+
+  c->fd = cfd;
+  if (ss.ss_family == AF_INET) {
+    c->from = *(struct sockaddr_in *) &ss;
+  } else {
+    /*
+     * Unix socket peers have no address; they show up as
+     * 0.0.0.0, numbered by connection.
+     */
+    c->from.sin_family = AF_INET;
+    c->from.sin_port = htons (++unix_conns);
+  }
+  conns[conn_count++] = c;
+}
+
+/*
+ * Reads what there is from stream i and passes its complete
+ * records on as one datagram (see collect_dgram), keeping any
+ * partial one for next time. Returns -1 once the stream is done.
+ */
+static int
+collect_receive_stream (unsigned i)
+{
+  ssize_t n;
+  unsigned off;
+  unsigned end;
+  unsigned count;
+  export_dgram d;
+  export_rec rec;
+  collect_slot *slot;
+  collect_conn *c = conns[i];
+
+  n = read (c->fd, c->buf + c->len, sizeof (c->buf) - c->len);
+  if (n < 0) {
+    return errno == EINTR || errno == EAGAIN ? 0 : -1;
+  }
+  if (n == 0) {
+    return -1;
+  }
+  c->len += n;
+
+  off = 0;
+  if (!c->started) {
+    if (c->len < sizeof (d)) {
+      return 0;
+    }
+    memcpy (&d, c->buf, sizeof (d));
+    if (ntohl (d.magic) != EXPORT_MAGIC || d.version != EXPORT_VERSION) {
+      fprintf (stderr, "Not a TLP export stream\n");
+      return -1;
+    }
+    c->started = true;
+    off = sizeof (d);
+  }
+
+  end = off;
+  count = 0;
+  while (end + sizeof (rec) <= c->len) {
+    memcpy (&rec, c->buf + end, sizeof (rec));
+    if (end + sizeof (rec) + ntohs (rec.size) > c->len) {
+      break;
+    }
+    end += sizeof (rec) + ntohs (rec.size);
+    count++;
+  }
+  if (count == 0) {
+    if (c->len == sizeof (c->buf)) {
+      fprintf (stderr, "Record too large in export stream\n");
+      return -1;
+    }
+    memmove (c->buf, c->buf + off, c->len - off);
+    c->len -= off;
+    return 0;
+  }
+
+  slot = spsc_push_wait (&ring, &stop, NULL, NULL);
+  if (slot == NULL) {
+    return 0;
+  }
+  memset (&d, 0, sizeof (d));
+  d.magic = htonl (EXPORT_MAGIC);
+  d.version = EXPORT_VERSION;
+  d.count = htons (count);
+  memcpy (slot->data, &d, sizeof (d));
+  memcpy (slot->data + sizeof (d), c->buf + off, end - off);
+  slot->rx_ns = time_now_ns ();
+  slot->from = c->from;
+  slot->len = sizeof (d) + end - off;
+  slot->truncated = false;
+  spsc_push_commit (&ring);
+
+  memmove (c->buf, c->buf + end, c->len - end);
+  c->len -= end;
+  return 0;
+}
+
+/*
+ * Receives until SIGINT: datagrams on udp_fd, and streams from
+ * whoever connects to the listening sockets (-1 if none).
+ */
+static int
+collect_receive (int udp_fd,
+                 int tcp_fd,
+                 int unix_fd)
+{
+  int n;
+  unsigned i;
+  unsigned base;
+  struct pollfd pfds[3 + COLLECT_MAX_CONNS];
+
+  while (!stop) {
+    base = 0;
+    pfds[base].fd = udp_fd;
+    pfds[base++].events = POLLIN;
+    pfds[base].fd = tcp_fd;
+    pfds[base++].events = POLLIN;
+    pfds[base].fd = unix_fd;
+    pfds[base++].events = POLLIN;
+    for (i = 0; i < conn_count; i++) {
+      pfds[base + i].fd = conns[i]->fd;
+      pfds[base + i].events = POLLIN;
+    }
+
+    /*
+     * Timing out so SIGINT is noticed while nothing comes in.
+     */
+    n = poll (pfds, base + conn_count, COLLECT_POLL_MS);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf (stderr, "poll: %s\n", strerror (errno));
+      return -1;
+    }
+
+    if ((pfds[0].revents & POLLIN) != 0 &&
+        collect_receive_dgrams (udp_fd) != 0) {
+      return -1;
+    }
+
+    /*
+     * Backwards, as closing one moves the last into its place;
+     * and before accepting, so they're all ones that were polled.
+     */
+    for (i = conn_count; i-- > 0;) {
+      if (pfds[base + i].revents != 0 &&
+          collect_receive_stream (i) != 0) {
+        collect_conn_close (i);
+      }
+    }
+
+    if ((pfds[1].revents & POLLIN) != 0) {
+      collect_accept (tcp_fd);
+    }
+    if ((pfds[2].revents & POLLIN) != 0) {
+      collect_accept (unix_fd);
+    }
+  }
+
+  while (conn_count > 0) {
+    collect_conn_close (conn_count - 1);
+  }
+  return 0;
+}
+
+/*
+ * Listens for export streams over TCP at sa, or a Unix socket at
+ * path if it's not NULL.
+ */
+static int
+collect_listen (const struct sockaddr_in *sa,
+                const char *path)
+{
+  int fd;
+  int one = 1;
+  struct sockaddr_un sun;
+
+  if (path != NULL) {
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof (sun.sun_path)) {
+      fprintf (stderr, "Socket path %s is too long\n", path);
+      return -1;
+    }
+    strcpy (sun.sun_path, path);
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      fprintf (stderr, "socket: %s\n", strerror (errno));
+      return -1;
+    }
+    unlink (path);
+    if (bind (fd, (struct sockaddr *) &sun, sizeof (sun)) != 0) {
+      fprintf (stderr, "Couldn't bind %s: %s\n", path, strerror (errno));
+      close (fd);
+      return -1;
+    }
+  } else {
+    fd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+      fprintf (stderr, "socket: %s\n", strerror (errno));
+      return -1;
+    }
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+    if (bind (fd, (struct sockaddr *) sa, sizeof (*sa)) != 0) {
+      fprintf (stderr, "Couldn't bind TCP %s:%u: %s\n", bind_addr,
+               bind_port, strerror (errno));
+      close (fd);
+      return -1;
+    }
+  }
+
+  if (listen (fd, 16) != 0) {
+    fprintf (stderr, "listen: %s\n", strerror (errno));
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+collect (void)
+{
+  int fd;
+  int err;
+  int tcp_fd = -1;
+  int unix_fd = -1;
+  int rcvbuf = COLLECT_RCVBUF;
+  pthread_t writer;
+  cap_file_hdr hdr;
+  collect_writer *w;
+  collect_slot *slot;
+  struct sockaddr_in sa;
+
+  w = calloc (1, sizeof (*w));
+  if (w == NULL) {
+    return -1;
+  }
+  w->zblock_size = compressBound (COLLECT_BLOCK_BYTES);
+  w->block = malloc (COLLECT_BLOCK_BYTES);
+  w->zblock = malloc (w->zblock_size);
+  if (w->block == NULL || w->zblock == NULL ||
+      spsc_init (&ring, COLLECT_SLOTS, sizeof (collect_slot)) != 0) {
+    fprintf (stderr, "Couldn't allocate buffers\n");
+    return -1;
+  }
+
+  w->f = fopen (out_path, "wb");
+  if (w->f == NULL) {
+    fprintf (stderr, "Couldn't create %s: %s\n", out_path, strerror (errno));
+    return -1;
+  }
+  setvbuf (w->f, NULL, _IOFBF, 1 << 20);
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, CAP_MAGIC, sizeof (hdr.magic));
+  hdr.version = 1;
+  if (fwrite (&hdr, sizeof (hdr), 1, w->f) != 1) {
+    fprintf (stderr, "Couldn't write %s\n", out_path);
+    return -1;
+  }
+  w->offset = sizeof (hdr);
+
+  fd = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0) {
+    fprintf (stderr, "socket: %s\n", strerror (errno));
+    return -1;
+  }
+  /*
+   * As big as we're allowed; SO_RCVBUFFORCE goes past rmem_max
+   * when we're privileged.
+   */
+  setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+#ifdef SO_RCVBUFFORCE
+  setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof (rcvbuf));
+#endif
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (bind_port);
+  sa.sin_addr.s_addr = inet_addr (bind_addr);
+  if (bind (fd, (struct sockaddr *) &sa, sizeof (sa)) != 0) {
+    fprintf (stderr, "Couldn't bind %s:%u: %s\n", bind_addr, bind_port,
+             strerror (errno));
+    return -1;
+  }
+  if (listen_tcp && (tcp_fd = collect_listen (&sa, NULL)) < 0) {
+    return -1;
+  }
+  if (unix_path != NULL && (unix_fd = collect_listen (NULL, unix_path)) < 0) {
+    return -1;
+  }
+
+  if (pthread_create (&writer, NULL, collect_writer_run, w) != 0) {
+    fprintf (stderr, "Couldn't start writer\n");
+    return -1;
+  }
+
+  printf ("Collecting on %s:%u%s%s%s into %s\n", bind_addr, bind_port,
+          listen_tcp ? " (UDP and TCP)" : "",
+          unix_path != NULL ? " and " : "",
+          unix_path != NULL ? unix_path : "", out_path);
+  err = collect_receive (fd, tcp_fd, unix_fd);
+
+  __atomic_store_n (&received_all, true, __ATOMIC_RELEASE);
+  spsc_wake (&ring);
+  pthread_join (writer, NULL);
+  close (fd);
+  if (tcp_fd >= 0) {
+    close (tcp_fd);
+  }
+  if (unix_fd >= 0) {
+    close (unix_fd);
+    unlink (unix_path);
+  }
+
+  /*
+   * The writer may have given up on an empty ring just before
+   * the last datagrams went in.
+   */
+  while ((slot = spsc_pop_slot (&ring)) != NULL) {
+    collect_dgram (w, slot);
+    spsc_pop_commit (&ring);
+  }
+
+  if (w->err == 0) {
+    w->err = collect_finish (w);
+  }
+  if (fclose (w->f) != 0) {
+    fprintf (stderr, "Couldn't write %s: %s\n", out_path, strerror (errno));
+    w->err = -1;
+  }
+
+  printf ("%" PRIu64 " datagrams, %" PRIu64 " bad, %" PRIu64 " from too "
+          "many senders; %" PRIu64 " bytes of records in %u blocks, "
+          "%" PRIu64 " bytes on disk\n",
+          w->dgrams, w->bad_dgrams, w->unknown_senders, w->raw_bytes,
+          w->index_count, w->offset);
+  collect_print_senders (w->senders, w->sender_count, stdout);
+  spsc_print_stats (&ring, "receiver->writer", stdout);
+
+  spsc_free (&ring);
+  free (w->index);
+  free (w->zblock);
+  free (w->block);
+  err = err != 0 ? err : w->err;
+  free (w);
+  return err;
+}
+
+/*
+ * Reads the index of the capture in f, or rebuilds what it can
+ * of it from the block headers if the capture was cut short.
+ */
+static int
+collect_read_index (FILE *f,
+                    cap_index **index,
+                    unsigned *index_count,
+                    cap_sender **senders,
+                    unsigned *sender_count)
+{
+  unsigned n;
+  unsigned size;
+  uint64_t offset;
+  off_t end;
+  cap_index *i;
+  cap_trailer t;
+  cap_file_hdr hdr;
+  cap_block_hdr b;
+
+  if (fread (&hdr, sizeof (hdr), 1, f) != 1 ||
+      memcmp (hdr.magic, CAP_MAGIC, sizeof (hdr.magic)) != 0) {
+    fprintf (stderr, "Not a capture\n");
+    return -1;
+  }
+
+  if (fseeko (f, -(off_t) sizeof (t), SEEK_END) == 0 &&
+      fread (&t, sizeof (t), 1, f) == 1 &&
+      memcmp (t.magic, CAP_INDEX_MAGIC, sizeof (t.magic)) == 0) {
+    *index = calloc (t.block_count + 1, sizeof (**index));
+    *senders = calloc (t.sender_count + 1, sizeof (**senders));
+    if (*index == NULL || *senders == NULL ||
+        fseeko (f, t.index_offset, SEEK_SET) != 0 ||
+        fread (*index, sizeof (**index), t.block_count, f) != t.block_count ||
+        fread (*senders, sizeof (**senders), t.sender_count, f) !=
+        t.sender_count) {
+      fprintf (stderr, "Bad index\n");
+      return -1;
+    }
+    *index_count = t.block_count;
+    *sender_count = t.sender_count;
+    return 0;
+  }
+
+  fprintf (stderr, "No index, capture cut short? Walking the blocks\n");
+  *senders = NULL;
+  *sender_count = 0;
+  *index = NULL;
+  n = 0;
+  size = 0;
+  offset = sizeof (hdr);
+  end = fseeko (f, 0, SEEK_END) == 0 ? ftello (f) : 0;
+  while (fseeko (f, offset, SEEK_SET) == 0 &&
+         fread (&b, sizeof (b), 1, f) == 1 && b.magic == CAP_BLOCK_MAGIC &&
+         offset + sizeof (b) + b.zlen <= (uint64_t) end) {
+    if (n == size) {
+      size = size != 0 ? size * 2 : 1024;
+      i = realloc (*index, size * sizeof (*i));
+      if (i == NULL) {
+        return -1;
+      }
+      *index = i;
+    }
+    i = &(*index)[n++];
+    i->offset = offset;
+    i->first_ns = b.first_ns;
+    i->last_ns = b.last_ns;
+    i->count = b.count;
+    offset += sizeof (b) + b.zlen;
+  }
+  *index_count = n;
+  return 0;
+}
+
+/*
+ * Decompresses the block at offset into data, by way of zdata
+ * (COLLECT_BLOCK_BYTES and compressBound of it).
+ */
+static int
+collect_read_block (FILE *f,
+                    uint64_t offset,
+                    uint8_t *data,
+                    uLongf *len,
+                    uint8_t *zdata,
+                    unsigned *count)
+{
+  int err;
+  cap_block_hdr b;
+
+  if (fseeko (f, offset, SEEK_SET) != 0 ||
+      fread (&b, sizeof (b), 1, f) != 1 || b.magic != CAP_BLOCK_MAGIC ||
+      b.len > COLLECT_BLOCK_BYTES || b.zlen > compressBound (b.len) ||
+      fread (zdata, b.zlen, 1, f) != 1) {
+    fprintf (stderr, "Bad block at %" PRIu64 "\n", offset);
+    return -1;
+  }
+
+  *len = COLLECT_BLOCK_BYTES;
+  err = uncompress (data, len, zdata, b.zlen);
+  if (err != Z_OK || *len != b.len) {
+    fprintf (stderr, "Bad block at %" PRIu64 ": %s\n", offset, zError (err));
+    return -1;
+  }
+  *count = b.count;
+  return 0;
+}
+
+/*
+ * Takes the record at *off of a block, len bytes of records: its
+ * sender, its export_rec and where its TLP is. -1 if it's cut
+ * short.
+ */
+static int
+collect_next_rec (const uint8_t *data,
+                  unsigned len,
+                  unsigned *off,
+                  unsigned *sender,
+                  export_rec *rec,
+                  const uint8_t **tlp)
+{
+  uint16_t be_sender;
+
+  if (*off + sizeof (be_sender) + sizeof (*rec) > len) {
+    return -1;
+  }
+  memcpy (&be_sender, data + *off, sizeof (be_sender));
+  memcpy (rec, data + *off + sizeof (be_sender), sizeof (*rec));
+  *off += sizeof (be_sender) + sizeof (*rec);
+  if (*off + ntohs (rec->size) > len) {
+    return -1;
+  }
+
+  *sender = ntohs (be_sender);
+  *tlp = data + *off;
+  *off += ntohs (rec->size);
+  return 0;
+}
+
+/*
+ * Summary of the capture at read_path, or the TLPs from from_s to
+ * to_s into out_path as pcapng.
+ */
+static int
+collect_read (void)
+{
+  int err = -1;
+  FILE *f;
+  unsigned i;
+  unsigned j;
+  unsigned n;
+  unsigned count;
+  unsigned off;
+  unsigned if_count;
+  unsigned sender;
+  unsigned if_of[COLLECT_MAX_SENDERS][COLLECT_MAX_DEVICES];
+  uint32_t devices[COLLECT_MAX_SENDERS];
+  const uint8_t *tlp;
+  uint64_t ts;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  uint64_t from_ns;
+  uint64_t to_ns;
+  uint64_t tlps = 0;
+  uLongf len;
+  uint8_t *data;
+  uint8_t *zdata;
+  char **if_descs = NULL;
+  unsigned index_count;
+  unsigned sender_count;
+  cap_index *index = NULL;
+  cap_sender *senders = NULL;
+  pcapng_t *out = NULL;
+  export_rec rec;
+  tlp_desc_t desc;
+  uint32_t dws[TLP_MAX_DWS];
+
+  f = fopen (read_path, "rb");
+  if (f == NULL) {
+    fprintf (stderr, "Couldn't open %s: %s\n", read_path, strerror (errno));
+    return -1;
+  }
+
+  data = malloc (COLLECT_BLOCK_BYTES);
+  zdata = malloc (compressBound (COLLECT_BLOCK_BYTES));
+  if (data == NULL || zdata == NULL ||
+      collect_read_index (f, &index, &index_count,
+                          &senders, &sender_count) != 0) {
+    goto out;
+  }
+
+  start_ns = UINT64_MAX;
+  end_ns = 0;
+  for (i = 0; i < index_count; i++) {
+    tlps += index[i].count;
+    if (index[i].first_ns < start_ns) {
+      start_ns = index[i].first_ns;
+    }
+    if (index[i].last_ns > end_ns) {
+      end_ns = index[i].last_ns;
+    }
+  }
+  if (index_count == 0) {
+    start_ns = end_ns = 0;
+  }
+
+  printf ("%" PRIu64 " TLPs in %u blocks over %.3f s\n", tlps, index_count,
+          (end_ns - start_ns) / 1e9);
+  collect_print_senders (senders, sender_count, stdout);
+  if (out_path == NULL) {
+    err = 0;
+    goto out;
+  }
+
+  from_ns = start_ns + (uint64_t) (from_s * 1e9);
+  to_ns = to_s < 0 ? UINT64_MAX : start_ns + (uint64_t) (to_s * 1e9);
+
+  /*
+   * An interface per device of each sender. Without an index,
+   * which devices there were takes a pass over the blocks first.
+   */
+  memset (devices, 0, sizeof (devices));
+  for (i = 0; i < sender_count && i < COLLECT_MAX_SENDERS; i++) {
+    devices[i] = senders[i].devices;
+  }
+  for (i = 0; sender_count == 0 && i < index_count; i++) {
+    if (index[i].last_ns < from_ns || index[i].first_ns > to_ns) {
+      continue;
+    }
+    if (collect_read_block (f, index[i].offset, data, &len, zdata,
+                            &count) != 0) {
+      goto out;
+    }
+    off = 0;
+    for (n = 0; n < count; n++) {
+      if (collect_next_rec (data, len, &off, &sender, &rec, &tlp) != 0) {
+        fprintf (stderr, "Bad block at %" PRIu64 "\n", index[i].offset);
+        goto out;
+      }
+      if (sender < COLLECT_MAX_SENDERS && rec.dev < COLLECT_MAX_DEVICES) {
+        devices[sender] |= 1u << rec.dev;
+      }
+    }
+  }
+
+  if_descs = calloc (COLLECT_MAX_SENDERS * COLLECT_MAX_DEVICES,
+                     sizeof (*if_descs));
+  if (if_descs == NULL) {
+    goto out;
+  }
+  if_count = 0;
+  for (i = 0; i < COLLECT_MAX_SENDERS; i++) {
+    for (j = 0; j < COLLECT_MAX_DEVICES; j++) {
+      if_of[i][j] = UINT32_MAX;
+      if ((devices[i] & (1u << j)) == 0) {
+        continue;
+      }
+      if_of[i][j] = if_count;
+      if ((i < sender_count ?
+           asprintf (&if_descs[if_count], "%s:%u device %u",
+                     senders[i].addr, senders[i].port, j) :
+           asprintf (&if_descs[if_count], "sender %u device %u", i, j)) < 0) {
+        goto out;
+      }
+      if_count++;
+    }
+  }
+
+  out = pcapng_open (out_path, if_descs, if_count, 0, 0, 0);
+  if (out == NULL) {
+    goto out;
+  }
+  pcapng_set_epoch_offset (out, 0);
+
+  memset (&desc, 0, sizeof (desc));
+  for (i = 0; i < index_count; i++) {
+    if (index[i].last_ns < from_ns || index[i].first_ns > to_ns) {
+      continue;
+    }
+    if (collect_read_block (f, index[i].offset, data, &len, zdata,
+                            &count) != 0) {
+      goto out;
+    }
+
+    off = 0;
+    for (n = 0; n < count; n++) {
+      if (collect_next_rec (data, len, &off, &sender, &rec, &tlp) != 0) {
+        fprintf (stderr, "Bad block at %" PRIu64 "\n", index[i].offset);
+        goto out;
+      }
+
+      ts = be64toh (rec.ts_ns);
+      if (ts < from_ns || ts > to_ns ||
+          sender >= COLLECT_MAX_SENDERS || rec.dev >= COLLECT_MAX_DEVICES ||
+          ntohs (rec.size) > sizeof (dws)) {
+        continue;
+      }
+      desc.size = ntohs (rec.size);
+      memcpy (dws, tlp, desc.size);
+      desc.data = dws;
+      desc.flags = rec.flags;
+      desc.ts_ns = ts;
+      desc.dev = if_of[sender][rec.dev];
+      if (pcapng_write (out, &desc) != 0) {
+        goto out;
+      }
+    }
+  }
+
+  pcapng_print_stats (out, stdout);
+  err = 0;
+
+ out:
+  pcapng_close (out);
+  for (i = 0; if_descs != NULL && i < COLLECT_MAX_SENDERS * COLLECT_MAX_DEVICES;
+       i++) {
+    free (if_descs[i]);
+  }
+  free (if_descs);
+  free (senders);
+  free (index);
+  free (zdata);
+  free (data);
+  fclose (f);
+  return err;
+}
+
+static int
+parse_opts (int argc,
+            char **argv)
+{
+  int opt;
+
+  while ((opt = getopt (argc, argv, "b:e:o:p:r:s:tu:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bind_addr = optarg;
+      break;
+    case 'e':
+      to_s = strtod (optarg, NULL);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    case 'p':
+      bind_port = (in_port_t) strtoul (optarg, NULL, 10);
+      break;
+    case 'r':
+      read_path = optarg;
+      break;
+    case 's':
+      from_s = strtod (optarg, NULL);
+      break;
+    case 't':
+      listen_tcp = true;
+      break;
+    case 'u':
+      unix_path = optarg;
+      break;
+    default: /* '?' */
+      fprintf (stderr, "Usage: %s [-b address] [-p port] [-t] [-u path] "
+               "-o capture\n"
+               "       %s -r capture [-o file.pcapng [-s from_s] [-e to_s]]\n",
+               argv[0], argv[0]);
+      return -1;
+    }
+  }
+
+  if (read_path == NULL && out_path == NULL) {
+    fprintf (stderr, "Where to? (-o)\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  if (parse_opts (argc, argv) != 0) {
+    return -1;
+  }
+
+  if (read_path != NULL) {
+    return collect_read () != 0 ? -1 : 0;
+  }
+
+  signal (SIGINT, on_sigint);
+  signal (SIGTERM, on_sigint);
+  return collect () != 0 ? -1 : 0;
+}
@@ -0,0 +1,943 @@
+/*
+ * LeechCore RX deframer.
+ *
+ * The FPGA sends 8-DWORD frames: a status DWORD (top nibble 0xE,
+ * then one nibble per data DWORD, slot 0 in the low nibble) and
+ * 7 data DWORDs. A nibble with the low two bits clear marks a TLP
+ * DWORD, and bit 2 on top of that marks the TLP's LAST DWORD.
+ * Frames may be separated by runs of 0x55556666 FTDI fillers.
+ * The other slot types (01 PCIe CFG, 10 loopback, 11 internal
+ * CFG) carry data only with both context bits clear; those DWORDs
+ * are routed to per-type queues, the rest is idle padding.
+ *
+ * Instead of walking DWORD by DWORD, the status nibbles of a frame
+ * are turned into a 7-bit TLP mask and a 7-bit LAST mask with
+ * byte-keyed tables, and the TLP DWORDs of the frame are packed
+ * into d->out in one go. The SSE2 and AVX2 variants additionally
+ * scan filler runs and validate status DWORDs several at a time.
+ *
+ * A bad status DWORD means the stream lost sync (a dropped or
+ * garbled transfer). The deframer then searches forward for the
+ * next DWORD with the 0xE marker, vectorized like the filler
+ * scan. It resumes there if the nibbles are ones the FPGA sends
+ * and the following frames also start with status DWORDs. The
+ * first TLP after that is kept only if its length agrees with its
+ * header, as it may be the tail of one whose start was lost.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEFRAME_X86
+#endif
+
+#define LC_FILLER           0x55556666
+#define LC_STATUS_MASK      0xf0000000
+#define LC_STATUS_MAGIC     0xe0000000
+#define LC_FRAME_DWORDS     8
+#define LC_DATA_DWORDS      7
+
+/*
+ * Status nibbles the FPGA sends (TLP, TLP LAST, the three routed
+ * types and idle padding), by bit. Only used to judge candidate
+ * frame boundaries when resyncing.
+ */
+#define LC_STATUS_NIBBLES   0x809f
+#define LC_RESYNC_FRAMES    2
+
+/*
+ * After deframe_compact, the largest TLP being assembled still
+ * leaves room for a frame.
+ */
+_Static_assert (TLP_MAX_DWS + LC_FRAME_DWORDS <= DEFRAME_OUT_DWORDS,
+                "deframe_t.out holds a whole TLP");
+
+typedef deframe_result (*deframe_run_fn) (deframe_t *d,
+                                          const uint32_t **pp,
+                                          const uint32_t *e);
+typedef const uint32_t *(*deframe_find_fn) (const uint32_t *p,
+                                            const uint32_t *e);
+
+/*
+ * Keyed by two status nibbles: which of the two slots are TLP
+ * DWORDs, and which are TLP LAST DWORDs.
+ */
+static uint8_t lut_tlp[256];
+static uint8_t lut_last[256];
+
+/*
+ * Keyed by the 7-bit TLP mask of a frame: how many TLP DWORDs
+ * it carries, where each one sits (1-based, so relative to the
+ * status DWORD), and how many TLP DWORDs precede and include each
+ * slot (for placing LAST boundaries).
+ */
+static uint8_t lut_count[128];
+static uint8_t lut_slot[128][LC_DATA_DWORDS];
+static uint8_t lut_prefix[128][LC_DATA_DWORDS];
+
+static deframe_run_fn deframe_impl;
+static deframe_find_fn deframe_find;
+
+static void
+deframe_tables_init (void)
+{
+  unsigned b;
+  unsigned m;
+  unsigned j;
+  unsigned n;
+
+  for (b = 0; b < 256; b++) {
+    for (j = 0; j < 2; j++) {
+      unsigned nibble = (b >> (j * 4)) & 0xf;
+
+      if ((nibble & 0x03) == 0x00) {
+        lut_tlp[b] |= 1 << j;
+      }
+      if ((nibble & 0x07) == 0x04) {
+        lut_last[b] |= 1 << j;
+      }
+    }
+  }
+
+  for (m = 0; m < 128; m++) {
+    n = 0;
+    for (j = 0; j < LC_DATA_DWORDS; j++) {
+      if ((m & (1 << j)) != 0) {
+        lut_slot[m][n++] = j + 1;
+      }
+      lut_prefix[m][j] = n;
+    }
+    lut_count[m] = n;
+  }
+}
+
+static inline void
+deframe_status (uint32_t status,
+                unsigned *tlp,
+                unsigned *last)
+{
+  /*
+   * Slot 6 is the low nibble of the top byte; the high
+   * nibble there is the 0xE marker.
+   */
+  *tlp = lut_tlp[status & 0xff] |
+    (lut_tlp[(status >> 8) & 0xff] << 2) |
+    (lut_tlp[(status >> 16) & 0xff] << 4) |
+    ((lut_tlp[(status >> 24) & 0x0f] & 1) << 6);
+  *last = lut_last[status & 0xff] |
+    (lut_last[(status >> 8) & 0xff] << 2) |
+    (lut_last[(status >> 16) & 0xff] << 4) |
+    ((lut_last[(status >> 24) & 0x0f] & 1) << 6);
+}
+
+/*
+ * Bit 4 * slot set for each slot holding CFG/loopback data, i.e.
+ * a status nibble of 0x1, 0x2 or 0x3.
+ */
+static inline uint32_t
+deframe_routed (uint32_t status)
+{
+  uint32_t lo;
+  uint32_t hi;
+
+  lo = (status | (status >> 1)) & 0x01111111;
+  hi = ((status >> 2) | (status >> 3)) & 0x01111111;
+  return lo & ~hi;
+}
+
+static void
+deframe_route (deframe_t *d,
+               const uint32_t *f,
+               uint32_t routed)
+{
+  unsigned j;
+  unsigned head;
+  unsigned tail;
+  deframe_queue *q;
+
+  while (routed != 0) {
+    j = __builtin_ctz (routed);
+    routed &= routed - 1;
+    q = DEFRAME_QUEUE (d, (f[0] >> j) & 0x3);
+
+    head = q->head;
+    tail = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+    if ((int) (q->flush - tail) > 0) {
+      tail = q->flush;
+    }
+    if (head - tail == DEFRAME_QUEUE_DWORDS) {
+      q->drops++;
+      continue;
+    }
+
+    q->dws[head % DEFRAME_QUEUE_DWORDS] = f[j / 4 + 1];
+    __atomic_store_n (&q->head, head + 1, __ATOMIC_RELEASE);
+  }
+}
+
+static inline bool
+deframe_has_room (deframe_t *d)
+{
+  /*
+   * A frame writes up to 8 DWORDs (vector stores write the full
+   * frame width) and ends up to 7 TLPs.
+   */
+  return d->out_len + LC_FRAME_DWORDS <= DEFRAME_OUT_DWORDS &&
+    d->ends_len + LC_DATA_DWORDS <= DEFRAME_MAX_ENDS;
+}
+
+static inline bool
+deframe_fast_ok (deframe_t *d)
+{
+  return !d->truncated && !d->verify &&
+    d->out_len - d->tlp_start + LC_DATA_DWORDS <= d->max_tlp_dws;
+}
+
+/*
+ * Records the TLPs ending in frame f. A TLP that began in this
+ * frame and fills consecutive slots is also still intact in the
+ * input, so note where.
+ */
+static inline void
+deframe_ends (deframe_t *d,
+              const uint32_t *f,
+              unsigned tlp,
+              unsigned last)
+{
+  unsigned j;
+  unsigned seg;
+  unsigned from;
+  bool fresh;
+
+  from = 0;
+  fresh = d->out_len == d->tlp_start;
+  while (last != 0) {
+    j = __builtin_ctz (last);
+    last &= last - 1;
+
+    seg = tlp & ((2u << j) - (1u << from));
+    from = __builtin_ctz (seg);
+    d->src[d->ends_len] = fresh && seg == (2u << j) - (1u << from) ?
+      f + 1 + from : NULL;
+
+    d->tlp_start = d->out_len + lut_prefix[tlp][j];
+    d->ends[d->ends_len++] = d->tlp_start;
+    from = j + 1;
+    fresh = true;
+  }
+}
+
+/*
+ * DWORD at a time, for frames that may push the TLP being
+ * assembled past max_tlp_dws, or that follow a resync. The excess
+ * of an overlong TLP is dropped and the TLP flagged when its LAST
+ * DWORD shows up. The first TLP after a resync is dropped whole
+ * unless it agrees with its header.
+ */
+static void
+deframe_frame_slow (deframe_t *d,
+                    const uint32_t *f,
+                    unsigned tlp,
+                    unsigned last)
+{
+  unsigned j;
+
+  for (j = 0; j < LC_DATA_DWORDS; j++) {
+    if ((tlp & (1 << j)) == 0) {
+      continue;
+    }
+
+    if (d->out_len - d->tlp_start < d->max_tlp_dws) {
+      d->out[d->out_len++] = f[j + 1];
+    } else {
+      d->truncated = true;
+    }
+
+    if ((last & (1 << j)) != 0 && d->verify) {
+      d->verify = false;
+      if (d->truncated ||
+          tlp_len_dws (d->out + d->tlp_start, d->out_len - d->tlp_start) !=
+          d->out_len - d->tlp_start) {
+        /*
+         * Counted already if it's the rest of the TLP cut
+         * short when sync was lost.
+         */
+        d->resync_dws += d->out_len - d->tlp_start;
+        d->resync_tlps += !d->cut;
+        d->out_len = d->tlp_start;
+        d->truncated = false;
+        continue;
+      }
+    }
+
+    if ((last & (1 << j)) != 0) {
+      d->src[d->ends_len] = NULL;
+      d->ends[d->ends_len++] = d->out_len |
+        (d->truncated ? DEFRAME_END_TRUNCATED : 0);
+      d->tlp_start = d->out_len;
+      d->truncated = false;
+    }
+  }
+}
+
+static inline void
+deframe_frame (deframe_t *d,
+               const uint32_t *f)
+{
+  unsigned j;
+  unsigned n;
+  unsigned tlp;
+  unsigned last;
+  uint32_t *out;
+  uint32_t routed;
+
+  deframe_status (f[0], &tlp, &last);
+  routed = deframe_routed (f[0]);
+  if (routed != 0) {
+    deframe_route (d, f, routed);
+  }
+
+  n = lut_count[tlp];
+  d->frames++;
+  d->other_dws += LC_DATA_DWORDS - n;
+
+  if (!deframe_fast_ok (d)) {
+    deframe_frame_slow (d, f, tlp, last);
+    return;
+  }
+
+  out = d->out + d->out_len;
+  for (j = 0; j < n; j++) {
+    out[j] = f[lut_slot[tlp][j]];
+  }
+
+  deframe_ends (d, f, tlp, last);
+  d->out_len += n;
+}
+
+/*
+ * Returns whether sync was only just lost, rather than still
+ * being searched for.
+ */
+static inline bool
+deframe_out_of_sync (deframe_t *d)
+{
+  bool fresh = !d->lost;
+
+  if (fresh) {
+    d->cut = d->out_len != d->tlp_start;
+    d->resync_tlps += d->cut;
+    d->out_of_sync++;
+  }
+
+  /*
+   * Whatever was assembled of the current TLP can't be trusted.
+   */
+  d->resync_dws += d->out_len - d->tlp_start;
+  d->out_len = d->tlp_start;
+  d->truncated = false;
+  d->verify = false;
+  d->lost = true;
+  return fresh;
+}
+
+static const uint32_t *
+deframe_find_status_scalar (const uint32_t *p,
+                            const uint32_t *e)
+{
+  while (p < e && (*p & LC_STATUS_MASK) != LC_STATUS_MAGIC) {
+    p++;
+  }
+
+  return p;
+}
+
+/*
+ * Whether f (a whole frame) looks like a real frame boundary:
+ * plausible status nibbles, and the LC_RESYNC_FRAMES frames after
+ * it (past any fillers, as far as [next, e) goes) also start with
+ * status DWORDs.
+ */
+static bool
+deframe_plausible (const uint32_t *f,
+                   const uint32_t *next,
+                   const uint32_t *e)
+{
+  unsigned j;
+
+  if ((f[0] & LC_STATUS_MASK) != LC_STATUS_MAGIC) {
+    return false;
+  }
+
+  for (j = 0; j < LC_DATA_DWORDS; j++) {
+    if (((LC_STATUS_NIBBLES >> ((f[0] >> (j * 4)) & 0xf)) & 1) == 0) {
+      return false;
+    }
+  }
+
+  for (j = 0; j < LC_RESYNC_FRAMES; j++) {
+    while (next < e && *next == LC_FILLER) {
+      next++;
+    }
+
+    if (next == e) {
+      break;
+    }
+    if ((*next & LC_STATUS_MASK) != LC_STATUS_MAGIC) {
+      return false;
+    }
+    next += LC_FRAME_DWORDS;
+  }
+
+  return true;
+}
+
+static inline void
+deframe_resume (deframe_t *d)
+{
+  d->lost = false;
+  d->verify = true;
+}
+
+/*
+ * Scans [p, e) for a frame boundary to resume at after losing
+ * sync, and returns it. A candidate too close to e to check is
+ * returned as is; it gets carried over and checked once the frame
+ * is complete. Returns e if there's none.
+ */
+static const uint32_t *
+deframe_resync (deframe_t *d,
+                const uint32_t *p,
+                const uint32_t *e)
+{
+  const uint32_t *s = p;
+
+  while ((p = deframe_find (p, e)) != e && e - p >= LC_FRAME_DWORDS) {
+    if (deframe_plausible (p, p + LC_FRAME_DWORDS, e)) {
+      deframe_resume (d);
+      break;
+    }
+    p++;
+  }
+
+  d->resync_dws += p - s;
+  return p;
+}
+
+static const uint32_t *
+deframe_skip_fillers_scalar (deframe_t *d,
+                             const uint32_t *p,
+                             const uint32_t *e)
+{
+  const uint32_t *s = p;
+
+  while (p < e && *p == LC_FILLER) {
+    p++;
+  }
+
+  d->fillers += p - s;
+  return p;
+}
+
+/*
+ * Everything that isn't a run of complete, well-formed frames:
+ * fillers, a frame split across buffers, a bad status DWORD or
+ * a full output buffer. Returns DEFRAME_MORE if the caller can go
+ * on with its fast path.
+ */
+#define DEFRAME_MORE ((deframe_result) -1)
+
+static inline deframe_result
+deframe_step (deframe_t *d,
+              const uint32_t **pp,
+              const uint32_t *e,
+              const uint32_t *(*skip) (deframe_t *,
+                                       const uint32_t *,
+                                       const uint32_t *))
+{
+  const uint32_t *p = *pp;
+
+  p = skip (d, p, e);
+  if (p == e) {
+    *pp = p;
+    return DEFRAME_DONE;
+  }
+
+  if (e - p < LC_FRAME_DWORDS) {
+    d->carry_len = e - p;
+    memcpy (d->carry, p, d->carry_len * sizeof (uint32_t));
+    *pp = e;
+    return DEFRAME_DONE;
+  }
+
+  if (!deframe_has_room (d)) {
+    *pp = p;
+    return DEFRAME_FULL;
+  }
+
+  if ((*p & LC_STATUS_MASK) != LC_STATUS_MAGIC) {
+    deframe_out_of_sync (d);
+    *pp = deframe_resync (d, p, e);
+    return DEFRAME_OUT_OF_SYNC;
+  }
+
+  deframe_frame (d, p);
+  *pp = p + LC_FRAME_DWORDS;
+  return DEFRAME_MORE;
+}
+
+static deframe_result
+deframe_run_scalar (deframe_t *d,
+                    const uint32_t **pp,
+                    const uint32_t *e)
+{
+  deframe_result r;
+  const uint32_t *p = *pp;
+
+  while (1) {
+    while (e - p >= LC_FRAME_DWORDS &&
+           (*p & LC_STATUS_MASK) == LC_STATUS_MAGIC &&
+           deframe_has_room (d)) {
+      deframe_frame (d, p);
+      p += LC_FRAME_DWORDS;
+    }
+
+    r = deframe_step (d, &p, e, deframe_skip_fillers_scalar);
+    if (r != DEFRAME_MORE) {
+      *pp = p;
+      return r;
+    }
+  }
+}
+
+#ifdef DEFRAME_X86
+__attribute__ ((target ("sse2")))
+static const uint32_t *
+deframe_skip_fillers_sse2 (deframe_t *d,
+                           const uint32_t *p,
+                           const uint32_t *e)
+{
+  unsigned mask;
+  __m128i v;
+  const uint32_t *s = p;
+  const __m128i filler = _mm_set1_epi32 (LC_FILLER);
+
+  while (e - p >= 4) {
+    v = _mm_loadu_si128 ((const __m128i *) p);
+    mask = _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpeq_epi32 (v, filler)));
+    if (mask != 0xf) {
+      p += __builtin_ctz (~mask);
+      d->fillers += p - s;
+      return p;
+    }
+    p += 4;
+  }
+
+  d->fillers += p - s;
+  return deframe_skip_fillers_scalar (d, p, e);
+}
+
+__attribute__ ((target ("sse2")))
+static const uint32_t *
+deframe_find_status_sse2 (const uint32_t *p,
+                          const uint32_t *e)
+{
+  unsigned mask;
+  __m128i v;
+  const __m128i hi = _mm_set1_epi32 (LC_STATUS_MASK);
+  const __m128i magic = _mm_set1_epi32 (LC_STATUS_MAGIC);
+
+  while (e - p >= 4) {
+    v = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *) p), hi);
+    mask = _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpeq_epi32 (v, magic)));
+    if (mask != 0) {
+      return p + __builtin_ctz (mask);
+    }
+    p += 4;
+  }
+
+  return deframe_find_status_scalar (p, e);
+}
+
+/*
+ * Checks the status DWORDs of four consecutive frames at once
+ * and runs the frame decoder over the leading well-formed ones.
+ */
+__attribute__ ((target ("sse2")))
+static deframe_result
+deframe_run_sse2 (deframe_t *d,
+                  const uint32_t **pp,
+                  const uint32_t *e)
+{
+  unsigned k;
+  unsigned n;
+  unsigned mask;
+  __m128i st;
+  deframe_result r;
+  const uint32_t *p = *pp;
+  const __m128i hi = _mm_set1_epi32 (LC_STATUS_MASK);
+  const __m128i magic = _mm_set1_epi32 (LC_STATUS_MAGIC);
+
+  while (1) {
+    while (e - p >= 4 * LC_FRAME_DWORDS &&
+           d->out_len + 4 * LC_FRAME_DWORDS <= DEFRAME_OUT_DWORDS &&
+           d->ends_len + 4 * LC_DATA_DWORDS <= DEFRAME_MAX_ENDS) {
+      st = _mm_set_epi32 (p[24], p[16], p[8], p[0]);
+      st = _mm_cmpeq_epi32 (_mm_and_si128 (st, hi), magic);
+      mask = _mm_movemask_ps (_mm_castsi128_ps (st));
+      n = __builtin_ctz (~mask);
+      for (k = 0; k < n; k++) {
+        deframe_frame (d, p);
+        p += LC_FRAME_DWORDS;
+      }
+
+      if (n != 4) {
+        break;
+      }
+    }
+
+    r = deframe_step (d, &p, e, deframe_skip_fillers_sse2);
+    if (r != DEFRAME_MORE) {
+      *pp = p;
+      return r;
+    }
+  }
+}
+
+__attribute__ ((target ("avx2")))
+static const uint32_t *
+deframe_skip_fillers_avx2 (deframe_t *d,
+                           const uint32_t *p,
+                           const uint32_t *e)
+{
+  unsigned mask;
+  __m256i v;
+  const uint32_t *s = p;
+  const __m256i filler = _mm256_set1_epi32 (LC_FILLER);
+
+  while (e - p >= 8) {
+    v = _mm256_loadu_si256 ((const __m256i *) p);
+    mask = _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpeq_epi32 (v, filler)));
+    if (mask != 0xff) {
+      p += __builtin_ctz (~mask);
+      d->fillers += p - s;
+      return p;
+    }
+    p += 8;
+  }
+
+  d->fillers += p - s;
+  return deframe_skip_fillers_scalar (d, p, e);
+}
+
+__attribute__ ((target ("avx2")))
+static const uint32_t *
+deframe_find_status_avx2 (const uint32_t *p,
+                          const uint32_t *e)
+{
+  unsigned mask;
+  __m256i v;
+  const __m256i hi = _mm256_set1_epi32 (LC_STATUS_MASK);
+  const __m256i magic = _mm256_set1_epi32 (LC_STATUS_MAGIC);
+
+  while (e - p >= 8) {
+    v = _mm256_and_si256 (_mm256_loadu_si256 ((const __m256i *) p), hi);
+    mask = _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpeq_epi32 (v, magic)));
+    if (mask != 0) {
+      return p + __builtin_ctz (mask);
+    }
+    p += 8;
+  }
+
+  return deframe_find_status_scalar (p, e);
+}
+
+/*
+ * _mm256_permutevar8x32_epi32 indices that pack the TLP DWORDs
+ * of a frame to the front, keyed by TLP mask.
+ */
+static uint32_t lut_perm[128][8] __attribute__ ((aligned (32)));
+
+/*
+ * Gathers the status DWORDs of eight consecutive frames, validates
+ * them in one compare and packs each frame's TLP DWORDs with a
+ * single permute.
+ */
+__attribute__ ((target ("avx2")))
+static deframe_result
+deframe_run_avx2 (deframe_t *d,
+                  const uint32_t **pp,
+                  const uint32_t *e)
+{
+  unsigned k;
+  unsigned n;
+  unsigned mask;
+  unsigned tlp;
+  unsigned last;
+  uint32_t routed;
+  __m256i st;
+  __m256i v;
+  deframe_result r;
+  uint32_t status[8] __attribute__ ((aligned (32)));
+  const uint32_t *p = *pp;
+  const __m256i idx = _mm256_setr_epi32 (0, 8, 16, 24, 32, 40, 48, 56);
+  const __m256i hi = _mm256_set1_epi32 (LC_STATUS_MASK);
+  const __m256i magic = _mm256_set1_epi32 (LC_STATUS_MAGIC);
+
+  while (1) {
+    while (e - p >= 8 * LC_FRAME_DWORDS &&
+           d->out_len + 8 * LC_FRAME_DWORDS <= DEFRAME_OUT_DWORDS &&
+           d->ends_len + 8 * LC_DATA_DWORDS <= DEFRAME_MAX_ENDS) {
+      st = _mm256_i32gather_epi32 ((const int *) p, idx, 4);
+      _mm256_store_si256 ((__m256i *) status, st);
+      st = _mm256_cmpeq_epi32 (_mm256_and_si256 (st, hi), magic);
+      mask = _mm256_movemask_ps (_mm256_castsi256_ps (st));
+      n = __builtin_ctz (~mask);
+
+      for (k = 0; k < n; k++) {
+        deframe_status (status[k], &tlp, &last);
+        routed = deframe_routed (status[k]);
+        if (routed != 0) {
+          deframe_route (d, p, routed);
+        }
+
+        d->frames++;
+        d->other_dws += LC_DATA_DWORDS - lut_count[tlp];
+
+        if (deframe_fast_ok (d)) {
+          v = _mm256_loadu_si256 ((const __m256i *) p);
+          v = _mm256_permutevar8x32_epi32 (v, _mm256_load_si256 ((const __m256i *) lut_perm[tlp]));
+          _mm256_storeu_si256 ((__m256i *) (d->out + d->out_len), v);
+          deframe_ends (d, p, tlp, last);
+          d->out_len += lut_count[tlp];
+        } else {
+          deframe_frame_slow (d, p, tlp, last);
+        }
+
+        p += LC_FRAME_DWORDS;
+      }
+
+      if (n != 8) {
+        break;
+      }
+    }
+
+    r = deframe_step (d, &p, e, deframe_skip_fillers_avx2);
+    if (r != DEFRAME_MORE) {
+      *pp = p;
+      return r;
+    }
+  }
+}
+#endif
+
+static pthread_once_t deframe_tables_once = PTHREAD_ONCE_INIT;
+
+static void
+deframe_tables_build (void)
+{
+  deframe_tables_init ();
+#ifdef DEFRAME_X86
+  {
+    unsigned m;
+    unsigned j;
+
+    for (m = 0; m < 128; m++) {
+      for (j = 0; j < 8; j++) {
+        lut_perm[m][j] = j < lut_count[m] ? lut_slot[m][j] : 0;
+      }
+    }
+  }
+#endif
+}
+
+/*
+ * Returns the name of the selected implementation, or NULL if
+ * the requested one isn't supported on this machine. The
+ * tables are built once, whichever thread gets here first.
+ */
+const char *
+deframe_select (deframe_kind kind)
+{
+  pthread_once (&deframe_tables_once, deframe_tables_build);
+
+#ifdef DEFRAME_X86
+  __builtin_cpu_init ();
+  if (kind == DEFRAME_AUTO) {
+    kind = __builtin_cpu_supports ("avx2") ? DEFRAME_AVX2 :
+      __builtin_cpu_supports ("sse2") ? DEFRAME_SSE2 :
+      DEFRAME_SCALAR;
+  }
+
+  if (kind == DEFRAME_AVX2 && __builtin_cpu_supports ("avx2")) {
+    deframe_impl = deframe_run_avx2;
+    deframe_find = deframe_find_status_avx2;
+    return "avx2";
+  }
+
+  if (kind == DEFRAME_SSE2 && __builtin_cpu_supports ("sse2")) {
+    deframe_impl = deframe_run_sse2;
+    deframe_find = deframe_find_status_sse2;
+    return "sse2";
+  }
+#else
+  if (kind == DEFRAME_AUTO) {
+    kind = DEFRAME_SCALAR;
+  }
+#endif
+
+  if (kind == DEFRAME_SCALAR) {
+    deframe_impl = deframe_run_scalar;
+    deframe_find = deframe_find_status_scalar;
+    return "scalar";
+  }
+
+  return NULL;
+}
+
+/*
+ * Moves the TLP being assembled to the start of d->out. Only
+ * valid once every completed TLP has been consumed.
+ */
+void
+deframe_compact (deframe_t *d)
+{
+  unsigned n;
+
+  n = d->out_len - d->tlp_start;
+  memmove (d->out, d->out + d->tlp_start, n * sizeof (uint32_t));
+  d->out_len = n;
+  d->tlp_start = 0;
+  d->ends_len = 0;
+}
+
+/*
+ * Forgets the TLP being assembled, any partial frame and any
+ * queued register responses, e.g. when the stream starts over.
+ * Completed TLPs are kept.
+ */
+void
+deframe_reset (deframe_t *d)
+{
+  unsigned i;
+
+  d->out_len = d->tlp_start;
+  d->truncated = false;
+  d->verify = false;
+  d->lost = false;
+  d->carry_len = 0;
+  for (i = 0; i < sizeof (d->queues) / sizeof (d->queues[0]); i++) {
+    __atomic_store_n (&d->queues[i].flush, d->queues[i].head,
+                      __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * Deframes [*pp, e) into d->out / d->ends, advancing *pp. Stops
+ * early when sync is lost (after skipping to where it resumes, as
+ * far as [*pp, e) goes) or when out of room. The caller should
+ * consume TLPs and call deframe_compact before resuming.
+ */
+deframe_result
+deframe_run (deframe_t *d,
+             const uint32_t **pp,
+             const uint32_t *e)
+{
+  bool fresh;
+  unsigned take;
+  const uint32_t *p = *pp;
+
+  if (deframe_impl == NULL) {
+    deframe_select (DEFRAME_AUTO);
+  }
+
+  /*
+   * Finish a frame that straddled the previous buffer first.
+   */
+  while (d->carry_len != 0) {
+    take = LC_FRAME_DWORDS - d->carry_len;
+    if (take > (unsigned) (e - p)) {
+      take = e - p;
+    }
+
+    memcpy (d->carry + d->carry_len, p, take * sizeof (uint32_t));
+    d->carry_len += take;
+    p += take;
+    *pp = p;
+
+    if (d->carry_len != LC_FRAME_DWORDS) {
+      return DEFRAME_DONE;
+    }
+
+    if (!deframe_has_room (d)) {
+      return DEFRAME_FULL;
+    }
+
+    if ((d->carry[0] & LC_STATUS_MASK) != LC_STATUS_MAGIC ||
+        (d->lost && !deframe_plausible (d->carry, p, e))) {
+      /*
+       * Drop up to the next candidate status DWORD in the
+       * carry copy and try again.
+       */
+      fresh = deframe_out_of_sync (d);
+      take = deframe_find (d->carry + 1, d->carry + d->carry_len) -
+        d->carry;
+      d->resync_dws += take;
+      d->carry_len -= take;
+      memmove (d->carry, d->carry + take, d->carry_len * sizeof (uint32_t));
+      if (fresh) {
+        return DEFRAME_OUT_OF_SYNC;
+      }
+      continue;
+    }
+
+    if (d->lost) {
+      deframe_resume (d);
+    }
+
+    /*
+     * Nothing in the carry copy outlives this call.
+     */
+    take = d->ends_len;
+    deframe_frame (d, d->carry);
+    while (take < d->ends_len) {
+      d->src[take++] = NULL;
+    }
+    d->carry_len = 0;
+  }
+
+  if (d->lost) {
+    *pp = p = deframe_resync (d, p, e);
+  }
+
+  return deframe_impl (d, pp, e);
+}
+
+bool
+deframe_queue_pop (deframe_queue *q,
+                   uint32_t *dw)
+{
+  unsigned flush;
+  unsigned tail = q->tail;
+
+  /*
+   * Drop whatever was queued before a reset.
+   */
+  flush = __atomic_load_n (&q->flush, __ATOMIC_ACQUIRE);
+  if ((int) (flush - tail) > 0) {
+    tail = flush;
+    __atomic_store_n (&q->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  if (tail == __atomic_load_n (&q->head, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  *dw = q->dws[tail % DEFRAME_QUEUE_DWORDS];
+  __atomic_store_n (&q->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
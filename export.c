@@ -0,0 +1,806 @@
+/*
+ * TLP export to a remote collector.
+ *
+ * Over UDP, TLPs are packed into datagrams of up to mtu bytes,
+ * each one starting with an export_dgram header and then, per
+ * TLP, an export_rec header followed by its bytes (a TLP too
+ * large for the MTU goes out alone). Up to EXPORT_BATCH
+ * datagrams are sent with one sendmmsg, once they fill up or
+ * once the oldest TLP in them has waited flush_ns (see
+ * export_poll).
+ *
+ * Over a stream (TCP or a Unix socket) it's one export_dgram
+ * header, with a count of 0, then the same records back to back.
+ * They're queued in chunks of EXPORT_CHUNK_BYTES, written out a
+ * batch of chunks per writev as the socket takes them, and what
+ * happens when the queue fills up is up to the export_policy:
+ * wait for the collector, drop the oldest chunks not yet
+ * started on, or keep going with just TLP headers (and drop TLPs
+ * once even those don't fit). Every TLP ends up counted as sent,
+ * dropped or lost with the connection.
+ *
+ * All fields are big-endian, TLPs as received. Sequence numbers
+ * run over all devices, so lost and reordered TLPs show up as
+ * gaps; timestamps are receive times in ns since the epoch. See
+ * wireshark/pcietlp.lua.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* sendmmsg */
+#endif
+#include "screamer.h"
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define EXPORT_BATCH        64
+#define EXPORT_CHUNK_BYTES  (64u << 10)
+#define EXPORT_CLOSE_WAIT_MS 5000
+/*
+ * How often a blocked stream export checks for export_stop.
+ */
+#define EXPORT_STOP_CHECK_MS 100
+
+/*
+ * desc flags worth passing on.
+ */
+#define EXPORT_FLAGS        (TLP_DESC_CORRUPT | TLP_DESC_TRUNCATED | \
+                             TLP_DESC_RESYNC | TLP_DESC_RECONNECT)
+
+#if !defined(__linux__)
+/*
+ * One sendmsg per datagram where there's no sendmmsg.
+ */
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+
+static int
+sendmmsg (int fd,
+          struct mmsghdr *msgs,
+          unsigned int count,
+          int flags)
+{
+  unsigned i;
+  ssize_t n;
+
+  for (i = 0; i < count; i++) {
+    n = sendmsg (fd, &msgs[i].msg_hdr, flags);
+    if (n < 0) {
+      return i != 0 ? (int) i : -1;
+    }
+    msgs[i].msg_len = n;
+  }
+  return count;
+}
+#endif
+
+typedef struct {
+  uint8_t *data;
+  unsigned len;
+  unsigned tlps;
+} export_chunk;
+
+struct export {
+  int fd;
+  bool stream;
+  uint64_t flush_ns;
+  uint64_t epoch_offset_ns;
+  uint32_t seq;
+  uint64_t first_ns;
+  uint64_t tlp_count;
+
+  /*
+   * UDP. Datagrams 0 to count - 1 are complete, count is being
+   * filled (len bytes so far, of tlps TLPs) unless len is 0.
+   * first_ns is when the oldest of them was added.
+   */
+  struct sockaddr_in sa;
+  unsigned mtu;
+  uint8_t *bufs;
+  unsigned buf_size;
+  unsigned count;
+  unsigned len;
+  unsigned tlps;
+  struct iovec iovs[EXPORT_BATCH];
+  struct mmsghdr msgs[EXPORT_BATCH];
+  uint64_t dgram_count;
+  uint64_t calls;
+  uint64_t dropped;
+
+  /*
+   * Streams. queued chunks from head on, the last of them being
+   * filled, sent bytes of the first already written. first_ns is
+   * when the queue last went from empty to not. stalled once the
+   * socket wouldn't take more, until it does.
+   */
+  export_policy policy;
+  export_chunk *chunks;
+  unsigned chunk_count;
+  unsigned head;
+  unsigned queued;
+  unsigned sent;
+  bool stalled;
+  bool failed;
+  bool finished;
+  volatile bool stopping;
+  uint64_t stream_bytes;
+  uint64_t writes;
+  uint64_t tlps_sent;
+  uint64_t tlps_dropped;
+  uint64_t tlps_rejected;
+  uint64_t tlps_headers;
+  uint64_t tlps_lost;
+  uint64_t blocked_ns;
+};
+
+static export_t *
+export_new (uint64_t flush_ns)
+{
+  export_t *e;
+
+  e = calloc (1, sizeof (*e));
+  if (e == NULL) {
+    return NULL;
+  }
+
+  e->fd = -1;
+  e->flush_ns = flush_ns;
+  e->epoch_offset_ns = time_epoch_offset_ns ();
+  return e;
+}
+
+export_t *
+export_udp_open (const char *remote_addr,
+                 in_port_t remote_port,
+                 unsigned mtu,
+                 uint64_t flush_ns)
+{
+  unsigned i;
+  export_t *e;
+
+  if (mtu < sizeof (export_dgram) + sizeof (export_rec) + 16) {
+    fprintf (stderr, "MTU of %u is too small\n", mtu);
+    return NULL;
+  }
+
+  e = export_new (flush_ns);
+  if (e == NULL) {
+    return NULL;
+  }
+
+  e->mtu = mtu;
+  e->buf_size = sizeof (export_dgram) + sizeof (export_rec) +
+    TLP_MAX_DWS * sizeof (uint32_t);
+  if (e->buf_size < mtu) {
+    e->buf_size = mtu;
+  }
+  e->bufs = malloc ((size_t) e->buf_size * EXPORT_BATCH);
+  if (e->bufs == NULL) {
+    export_close (e);
+    return NULL;
+  }
+
+  e->fd = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (e->fd < 0) {
+    fprintf (stderr, "socket: %s\n", strerror (errno));
+    export_close (e);
+    return NULL;
+  }
+
+  e->sa.sin_family = AF_INET;
+  e->sa.sin_port = htons (remote_port);
+  e->sa.sin_addr.s_addr = inet_addr (remote_addr);
+
+  /*
+   * Unconnected, as with net_dump: a server that isn't up yet
+   * shouldn't turn into send errors.
+   */
+  for (i = 0; i < EXPORT_BATCH; i++) {
+    e->iovs[i].iov_base = e->bufs + (size_t) i * e->buf_size;
+    e->msgs[i].msg_hdr.msg_name = &e->sa;
+    e->msgs[i].msg_hdr.msg_namelen = sizeof (e->sa);
+    e->msgs[i].msg_hdr.msg_iov = &e->iovs[i];
+    e->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  return e;
+}
+
+/*
+ * Connects to "tcp:host:port" or "unix:path".
+ */
+static int
+export_connect (const char *spec)
+{
+  int fd;
+  int err;
+  int one = 1;
+  char *host;
+  char *port;
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct addrinfo *ai;
+  struct sockaddr_un sun;
+
+  if (strncmp (spec, "unix:", 5) == 0) {
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen (spec + 5) >= sizeof (sun.sun_path)) {
+      fprintf (stderr, "Socket path %s is too long\n", spec + 5);
+      return -1;
+    }
+    strcpy (sun.sun_path, spec + 5);
+
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      fprintf (stderr, "socket: %s\n", strerror (errno));
+      return -1;
+    }
+    if (connect (fd, (struct sockaddr *) &sun, sizeof (sun)) != 0) {
+      fprintf (stderr, "Couldn't connect to %s: %s\n", spec + 5,
+               strerror (errno));
+      close (fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  if (strncmp (spec, "tcp:", 4) != 0 ||
+      (port = strrchr (spec + 4, ':')) == NULL) {
+    fprintf (stderr, "Export to tcp:host:port or unix:path, not %s\n", spec);
+    return -1;
+  }
+
+  host = strndup (spec + 4, port - spec - 4);
+  if (host == NULL) {
+    return -1;
+  }
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  err = getaddrinfo (host, port + 1, &hints, &res);
+  free (host);
+  if (err != 0) {
+    fprintf (stderr, "%s: %s\n", spec, gai_strerror (err));
+    return -1;
+  }
+
+  fd = -1;
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close (fd);
+    fd = -1;
+  }
+  freeaddrinfo (res);
+  if (fd < 0) {
+    fprintf (stderr, "Couldn't connect to %s: %s\n", spec, strerror (errno));
+    return -1;
+  }
+
+  /*
+   * Chunks go out whole, or on purpose when flushed.
+   */
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  return fd;
+}
+
+/*
+ * Streams to spec (see export_connect) through a queue of about
+ * queue_bytes, handled per policy when the collector can't keep
+ * up.
+ */
+export_t *
+export_stream_open (const char *spec,
+                    size_t queue_bytes,
+                    export_policy policy,
+                    uint64_t flush_ns)
+{
+  unsigned i;
+  export_t *e;
+  export_dgram hdr;
+
+  e = export_new (flush_ns);
+  if (e == NULL) {
+    return NULL;
+  }
+
+  e->stream = true;
+  e->policy = policy;
+  e->chunk_count = queue_bytes / EXPORT_CHUNK_BYTES;
+  if (e->chunk_count < 4) {
+    e->chunk_count = 4;
+  }
+  e->chunks = calloc (e->chunk_count, sizeof (*e->chunks));
+  if (e->chunks == NULL) {
+    export_close (e);
+    return NULL;
+  }
+  for (i = 0; i < e->chunk_count; i++) {
+    e->chunks[i].data = malloc (EXPORT_CHUNK_BYTES);
+    if (e->chunks[i].data == NULL) {
+      export_close (e);
+      return NULL;
+    }
+  }
+
+  e->fd = export_connect (spec);
+  if (e->fd < 0) {
+    export_close (e);
+    return NULL;
+  }
+
+  /*
+   * Ahead of the queue, so dropping chunks can't take it out.
+   */
+  hdr.magic = htonl (EXPORT_MAGIC);
+  hdr.version = EXPORT_VERSION;
+  hdr.reserved = 0;
+  hdr.count = 0;
+  if (write (e->fd, &hdr, sizeof (hdr)) != sizeof (hdr)) {
+    fprintf (stderr, "Couldn't write to %s\n", spec);
+    export_close (e);
+    return NULL;
+  }
+  e->stream_bytes = sizeof (hdr);
+
+  if (fcntl (e->fd, F_SETFL, fcntl (e->fd, F_GETFL) | O_NONBLOCK) != 0) {
+    fprintf (stderr, "fcntl: %s\n", strerror (errno));
+    export_close (e);
+    return NULL;
+  }
+
+  return e;
+}
+
+static inline export_chunk *
+export_chunk_at (export_t *e,
+                 unsigned i)
+{
+  return &e->chunks[(e->head + i) % e->chunk_count];
+}
+
+/*
+ * Writes queued chunks until the socket won't take more. -1 once
+ * the connection is gone, everything still queued counted lost.
+ */
+static int
+export_stream_write (export_t *e)
+{
+  unsigned i;
+  unsigned n;
+  ssize_t done;
+  export_chunk *c;
+  struct iovec iovs[EXPORT_BATCH];
+
+  while (!e->failed && e->queued != 0 &&
+         (e->queued > 1 || export_chunk_at (e, 0)->len > e->sent)) {
+    n = e->queued < EXPORT_BATCH ? e->queued : EXPORT_BATCH;
+    for (i = 0; i < n; i++) {
+      c = export_chunk_at (e, i);
+      iovs[i].iov_base = c->data + (i == 0 ? e->sent : 0);
+      iovs[i].iov_len = c->len - (i == 0 ? e->sent : 0);
+    }
+
+    done = writev (e->fd, iovs, n);
+    e->writes++;
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        e->stalled = true;
+        return 0;
+      }
+      fprintf (stderr, "Export connection lost: %s\n", strerror (errno));
+      e->failed = true;
+      for (i = 0; i < e->queued; i++) {
+        e->tlps_lost += export_chunk_at (e, i)->tlps;
+      }
+      e->queued = 0;
+      e->sent = 0;
+      return -1;
+    }
+
+    e->stream_bytes += done;
+    e->stalled = false;
+    while (done > 0) {
+      c = export_chunk_at (e, 0);
+      n = c->len - e->sent;
+      if ((size_t) done < n) {
+        e->sent += done;
+        break;
+      }
+      done -= n;
+      e->tlps_sent += c->tlps;
+      c->len = 0;
+      c->tlps = 0;
+      e->sent = 0;
+      if (e->queued > 1) {
+        e->head = (e->head + 1) % e->chunk_count;
+        e->queued--;
+      }
+    }
+  }
+
+  if (e->queued == 1 && export_chunk_at (e, 0)->len == 0) {
+    e->queued = 0;
+  }
+  return e->failed ? -1 : 0;
+}
+
+/*
+ * Waits up to timeout_ms (forever if negative) for the socket to
+ * take more. -1 on timeout or signal.
+ */
+static int
+export_stream_wait (export_t *e,
+                    int timeout_ms)
+{
+  int n;
+  uint64_t start;
+  struct pollfd pfd;
+
+  pfd.fd = e->fd;
+  pfd.events = POLLOUT;
+  start = time_now_ns ();
+  n = poll (&pfd, 1, timeout_ms);
+  e->blocked_ns += time_now_ns () - start;
+  return n > 0 ? 0 : -1;
+}
+
+/*
+ * The queue is full: makes room for a chunk per policy, or
+ * returns -1 for the TLP to be dropped.
+ */
+static int
+export_stream_overload (export_t *e)
+{
+  unsigned i;
+  unsigned victim;
+  export_chunk c;
+
+  switch (e->policy) {
+  case EXPORT_BLOCK:
+    while (e->queued == e->chunk_count) {
+      /*
+       * export_stop lets the capture wind down even with the
+       * collector stuck. The signal may well have gone to
+       * another thread, so don't count on poll being cut short.
+       */
+      if (e->stopping) {
+        return -1;
+      }
+      if (export_stream_wait (e, EXPORT_STOP_CHECK_MS) == 0 &&
+          export_stream_write (e) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+
+  case EXPORT_DROP_OLDEST:
+    /*
+     * The oldest chunk, unless writing it has started.
+     */
+    victim = e->sent != 0 ? 1 : 0;
+    e->tlps_dropped += export_chunk_at (e, victim)->tlps;
+    c = *export_chunk_at (e, victim);
+    for (i = victim; i + 1 < e->queued; i++) {
+      *export_chunk_at (e, i) = *export_chunk_at (e, i + 1);
+    }
+    c.len = 0;
+    c.tlps = 0;
+    *export_chunk_at (e, e->queued - 1) = c;
+    e->queued--;
+    return 0;
+
+  case EXPORT_HEADERS:
+  default:
+    return -1;
+  }
+}
+
+/*
+ * DWORDs up to the end of desc's header (prefixes included).
+ */
+static unsigned
+export_header_bytes (const tlp_desc_t *desc)
+{
+  unsigned i;
+  unsigned dws;
+  unsigned count = desc->size / 4;
+
+  for (i = 0; i < count && i <= TLP_MAX_PREFIX_DWS; i++) {
+    if (!tlp_dw_is_prefix (desc->data[i])) {
+      dws = i + tlp_types[be32toh (desc->data[i]) >> 24].hdr_dws;
+      return (dws < count ? dws : count) * 4;
+    }
+  }
+
+  return desc->size;
+}
+
+static inline void
+export_rec_put (export_t *e,
+                uint8_t *d,
+                const tlp_desc_t *desc,
+                unsigned size,
+                uint8_t flags)
+{
+  export_rec rec;
+
+  rec.seq = htonl (e->seq++);
+  rec.ts_ns = htobe64 (desc->ts_ns + e->epoch_offset_ns);
+  rec.dev = desc->dev;
+  rec.flags = (desc->flags & EXPORT_FLAGS) | flags;
+  rec.size = htons (size);
+  memcpy (d, &rec, sizeof (rec));
+  memcpy (d + sizeof (rec), desc->data, size);
+}
+
+static int
+export_stream_tlp (export_t *e,
+                   const tlp_desc_t *desc)
+{
+  int err = 0;
+  unsigned size;
+  uint8_t flags = 0;
+  export_chunk *c;
+
+  e->tlp_count++;
+  if (e->failed) {
+    e->seq++;
+    e->tlps_lost++;
+    return -1;
+  }
+
+  size = desc->size;
+  if (e->policy == EXPORT_HEADERS &&
+      e->queued + e->chunk_count / 4 >= e->chunk_count) {
+    size = export_header_bytes (desc);
+    if (size < desc->size) {
+      flags = EXPORT_REC_HEADERS;
+      e->tlps_headers++;
+    }
+  }
+
+  c = e->queued != 0 ? export_chunk_at (e, e->queued - 1) : NULL;
+  if (c == NULL || c->len + sizeof (export_rec) + size > EXPORT_CHUNK_BYTES) {
+    if (c != NULL && !e->stalled) {
+      /*
+       * A chunk's worth: time to write. Once the socket is full,
+       * it's up to export_poll to try again.
+       */
+      err = export_stream_write (e);
+      if (err != 0) {
+        e->seq++;
+        e->tlps_lost++;
+        return -1;
+      }
+    }
+    if (e->queued == e->chunk_count && export_stream_overload (e) != 0) {
+      e->seq++;
+      e->tlps_rejected++;
+      if (flags != 0) {
+        e->tlps_headers--;
+      }
+      return -1;
+    }
+    if (e->queued == 0) {
+      e->first_ns = time_now_ns ();
+    }
+    if (e->queued == 0 || export_chunk_at (e, e->queued - 1)->len != 0) {
+      e->queued++;
+    }
+    c = export_chunk_at (e, e->queued - 1);
+  }
+
+  export_rec_put (e, c->data + c->len, desc, size, flags);
+  c->len += sizeof (export_rec) + size;
+  c->tlps++;
+  return 0;
+}
+
+/*
+ * Finishes the datagram being filled.
+ */
+static void
+export_seal (export_t *e)
+{
+  export_dgram *d;
+
+  d = e->iovs[e->count].iov_base;
+  d->count = htons (e->tlps);
+  e->iovs[e->count].iov_len = e->len;
+  e->count++;
+  e->len = 0;
+  e->tlps = 0;
+}
+
+/*
+ * Sends all buffered TLPs (for streams, as much as the socket
+ * takes right now). Datagrams the socket wouldn't take are
+ * dropped (and counted), leaving the gap in sequence numbers.
+ */
+int
+export_flush (export_t *e)
+{
+  int n;
+  unsigned sent;
+
+  if (e->stream) {
+    return export_stream_write (e);
+  }
+
+  if (e->len != 0) {
+    export_seal (e);
+  }
+
+  for (sent = 0; sent < e->count; sent += n) {
+    n = sendmmsg (e->fd, e->msgs + sent, e->count - sent, 0);
+    e->calls++;
+    if (n < 0 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0) {
+      fprintf (stderr, "sendmmsg: %s\n", strerror (errno));
+      e->dropped += e->count - sent;
+      break;
+    }
+    e->dgram_count += n;
+  }
+
+  n = sent < e->count ? -1 : 0;
+  e->count = 0;
+  return n;
+}
+
+int
+export_tlp (export_t *e,
+            const tlp_desc_t *desc)
+{
+  int err = 0;
+  uint8_t *d;
+  unsigned need;
+  export_dgram *dgram;
+
+  if (e->stream) {
+    return export_stream_tlp (e, desc);
+  }
+
+  need = sizeof (export_rec) + desc->size;
+  if (e->len != 0 && e->len + need > e->mtu) {
+    export_seal (e);
+    if (e->count == EXPORT_BATCH) {
+      err = export_flush (e);
+    }
+  }
+
+  d = e->iovs[e->count].iov_base;
+  if (e->len == 0) {
+    if (e->count == 0) {
+      e->first_ns = time_now_ns ();
+    }
+    dgram = (export_dgram *) d;
+    dgram->magic = htonl (EXPORT_MAGIC);
+    dgram->version = EXPORT_VERSION;
+    dgram->reserved = 0;
+    e->len = sizeof (*dgram);
+  }
+
+  export_rec_put (e, d + e->len, desc, desc->size, 0);
+  e->len += need;
+  e->tlps++;
+  e->tlp_count++;
+
+  return err;
+}
+
+/*
+ * Sends what's buffered if it has waited long enough, for
+ * whenever TLPs don't fill datagrams (or chunks) quickly.
+ */
+void
+export_poll (export_t *e,
+             uint64_t now_ns)
+{
+  if ((e->count != 0 || e->len != 0 || e->queued != 0) &&
+      now_ns - e->first_ns >= e->flush_ns) {
+    export_flush (e);
+    e->first_ns = now_ns;
+  }
+}
+
+void
+export_print_stats (export_t *e,
+                    FILE *f)
+{
+  if (e->stream) {
+    fprintf (f, "Export: %" PRIu64 " TLPs, %" PRIu64 " sent (%" PRIu64
+             " headers only), %" PRIu64 " dropped oldest, %" PRIu64
+             " dropped as the queue was full, %" PRIu64 " lost with the "
+             "connection, %" PRIu64 " still queued\n",
+             e->tlp_count, e->tlps_sent, e->tlps_headers, e->tlps_dropped,
+             e->tlps_rejected, e->tlps_lost,
+             e->tlp_count - e->tlps_sent - e->tlps_dropped -
+             e->tlps_rejected - e->tlps_lost);
+    fprintf (f, "Export: %" PRIu64 " bytes in %" PRIu64 " writes, "
+             "%" PRIu64 " ms waiting for the collector\n",
+             e->stream_bytes, e->writes, e->blocked_ns / 1000000);
+    return;
+  }
+
+  fprintf (f, "Export: %" PRIu64 " TLPs in %" PRIu64 " datagrams, "
+           "%" PRIu64 " sendmmsg calls",
+           e->tlp_count, e->dgram_count, e->calls);
+  if (e->calls != 0) {
+    fprintf (f, " (%.1f TLPs/call)", (double) e->tlp_count / e->calls);
+  }
+  fprintf (f, ", %" PRIu64 " datagrams dropped\n", e->dropped);
+}
+
+/*
+ * Stops waiting for the collector: TLPs that don't fit are
+ * dropped from here on. Safe from a signal handler.
+ */
+void
+export_stop (export_t *e)
+{
+  e->stopping = true;
+}
+
+/*
+ * Sends what's left, for streams waiting on the collector as
+ * long as it keeps taking more. Whatever it won't is still
+ * queued as far as export_print_stats is concerned.
+ */
+void
+export_finish (export_t *e)
+{
+  if (e->fd < 0 || e->finished) {
+    return;
+  }
+
+  e->finished = true;
+  export_flush (e);
+  while (e->stream && e->queued != 0 && !e->failed &&
+         export_stream_wait (e, EXPORT_CLOSE_WAIT_MS) == 0) {
+    export_stream_write (e);
+  }
+}
+
+void
+export_close (export_t *e)
+{
+  unsigned i;
+
+  if (e == NULL) {
+    return;
+  }
+
+  if (e->fd >= 0) {
+    export_finish (e);
+    close (e->fd);
+  }
+
+  for (i = 0; e->chunks != NULL && i < e->chunk_count; i++) {
+    free (e->chunks[i].data);
+  }
+  free (e->chunks);
+  free (e->bufs);
+  free (e);
+}
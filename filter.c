@@ -0,0 +1,689 @@
+/*
+ * TLP filters.
+ *
+ * An expression such as
+ *
+ *   type CfgWr0 and reg 0x10-0x24 and bus 0
+ *
+ * is parsed into a tree and compiled into a short program of
+ * field tests, each with a next instruction for true and for
+ * false (or ACCEPT/REJECT), as in BPF. Jumps always go to lower
+ * indices, so programs can't loop. Tests are made on the header
+ * DWORDs as received, without decoding the TLP.
+ *
+ * Most filters are settled by the fmt/type byte alone: every test
+ * of a field the type's layout doesn't have is false, and type
+ * tests are bitmaps. So for each of the 256 fmt/type bytes, the
+ * compiler works out whether every path through the program ends
+ * in ACCEPT, every one in REJECT, or it depends; only in the last
+ * case is the program run.
+ *
+ * Grammar (keywords are case-insensitive):
+ *
+ *   expr    := term { "or" term }
+ *   term    := factor { "and" factor }
+ *   factor  := "not" factor | "(" expr ")" | test
+ *   test    := "type" name{,name} | field value[-value]
+ *
+ * with the fields requester, completer (bus:dev.fn in hex, or a
+ * number), bus (the requester's), address, reg (config space
+ * byte offset), length (DWORDs, 1-1024) and tag. A test of a
+ * field the TLP doesn't have is false.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+#include <strings.h>
+
+#define TLP_FILTER_MAX_NODES    128
+#define TLP_FILTER_MAX_INSNS    64
+#define TLP_FILTER_MAX_TOKEN    64
+
+/*
+ * Jump targets past the last instruction.
+ */
+#define TLP_FILTER_REJECT       0xfe
+#define TLP_FILTER_ACCEPT       0xff
+
+/*
+ * by_type entries.
+ */
+#define TLP_FILTER_NO           0
+#define TLP_FILTER_YES          1
+#define TLP_FILTER_RUN          2
+
+typedef enum {
+  TLP_FILTER_TYPE,
+  TLP_FILTER_REQUESTER,
+  TLP_FILTER_BUS,
+  TLP_FILTER_COMPLETER,
+  TLP_FILTER_ADDRESS,
+  TLP_FILTER_REG,
+  TLP_FILTER_LENGTH,
+  TLP_FILTER_TAG,
+} tlp_filter_field;
+
+typedef struct {
+  const char *name;
+  uint8_t field;
+  uint64_t max;
+} tlp_filter_field_info;
+
+static const tlp_filter_field_info tlp_filter_fields[] = {
+  { "type", TLP_FILTER_TYPE, 0 },
+  { "requester", TLP_FILTER_REQUESTER, 0xffff },
+  { "bus", TLP_FILTER_BUS, 0xff },
+  { "completer", TLP_FILTER_COMPLETER, 0xffff },
+  { "address", TLP_FILTER_ADDRESS, UINT64_MAX },
+  { "reg", TLP_FILTER_REG, 0xffc },
+  { "length", TLP_FILTER_LENGTH, 0x400 },
+  { "tag", TLP_FILTER_TAG, 0x3ff },
+};
+
+#define TLP_FILTER_F(x) (1u << TLP_FILTER_##x)
+#define TLP_FILTER_F_COMMON (TLP_FILTER_F (REQUESTER) | TLP_FILTER_F (BUS) | \
+                             TLP_FILTER_F (LENGTH) | TLP_FILTER_F (TAG))
+
+/*
+ * Fields each header layout has.
+ */
+static const uint32_t tlp_filter_layout_fields[TLP_LAYOUT_COUNT] = {
+  [TLP_LAYOUT_MEM32] = TLP_FILTER_F_COMMON | TLP_FILTER_F (ADDRESS),
+  [TLP_LAYOUT_MEM64] = TLP_FILTER_F_COMMON | TLP_FILTER_F (ADDRESS),
+  [TLP_LAYOUT_CFG] = TLP_FILTER_F_COMMON | TLP_FILTER_F (COMPLETER) |
+                     TLP_FILTER_F (REG),
+  [TLP_LAYOUT_MSG] = TLP_FILTER_F_COMMON,
+  [TLP_LAYOUT_CPL] = TLP_FILTER_F_COMMON | TLP_FILTER_F (COMPLETER),
+};
+
+/*
+ * A test, for the tree and for the program. Type tests have a
+ * bitmap of fmt/type bytes instead of a range.
+ */
+typedef struct {
+  uint8_t field;
+  uint8_t jt;
+  uint8_t jf;
+  union {
+    struct {
+      uint64_t lo;
+      uint64_t hi;
+    };
+    uint64_t types[4];
+  };
+} tlp_filter_insn;
+
+struct tlp_filter {
+  uint8_t by_type[256];
+  unsigned entry;
+  unsigned insn_count;
+  tlp_filter_insn insns[TLP_FILTER_MAX_INSNS];
+};
+
+typedef enum {
+  TLP_FILTER_NODE_TEST,
+  TLP_FILTER_NODE_AND,
+  TLP_FILTER_NODE_OR,
+  TLP_FILTER_NODE_NOT,
+} tlp_filter_node_kind;
+
+typedef struct {
+  uint8_t kind;
+  unsigned a;
+  unsigned b;
+  tlp_filter_insn test;
+} tlp_filter_node;
+
+typedef struct {
+  const char *p;
+  char token[TLP_FILTER_MAX_TOKEN];
+  tlp_filter_node nodes[TLP_FILTER_MAX_NODES];
+  unsigned node_count;
+} tlp_filter_parser;
+
+/*
+ * Reads the next token into ps->token: a parenthesis, or a run
+ * of anything else up to a space or parenthesis. Empty at the
+ * end.
+ */
+static int
+tlp_filter_next (tlp_filter_parser *ps)
+{
+  size_t n;
+
+  while (isspace ((unsigned char) *ps->p)) {
+    ps->p++;
+  }
+
+  if (*ps->p == '(' || *ps->p == ')') {
+    n = 1;
+  } else {
+    n = strcspn (ps->p, " \t\n()");
+  }
+
+  if (n >= sizeof (ps->token)) {
+    fprintf (stderr, "Filter: token too long at \"%.16s\"\n", ps->p);
+    return -1;
+  }
+
+  memcpy (ps->token, ps->p, n);
+  ps->token[n] = '\0';
+  ps->p += n;
+  return 0;
+}
+
+static int
+tlp_filter_node_new (tlp_filter_parser *ps,
+                     uint8_t kind,
+                     unsigned a,
+                     unsigned b)
+{
+  tlp_filter_node *n;
+
+  if (ps->node_count == TLP_FILTER_MAX_NODES) {
+    fprintf (stderr, "Filter: too many terms\n");
+    return -1;
+  }
+
+  n = &ps->nodes[ps->node_count];
+  memset (n, 0, sizeof (*n));
+  n->kind = kind;
+  n->a = a;
+  n->b = b;
+  return ps->node_count++;
+}
+
+static int
+tlp_filter_parse_types (const char *s,
+                        uint64_t *types)
+{
+  unsigned b;
+  size_t n;
+  bool found;
+
+  while (*s != '\0') {
+    n = strcspn (s, ",");
+    found = false;
+    for (b = 0; b < 256; b++) {
+      if (tlp_types[b].name != NULL &&
+          strlen (tlp_types[b].name) == n &&
+          strncasecmp (tlp_types[b].name, s, n) == 0) {
+        types[b / 64] |= 1ull << (b % 64);
+        found = true;
+      }
+    }
+
+    if (!found) {
+      fprintf (stderr, "Filter: unknown TLP type \"%.*s\"\n", (int) n, s);
+      return -1;
+    }
+
+    s += n;
+    if (*s == ',') {
+      s++;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * One end of a range: a number, or for IDs bus:dev.fn.
+ */
+static int
+tlp_filter_parse_value (const char *s,
+                        const char *e,
+                        const tlp_filter_field_info *fi,
+                        uint64_t *v)
+{
+  char *end;
+  unsigned bus;
+  unsigned dev;
+  unsigned fn;
+  int n;
+  char buf[TLP_FILTER_MAX_TOKEN];
+
+  memcpy (buf, s, e - s);
+  buf[e - s] = '\0';
+
+  if ((fi->field == TLP_FILTER_REQUESTER ||
+       fi->field == TLP_FILTER_COMPLETER) && strchr (buf, ':') != NULL) {
+    if (sscanf (buf, "%x:%x.%x%n", &bus, &dev, &fn, &n) != 3 ||
+        buf[n] != '\0' || bus > 0xff || dev > 0x1f || fn > 7) {
+      fprintf (stderr, "Filter: bad ID \"%s\"\n", buf);
+      return -1;
+    }
+    *v = (bus << 8) | (dev << 3) | fn;
+    return 0;
+  }
+
+  errno = 0;
+  *v = strtoull (buf, &end, 0);
+  if (buf[0] == '\0' || *end != '\0' || errno != 0 || *v > fi->max) {
+    fprintf (stderr, "Filter: bad %s \"%s\"\n", fi->name, buf);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+tlp_filter_parse_test (tlp_filter_parser *ps)
+{
+  int n;
+  unsigned i;
+  const char *dash;
+  const tlp_filter_field_info *fi = NULL;
+  tlp_filter_insn *t;
+
+  for (i = 0; i < sizeof (tlp_filter_fields) / sizeof (tlp_filter_fields[0]);
+       i++) {
+    if (strcasecmp (ps->token, tlp_filter_fields[i].name) == 0) {
+      fi = &tlp_filter_fields[i];
+    }
+  }
+  if (fi == NULL) {
+    fprintf (stderr, "Filter: expected a field, got \"%s\"\n", ps->token);
+    return -1;
+  }
+
+  if (tlp_filter_next (ps) != 0) {
+    return -1;
+  }
+  if (ps->token[0] == '\0' || ps->token[0] == '(' || ps->token[0] == ')') {
+    fprintf (stderr, "Filter: %s needs a value\n", fi->name);
+    return -1;
+  }
+
+  n = tlp_filter_node_new (ps, TLP_FILTER_NODE_TEST, 0, 0);
+  if (n < 0) {
+    return -1;
+  }
+  t = &ps->nodes[n].test;
+  t->field = fi->field;
+
+  if (fi->field == TLP_FILTER_TYPE) {
+    if (tlp_filter_parse_types (ps->token, t->types) != 0) {
+      return -1;
+    }
+  } else {
+    dash = strchr (ps->token, '-');
+    if (dash == NULL) {
+      dash = ps->token + strlen (ps->token);
+    }
+    if (tlp_filter_parse_value (ps->token, dash, fi, &t->lo) != 0) {
+      return -1;
+    }
+    t->hi = t->lo;
+    if (*dash == '-' &&
+        tlp_filter_parse_value (dash + 1, dash + strlen (dash), fi,
+                                &t->hi) != 0) {
+      return -1;
+    }
+    if (t->lo > t->hi) {
+      fprintf (stderr, "Filter: empty range \"%s\"\n", ps->token);
+      return -1;
+    }
+  }
+
+  if (tlp_filter_next (ps) != 0) {
+    return -1;
+  }
+
+  return n;
+}
+
+static int
+tlp_filter_parse_or (tlp_filter_parser *ps);
+
+/*
+ * Type tests combined with each other become one bitmap test.
+ */
+static int
+tlp_filter_combine (tlp_filter_parser *ps,
+                    uint8_t kind,
+                    int a,
+                    int b)
+{
+  unsigned i;
+  tlp_filter_node *na = &ps->nodes[a];
+  tlp_filter_node *nb = b >= 0 ? &ps->nodes[b] : NULL;
+
+  if (na->kind == TLP_FILTER_NODE_TEST &&
+      na->test.field == TLP_FILTER_TYPE &&
+      (nb == NULL || (nb->kind == TLP_FILTER_NODE_TEST &&
+                      nb->test.field == TLP_FILTER_TYPE))) {
+    for (i = 0; i < 4; i++) {
+      if (kind == TLP_FILTER_NODE_NOT) {
+        na->test.types[i] = ~na->test.types[i];
+      } else if (kind == TLP_FILTER_NODE_AND) {
+        na->test.types[i] &= nb->test.types[i];
+      } else {
+        na->test.types[i] |= nb->test.types[i];
+      }
+    }
+    return a;
+  }
+
+  return tlp_filter_node_new (ps, kind, a, b);
+}
+
+static int
+tlp_filter_parse_factor (tlp_filter_parser *ps)
+{
+  int n;
+
+  if (strcasecmp (ps->token, "not") == 0) {
+    if (tlp_filter_next (ps) != 0) {
+      return -1;
+    }
+    n = tlp_filter_parse_factor (ps);
+    if (n < 0) {
+      return -1;
+    }
+    return tlp_filter_combine (ps, TLP_FILTER_NODE_NOT, n, -1);
+  }
+
+  if (strcmp (ps->token, "(") == 0) {
+    if (tlp_filter_next (ps) != 0) {
+      return -1;
+    }
+    n = tlp_filter_parse_or (ps);
+    if (n < 0) {
+      return -1;
+    }
+    if (strcmp (ps->token, ")") != 0) {
+      fprintf (stderr, "Filter: missing \")\"\n");
+      return -1;
+    }
+    if (tlp_filter_next (ps) != 0) {
+      return -1;
+    }
+    return n;
+  }
+
+  return tlp_filter_parse_test (ps);
+}
+
+static int
+tlp_filter_parse_and (tlp_filter_parser *ps)
+{
+  int a;
+  int b;
+
+  a = tlp_filter_parse_factor (ps);
+  while (a >= 0 && strcasecmp (ps->token, "and") == 0) {
+    if (tlp_filter_next (ps) != 0) {
+      return -1;
+    }
+    b = tlp_filter_parse_factor (ps);
+    if (b < 0) {
+      return -1;
+    }
+    a = tlp_filter_combine (ps, TLP_FILTER_NODE_AND, a, b);
+  }
+
+  return a;
+}
+
+static int
+tlp_filter_parse_or (tlp_filter_parser *ps)
+{
+  int a;
+  int b;
+
+  a = tlp_filter_parse_and (ps);
+  while (a >= 0 && strcasecmp (ps->token, "or") == 0) {
+    if (tlp_filter_next (ps) != 0) {
+      return -1;
+    }
+    b = tlp_filter_parse_and (ps);
+    if (b < 0) {
+      return -1;
+    }
+    a = tlp_filter_combine (ps, TLP_FILTER_NODE_OR, a, b);
+  }
+
+  return a;
+}
+
+/*
+ * Emits node n so that it continues at jt if it holds and at jf
+ * if not, after everything it jumps to. Returns its first
+ * instruction.
+ */
+static int
+tlp_filter_emit (tlp_filter *f,
+                 const tlp_filter_parser *ps,
+                 unsigned n,
+                 unsigned jt,
+                 unsigned jf)
+{
+  int b;
+  const tlp_filter_node *node = &ps->nodes[n];
+  tlp_filter_insn *insn;
+
+  switch (node->kind) {
+  case TLP_FILTER_NODE_AND:
+    b = tlp_filter_emit (f, ps, node->b, jt, jf);
+    return b < 0 ? -1 : tlp_filter_emit (f, ps, node->a, b, jf);
+  case TLP_FILTER_NODE_OR:
+    b = tlp_filter_emit (f, ps, node->b, jt, jf);
+    return b < 0 ? -1 : tlp_filter_emit (f, ps, node->a, jt, b);
+  case TLP_FILTER_NODE_NOT:
+    return tlp_filter_emit (f, ps, node->a, jf, jt);
+  }
+
+  if (f->insn_count == TLP_FILTER_MAX_INSNS) {
+    fprintf (stderr, "Filter: too many tests\n");
+    return -1;
+  }
+
+  insn = &f->insns[f->insn_count];
+  *insn = node->test;
+  insn->jt = jt;
+  insn->jf = jf;
+  return f->insn_count++;
+}
+
+static inline bool
+tlp_filter_type_hit (const tlp_filter_insn *insn,
+                     unsigned fmt_type)
+{
+  return (insn->types[fmt_type / 64] >> (fmt_type % 64)) & 1;
+}
+
+/*
+ * Whether the program's outcome for fmt/type byte b is settled
+ * without looking past it.
+ */
+static uint8_t
+tlp_filter_settle (const tlp_filter *f,
+                   unsigned b)
+{
+  int pc;
+  unsigned j;
+  uint64_t reach;
+  bool yes = false;
+  bool no = false;
+  const tlp_filter_insn *insn;
+  const tlp_type_info *t = &tlp_types[b];
+  uint32_t fields = t->hdr_dws > 1 ? tlp_filter_layout_fields[t->layout] : 0;
+
+  reach = 1ull << f->entry;
+  for (pc = f->entry; pc >= 0; pc--) {
+    if ((reach & (1ull << pc)) == 0) {
+      continue;
+    }
+
+    insn = &f->insns[pc];
+    for (j = 0; j < 2; j++) {
+      unsigned next = j == 0 ? insn->jt : insn->jf;
+
+      if (insn->field == TLP_FILTER_TYPE) {
+        if (tlp_filter_type_hit (insn, b) != (j == 0)) {
+          continue;
+        }
+      } else if ((fields & (1u << insn->field)) == 0 && j == 0) {
+        continue;
+      }
+
+      if (next == TLP_FILTER_ACCEPT) {
+        yes = true;
+      } else if (next == TLP_FILTER_REJECT) {
+        no = true;
+      } else {
+        reach |= 1ull << next;
+      }
+    }
+  }
+
+  return yes && no ? TLP_FILTER_RUN : yes ? TLP_FILTER_YES : TLP_FILTER_NO;
+}
+
+/*
+ * Compiles expr, or returns NULL after saying what's wrong with
+ * it.
+ */
+tlp_filter *
+tlp_filter_compile (const char *expr)
+{
+  int root;
+  int entry;
+  unsigned b;
+  tlp_filter *f;
+  tlp_filter_parser *ps;
+
+  ps = calloc (1, sizeof (*ps));
+  f = calloc (1, sizeof (*f));
+  if (ps == NULL || f == NULL) {
+    free (ps);
+    free (f);
+    return NULL;
+  }
+
+  ps->p = expr;
+  root = -1;
+  if (tlp_filter_next (ps) == 0) {
+    root = tlp_filter_parse_or (ps);
+  }
+  if (root >= 0 && ps->token[0] != '\0') {
+    fprintf (stderr, "Filter: unexpected \"%s\"\n", ps->token);
+    root = -1;
+  }
+
+  entry = root < 0 ? -1 :
+    tlp_filter_emit (f, ps, root, TLP_FILTER_ACCEPT, TLP_FILTER_REJECT);
+  free (ps);
+  if (entry < 0) {
+    free (f);
+    return NULL;
+  }
+
+  f->entry = entry;
+  for (b = 0; b < 256; b++) {
+    f->by_type[b] = tlp_filter_settle (f, b);
+  }
+
+  return f;
+}
+
+void
+tlp_filter_free (tlp_filter *f)
+{
+  free (f);
+}
+
+/*
+ * Field of the header at dws (after any prefixes) with layout,
+ * which has it.
+ */
+static inline uint64_t
+tlp_filter_get (unsigned field,
+                unsigned layout,
+                const uint32_t *dws,
+                uint32_t dw0)
+{
+  unsigned id_dw = layout == TLP_LAYOUT_CPL ? 2 : 1;
+
+  switch (field) {
+  case TLP_FILTER_REQUESTER:
+    return be32toh (dws[id_dw]) >> 16;
+  case TLP_FILTER_BUS:
+    return be32toh (dws[id_dw]) >> 24;
+  case TLP_FILTER_COMPLETER:
+    return be32toh (dws[layout == TLP_LAYOUT_CPL ? 1 : 2]) >> 16;
+  case TLP_FILTER_ADDRESS:
+    if (layout == TLP_LAYOUT_MEM64) {
+      return ((uint64_t) be32toh (dws[2]) << 32) | (be32toh (dws[3]) & ~3u);
+    }
+    return be32toh (dws[2]) & ~3u;
+  case TLP_FILTER_REG:
+    return be32toh (dws[2]) & 0xffc;
+  case TLP_FILTER_LENGTH:
+    return ((dw0 - 1) & 0x3ff) + 1;
+  case TLP_FILTER_TAG:
+    return ((be32toh (dws[id_dw]) >> 8) & 0xff) | ((dw0 >> 14) & 0x200) |
+      ((dw0 >> 11) & 0x100);
+  }
+
+  return 0;
+}
+
+/*
+ * Whether the TLP at dws (count DWORDs, as received) passes f.
+ * TLPs without a header never do.
+ */
+bool
+tlp_filter_match (const tlp_filter *f,
+                  const uint32_t *dws,
+                  unsigned count)
+{
+  unsigned pc;
+  unsigned b;
+  uint32_t dw0;
+  uint32_t fields;
+  bool hit;
+  const tlp_filter_insn *insn;
+
+  while (count != 0 && tlp_dw_is_prefix (*dws)) {
+    dws++;
+    count--;
+  }
+  if (count == 0) {
+    return false;
+  }
+
+  dw0 = be32toh (dws[0]);
+  b = dw0 >> 24;
+  if (f->by_type[b] != TLP_FILTER_RUN) {
+    return f->by_type[b] == TLP_FILTER_YES;
+  }
+
+  /*
+   * A header cut short has no fields.
+   */
+  fields = count >= tlp_types[b].hdr_dws ?
+    tlp_filter_layout_fields[tlp_types[b].layout] : 0;
+
+  pc = f->entry;
+  while (1) {
+    insn = &f->insns[pc];
+    if (insn->field == TLP_FILTER_TYPE) {
+      hit = tlp_filter_type_hit (insn, b);
+    } else if ((fields & (1u << insn->field)) != 0) {
+      uint64_t v = tlp_filter_get (insn->field, tlp_types[b].layout,
+                                   dws, dw0);
+
+      hit = v >= insn->lo && v <= insn->hi;
+    } else {
+      hit = false;
+    }
+
+    pc = hit ? insn->jt : insn->jf;
+    if (pc >= TLP_FILTER_REJECT) {
+      return pc == TLP_FILTER_ACCEPT;
+    }
+  }
+}
@@ -6,14 +6,11 @@
  *
  * TBD:
  * - not endian safe (assumes LE)
- * - sketchy buffer handling in fpga_config_read
- *   (0x400 should be enough, or just reuse the
- *   global data buffer).
- * - unify TLP RX with config_read.
  * - BAR enable.
  */
 
 #include "screamer.h"
+#include <pthread.h>
 
 #define FPGA_CMD_VERSION_MAJOR          0x01
 #define FPGA_CMD_DEVICE_ID              0x03
@@ -25,55 +22,192 @@
 #define FPGA_REG_READWRITE            0x8000
 #define FPGA_REG_SHADOWCFGSPACE       0xC000
 
-#define TLP_RX_MAX_SIZE             (16+1024)
-#define TLP_RX_MAX_SIZE_IN_DWORDS   ((int) (TLP_RX_MAX_SIZE / sizeof (uint32_t)))
+#define TLP_TX_MAX_SIZE             (4 * 4 + 128)
 
-static uint8_t rx_data[TLP_RX_MAX_SIZE];
-static uint32_t rx_tlp_dwords[TLP_RX_MAX_SIZE_IN_DWORDS];
+/*
+ * TX queue. Framed TLPs are packed into a batch, which is
+ * submitted as one bulk OUT transfer when it fills up, when the
+ * oldest TLP in it has waited for tx_deadline_ns, or when the
+ * RX side runs dry (nothing more to respond to for now).
+ */
+#define TX_BATCH_COUNT              4
+#define TX_BATCH_SIZE               0x4000
+#define TX_BATCH_SIZE_IN_DWORDS     ((int) (TX_BATCH_SIZE / sizeof (uint32_t)))
+#define TX_BATCH_MAX_TLPS           64
 
-#define TLP_TX_MAX_SIZE             (4 * 4 + 128)
-static uint32_t tx_data[TLP_TX_MAX_SIZE * 2];
+typedef struct {
+  fpga_tx_done_cb cb;
+  void *opaque;
+  uint64_t queued_ns;
+} fpga_tx_entry;
 
-int
-fpga_init (void)
+typedef struct {
+  fpga_dev_t *dev;
+  uint32_t data[TX_BATCH_SIZE_IN_DWORDS];
+  int len_dws;
+  fpga_tx_entry entries[TX_BATCH_MAX_TLPS];
+  unsigned entry_count;
+  bool in_flight;
+  int completed;
+} fpga_tx_batch;
+
+#define FPGA_REG_CHUNK_SIZE         0x3f0
+#define FPGA_REG_BUF_SIZE           0x10000
+#define FPGA_REG_TIMEOUT_NS         (100 * 1000000ull)
+
+/*
+ * fpga_init attempts after the transport reconnects; after a
+ * target reboot the gateware may take a while to come up.
+ */
+#define FPGA_REINIT_ATTEMPTS        20
+
+/*
+ * One attached FPGA. Nothing in here is shared with any other,
+ * so each can be driven from its own thread.
+ */
+struct fpga_dev {
+  transport_t *transport;
+  unsigned id;
+
+  /*
+   * TX batches and register accesses, from whichever thread
+   * sends or, after a reconnect, the one deframing: tx_lock
+   * makes it one at a time.
+   */
+  pthread_mutex_t tx_lock;
+  fpga_tx_batch tx_batches[TX_BATCH_COUNT];
+  unsigned tx_cur;
+  uint64_t tx_deadline_ns;
+  fpga_tx_stats tx_stats;
+
+  /*
+   * Register accesses are encoded into reg_buf and go out in
+   * chunks of what the gateware's command FIFO takes at once,
+   * all submitted before waiting on any. Read responses come in
+   * among the TLPs and are picked out by the deframer of
+   * whichever receive context last ran (rx_active), or of rx_own
+   * before there is one.
+   */
+  uint8_t reg_buf[FPGA_REG_BUF_SIZE];
+  int reg_len;
+  uint8_t reg_seen[FPGA_REG_BUF_SIZE / 8 / 8];
+  unsigned reg_tx_pending;
+  int reg_tx_completed;
+  int reg_tx_status;
+
+  tlp_receive_context rx_own;
+  tlp_receive_context *rx_active;
+  /*
+   * Context re-running fpga_init after a reconnect, from the
+   * thread that deframes it.
+   */
+  tlp_receive_context *rx_reinit;
+
+  const tlp_filter *rx_filter;
+};
+
+static inline transport_t *
+fpga_rx_transport (tlp_receive_context *c);
+
+static int
+fpga_rx_fill (tlp_receive_context *c);
+
+static deframe_result
+fpga_rx_deframe (tlp_receive_context *c);
+
+static void
+fpga_rx_compact (tlp_receive_context *c);
+
+static int
+fpga_rx_pump (tlp_receive_context *c);
+
+static int
+fpga_tx_flush_locked (fpga_dev_t *f);
+
+/*
+ * Takes over t's TX side and register accesses; id tags the
+ * TLPs received through it.
+ */
+fpga_dev_t *
+fpga_attach (transport_t *t,
+             unsigned id)
 {
-  int err;
-  uint8_t fpga_version;
-  uint8_t pcie_core;
+  unsigned i;
+  fpga_dev_t *f;
 
-  err = fpga_config_read (0x0008, &fpga_version, 1,
-                          FPGA_REG_CORE | FPGA_REG_READONLY);
-  if (err != 0) {
-    return -1;
+  f = calloc (1, sizeof (*f));
+  if (f == NULL) {
+    return NULL;
   }
 
-  if (fpga_version != 4) {
-    fprintf (stderr, "Unsupported FPGA version 0x%x\n",
-             fpga_version);
-    return -1;
+  f->transport = t;
+  f->id = id;
+  f->tx_deadline_ns = 100000;
+  pthread_mutex_init (&f->tx_lock, NULL);
+  for (i = 0; i < TX_BATCH_COUNT; i++) {
+    f->tx_batches[i].dev = f;
   }
 
-  err = fpga_config_read (0x0019, &pcie_core, 1,
-                          FPGA_REG_CORE | FPGA_REG_READWRITE);
-  if (err != 0) {
-    return -1;
+  return f;
+}
+
+/*
+ * Before closing the transport, and once no receive context
+ * is used anymore.
+ */
+void
+fpga_detach (fpga_dev_t *f)
+{
+  tlp_receive_context *o = &f->rx_own;
+
+  if (o->buf != NULL) {
+    transport_release (f->transport, o->buf);
   }
+  pthread_mutex_destroy (&f->tx_lock);
+  free (f);
+}
 
-  /*
-   * Disable CFGTLP FILTER TLP FROM USER to see accesses
-   * to parts of the CFG space beyond what's managed by
-   * the Xilinx IP.
-   */
-  pcie_core &= ~0x10;
-  err = fpga_config_write (0x0019, &pcie_core, 1,
-                           FPGA_REG_CORE | FPGA_REG_READWRITE);
+transport_t *
+fpga_transport (fpga_dev_t *f)
+{
+  return f->transport;
+}
+
+void
+fpga_set_filter (fpga_dev_t *f,
+                 const tlp_filter *filter)
+{
+  f->rx_filter = filter;
+}
+
+int
+fpga_init (fpga_dev_t *f)
+{
+  int err;
+  uint8_t fpga_version;
+  uint8_t pcie_core;
+  uint8_t filter_off = 0x00;
+  uint8_t filter_mask = 0x10;
+  fpga_reg_op ops[] = {
+    { 0x0008, 1, FPGA_REG_CORE | FPGA_REG_READONLY, false, &fpga_version, NULL },
+    /*
+     * Disable CFGTLP FILTER TLP FROM USER to see accesses
+     * to parts of the CFG space beyond what's managed by
+     * the Xilinx IP. A masked write needs no read first, so
+     * this and the version check are a single round trip.
+     */
+    { 0x0019, 1, FPGA_REG_CORE | FPGA_REG_READWRITE, true, &filter_off, &filter_mask },
+    { 0x0019, 1, FPGA_REG_CORE | FPGA_REG_READWRITE, false, &pcie_core, NULL },
+  };
+
+  err = fpga_reg_batch (f, ops, sizeof (ops) / sizeof (ops[0]));
   if (err != 0) {
     return -1;
   }
 
-  err = fpga_config_read (0x0019, &pcie_core, 1,
-                          FPGA_REG_CORE | FPGA_REG_READWRITE);
-  if (err != 0) {
+  if (fpga_version != 4) {
+    fprintf (stderr, "Unsupported FPGA version 0x%x (device %u)\n",
+             fpga_version, f->id);
     return -1;
   }
 
@@ -85,381 +219,1269 @@ fpga_init (void)
   return 0;
 }
 
-int
-fpga_config_write (uint16_t address,
-                   void *data,
-                   uint16_t count,
-                   uint16_t flags)
+/*
+ * Number of 16-bit register words [address, address + count)
+ * touches, i.e. commands (and read responses) for op.
+ */
+static unsigned
+fpga_reg_words (const fpga_reg_op *op)
+{
+  return (op->address + op->count - (op->address & 0xfffe) + 1) / 2;
+}
+
+static void
+fpga_reg_encode (fpga_dev_t *f,
+                 const fpga_reg_op *op)
 {
-  int err;
-  uint8_t buf[0x800];
-  uint16_t cur_addr;
-  int buf_index;
   int i;
+  uint8_t *buf;
+  uint16_t cur_addr;
+  uint8_t *data = op->data;
+  const uint8_t *mask = op->mask;
 
-  if (count == 0 || (address + count) > 0x1000) {
-    return -1;
+  buf = f->reg_buf + f->reg_len;
+  if (!op->write) {
+    for (cur_addr = op->address & 0xfffe;
+         cur_addr < (op->address + op->count);
+         cur_addr += 2) {
+      buf[0] = 0x00;
+      buf[1] = 0x00;
+      buf[2] = 0x00;
+      buf[3] = 0x00;
+      buf[4] = (cur_addr | (op->flags & 0xC000)) >> 8;
+      buf[5] = cur_addr & 0xff;
+      buf[6] = 0x10 | (op->flags & 0x03);
+      buf[7] = 0x77;
+      buf += 8;
+    }
+    f->reg_len = buf - f->reg_buf;
+    return;
   }
 
   i = 0;
-  buf_index = 0;
-  if ((address % 2) != 0) {
+  if ((op->address % 2) != 0) {
     /*
      * Byte align if required.
      */
-    cur_addr = (address - 1) | (flags & 0xC000);
-    buf[buf_index + 0] = 0x00;
-    buf[buf_index + 1] = *((uint8_t *) data);
-    buf[buf_index + 2] = 0x00;
-    buf[buf_index + 3] = 0xff;
-    buf[buf_index + 4] = cur_addr >> 8;
-    buf[buf_index + 5] = cur_addr & 0xff;
-    buf[buf_index + 6] = 0x20 | (flags & 0x03);
-    buf[buf_index + 7] = 0x77;
-    buf_index += 8;
+    cur_addr = (op->address - 1) | (op->flags & 0xC000);
+    buf[0] = 0x00;
+    buf[1] = data[0];
+    buf[2] = 0x00;
+    buf[3] = mask != NULL ? mask[0] : 0xff;
+    buf[4] = cur_addr >> 8;
+    buf[5] = cur_addr & 0xff;
+    buf[6] = 0x20 | (op->flags & 0x03);
+    buf[7] = 0x77;
+    buf += 8;
     i++;
   }
 
-  for (; i < count; i += 2) {
-    cur_addr = (address + i) | (flags & 0xC000);
-    buf[buf_index + 0] = ((uint8_t *) data)[i];
-    buf[buf_index + 1] = (count == i + 1) ? 0 : ((uint8_t *) data)[i + 1];
-    buf[buf_index + 2] = 0xff;
-    buf[buf_index + 3] = (count == i + 1) ? 0 : 0xff;
-    buf[buf_index + 4] = cur_addr >> 8;
-    buf[buf_index + 5] = cur_addr & 0xff;
-    buf[buf_index + 6] = 0x20 | (flags & 0x03);
-    buf[buf_index + 7] = 0x77;
-    buf_index += 8;
-    if (buf_index >= 0x3f0) {
-      err = ftdi_write (buf, buf_index, &buf_index);
-      if (err != 0) {
-        return -1;
-      }
-      buf_index = 0;
-    }
+  for (; i < op->count; i += 2) {
+    cur_addr = (op->address + i) | (op->flags & 0xC000);
+    buf[0] = data[i];
+    buf[1] = (op->count == i + 1) ? 0 : data[i + 1];
+    buf[2] = mask != NULL ? mask[i] : 0xff;
+    buf[3] = (op->count == i + 1) ? 0 : mask != NULL ? mask[i + 1] : 0xff;
+    buf[4] = cur_addr >> 8;
+    buf[5] = cur_addr & 0xff;
+    buf[6] = 0x20 | (op->flags & 0x03);
+    buf[7] = 0x77;
+    buf += 8;
   }
+  f->reg_len = buf - f->reg_buf;
+}
 
-  if (buf_index != 0) {
-    err = ftdi_write (buf, buf_index, &buf_index);
-    if (err != 0) {
-      return -1;
+/*
+ * Stores a read response in the first op still waiting for
+ * that word. Returns false for anything else, e.g. a late
+ * response to an earlier, timed out, read.
+ */
+static bool
+fpga_reg_response (fpga_dev_t *f,
+                   fpga_reg_op *ops,
+                   unsigned count,
+                   unsigned type,
+                   uint32_t data_field)
+{
+  unsigned i;
+  unsigned req;
+  unsigned words;
+  uint16_t addr;
+  uint16_t word;
+  int rel;
+  uint8_t *data;
+
+  addr = be16toh ((uint16_t) data_field);
+  req = 0;
+  for (i = 0; i < count; i++) {
+    fpga_reg_op *op = &ops[i];
+
+    if (op->write) {
+      continue;
+    }
+
+    words = fpga_reg_words (op);
+    if ((op->flags & 0x03) != type ||
+        (op->flags & 0xC000) != (addr & 0xC000)) {
+      req += words;
+      continue;
     }
+
+    word = (addr & 0x3fff) - (op->address & 0xfffe);
+    if ((word % 2) != 0 || word / 2 >= words ||
+        (f->reg_seen[(req + word / 2) / 8] & (1 << ((req + word / 2) % 8))) != 0) {
+      req += words;
+      continue;
+    }
+    req += word / 2;
+    f->reg_seen[req / 8] |= 1 << (req % 8);
+
+    /*
+     * The response carries the two bytes at the even address,
+     * either of which may be outside what was asked for.
+     */
+    data = op->data;
+    rel = (addr & 0x3fff) - op->address;
+    if (rel >= 0 && rel < op->count) {
+      data[rel] = (data_field >> 16) & 0xff;
+    }
+    if (rel + 1 < op->count) {
+      data[rel + 1] = (data_field >> 24) & 0xff;
+    }
+    return true;
   }
-  return 0;
+
+  return false;
 }
 
-int
-fpga_config_read (uint16_t address,
-                  void *data,
-                  uint16_t count,
-                  uint16_t flags)
+static void
+fpga_reg_tx_done (void *opaque,
+                  int status)
 {
-  int err;
-  uint8_t *buf;
-  uint16_t cur_addr;
-  int buf_index;
-  int i;
+  fpga_dev_t *f = opaque;
 
-  if (count == 0 ||
-      (address + count) > 0x1000) {
-    return -1;
+  if (status != 0) {
+    f->reg_tx_status = -1;
+  }
+  if (--f->reg_tx_pending == 0) {
+    f->reg_tx_completed = 1;
   }
+}
 
-  memset (data, 0, count);
+/*
+ * Sends what's in reg_buf and waits for the responses to the
+ * reads among ops.
+ */
+static int
+fpga_reg_run (fpga_dev_t *f,
+              fpga_reg_op *ops,
+              unsigned count)
+{
+  int err;
+  int off;
+  int size;
+  bool threaded;
+  bool nonblock;
+  unsigned i;
+  unsigned type;
+  unsigned types;
+  unsigned pending;
+  unsigned requests;
+  uint32_t data_field;
+  uint64_t deadline;
+  tlp_receive_context *c;
+  transport_t *t = f->transport;
 
-  buf = malloc (0x20000);
-  if (buf == NULL) {
-    return -1;
-  }
-  memset (buf, 0, 0x20000);
-
-  buf_index = 0;
-  for (cur_addr = address & 0xfffe;
-       cur_addr < (address + count);
-       cur_addr += 2) {
-    buf[buf_index + 4] = (cur_addr | (flags & 0xC000)) >> 8;
-    buf[buf_index + 5] = cur_addr & 0xff;
-    buf[buf_index + 6] = 0x10 | (flags & 0x03);
-    buf[buf_index + 7] = 0x77;
-    buf_index += 8;
-    if (buf_index >= 0x3f0) {
-      err = ftdi_write (buf, buf_index, &buf_index);
-      if (err != 0) {
-        goto out;
-      }
-      buf_index = 0;
+  types = 0;
+  requests = 0;
+  for (i = 0; i < count; i++) {
+    if (!ops[i].write) {
+      requests += fpga_reg_words (&ops[i]);
+      types |= 1 << (ops[i].flags & 0x03);
     }
   }
-  if (buf_index != 0) {
-      err = ftdi_write (buf, buf_index, &buf_index);
-      if (err != 0) {
-        goto out;
-      }
+  memset (f->reg_seen, 0, (requests + 7) / 8);
+
+  /*
+   * Everything goes out before we wait on any of it.
+   */
+  f->reg_tx_pending = 1;
+  f->reg_tx_completed = 0;
+  f->reg_tx_status = 0;
+  for (off = 0; off < f->reg_len; off += size) {
+    size = f->reg_len - off;
+    if (size > FPGA_REG_CHUNK_SIZE) {
+      size = FPGA_REG_CHUNK_SIZE;
+    }
+
+    f->reg_tx_pending++;
+    err = t->ops->write (t, f->reg_buf + off, size,
+                         fpga_reg_tx_done, f);
+    if (err != 0) {
+      fpga_reg_tx_done (f, -1);
+      break;
+    }
   }
+  fpga_reg_tx_done (f, 0);
+  f->reg_len = 0;
 
-  usleep (MS_TO_US(10));
+  if (t->ops->wait (t, &f->reg_tx_completed) != 0 ||
+      f->reg_tx_status != 0) {
+    return -1;
+  }
 
- retry:
-  err = ftdi_read (buf, 0x20000, &buf_index);
-  if (err < 0) {
-    goto out;
+  /*
+   * Responses show up on the deframer's queue for their register
+   * space. Either another thread keeps deframing (pipelined
+   * receive), or we pump the stream ourselves; any TLPs that
+   * come in meanwhile stay queued for the receive context.
+   */
+  c = __atomic_load_n (&f->rx_active, __ATOMIC_RELAXED);
+  if (c == NULL) {
+    c = &f->rx_own;
+    if (c->d.max_tlp_dws == 0) {
+      fpga_rx_context_init (c, f, NULL);
+    }
   }
+  threaded = fpga_rx_transport (c) != t && c != f->rx_reinit;
+  nonblock = fpga_rx_transport (c)->nonblock;
 
-  for (i = 0; i < buf_index; i += 32) {
-    int j;
-    uint32_t status_field;
-    uint32_t *data_fields;
+  pending = requests;
+  deadline = time_now_ns () + FPGA_REG_TIMEOUT_NS;
+  while (pending != 0) {
+    bool popped = false;
 
-    while (*(uint32_t *)(buf + i) == 0x55556666) {
-      /*
-       * Skip over FTDI workaround dummy fillers.
-       */
-      i += 4;
-      if ((i + 32) > buf_index) {
-        err = -1;
-        goto retry;
+    for (type = DEFRAME_PCIE_CFG; type <= DEFRAME_CORE_CFG; type++) {
+      if ((types & (1 << type)) == 0) {
+        continue;
+      }
+
+      while (deframe_queue_pop (DEFRAME_QUEUE (&c->d, type), &data_field)) {
+        popped = true;
+        if (fpga_reg_response (f, ops, count, type, data_field)) {
+          pending--;
+        }
       }
     }
+    if (popped) {
+      continue;
+    }
 
-    status_field = *(uint32_t *)(buf + i);
-    data_fields = (uint32_t *)(buf + i + 4);
+    if (time_now_ns () > deadline) {
+      fprintf (stderr, "Timed out waiting for %u of %u register reads "
+               "(device %u)\n", pending, requests, f->id);
+      return -1;
+    }
 
-    if ((status_field & 0xf0000000) != 0xe0000000) {
+    if (threaded) {
+      usleep (10);
       continue;
     }
 
-    for (j = 0; j < 7; j++) {
-      bool f_match;
-      uint32_t data_field;
-
-      f_match = (status_field & 0x0f) == (flags & 0x03);
-      data_field = *data_fields++;
-      status_field >>= 4;
-      if (!f_match) {
-        continue;
+    if (c->p == c->e) {
+      /*
+       * Even from inside an event loop; the response is due
+       * within FPGA_REG_TIMEOUT_NS anyway.
+       */
+      fpga_rx_transport (c)->nonblock = false;
+      err = fpga_rx_fill (c);
+      fpga_rx_transport (c)->nonblock = nonblock;
+      if (err == TRANSPORT_EOF) {
+        return -1;
       }
+      continue;
+    }
 
-      cur_addr = be16toh ((uint16_t) data_field);
-      cur_addr -= (flags & 0xC000) + address;
-      if (cur_addr == 0xffff) {
-        /*
-         * First unaligned byte.
-         */
-        *(uint8_t *) data = (data_field >> 24) & 0xff;
-      }
-      if (cur_addr >= count) {
-        /*
-         * Address read is out of range.
-         */
-        continue;
-      }
-      if (cur_addr == count - 1) {
-        /*
-         * Last byte.
-         */
-        *(((uint8_t *) data) + cur_addr) = (data_field >> 16) & 0xff;
-      } else {
-        /*
-         * Normal two bytes.
-         */
-        *(((uint16_t *) data) + cur_addr) = (data_field >> 16) & 0xffff;
-      }
+    if (fpga_rx_pump (c) != 0) {
+      return -1;
     }
   }
- out:
-  free (buf);
-  return err;
+
+  return 0;
 }
 
 int
-fpga_tlp_send (void *tlp_data,
-               uint32_t tlp_size)
+fpga_reg_batch (fpga_dev_t *f,
+                fpga_reg_op *ops,
+                unsigned count)
 {
   int err;
-  uint32_t i;
-  uint32_t s_len;
-  int d_len;
-  uint32_t *s;
-  uint32_t *d;
-  /*
-   * TLP data must well-formed - aligned  to 4 bytes.
-   */
-  assert ((tlp_size & 0x3) == 0);
-  assert (tlp_size <= TLP_TX_MAX_SIZE);
-  assert (tlp_size > 0);
+  unsigned i;
+  unsigned first;
+  unsigned size;
 
-  s = tlp_data;
-  s_len = tlp_size / sizeof (uint32_t);
+  for (i = 0; i < count; i++) {
+    if (ops[i].count == 0 ||
+        (ops[i].address + ops[i].count) > 0x1000 ||
+        (ops[i].flags & 0x03) == 0) {
+      return -1;
+    }
+  }
 
-  d = tx_data;
-  for (d_len = 0, i = 0; i < s_len; i++) {
-    d[d_len++] = s[i];
-    d[d_len++] = 0x77000000;
+  pthread_mutex_lock (&f->tx_lock);
+  if (fpga_tx_flush_locked (f) != 0) {
+    pthread_mutex_unlock (&f->tx_lock);
+    return -1;
   }
 
-  assert (d[d_len - 1] == 0x77000000);
-  /*
-   * TX TLP VALID LAST.
-   */
-  d[d_len - 1] = 0x77040000;
+  for (i = 0; i < count; i++) {
+    if (!ops[i].write) {
+      memset (ops[i].data, 0, ops[i].count);
+    }
+  }
+
+  first = 0;
+  f->reg_len = 0;
+  for (i = 0; i < count; i++) {
+    size = fpga_reg_words (&ops[i]) * 8;
+    if (f->reg_len + size > sizeof (f->reg_buf)) {
+      err = fpga_reg_run (f, ops + first, i - first);
+      if (err != 0) {
+        pthread_mutex_unlock (&f->tx_lock);
+        return -1;
+      }
+      first = i;
+    }
 
-  err = ftdi_write (d, d_len * sizeof (uint32_t),
-                    &d_len);
+    fpga_reg_encode (f, &ops[i]);
+  }
+
+  err = fpga_reg_run (f, ops + first, count - first);
+  pthread_mutex_unlock (&f->tx_lock);
   return err;
 }
 
-tlp_receive_result_t
-fpga_tlp_receive (tlp_receive_context *c,
-                  void **tlp_data,
-                  uint32_t *tlp_size)
+int
+fpga_config_write (fpga_dev_t *f,
+                   uint16_t address,
+                   void *data,
+                   uint16_t count,
+                   uint16_t flags)
 {
-  int err;
-  int tlp_dword_index;
-  int tlp_dword_count;
-  bool tlp_header_seen;
+  fpga_reg_op op = {
+    .address = address,
+    .count = count,
+    .flags = flags,
+    .write = true,
+    .data = data,
+    .mask = NULL,
+  };
 
-  tlp_dword_index = 0;
-  tlp_dword_count = 0;
-  tlp_header_seen = false;
+  return fpga_reg_batch (f, &op, 1);
+}
 
-  while (1) {
-    if (c->p == c->e) {
-      int transferred;
+int
+fpga_config_read (fpga_dev_t *f,
+                  uint16_t address,
+                  void *data,
+                  uint16_t count,
+                  uint16_t flags)
+{
+  fpga_reg_op op = {
+    .address = address,
+    .count = count,
+    .flags = flags,
+    .write = false,
+    .data = data,
+    .mask = NULL,
+  };
 
-      transferred = 0;
-      err = ftdi_read (rx_data,
-                       sizeof (rx_data), &transferred);
-      if (err != 0) {
-        continue;
-      }
-      if ((transferred % sizeof (uint32_t)) != 0) {
-        fprintf (stderr, "Transfer size not aligned to 32 bits\n");
-      }
-      transferred /= sizeof (uint32_t);
+  return fpga_reg_batch (f, &op, 1);
+}
 
-      c->p = (void *) rx_data;
-      c->e = c->p + transferred;
+/*
+ * Runs on whichever thread handles the transport's events, which
+ * with a pipeline isn't the one sending: the batch is emptied
+ * before it's handed back with a release store, and the stats are
+ * added to atomically.
+ */
+static void
+fpga_tx_done (void *opaque,
+              int status)
+{
+  unsigned i;
+  uint64_t now;
+  uint64_t latency;
+  uint64_t max;
+  fpga_tx_batch *b = opaque;
+  fpga_tx_stats *stats = &b->dev->tx_stats;
 
-      if (c->p == c->e) {
-        if (!tlp_header_seen) {
-          /*
-           * Can only do this if we're not in the middle
-           * of processing a TLP.
-           */
-          break;
-        }
+  now = time_now_ns ();
+  for (i = 0; i < b->entry_count; i++) {
+    fpga_tx_entry *e = &b->entries[i];
 
-        continue;
-      }
+    latency = now - e->queued_ns;
+    __atomic_fetch_add (&stats->latency_ns_total, latency, __ATOMIC_RELAXED);
+    max = __atomic_load_n (&stats->latency_ns_max, __ATOMIC_RELAXED);
+    while (latency > max &&
+           !__atomic_compare_exchange_n (&stats->latency_ns_max, &max,
+                                         latency, true, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED)) {
     }
 
-    while (1) {
-      if (c->state == STATE_STATUS) {
-        c->status_index = 0;
-        while (*c->p == 0x55556666 &&
-               c->p < c->e) {
-          c->p++;
-        }
+    if (e->cb != NULL) {
+      e->cb (e->opaque, status, e->queued_ns, now);
+    }
+  }
 
-        if (c->p == c->e) {
-          break;
-        }
+  if (status != 0) {
+    __atomic_fetch_add (&stats->errors, b->entry_count, __ATOMIC_RELAXED);
+  }
 
-        c->status_field = *c->p++;
-        if ((c->status_field & 0xf0000000) != 0xe0000000) {
-          return TLP_OUT_OF_SYNC;
-        } else {
-          c->state = STATE_DATA;
-        }
-      } else if (c->state == STATE_DATA) {
-        if (c->status_index == 7) {
-          c->state = STATE_STATUS;
-          continue;
-        }
+  b->len_dws = 0;
+  b->entry_count = 0;
+  __atomic_store_n (&b->in_flight, false, __ATOMIC_RELEASE);
+  __atomic_store_n (&b->completed, 1, __ATOMIC_RELEASE);
+}
 
-        if (!tlp_header_seen) {
-          while (*c->p == 0x55556666 &&
-                 c->p < c->e) {
-            c->p++;
-          }
-        }
+static fpga_tx_batch *
+fpga_tx_batch_get (fpga_dev_t *f)
+{
+  fpga_tx_batch *b;
 
-        if (c->p == c->e) {
-          break;
-        }
+  b = &f->tx_batches[f->tx_cur];
+  while (__atomic_load_n (&b->in_flight, __ATOMIC_ACQUIRE)) {
+    if (f->transport->ops->wait (f->transport, &b->completed) != 0) {
+      return NULL;
+    }
+  }
 
-        c->status_index++;
-        if ((c->status_field & 0x03) == 0x00) {
-          /*
-           * PCIe TLP.
-           */
-          rx_tlp_dwords[tlp_dword_index] = *c->p++;
-
-          if (!tlp_header_seen) {
-            uint32_t len_dw;
-            uint32_t dw = rx_tlp_dwords[tlp_dword_index];
-
-            len_dw = tlp_packet_len_dws (dw, NULL);
-            tlp_dword_count += len_dw;
-
-            if (len_dw > 1) {
-              tlp_header_seen = true;
-            }
-          }
-          tlp_dword_index++;
-        }
+  return b;
+}
 
-        if ((c->status_field & 0x07) == 0x04) {
-          /*
-           * PCIe TLP and LAST.
-           */
-          c->state = STATE_TLP_COMPLETE;
-        }
+static int
+fpga_tx_flush_locked (fpga_dev_t *f)
+{
+  int err;
+  fpga_tx_batch *b;
 
-        c->status_field >>= 4;
-      } else if (c->state == STATE_REM) {
-        if (c->status_index == 7) {
-          c->state = STATE_STATUS;
-          continue;
-        }
+  b = &f->tx_batches[f->tx_cur];
+  if (b->entry_count == 0) {
+    return 0;
+  }
 
-        if (c->p == c->e) {
-          break;
-        }
+  __atomic_fetch_add (&f->tx_stats.tlps, b->entry_count, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&f->tx_stats.batches, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&f->tx_stats.bytes, b->len_dws * sizeof (uint32_t),
+                      __ATOMIC_RELAXED);
 
-        c->p++;
-        c->status_index++;
-        c->status_field >>= 4;
-      } else if (c->state == STATE_TLP_COMPLETE) {
-        if ((c->status_field & 0x03) == 0) {
-          c->state = STATE_DATA;
-        } else {
-          c->state = STATE_REM;
-        }
+  __atomic_store_n (&b->in_flight, true, __ATOMIC_RELAXED);
+  __atomic_store_n (&b->completed, 0, __ATOMIC_RELAXED);
+  f->tx_cur = (f->tx_cur + 1) % TX_BATCH_COUNT;
+  err = f->transport->ops->write (f->transport, b->data,
+                                  b->len_dws * sizeof (uint32_t),
+                                  fpga_tx_done, b);
+  if (err != 0) {
+    fpga_tx_done (b, -1);
+    return -1;
+  }
 
-        if (tlp_dword_index == tlp_dword_count) {
-          *tlp_data = rx_tlp_dwords;
-          *tlp_size = tlp_dword_index << 2;
-          c->state = STATE_STATUS;
-          return TLP_COMPLETE;
-        }
+  return 0;
+}
+
+int
+fpga_tx_flush (fpga_dev_t *f)
+{
+  int err;
+
+  pthread_mutex_lock (&f->tx_lock);
+  err = fpga_tx_flush_locked (f);
+  pthread_mutex_unlock (&f->tx_lock);
+  return err;
+}
+
+/*
+ * Flushes the pending batch if its oldest TLP is past the deadline.
+ * From whichever thread sends: with a pipeline, the deframer
+ * doesn't do it for us.
+ */
+int
+fpga_tx_poll (fpga_dev_t *f)
+{
+  int err = 0;
+  fpga_tx_batch *b;
+
+  pthread_mutex_lock (&f->tx_lock);
+  b = &f->tx_batches[f->tx_cur];
+  if (b->entry_count != 0 &&
+      time_now_ns () - b->entries[0].queued_ns >= f->tx_deadline_ns) {
+    err = fpga_tx_flush_locked (f);
+  }
+  pthread_mutex_unlock (&f->tx_lock);
+  return err;
+}
+
+void
+fpga_tx_set_deadline (fpga_dev_t *f,
+                      unsigned deadline_us)
+{
+  f->tx_deadline_ns = (uint64_t) deadline_us * 1000;
+}
+
+void
+fpga_tx_get_stats (fpga_dev_t *f,
+                   fpga_tx_stats *stats)
+{
+  stats->tlps = __atomic_load_n (&f->tx_stats.tlps, __ATOMIC_RELAXED);
+  stats->batches = __atomic_load_n (&f->tx_stats.batches, __ATOMIC_RELAXED);
+  stats->bytes = __atomic_load_n (&f->tx_stats.bytes, __ATOMIC_RELAXED);
+  stats->errors = __atomic_load_n (&f->tx_stats.errors, __ATOMIC_RELAXED);
+  stats->latency_ns_total = __atomic_load_n (&f->tx_stats.latency_ns_total,
+                                             __ATOMIC_RELAXED);
+  stats->latency_ns_max = __atomic_load_n (&f->tx_stats.latency_ns_max,
+                                           __ATOMIC_RELAXED);
+}
+
+static int
+fpga_tlp_send_locked (fpga_dev_t *f,
+                      void *tlp_data,
+                      uint32_t tlp_size,
+                      fpga_tx_done_cb cb,
+                      void *opaque)
+{
+  uint32_t i;
+  uint32_t s_len;
+  uint32_t *s;
+  uint32_t *d;
+  fpga_tx_batch *b;
+  fpga_tx_entry *e;
+
+  /*
+   * TLP data must well-formed - aligned  to 4 bytes.
+   */
+  assert ((tlp_size & 0x3) == 0);
+  assert (tlp_size <= TLP_TX_MAX_SIZE);
+  assert (tlp_size > 0);
+
+  s = tlp_data;
+  s_len = tlp_size / sizeof (uint32_t);
+
+  b = fpga_tx_batch_get (f);
+  if (b == NULL) {
+    return -1;
+  }
+
+  if (b->entry_count == TX_BATCH_MAX_TLPS ||
+      b->len_dws + s_len * 2 > TX_BATCH_SIZE_IN_DWORDS) {
+    if (fpga_tx_flush_locked (f) != 0) {
+      return -1;
+    }
+
+    b = fpga_tx_batch_get (f);
+    if (b == NULL) {
+      return -1;
+    }
+  }
+
+  d = b->data + b->len_dws;
+  for (i = 0; i < s_len; i++) {
+    *d++ = s[i];
+    *d++ = 0x77000000;
+  }
+
+  /*
+   * TX TLP VALID LAST.
+   */
+  d[-1] = 0x77040000;
+  b->len_dws += s_len * 2;
+
+  e = &b->entries[b->entry_count++];
+  e->cb = cb;
+  e->opaque = opaque;
+  e->queued_ns = time_now_ns ();
+
+  if (e->queued_ns - b->entries[0].queued_ns >= f->tx_deadline_ns) {
+    return fpga_tx_flush_locked (f);
+  }
+
+  return 0;
+}
+
+int
+fpga_tlp_send_async (fpga_dev_t *f,
+                     void *tlp_data,
+                     uint32_t tlp_size,
+                     fpga_tx_done_cb cb,
+                     void *opaque)
+{
+  int err;
+
+  pthread_mutex_lock (&f->tx_lock);
+  err = fpga_tlp_send_locked (f, tlp_data, tlp_size, cb, opaque);
+  pthread_mutex_unlock (&f->tx_lock);
+  return err;
+}
+
+int
+fpga_tlp_send (fpga_dev_t *f,
+               void *tlp_data,
+               uint32_t tlp_size)
+{
+  return fpga_tlp_send_async (f, tlp_data, tlp_size, NULL, NULL);
+}
+
+static tlp_receive_result_t
+fpga_tlp_next (tlp_receive_context *c,
+               void **tlp_data,
+               uint32_t *tlp_size)
+{
+  uint32_t end;
+  uint32_t *dws;
+  unsigned count;
+  unsigned claimed;
+  bool truncated;
+
+  end = c->d.ends[c->next++];
+  truncated = (end & DEFRAME_END_TRUNCATED) != 0;
+  end &= ~DEFRAME_END_TRUNCATED;
+
+  dws = c->d.out + c->start;
+  count = end - c->start;
+  c->start = end;
+
+  *tlp_data = dws;
+  *tlp_size = count << 2;
+
+  claimed = tlp_len_dws (dws, count);
+  STATS_INC (rx_tlps, 1);
+  if (!truncated && claimed == count) {
+    return TLP_COMPLETE;
+  }
+
+  STATS_INC (rx_corrupt, 1);
+  fprintf (stderr, "Disagreement on TLP size (header -> %u dw, actual -> %u dw%s)\n",
+           claimed, count, truncated ? ", truncated" : "");
+  return TLP_CORRUPT;
+}
+
+/*
+ * Drops the next completed TLP if it doesn't pass the device's
+ * filter, before anything looks at or copies it. Sync losses and
+ * reconnects stay pending for the next TLP that does.
+ */
+static inline bool
+fpga_tlp_filtered (tlp_receive_context *c)
+{
+  uint32_t end;
+  const tlp_filter *filter = c->dev->rx_filter;
+
+  if (filter == NULL) {
+    return false;
+  }
+
+  end = c->d.ends[c->next] & ~DEFRAME_END_TRUNCATED;
+  if (tlp_filter_match (filter, c->d.out + c->start, end - c->start)) {
+    return false;
+  }
+
+  c->next++;
+  c->start = end;
+  STATS_INC (rx_tlps, 1);
+  STATS_INC (rx_filtered, 1);
+  return true;
+}
+
+static inline transport_t *
+fpga_rx_transport (tlp_receive_context *c)
+{
+  return c->transport != NULL ? c->transport : c->dev->transport;
+}
+
+/*
+ * Register accesses made before anything else receives go
+ * through f's rx_own; the first real context takes over where
+ * it left off in the stream.
+ */
+static void
+fpga_rx_take_over (tlp_receive_context *c)
+{
+  unsigned n;
+  fpga_dev_t *f = c->dev;
+  tlp_receive_context *o = &f->rx_own;
+
+  if (c == o || o->d.max_tlp_dws == 0) {
+    return;
+  }
+
+  /*
+   * Finish the buffer rx_own was in the middle of and take over
+   * everything in it, including TLPs that came in during
+   * fpga_init (unless there were more than d.out holds). Their
+   * copies in the buffer are gone once it's released.
+   */
+  while (o->p != o->e) {
+    fpga_rx_pump (o);
+  }
+
+  c->d = o->d;
+  for (n = 0; n < c->d.ends_len; n++) {
+    c->d.src[n] = NULL;
+  }
+  c->next = o->next;
+  c->start = o->start;
+  c->out_of_sync = o->out_of_sync;
+  c->oos_end = o->oos_end;
+
+  if (o->buf != NULL) {
+    transport_release (f->transport, o->buf);
+  }
+
+  if (f->rx_active == o) {
+    f->rx_active = NULL;
+  }
+  memset (o, 0, sizeof (*o));
+}
+
+/*
+ * Readies a receive context for f's TLPs, reading from t (NULL
+ * for f's own transport).
+ */
+void
+fpga_rx_context_init (tlp_receive_context *c,
+                      fpga_dev_t *f,
+                      transport_t *t)
+{
+  c->dev = f;
+  c->transport = t;
+  c->d.max_tlp_dws = TLP_MAX_DWS;
+  fpga_rx_take_over (c);
+}
+
+static void
+fpga_rx_buf_put (fpga_rx_buf *b)
+{
+  tlp_receive_context *c = b->owner;
+
+  if (--b->refs != 0) {
+    return;
+  }
+
+  if (b->data != NULL) {
+    transport_release (fpga_rx_transport (c), b->data);
+    b->data = NULL;
+  }
+  b->next = c->free_bufs;
+  c->free_bufs = b;
+}
 
-        fprintf (stderr, "Disagreement on TLP size (header -> %u dw, actual -> %u dw)\n",
-                tlp_dword_count, tlp_dword_index);
-        *tlp_data = rx_tlp_dwords;
+/*
+ * Makes a free fpga_rx_buf, with room for arena_dws DWORDs of
+ * copied TLPs, the one being deframed. Returns NULL if they are
+ * all held.
+ */
+static fpga_rx_buf *
+fpga_rx_buf_get (tlp_receive_context *c,
+                 unsigned arena_dws)
+{
+  unsigned i;
+  fpga_rx_buf *b;
+
+  if (c->pool == NULL) {
+    c->pool = calloc (FPGA_RX_BUFS, sizeof (*c->pool));
+    if (c->pool == NULL) {
+      return NULL;
+    }
+
+    for (i = 0; i < FPGA_RX_BUFS; i++) {
+      c->pool[i].owner = c;
+      c->pool[i].next = c->free_bufs;
+      c->free_bufs = &c->pool[i];
+    }
+  }
+
+  if (c->cur != NULL) {
+    fpga_rx_buf_put (c->cur);
+    c->cur = NULL;
+  }
+
+  b = c->free_bufs;
+  if (b == NULL) {
+    fprintf (stderr, "All %u receive buffers held\n", FPGA_RX_BUFS);
+    return NULL;
+  }
+
+  if (b->arena_size < arena_dws) {
+    free (b->arena);
+    b->arena = malloc (arena_dws * sizeof (uint32_t));
+    b->arena_size = b->arena != NULL ? arena_dws : 0;
+    if (b->arena == NULL) {
+      return NULL;
+    }
+  }
+
+  c->free_bufs = b->next;
+  b->data = NULL;
+  b->refs = 1;
+  b->ts_ns = 0;
+  b->arena_len = 0;
+  c->cur = b;
+  return b;
+}
+
+/*
+ * Wraps the next transport buffer in an fpga_rx_buf. Returns
+ * 0 or TRANSPORT_EOF, or -1 if nothing could be read.
+ */
+static int
+fpga_rx_buf_next (tlp_receive_context *c)
+{
+  int err;
+  int transferred;
+  void *buf;
+  fpga_rx_buf *b;
+  transport_t *t = fpga_rx_transport (c);
+
+  transferred = 0;
+  err = transport_read (t, &buf, &transferred);
+  if (err != 0) {
+    return err;
+  }
+
+  if ((transferred % sizeof (uint32_t)) != 0) {
+    fprintf (stderr, "Transfer size not aligned to 32 bits\n");
+  }
+  transferred /= sizeof (uint32_t);
+
+  /*
+   * Worst case, every TLP DWORD in the buffer gets copied, plus
+   * whatever was left in d.out when it was read (see
+   * fpga_rx_fill).
+   */
+  b = fpga_rx_buf_get (c, transferred + DEFRAME_OUT_DWORDS);
+  if (b == NULL) {
+    transport_release (t, buf);
+    return -1;
+  }
+
+  b->data = buf;
+  b->ts_ns = t->rx_ns;
+
+  c->p = buf;
+  c->e = c->p + transferred;
+  return 0;
+}
+
+/*
+ * Makes the next transport buffer the one being deframed.
+ * Returns 0, TRANSPORT_EOF or -1.
+ */
+static int
+fpga_rx_fill (tlp_receive_context *c)
+{
+  int err;
+  int transferred;
+  void *buf;
+  unsigned i;
+  transport_t *t = fpga_rx_transport (c);
+
+  if (c->batch) {
+    /*
+     * TLPs not handed out yet (register accesses pump the
+     * stream too) mustn't point into the buffer let go of.
+     */
+    for (i = c->next; i < c->d.ends_len; i++) {
+      c->d.src[i] = NULL;
+    }
+
+    return fpga_rx_buf_next (c);
+  }
+
+  /*
+   * Everything in it has been copied out by now.
+   */
+  if (c->buf != NULL) {
+    transport_release (t, c->buf);
+    c->buf = NULL;
+  }
+
+  transferred = 0;
+  err = transport_read (t, &buf, &transferred);
+  if (err != 0) {
+    return err;
+  }
+
+  if ((transferred % sizeof (uint32_t)) != 0) {
+    fprintf (stderr, "Transfer size not aligned to 32 bits\n");
+  }
+
+  c->buf = buf;
+  c->p = buf;
+  c->e = c->p + transferred / sizeof (uint32_t);
+  return 0;
+}
+
+/*
+ * Brings the FPGA back up after a reconnect, with the register
+ * responses coming in through c. Tried again each time c runs
+ * dry until it works, as TLPs the target sends meanwhile can
+ * fill up c until they are handed out.
+ */
+static void
+fpga_rx_reinit (tlp_receive_context *c)
+{
+  int err;
+  fpga_dev_t *f = c->dev;
+
+  f->rx_reinit = c;
+  err = fpga_init (f);
+  f->rx_reinit = NULL;
+
+  if (err == 0) {
+    c->reinit_attempts = 0;
+  } else if (--c->reinit_attempts == 0) {
+    fprintf (stderr, "Giving up on FPGA %u init after reconnect\n", f->id);
+  }
+}
+
+/*
+ * fpga_rx_fill for the receive calls: also recovers from the
+ * transport losing the device. The stream starts over after a
+ * reconnect, so any partial TLP or frame is dropped, and the
+ * next TLP is flagged.
+ */
+static int
+fpga_rx_next (tlp_receive_context *c)
+{
+  int err;
+
+  if (c->reinit_attempts != 0) {
+    fpga_rx_reinit (c);
+  }
+
+  err = fpga_rx_fill (c);
+  if (err != TRANSPORT_RECONNECTED) {
+    return err;
+  }
+
+  deframe_reset (&c->d);
+  c->p = NULL;
+  c->e = NULL;
+  c->out_of_sync = false;
+  c->reconnected = true;
+  c->reinit_attempts = FPGA_REINIT_ATTEMPTS;
+  fpga_rx_reinit (c);
+  return err;
+}
+
+static deframe_result
+fpga_rx_deframe (tlp_receive_context *c)
+{
+  deframe_result r;
+  uint64_t start;
+  uint64_t fillers;
+  uint64_t out_of_sync;
+  uint64_t resync_dws;
+  uint64_t resync_tlps;
+  const uint32_t *p;
+
+  start = STATS_NOW ();
+  p = c->p;
+  fillers = c->d.fillers;
+  out_of_sync = c->d.out_of_sync;
+  resync_dws = c->d.resync_dws;
+  resync_tlps = c->d.resync_tlps;
+
+  r = deframe_run (&c->d, &c->p, c->e);
+
+  STATS_INC (deframe_ns, STATS_NOW () - start);
+  STATS_INC (deframe_bytes, (c->p - p) * sizeof (uint32_t));
+  STATS_INC (rx_filler_dws, c->d.fillers - fillers);
+  STATS_INC (rx_out_of_sync, c->d.out_of_sync - out_of_sync);
+  STATS_INC (rx_resync_bytes, (c->d.resync_dws - resync_dws) * sizeof (uint32_t));
+  STATS_INC (rx_resync_tlps, c->d.resync_tlps - resync_tlps);
+  if (r == DEFRAME_OUT_OF_SYNC && !c->out_of_sync) {
+    /*
+     * Reported once the TLPs before it are handed out.
+     */
+    c->out_of_sync = true;
+    c->oos_end = c->d.ends_len;
+  }
+
+  return r;
+}
+
+/*
+ * Everything handed out, reclaim the space.
+ */
+static void
+fpga_rx_compact (tlp_receive_context *c)
+{
+  deframe_compact (&c->d);
+  c->next = 0;
+  c->start = 0;
+  c->oos_end = 0;
+}
+
+/*
+ * Deframes more of the current buffer for a register access.
+ * rx_own has nobody to hand TLPs to yet, so once it runs out of
+ * room the ones it has are dropped.
+ */
+static int
+fpga_rx_pump (tlp_receive_context *c)
+{
+  if (fpga_rx_deframe (c) != DEFRAME_FULL) {
+    return 0;
+  }
+
+  if (c != &c->dev->rx_own) {
+    fprintf (stderr, "Register response stuck behind unreceived TLPs\n");
+    return -1;
+  }
+
+  c->next = c->d.ends_len;
+  fpga_rx_compact (c);
+  return 0;
+}
+
+static bool
+fpga_rx_begin (tlp_receive_context *c)
+{
+  bool own;
+
+  assert (c->dev != NULL);
+  fpga_rx_take_over (c);
+
+  __atomic_store_n (&c->dev->rx_active, c, __ATOMIC_RELAXED);
+
+  own = fpga_rx_transport (c) == c->dev->transport;
+  if (own) {
+    fpga_tx_poll (c->dev);
+  }
+
+  return own;
+}
+
+tlp_receive_result_t
+fpga_tlp_receive (tlp_receive_context *c,
+                  void **tlp_data,
+                  uint32_t *tlp_size)
+{
+  int err;
+  bool own;
+
+  own = fpga_rx_begin (c);
+  while (1) {
+    if (c->reconnected) {
+      c->reconnected = false;
+      return TLP_RECONNECTED;
+    }
+
+    if (c->out_of_sync && c->next >= c->oos_end) {
+      c->out_of_sync = false;
+      return TLP_OUT_OF_SYNC;
+    }
+
+    if (c->next < c->d.ends_len) {
+      if (fpga_tlp_filtered (c)) {
+        continue;
+      }
+      return fpga_tlp_next (c, tlp_data, tlp_size);
+    }
+
+    if (c->next != 0) {
+      fpga_rx_compact (c);
+    }
+
+    if (c->p == c->e) {
+      /*
+       * About to wait for more data, so nothing else will be
+       * coalesced with what's queued right now.
+       */
+      if (own) {
+        fpga_tx_flush (c->dev);
+      }
+
+      err = fpga_rx_next (c);
+      if (err == TRANSPORT_EOF) {
+        return TLP_END_OF_STREAM;
+      }
+      if (err == TRANSPORT_AGAIN) {
+        return TLP_NO_DATA;
+      }
+      if (err != 0) {
+        continue;
+      }
+
+      if (c->p == c->e && c->d.out_len == c->d.tlp_start &&
+          !fpga_rx_transport (c)->nonblock) {
         /*
-         * Return the larger amount, the caller
-         * may want to dump it.
+         * Can only do this if we're not in the middle
+         * of processing a TLP. Watched transports say when
+         * there's nothing more instead.
          */
-        *tlp_size = tlp_dword_count > tlp_dword_index ?
-          tlp_dword_count << 2 :
-          tlp_dword_index << 2;
-        c->state = STATE_STATUS;
-        return TLP_CORRUPT;
+        return TLP_NO_DATA;
       }
     }
+
+    fpga_rx_deframe (c);
+  }
+}
+
+static void
+fpga_tlp_desc (tlp_receive_context *c,
+               tlp_desc_t *desc)
+{
+  uint32_t end;
+  uint32_t *dws;
+  unsigned count;
+  const uint32_t *src;
+  fpga_rx_buf *b = c->cur;
+
+  src = c->d.src[c->next];
+  end = c->d.ends[c->next++];
+  desc->flags = 0;
+  if ((end & DEFRAME_END_TRUNCATED) != 0) {
+    desc->flags |= TLP_DESC_TRUNCATED | TLP_DESC_CORRUPT;
+    end &= ~DEFRAME_END_TRUNCATED;
+  }
+
+  if (c->out_of_sync && c->next > c->oos_end) {
+    desc->flags |= TLP_DESC_RESYNC;
+    c->out_of_sync = false;
+  }
+
+  if (c->reconnected) {
+    desc->flags |= TLP_DESC_RECONNECT;
+    c->reconnected = false;
+  }
+
+  dws = c->d.out + c->start;
+  count = end - c->start;
+  c->start = end;
+
+  if (tlp_len_dws (dws, count) != count) {
+    desc->flags |= TLP_DESC_CORRUPT;
+  }
+  STATS_INC (rx_tlps, 1);
+  if ((desc->flags & TLP_DESC_CORRUPT) != 0) {
+    STATS_INC (rx_corrupt, 1);
+  }
+
+  if (src == NULL) {
+    /*
+     * Split across frames or buffers, so d.out is the only
+     * contiguous copy and it gets reused.
+     */
+    memcpy (b->arena + b->arena_len, dws, count * sizeof (uint32_t));
+    src = b->arena + b->arena_len;
+    b->arena_len += count;
+    desc->flags |= TLP_DESC_COPIED;
+  }
+
+  desc->data = src;
+  desc->size = count << 2;
+  desc->ts_ns = b->ts_ns;
+  desc->dev = c->dev->id;
+  desc->buf = b;
+  b->refs++;
+}
+
+/*
+ * Fills descs with up to max received TLPs, deframing whole
+ * transport buffers at a time. Returns how many, 0 if there was
+ * nothing to receive (with a watched transport, only once its
+ * read would block), or -1 at the end of a replayed stream.
+ * Every returned descriptor must be handed back with
+ * fpga_tlp_release; until then its data stays valid. Once it
+ * has some TLPs, it returns rather than wait for more.
+ */
+int
+fpga_tlp_receive_batch (tlp_receive_context *c,
+                        tlp_desc_t *descs,
+                        unsigned max)
+{
+  int err;
+  bool own;
+  unsigned n;
+
+  own = fpga_rx_begin (c);
+  c->batch = true;
+
+  n = 0;
+  while (n < max) {
+    if (c->next < c->d.ends_len) {
+      if (fpga_tlp_filtered (c)) {
+        continue;
+      }
+      if (c->cur == NULL) {
+        /*
+         * TLPs taken over from rx_own, with no transport buffer
+         * to go with them; the arena is all they need.
+         */
+        if (fpga_rx_buf_get (c, DEFRAME_OUT_DWORDS) == NULL) {
+          break;
+        }
+        c->cur->ts_ns = fpga_rx_transport (c)->rx_ns;
+      }
+
+      fpga_tlp_desc (c, &descs[n++]);
+      continue;
+    }
+
+    if (c->next != 0) {
+      fpga_rx_compact (c);
+    }
+
+    if (c->p == c->e) {
+      if (n != 0) {
+        break;
+      }
+
+      if (own) {
+        fpga_tx_flush (c->dev);
+      }
+
+      err = fpga_rx_next (c);
+      if (err == TRANSPORT_EOF) {
+        return -1;
+      }
+      if (err == TRANSPORT_RECONNECTED) {
+        continue;
+      }
+      if (err != 0) {
+        break;
+      }
+
+      if (c->p == c->e && c->d.out_len == c->d.tlp_start &&
+          !fpga_rx_transport (c)->nonblock) {
+        break;
+      }
+    }
+
+    fpga_rx_deframe (c);
+  }
+
+  return n;
+}
+
+void
+fpga_tlp_release (tlp_desc_t *descs,
+                  unsigned count)
+{
+  unsigned i;
+
+  for (i = 0; i < count; i++) {
+    fpga_rx_buf_put (descs[i].buf);
+  }
+}
+
+/*
+ * Loopback: the FPGA sends each DWORD straight back, as frame
+ * data of type DEFRAME_LOOPBACK. cmd needs room for two DWORDs
+ * per data DWORD; returns how many it used.
+ */
+unsigned
+fpga_loopback_encode (uint32_t *cmd,
+                      const uint32_t *dws,
+                      unsigned count)
+{
+  unsigned i;
+
+  for (i = 0; i < count; i++) {
+    *cmd++ = dws[i];
+    *cmd++ = FPGA_TX_LOOPBACK;
   }
 
-  return TLP_NO_DATA;
+  return count * 2;
 }
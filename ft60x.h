@@ -15,6 +15,13 @@
 #define FTDI_ENDPOINT_OUT            0x02
 #define FTDI_ENDPOINT_IN             0x82
 
+/*
+ * IN session reads: whole 32-byte frames, and no more than the
+ * largest we ask the FT601 for in one go.
+ */
+#define FTDI_RX_ALIGN                32
+#define FTDI_MAX_RX_SIZE             (16u << 20)
+
 typedef struct __attribute__ ((packed)) {
   /*
    * Device descriptor.
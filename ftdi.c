@@ -4,136 +4,1593 @@
  *
  * SPDX-License-Identifier: GPL-3.0
  *
+ * FT601 transport over libusb.
  */
 
 #include "screamer.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <libusb.h>
+#include <event2/event.h>
 
-static libusb_context *usb_ctx;
-static libusb_device_handle *device_handle;
+/*
+ * The usbfs data path needs the fd libusb works on, which only
+ * libusb_wrap_sys_device gives us.
+ */
+#if defined(__linux__) && defined(HAVE_LIBUSB_WRAP_SYS_DEVICE)
+#define FTDI_USBFS 1
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/usbdevice_fs.h>
+#endif
+
+typedef struct ftdi_dev ftdi_dev;
+
+/*
+ * Consecutive failed RX transfers after which the FT601 is
+ * taken to have been reset, and how long a read waits for it
+ * to come back before giving up (until the next read).
+ */
+#define FTDI_MAX_RX_ERRORS          8
+#define FTDI_RECONNECT_WAIT_MS      100
+
+/*
+ * libusb fds a watched device can have: its own event fds plus
+ * one per open device.
+ */
+#define FTDI_MAX_POLLFDS            8
+
+/*
+ * usbfs data path: async writes in flight at once, and the
+ * largest bulk URB without USBDEVFS_CAP_NO_PACKET_SIZE_LIM.
+ */
+#define FTDI_URB_TX_COUNT           32
+#define FTDI_URB_MAX_SIZE           16384
+
+/*
+ * An RX slot. status (a libusb_transfer_status) and len are the
+ * IN transfer's outcome, whichever way it went.
+ */
+typedef struct {
+  ftdi_dev *dev;
+  struct libusb_transfer *cmd_transfer;
+  struct libusb_transfer *in_transfer;
+#ifdef FTDI_USBFS
+  struct usbdevfs_urb cmd_urb;
+  struct usbdevfs_urb in_urb;
+  bool mapped;
+#endif
+  ft60x_ctrl_req ctrl_req;
+  uint8_t *buf;
+  int status;
+  int len;
+  bool cmd_pending;
+  bool failed;
+  bool held;
+  int completed;
+  uint64_t submit_ns;
+  uint64_t done_ns;
+} ftdi_rx_slot;
+
+typedef struct {
+  ftdi_dev *dev;
+  struct libusb_transfer *transfer;
+  transport_write_cb cb;
+  void *opaque;
+  uint64_t submit_ns;
+} ftdi_write_req;
+
+#ifdef FTDI_USBFS
+typedef struct {
+  ftdi_dev *dev;
+  struct usbdevfs_urb urb;
+  transport_write_cb cb;
+  void *opaque;
+  uint64_t submit_ns;
+  bool busy;
+} ftdi_urb_tx;
+#endif
+
+/*
+ * Startup phases, as printed by ftdi_open.
+ */
+enum {
+  FTDI_STARTUP_LIBUSB,
+  FTDI_STARTUP_OPEN,
+  FTDI_STARTUP_CLAIM,
+  FTDI_STARTUP_CHIP_CONFIG,
+  FTDI_STARTUP_RX,
+  FTDI_STARTUP_PHASES,
+};
+
+struct ftdi_dev {
+  /*
+   * A libusb context of its own, so that handling events for
+   * this device never runs another device's callbacks (and
+   * their thread's state) from our thread.
+   */
+  libusb_context *usb_ctx;
+  libusb_device_handle *device_handle;
+  /*
+   * usbfs fd the handle wraps, when opened by bus/address.
+   */
+  int sys_fd;
+#ifdef FTDI_USBFS
+  /*
+   * Bulk transfers as URBs submitted and reaped on sys_fd
+   * directly (libusb only finds, claims and configures). RX
+   * buffers are mmap'd from map_fd (sys_fd, until a reconnect
+   * replaces that) so the controller DMAs straight into them.
+   */
+  bool usbfs;
+  int map_fd;
+  uint32_t caps;
+  ftdi_urb_tx urb_tx[FTDI_URB_TX_COUNT];
+  /*
+   * The reader and a pipeline's sender both wait on sys_fd. One
+   * of them reaps at a time and completes whatever it gets, RX
+   * or TX; the other waits on reap_cond for it. reap_lock also
+   * covers the slots' and urb_tx's completion state.
+   */
+  pthread_mutex_t reap_lock;
+  pthread_cond_t reap_cond;
+  bool reaping;
+#endif
+  uint64_t startup_ns[FTDI_STARTUP_PHASES];
+
+  /*
+   * Where it is plugged in, to find it again after it drops off
+   * the bus. lost is set once it has; the next read reconnects.
+   */
+  uint8_t bus;
+  uint8_t ports[7];
+  int port_count;
+  bool lost;
+  /*
+   * Held to submit writes, and to swap the handle (and usbfs
+   * fd) when reconnecting, which may be on different threads.
+   */
+  pthread_mutex_t tx_lock;
+  unsigned rx_errors;
+  unsigned tx_pending;
+  bool hotplug;
+  libusb_hotplug_callback_handle hotplug_handle;
+  int arrived;
+
+  /*
+   * Async RX ring. Each slot is a session command (telling
+   * the FT601 how much to send) followed by a bulk IN transfer.
+   * Slots are handed out in submission order from rx_head and
+   * resubmitted, still in ring order from rx_tail, once the
+   * consumer releases them. rx_out counts slots handed out and
+   * not yet resubmitted.
+   */
+  ftdi_rx_slot *rx_slots;
+  unsigned rx_slot_count;
+  unsigned rx_slot_size;
+  unsigned rx_head;
+  unsigned rx_tail;
+  unsigned rx_out;
+
+  /*
+   * Watched from an event loop: an event per libusb fd, a timer
+   * for libusb's own timeouts where its fds don't cover them,
+   * and one to try reconnecting again.
+   */
+  struct event_base *ev_base;
+  struct event *poll_evs[FTDI_MAX_POLLFDS];
+  struct event *timeout_ev;
+  struct event *retry_ev;
+  transport_ready_cb ready_cb;
+  void *ready_opaque;
+};
+
+static int
+ftdi_reconnect (transport_t *t);
+
+static bool
+ftdi_usbfs (ftdi_dev *dev)
+{
+#ifdef FTDI_USBFS
+  return dev->usbfs;
+#else
+  (void) dev;
+  return false;
+#endif
+}
+
+#ifdef FTDI_USBFS
+/*
+ * libusb's synchronous transfers run its event handling, which
+ * would reap our URBs off the shared fd, so once those are in
+ * flight control transfers go to usbfs directly as well.
+ * Returns like libusb_control_transfer.
+ */
+static int
+ftdi_urb_control (ftdi_dev *dev,
+                  uint8_t request_type,
+                  uint16_t value,
+                  void *data,
+                  uint16_t len)
+{
+  int n;
+  struct usbdevfs_ctrltransfer ctrl;
+
+  memset (&ctrl, 0, sizeof (ctrl));
+  ctrl.bRequestType = request_type;
+  ctrl.bRequest = 0xCF;
+  ctrl.wValue = value;
+  ctrl.wLength = len;
+  ctrl.timeout = 1000;
+  ctrl.data = data;
+
+  n = ioctl (dev->sys_fd, USBDEVFS_CONTROL, &ctrl);
+  if (n < 0) {
+    return errno == ENODEV ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+  }
+
+  return n;
+}
+#endif
+
+static int
+ftdi_set_config (ftdi_dev *dev,
+                 ft60x_config *config)
+{
+#ifdef FTDI_USBFS
+  if (dev->usbfs && dev->rx_slots != NULL) {
+    return ftdi_urb_control (dev, LIBUSB_RECIPIENT_DEVICE |
+                             LIBUSB_REQUEST_TYPE_VENDOR |
+                             LIBUSB_ENDPOINT_OUT,
+                             0, config, sizeof (*config));
+  }
+#endif
+
+  return libusb_control_transfer (dev->device_handle,
+                                  LIBUSB_RECIPIENT_DEVICE |
+                                  LIBUSB_REQUEST_TYPE_VENDOR |
+                                  LIBUSB_ENDPOINT_OUT,
+                                  0xCF,
+                                  0,
+                                  0,
+                                  (void *) config,
+                                  sizeof (*config),
+                                  1000
+                                  );
+}
+
+static int
+ftdi_get_config (ftdi_dev *dev,
+                 ft60x_config *config)
+{
+#ifdef FTDI_USBFS
+  if (dev->usbfs && dev->rx_slots != NULL) {
+    return ftdi_urb_control (dev, LIBUSB_RECIPIENT_DEVICE |
+                             LIBUSB_REQUEST_TYPE_VENDOR |
+                             LIBUSB_ENDPOINT_IN,
+                             1, config, sizeof (*config));
+  }
+#endif
+
+  return libusb_control_transfer(dev->device_handle,
+                                 LIBUSB_RECIPIENT_DEVICE |
+                                 LIBUSB_REQUEST_TYPE_VENDOR |
+                                 LIBUSB_ENDPOINT_IN,
+                                 0xCF,
+                                 1,
+                                 0,
+                                 (void *) config,
+                                 sizeof (*config),
+                                 1000
+                                 );
+}
+
+static int
+ftdi_config (transport_t *t,
+             ft60x_config *config,
+             bool set)
+{
+  int err;
+
+  if (set) {
+    err = ftdi_set_config (t->priv, config);
+  } else {
+    err = ftdi_get_config (t->priv, config);
+  }
+
+  if (err < 0) {
+    fprintf (stderr, "ftdi_%s_config: %s\n", set ? "set" : "get",
+             libusb_strerror (err));
+    return -1;
+  }
+  if (err != sizeof (*config)) {
+    fprintf (stderr, "ftdi_%s_config: bad config size\n",
+             set ? "set" : "get");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void
+ftdi_tx_account (int size,
+                 uint64_t submit_ns,
+                 int status)
+{
+  if (status != 0) {
+    STATS_INC (usb_tx_errors, 1);
+    return;
+  }
+
+  STATS_INC (usb_tx_transfers, 1);
+  STATS_INC (usb_tx_bytes, size);
+  STATS_HIST (usb_tx_size, size);
+  STATS_HIST (usb_tx_latency_us, (STATS_NOW () - submit_ns) / 1000);
+}
+
+#ifdef FTDI_USBFS
+static int
+ftdi_urb_status (int status)
+{
+  switch (status) {
+  case 0:
+    return LIBUSB_TRANSFER_COMPLETED;
+  case -ENOENT:
+  case -ECONNRESET:
+    return LIBUSB_TRANSFER_CANCELLED;
+  case -ENODEV:
+  case -ESHUTDOWN:
+    return LIBUSB_TRANSFER_NO_DEVICE;
+  case -EPIPE:
+    return LIBUSB_TRANSFER_STALL;
+  case -EOVERFLOW:
+    return LIBUSB_TRANSFER_OVERFLOW;
+  default:
+    return LIBUSB_TRANSFER_ERROR;
+  }
+}
+
+static void
+ftdi_urb_fill (struct usbdevfs_urb *urb,
+               unsigned char endpoint,
+               void *buf,
+               int len,
+               void *opaque)
+{
+  memset (urb, 0, sizeof (*urb));
+  urb->type = USBDEVFS_URB_TYPE_BULK;
+  urb->endpoint = endpoint;
+  urb->buffer = buf;
+  urb->buffer_length = len;
+  urb->usercontext = opaque;
+}
+
+/*
+ * Returns 0 or a libusb error, like libusb_submit_transfer.
+ */
+static int
+ftdi_urb_submit (ftdi_dev *dev,
+                 struct usbdevfs_urb *urb)
+{
+  if (ioctl (dev->sys_fd, USBDEVFS_SUBMITURB, urb) == 0) {
+    return 0;
+  }
+
+  if (errno == ENODEV) {
+    dev->lost = true;
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  return errno == ENOMEM ? LIBUSB_ERROR_NO_MEM : LIBUSB_ERROR_IO;
+}
+
+static void
+ftdi_urb_tx_done (ftdi_urb_tx *tx,
+                  int urb_status)
+{
+  int status;
+  void *opaque;
+  transport_write_cb cb;
+  ftdi_dev *dev = tx->dev;
+
+  status = 0;
+  if (urb_status != 0) {
+    fprintf (stderr, "TX transfer failed: %d\n", ftdi_urb_status (urb_status));
+    status = -1;
+  } else if (tx->urb.actual_length != tx->urb.buffer_length) {
+    fprintf (stderr, "only %d/%d bytes transferred\n",
+             tx->urb.actual_length, tx->urb.buffer_length);
+    status = -1;
+  }
+
+  if (ftdi_urb_status (urb_status) == LIBUSB_TRANSFER_NO_DEVICE) {
+    dev->lost = true;
+  }
+  ftdi_tx_account (tx->urb.actual_length, tx->submit_ns, status);
+
+  /*
+   * tx may be taken again as soon as it's free.
+   */
+  cb = tx->cb;
+  opaque = tx->opaque;
+  pthread_mutex_lock (&dev->reap_lock);
+  tx->busy = false;
+  __atomic_fetch_sub (&dev->tx_pending, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&dev->reap_lock);
+  cb (opaque, status);
+}
+
+/*
+ * Reaps one completed URB, waiting for it if block. Returns 0,
+ * 1 if none had completed, or -1 (e.g. the device is gone and
+ * everything has been reaped).
+ */
+static int
+ftdi_urb_reap (ftdi_dev *dev,
+               bool block)
+{
+  ftdi_rx_slot *slot;
+  struct usbdevfs_urb *urb;
+
+  if (ioctl (dev->sys_fd, block ? USBDEVFS_REAPURB : USBDEVFS_REAPURBNDELAY,
+             &urb) < 0) {
+    if (errno == EAGAIN) {
+      return 1;
+    }
+    if (errno == EINTR) {
+      return 0;
+    }
+    if (errno == ENODEV) {
+      dev->lost = true;
+    } else {
+      fprintf (stderr, "USBDEVFS_REAPURB: %s\n", strerror (errno));
+    }
+    return -1;
+  }
+
+  if (urb->endpoint == FTDI_ENDPOINT_IN) {
+    slot = urb->usercontext;
+    pthread_mutex_lock (&dev->reap_lock);
+    slot->done_ns = time_now_ns ();
+    slot->status = ftdi_urb_status (urb->status);
+    slot->len = urb->actual_length;
+    __atomic_store_n (&slot->completed, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&dev->reap_lock);
+  } else if (urb->endpoint == FTDI_ENDPOINT_SESSION_OUT) {
+    slot = urb->usercontext;
+    pthread_mutex_lock (&dev->reap_lock);
+    slot->cmd_pending = false;
+    pthread_mutex_unlock (&dev->reap_lock);
+    if (urb->status != 0) {
+      /*
+       * As in ftdi_rx_cmd_done.
+       */
+      if (ftdi_urb_status (urb->status) == LIBUSB_TRANSFER_NO_DEVICE) {
+        dev->lost = true;
+      } else {
+        fprintf (stderr, "RX session command failed: %d\n",
+                 ftdi_urb_status (urb->status));
+      }
+      ioctl (dev->sys_fd, USBDEVFS_DISCARDURB, &slot->in_urb);
+    }
+  } else {
+    ftdi_urb_tx_done (urb->usercontext, urb->status);
+  }
+
+  return 0;
+}
+
+/*
+ * The device went away with URBs the kernel won't give back.
+ */
+static void
+ftdi_urb_abandon (ftdi_dev *dev)
+{
+  unsigned i;
+  ftdi_rx_slot *slot;
+
+  for (i = 0; i < dev->rx_slot_count; i++) {
+    slot = &dev->rx_slots[i];
+    if (!slot->completed) {
+      slot->status = LIBUSB_TRANSFER_NO_DEVICE;
+      slot->len = 0;
+      slot->completed = 1;
+    }
+    slot->cmd_pending = false;
+  }
+
+  for (i = 0; i < FTDI_URB_TX_COUNT; i++) {
+    if (dev->urb_tx[i].busy) {
+      ftdi_urb_tx_done (&dev->urb_tx[i], -ENODEV);
+    }
+  }
+}
+
+/*
+ * With reap_lock held: reaps one URB, or waits for whichever
+ * thread is reaping to get one. Returns with reap_lock held, 0 or
+ * -1 as ftdi_urb_reap.
+ */
+static int
+ftdi_urb_reap_shared (ftdi_dev *dev)
+{
+  int err;
+
+  if (dev->reaping) {
+    pthread_cond_wait (&dev->reap_cond, &dev->reap_lock);
+    return 0;
+  }
+
+  dev->reaping = true;
+  pthread_mutex_unlock (&dev->reap_lock);
+  err = ftdi_urb_reap (dev, true);
+  pthread_mutex_lock (&dev->reap_lock);
+  dev->reaping = false;
+  pthread_cond_broadcast (&dev->reap_cond);
+  return err < 0 ? -1 : 0;
+}
+
+static int
+ftdi_urb_wait (ftdi_dev *dev,
+               int *completed)
+{
+  int err = 0;
+
+  pthread_mutex_lock (&dev->reap_lock);
+  while (!__atomic_load_n (completed, __ATOMIC_ACQUIRE) && err == 0) {
+    err = ftdi_urb_reap_shared (dev);
+  }
+  pthread_mutex_unlock (&dev->reap_lock);
+
+  return err;
+}
+
+/*
+ * Async write from the fixed URB pool; waits for a free entry
+ * if they're all in flight.
+ */
+static int
+ftdi_urb_write (ftdi_dev *dev,
+                void *data,
+                int size,
+                transport_write_cb cb,
+                void *opaque)
+{
+  int err;
+  unsigned i;
+  ftdi_urb_tx *tx;
+
+  pthread_mutex_lock (&dev->reap_lock);
+  for (;;) {
+    for (i = 0; i < FTDI_URB_TX_COUNT; i++) {
+      if (!dev->urb_tx[i].busy) {
+        break;
+      }
+    }
+    if (i < FTDI_URB_TX_COUNT) {
+      break;
+    }
+    if (ftdi_urb_reap_shared (dev) < 0) {
+      pthread_mutex_unlock (&dev->reap_lock);
+      return -1;
+    }
+  }
+
+  tx = &dev->urb_tx[i];
+  tx->busy = true;
+  __atomic_fetch_add (&dev->tx_pending, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&dev->reap_lock);
+
+  tx->dev = dev;
+  tx->cb = cb;
+  tx->opaque = opaque;
+  tx->submit_ns = STATS_NOW ();
+  ftdi_urb_fill (&tx->urb, FTDI_ENDPOINT_OUT, data, size, tx);
+
+  err = ftdi_urb_submit (dev, &tx->urb);
+  if (err != 0) {
+    fprintf (stderr, "USBDEVFS_SUBMITURB(out): %s\n", libusb_strerror (err));
+    pthread_mutex_lock (&dev->reap_lock);
+    tx->busy = false;
+    __atomic_fetch_sub (&dev->tx_pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&dev->reap_lock);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+ftdi_urb_bulk (ftdi_dev *dev,
+               void *data,
+               int size,
+               int *transferred)
+{
+  int n;
+  struct usbdevfs_bulktransfer bulk;
+
+  memset (&bulk, 0, sizeof (bulk));
+  bulk.ep = FTDI_ENDPOINT_OUT;
+  bulk.len = size;
+  bulk.timeout = 1000;
+  bulk.data = data;
+
+  n = ioctl (dev->sys_fd, USBDEVFS_BULK, &bulk);
+  if (n < 0) {
+    *transferred = 0;
+    if (errno == ENODEV) {
+      dev->lost = true;
+      return LIBUSB_ERROR_NO_DEVICE;
+    }
+    return errno == ETIMEDOUT ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+  }
+
+  *transferred = n;
+  return 0;
+}
+
+#endif
+
+static void LIBUSB_CALL
+ftdi_write_done (struct libusb_transfer *transfer)
+{
+  ftdi_write_req *req = transfer->user_data;
+  int status;
+
+  status = 0;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    fprintf (stderr, "TX transfer failed: %d\n", transfer->status);
+    status = -1;
+  } else if (transfer->actual_length != transfer->length) {
+    fprintf (stderr, "only %d/%d bytes transferred\n",
+             transfer->actual_length, transfer->length);
+    status = -1;
+  }
+
+  if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    req->dev->lost = true;
+  }
+  ftdi_tx_account (transfer->actual_length, req->submit_ns, status);
+
+  __atomic_fetch_sub (&req->dev->tx_pending, 1, __ATOMIC_RELEASE);
+  req->cb (req->opaque, status);
+  free (req);
+}
+
+/*
+ * Submits a bulk OUT transfer and returns immediately. cb runs
+ * from libusb event handling (e.g. inside ftdi_read or
+ * ftdi_wait) once the FT601 has taken the data. data must stay
+ * valid until then.
+ */
+static int
+ftdi_write_async (ftdi_dev *dev,
+                  void *data,
+                  int size,
+                  transport_write_cb cb,
+                  void *opaque)
+{
+  int err;
+  ftdi_write_req *req;
+
+  req = malloc (sizeof (*req));
+  if (req == NULL) {
+    return -1;
+  }
+
+  req->dev = dev;
+  req->cb = cb;
+  req->opaque = opaque;
+  req->submit_ns = STATS_NOW ();
+  req->transfer = libusb_alloc_transfer (0);
+  if (req->transfer == NULL) {
+    free (req);
+    return -1;
+  }
+
+  libusb_fill_bulk_transfer (req->transfer, dev->device_handle,
+                             FTDI_ENDPOINT_OUT, data, size,
+                             ftdi_write_done, req, 1000);
+  req->transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
+
+  /*
+   * Counted first: ftdi_write_done may run on another thread
+   * before libusb_submit_transfer returns.
+   */
+  __atomic_fetch_add (&dev->tx_pending, 1, __ATOMIC_RELAXED);
+  err = libusb_submit_transfer (req->transfer);
+  if (err != 0) {
+    __atomic_fetch_sub (&dev->tx_pending, 1, __ATOMIC_RELAXED);
+    fprintf (stderr, "libusb_submit_transfer(out): %s\n",
+             libusb_strerror (err));
+    if (err == LIBUSB_ERROR_NO_DEVICE) {
+      dev->lost = true;
+    }
+    libusb_free_transfer (req->transfer);
+    free (req);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+ftdi_write_locked (transport_t *t,
+                   void *data,
+                   int size,
+                   transport_write_cb cb,
+                   void *opaque)
+{
+  int err;
+  int transferred;
+  uint64_t start;
+  ftdi_dev *dev = t->priv;
+
+  if (dev->device_handle == NULL) {
+    /*
+     * Lost and not back yet.
+     */
+    return -1;
+  }
+
+  if (cb != NULL) {
+#ifdef FTDI_USBFS
+    if (dev->usbfs) {
+      return ftdi_urb_write (dev, data, size, cb, opaque);
+    }
+#endif
+    return ftdi_write_async (dev, data, size, cb, opaque);
+  }
+
+  start = STATS_NOW ();
+  transferred = 0;
+#ifdef FTDI_USBFS
+  if (dev->usbfs) {
+    err = ftdi_urb_bulk (dev, data, size, &transferred);
+  } else
+#endif
+  err = libusb_bulk_transfer (dev->device_handle, FTDI_ENDPOINT_OUT,
+                              data, size, &transferred, 1000);
+  if (err < 0) {
+    fprintf (stderr, "libusb_bulk_transfer: %s\n",
+             libusb_strerror (err));
+    ftdi_tx_account (0, start, -1);
+    return -1;
+  }
+
+  if (transferred != size) {
+    fprintf (stderr, "only %d/%d bytes transferred\n",
+             transferred, size);
+    ftdi_tx_account (transferred, start, -1);
+    return -1;
+  }
+
+  ftdi_tx_account (transferred, start, 0);
+  return 0;
+}
+
+static int
+ftdi_write (transport_t *t,
+            void *data,
+            int size,
+            transport_write_cb cb,
+            void *opaque)
+{
+  int err;
+  ftdi_dev *dev = t->priv;
+
+  pthread_mutex_lock (&dev->tx_lock);
+  err = ftdi_write_locked (t, data, size, cb, opaque);
+  pthread_mutex_unlock (&dev->tx_lock);
+  return err;
+}
+
+/*
+ * Runs libusb event handling (or reaps URBs) until *completed
+ * is set.
+ */
+static int
+ftdi_wait (transport_t *t,
+           int *completed)
+{
+  int err;
+  ftdi_dev *dev = t->priv;
+
+#ifdef FTDI_USBFS
+  if (dev->usbfs) {
+    return ftdi_urb_wait (dev, completed);
+  }
+#endif
+
+  while (!*completed) {
+    err = libusb_handle_events_completed (dev->usb_ctx, completed);
+    if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+      fprintf (stderr, "libusb_handle_events_completed: %s\n",
+               libusb_strerror (err));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void LIBUSB_CALL
+ftdi_rx_cmd_done (struct libusb_transfer *transfer)
+{
+  ftdi_rx_slot *slot = transfer->user_data;
+
+  slot->cmd_pending = false;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    /*
+     * The FT601 won't send anything without the session
+     * command, so don't leave the IN transfer hanging.
+     */
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+      slot->dev->lost = true;
+    } else {
+      fprintf (stderr, "RX session command failed: %d\n",
+               transfer->status);
+    }
+    libusb_cancel_transfer (slot->in_transfer);
+  }
+}
+
+static void LIBUSB_CALL
+ftdi_rx_in_done (struct libusb_transfer *transfer)
+{
+  ftdi_rx_slot *slot = transfer->user_data;
+
+  slot->done_ns = time_now_ns ();
+  slot->status = transfer->status;
+  slot->len = transfer->actual_length;
+  slot->completed = 1;
+}
+
+static int
+ftdi_rx_submit_one (ftdi_rx_slot *slot,
+                    bool in)
+{
+#ifdef FTDI_USBFS
+  if (slot->dev->usbfs) {
+    return ftdi_urb_submit (slot->dev, in ? &slot->in_urb : &slot->cmd_urb);
+  }
+#endif
+
+  return libusb_submit_transfer (in ? slot->in_transfer : slot->cmd_transfer);
+}
+
+static void
+ftdi_rx_cancel_one (ftdi_rx_slot *slot,
+                    bool in)
+{
+#ifdef FTDI_USBFS
+  if (slot->dev->usbfs) {
+    ioctl (slot->dev->sys_fd, USBDEVFS_DISCARDURB,
+           in ? &slot->in_urb : &slot->cmd_urb);
+    return;
+  }
+#endif
+
+  libusb_cancel_transfer (in ? slot->in_transfer : slot->cmd_transfer);
+}
+
+static int
+ftdi_rx_submit (ftdi_rx_slot *slot)
+{
+  int err;
+
+  memset (&slot->ctrl_req, 0, sizeof (slot->ctrl_req));
+  slot->ctrl_req.idx++;
+  slot->ctrl_req.pipe = FTDI_ENDPOINT_IN;
+  slot->ctrl_req.cmd = 1;
+  slot->ctrl_req.len = slot->dev->rx_slot_size;
+  slot->completed = 0;
+  slot->failed = false;
+  slot->submit_ns = STATS_NOW ();
+
+  err = ftdi_rx_submit_one (slot, false);
+  if (err != 0) {
+    goto err;
+  }
+  slot->cmd_pending = true;
+
+  err = ftdi_rx_submit_one (slot, true);
+  if (err != 0) {
+    goto err;
+  }
+
+  return 0;
+
+ err:
+  if (err == LIBUSB_ERROR_NO_DEVICE) {
+    slot->dev->lost = true;
+  } else {
+    fprintf (stderr, "libusb_submit_transfer(%s): %s\n",
+             slot->cmd_pending ? "in" : "cmd", libusb_strerror (err));
+  }
+  slot->failed = true;
+  slot->status = LIBUSB_TRANSFER_ERROR;
+  slot->completed = 1;
+  return -1;
+}
+
+/*
+ * Cancels every RX transfer in flight and waits for them, and
+ * for any writes, to finish.
+ */
+static void
+ftdi_rx_cancel (ftdi_dev *dev)
+{
+  unsigned i;
+  int busy;
+#ifdef FTDI_USBFS
+  int err;
+#endif
+  ftdi_rx_slot *slot;
+
+  for (i = 0; i < dev->rx_slot_count; i++) {
+    slot = &dev->rx_slots[i];
+    if (!slot->completed) {
+      ftdi_rx_cancel_one (slot, true);
+    }
+    if (slot->cmd_pending) {
+      ftdi_rx_cancel_one (slot, false);
+    }
+  }
+#ifdef FTDI_USBFS
+  for (i = 0; dev->usbfs && i < FTDI_URB_TX_COUNT; i++) {
+    if (dev->urb_tx[i].busy) {
+      ioctl (dev->sys_fd, USBDEVFS_DISCARDURB, &dev->urb_tx[i].urb);
+    }
+  }
+#endif
+
+  do {
+    busy = __atomic_load_n (&dev->tx_pending, __ATOMIC_ACQUIRE) != 0;
+    for (i = 0; i < dev->rx_slot_count; i++) {
+      slot = &dev->rx_slots[i];
+      if (!slot->completed || slot->cmd_pending) {
+        busy = 1;
+      }
+    }
+
+    if (!busy) {
+      break;
+    }
+#ifdef FTDI_USBFS
+    if (dev->usbfs) {
+      pthread_mutex_lock (&dev->reap_lock);
+      err = ftdi_urb_reap_shared (dev);
+      pthread_mutex_unlock (&dev->reap_lock);
+      if (err < 0) {
+        ftdi_urb_abandon (dev);
+        break;
+      }
+      continue;
+    }
+#endif
+    if (libusb_handle_events (dev->usb_ctx) != 0) {
+      break;
+    }
+  } while (busy);
+}
+
+static void
+ftdi_rx_stop (ftdi_dev *dev)
+{
+  unsigned i;
+  ftdi_rx_slot *slot;
+
+  if (dev->rx_slots == NULL) {
+    return;
+  }
+
+  ftdi_rx_cancel (dev);
+
+  for (i = 0; i < dev->rx_slot_count; i++) {
+    slot = &dev->rx_slots[i];
+#ifdef FTDI_USBFS
+    if (slot->mapped) {
+      munmap (slot->buf, dev->rx_slot_size);
+      slot->buf = NULL;
+    }
+#endif
+    free (slot->buf);
+    if (slot->in_transfer != NULL) {
+      libusb_free_transfer (slot->in_transfer);
+    }
+    if (slot->cmd_transfer != NULL) {
+      libusb_free_transfer (slot->cmd_transfer);
+    }
+  }
+
+  free (dev->rx_slots);
+  dev->rx_slots = NULL;
+  dev->rx_slot_count = 0;
+}
+
+static int
+ftdi_rx_start (ftdi_dev *dev,
+               unsigned count,
+               unsigned size)
+{
+  unsigned i;
+  uint8_t *buf;
+  ftdi_rx_slot *slot;
+
+  assert (dev->rx_slots == NULL);
+  assert (count > 0);
+  assert (size > 0 && (size % sizeof (uint32_t)) == 0);
+
+  dev->rx_slots = calloc (count, sizeof (*dev->rx_slots));
+  if (dev->rx_slots == NULL) {
+    return -1;
+  }
+
+  dev->rx_slot_count = count;
+  dev->rx_slot_size = size;
+  dev->rx_head = 0;
+  dev->rx_tail = 0;
+  dev->rx_out = 0;
+
+  for (i = 0; i < count; i++) {
+    slot = &dev->rx_slots[i];
+    slot->dev = dev;
+    slot->completed = 1;
+
+    slot->cmd_transfer = libusb_alloc_transfer (0);
+    slot->in_transfer = libusb_alloc_transfer (0);
+    buf = NULL;
+#ifdef FTDI_USBFS
+    if (dev->usbfs && (dev->caps & USBDEVFS_CAP_MMAP) != 0) {
+      buf = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  dev->sys_fd, 0);
+      if (buf == MAP_FAILED) {
+        buf = NULL;
+      } else {
+        slot->mapped = true;
+      }
+    }
+#endif
+    if (buf == NULL) {
+      buf = malloc (size);
+    }
+    slot->buf = buf;
+    if (slot->cmd_transfer == NULL ||
+        slot->in_transfer == NULL ||
+        buf == NULL) {
+      goto err;
+    }
+
+    libusb_fill_bulk_transfer (slot->cmd_transfer, dev->device_handle,
+                               FTDI_ENDPOINT_SESSION_OUT,
+                               (void *) &slot->ctrl_req,
+                               sizeof (slot->ctrl_req),
+                               ftdi_rx_cmd_done, slot, 1000);
+    libusb_fill_bulk_transfer (slot->in_transfer, dev->device_handle,
+                               FTDI_ENDPOINT_IN, buf, size,
+                               ftdi_rx_in_done, slot, 0);
+#ifdef FTDI_USBFS
+    ftdi_urb_fill (&slot->cmd_urb, FTDI_ENDPOINT_SESSION_OUT,
+                   &slot->ctrl_req, sizeof (slot->ctrl_req), slot);
+    ftdi_urb_fill (&slot->in_urb, FTDI_ENDPOINT_IN, buf, size, slot);
+#endif
+  }
+#ifdef FTDI_USBFS
+  dev->map_fd = dev->sys_fd;
+#endif
+
+  for (i = 0; i < count; i++) {
+    if (ftdi_rx_submit (&dev->rx_slots[i]) != 0) {
+      goto err;
+    }
+  }
+
+  return 0;
+
+ err:
+  ftdi_rx_stop (dev);
+  return -1;
+}
+
+/*
+ * Resubmits released slots. A slot released out of order waits
+ * for the ones before it, so data keeps arriving in ring order.
+ */
+static int
+ftdi_rx_refill (ftdi_dev *dev)
+{
+  int err;
+  ftdi_rx_slot *slot;
+
+  while (dev->rx_out > 0) {
+    slot = &dev->rx_slots[dev->rx_tail];
+    if (slot->held) {
+      break;
+    }
+
+    dev->rx_tail = (dev->rx_tail + 1) % dev->rx_slot_count;
+    dev->rx_out--;
+    err = ftdi_rx_submit (slot);
+    if (err != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Returns the next completed RX buffer. The buffer stays valid
+ * until it is passed to ftdi_release.
+ */
+static int
+ftdi_read (transport_t *t,
+           void **data,
+           int *transferred)
+{
+  int err;
+  int len;
+  uint64_t start;
+  struct timeval tv;
+  ftdi_rx_slot *slot;
+  ftdi_dev *dev = t->priv;
+
+  if (dev->lost) {
+    if (ftdi_reconnect (t) == 0) {
+      t->rx_ns = time_now_ns ();
+      return TRANSPORT_RECONNECTED;
+    }
+    if (!t->nonblock) {
+      return -1;
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = FTDI_RECONNECT_WAIT_MS * 1000;
+    evtimer_add (dev->retry_ev, &tv);
+    return TRANSPORT_AGAIN;
+  }
+
+  if (dev->rx_out == dev->rx_slot_count) {
+    fprintf (stderr, "All %u RX buffers held\n", dev->rx_slot_count);
+    return -1;
+  }
+
+  slot = &dev->rx_slots[dev->rx_head];
+  if (t->nonblock && !slot->completed) {
+    /*
+     * The loop handles libusb events and calls back once
+     * there's more.
+     */
+    return TRANSPORT_AGAIN;
+  }
+  start = STATS_NOW ();
+  err = ftdi_wait (t, &slot->completed);
+  if (err != 0) {
+    return -1;
+  }
+  STATS_HIST (usb_rx_wait_us, (STATS_NOW () - start) / 1000);
+
+  dev->rx_head = (dev->rx_head + 1) % dev->rx_slot_count;
+  dev->rx_out++;
+
+  if (slot->failed || slot->status != LIBUSB_TRANSFER_COMPLETED) {
+    STATS_INC (usb_rx_errors, 1);
+    *transferred = 0;
+    if (slot->status == LIBUSB_TRANSFER_NO_DEVICE ||
+        ++dev->rx_errors == FTDI_MAX_RX_ERRORS) {
+      dev->lost = true;
+    }
+    if (dev->lost) {
+      return -1;
+    }
+
+    fprintf (stderr, "RX transfer failed: %d\n", slot->status);
+    ftdi_rx_refill (dev);
+    return -1;
+  }
+  dev->rx_errors = 0;
+
+  len = slot->len;
+  STATS_INC (usb_rx_transfers, 1);
+  STATS_INC (usb_rx_bytes, len);
+  STATS_INC (usb_rx_short, len < (int) dev->rx_slot_size);
+  STATS_HIST (usb_rx_size, len);
+  STATS_HIST (usb_rx_latency_us, (slot->done_ns - slot->submit_ns) / 1000);
+
+  slot->held = true;
+  *data = slot->buf;
+  *transferred = len;
+  t->rx_ns = slot->done_ns;
+  return 0;
+}
+
+static void
+ftdi_release (transport_t *t,
+              void *data)
+{
+  unsigned i;
+  ftdi_dev *dev = t->priv;
+
+  for (i = 0; i < dev->rx_slot_count; i++) {
+    if (dev->rx_slots[i].buf == data) {
+      dev->rx_slots[i].held = false;
+      ftdi_rx_refill (dev);
+      return;
+    }
+  }
 
-int
-ftdi_set_config (ft60x_config *config)
-{
-  return libusb_control_transfer (device_handle,
-                                  LIBUSB_RECIPIENT_DEVICE |
-                                  LIBUSB_REQUEST_TYPE_VENDOR |
-                                  LIBUSB_ENDPOINT_OUT,
-                                  0xCF,
-                                  0,
-                                  0,
-                                  (void *) config,
-                                  sizeof (*config),
-                                  1000
-                                  );
+  fprintf (stderr, "Releasing unknown RX buffer %p\n", data);
 }
 
-int
-ftdi_get_config (ft60x_config *config)
+static void
+ftdi_ready (evutil_socket_t fd,
+            short what,
+            void *opaque)
 {
-  return libusb_control_transfer(device_handle,
-                                 LIBUSB_RECIPIENT_DEVICE |
-                                 LIBUSB_REQUEST_TYPE_VENDOR |
-                                 LIBUSB_ENDPOINT_IN,
-                                 0xCF,
-                                 1,
-                                 0,
-                                 (void *) config,
-                                 sizeof (*config),
-                                 1000
-                                 );
+  struct timeval tv;
+  ftdi_dev *dev = opaque;
+
+  (void) fd;
+  (void) what;
+
+#ifdef FTDI_USBFS
+  if (dev->usbfs) {
+    while (ftdi_urb_reap (dev, false) == 0) {
+    }
+    dev->ready_cb (dev->ready_opaque);
+    return;
+  }
+#endif
+
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  libusb_handle_events_timeout_completed (dev->usb_ctx, &tv, NULL);
+
+  if (dev->timeout_ev != NULL) {
+    if (libusb_get_next_timeout (dev->usb_ctx, &tv) == 1) {
+      evtimer_add (dev->timeout_ev, &tv);
+    } else {
+      evtimer_del (dev->timeout_ev);
+    }
+  }
+
+  dev->ready_cb (dev->ready_opaque);
 }
 
-int
-ftdi_send_cmd_read (int size)
+static void LIBUSB_CALL
+ftdi_pollfd_added (int fd,
+                   short events,
+                   void *opaque)
 {
-  int transferred;
-  ft60x_ctrl_req ctrl_req;
+  unsigned i;
+  short what;
+  ftdi_dev *dev = opaque;
 
-  memset (&ctrl_req, 0, sizeof (ctrl_req));
-  ctrl_req.idx++;
-  ctrl_req.pipe = FTDI_ENDPOINT_IN;
-  ctrl_req.cmd = 1;
-  ctrl_req.len = size;
-  transferred = 0;
+  for (i = 0; i < FTDI_MAX_POLLFDS; i++) {
+    if (dev->poll_evs[i] == NULL) {
+      break;
+    }
+  }
+  if (i == FTDI_MAX_POLLFDS) {
+    fprintf (stderr, "Too many libusb fds to watch\n");
+    return;
+  }
+
+  what = EV_PERSIST;
+  if ((events & POLLIN) != 0) {
+    what |= EV_READ;
+  }
+  if ((events & POLLOUT) != 0) {
+    what |= EV_WRITE;
+  }
 
-  return libusb_bulk_transfer (device_handle, FTDI_ENDPOINT_SESSION_OUT,
-                               (void *) &ctrl_req, sizeof (ctrl_req),
-                               &transferred, 1000);
+  dev->poll_evs[i] = event_new (dev->ev_base, fd, what, ftdi_ready, dev);
+  if (dev->poll_evs[i] == NULL || event_add (dev->poll_evs[i], NULL) != 0) {
+    fprintf (stderr, "Couldn't watch libusb fd %d\n", fd);
+  }
 }
 
-int
-ftdi_write (void *data, int size, int *transferred)
+static void LIBUSB_CALL
+ftdi_pollfd_removed (int fd,
+                     void *opaque)
 {
-  int err;
+  unsigned i;
+  ftdi_dev *dev = opaque;
 
-  *transferred = 0;
-  err = libusb_bulk_transfer (device_handle, FTDI_ENDPOINT_OUT,
-                              data, size, transferred, 1000);
-  if (err < 0) {
-    fprintf (stderr, "libusb_bulk_transfer: %s\n",
-             libusb_strerror (err));
-    return -1;
+  for (i = 0; i < FTDI_MAX_POLLFDS; i++) {
+    if (dev->poll_evs[i] != NULL &&
+        event_get_fd (dev->poll_evs[i]) == fd) {
+      event_free (dev->poll_evs[i]);
+      dev->poll_evs[i] = NULL;
+    }
+  }
+}
+
+/*
+ * Puts libusb's fds (and those of devices opened later, e.g. on
+ * reconnect) into the loop, so RX and TX completions get handled
+ * there rather than inside read.
+ */
+static int
+ftdi_watch (transport_t *t,
+            struct event_base *base,
+            transport_ready_cb cb,
+            void *opaque)
+{
+  unsigned i;
+  const struct libusb_pollfd **pollfds;
+  ftdi_dev *dev = t->priv;
 
-    if (*transferred != size) {
-      fprintf (stderr, "only %d/%d bytes transferred\n",
-               *transferred, size);
+  dev->ev_base = base;
+  dev->ready_cb = cb;
+  dev->ready_opaque = opaque;
+
+  if (ftdi_usbfs (dev)) {
+    /*
+     * Completed URBs make the fd writable. libusb's own fds
+     * stay out of the loop, as handling its events would reap
+     * our URBs.
+     */
+    ftdi_pollfd_added (dev->sys_fd, POLLOUT, dev);
+  } else {
+    pollfds = libusb_get_pollfds (dev->usb_ctx);
+    if (pollfds == NULL) {
+      fprintf (stderr, "libusb can't hand out its fds here\n");
+      dev->ev_base = NULL;
       return -1;
     }
+
+    for (i = 0; pollfds[i] != NULL; i++) {
+      ftdi_pollfd_added (pollfds[i]->fd, pollfds[i]->events, dev);
+    }
+    libusb_free_pollfds (pollfds);
+    libusb_set_pollfd_notifiers (dev->usb_ctx, ftdi_pollfd_added,
+                                 ftdi_pollfd_removed, dev);
+
+    if (!libusb_pollfds_handle_timeouts (dev->usb_ctx)) {
+      dev->timeout_ev = evtimer_new (base, ftdi_ready, dev);
+    }
+  }
+
+  /*
+   * Transfers may have completed already, while the FPGA was
+   * being set up.
+   */
+  dev->retry_ev = evtimer_new (base, ftdi_ready, dev);
+  if (dev->retry_ev == NULL) {
+    fprintf (stderr, "Couldn't create FT601 events\n");
+    return -1;
+  }
+  event_active (dev->retry_ev, EV_TIMEOUT, 0);
+  return 0;
+}
+
+static void
+ftdi_unwatch (ftdi_dev *dev)
+{
+  unsigned i;
+
+  if (dev->ev_base == NULL) {
+    return;
+  }
+
+  libusb_set_pollfd_notifiers (dev->usb_ctx, NULL, NULL, NULL);
+  for (i = 0; i < FTDI_MAX_POLLFDS; i++) {
+    if (dev->poll_evs[i] != NULL) {
+      event_free (dev->poll_evs[i]);
+    }
+  }
+  if (dev->timeout_ev != NULL) {
+    event_free (dev->timeout_ev);
+  }
+  if (dev->retry_ev != NULL) {
+    event_free (dev->retry_ev);
+  }
+  dev->ev_base = NULL;
+}
+
+static void
+ftdi_close (transport_t *t)
+{
+  ftdi_dev *dev = t->priv;
+
+  ftdi_unwatch (dev);
+  ftdi_rx_stop (dev);
+  if (dev->device_handle != NULL) {
+    libusb_release_interface (dev->device_handle, FTDI_DATA_INTERFACE);
+    libusb_release_interface (dev->device_handle,
+                              FTDI_COMMUNICATION_INTERFACE);
+    libusb_close (dev->device_handle);
+  }
+  if (dev->sys_fd >= 0) {
+    close (dev->sys_fd);
+  }
+#ifdef FTDI_USBFS
+  if (dev->map_fd >= 0 && dev->map_fd != dev->sys_fd) {
+    close (dev->map_fd);
+  }
+  pthread_mutex_destroy (&dev->reap_lock);
+  pthread_cond_destroy (&dev->reap_cond);
+#endif
+  if (dev->hotplug) {
+    libusb_hotplug_deregister_callback (dev->usb_ctx, dev->hotplug_handle);
+  }
+  if (dev->usb_ctx != NULL) {
+    libusb_exit (dev->usb_ctx);
+  }
+
+  pthread_mutex_destroy (&dev->tx_lock);
+  free (dev);
+  t->priv = NULL;
+}
+
+/*
+ * Which FT601 to use: the index-th one attached, the one at
+ * bus:address, or the one with the given serial number. When
+ * reconnecting, the one at the same bus and port path (its
+ * address changes each time it enumerates).
+ */
+typedef struct {
+  unsigned long index;
+  bool by_location;
+  unsigned bus;
+  unsigned address;
+  const char *serial;
+  bool by_port;
+  const uint8_t *ports;
+  int port_count;
+} ftdi_spec;
+
+static int
+ftdi_parse_spec (const char *spec,
+                 ftdi_spec *match)
+{
+  char *end;
+
+  memset (match, 0, sizeof (*match));
+  if (strncmp (spec, "serial:", 7) == 0) {
+    match->serial = spec + 7;
+    return 0;
+  }
+
+  match->index = strtoul (spec, &end, 10);
+  if (*end == ':') {
+    match->by_location = true;
+    match->bus = match->index;
+    match->address = strtoul (end + 1, &end, 10);
+  }
+  if (end == spec || *end != '\0') {
+    fprintf (stderr, "Bad FT601 device %s (index, bus:address "
+             "or serial:number)\n", spec);
+    return -1;
   }
 
   return 0;
 }
 
-int
-ftdi_read (void *data, int size, int *transferred)
+#ifdef HAVE_LIBUSB_WRAP_SYS_DEVICE
+/*
+ * Opens the usbfs node directly, so that finding the device
+ * costs neither a device list nor any descriptor reads.
+ */
+static int
+ftdi_open_location (ftdi_dev *dev,
+                    unsigned bus,
+                    unsigned address)
 {
   int err;
+  int fd;
+  char path[32];
+  struct libusb_device_descriptor desc;
+
+  snprintf (path, sizeof (path), "/dev/bus/usb/%03u/%03u", bus, address);
+  fd = open (path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
 
-  err = ftdi_send_cmd_read (size);
+  err = libusb_wrap_sys_device (dev->usb_ctx, (intptr_t) fd, &dev->device_handle);
   if (err != 0) {
-    fprintf (stderr, "ftdi_send_cmd_read: %s\n", libusb_strerror(err));
+    fprintf (stderr, "libusb_wrap_sys_device: %s\n", libusb_strerror (err));
+    dev->device_handle = NULL;
+    close (fd);
     return -1;
   }
+  dev->sys_fd = fd;
 
-  *transferred = 0;
-  err = libusb_bulk_transfer(device_handle, FTDI_ENDPOINT_IN, data, size, transferred, 0);
-  if (err < 0) {
-    fprintf (stderr, "libusb_bulk_transfer: %s\n", libusb_strerror(err));
+  err = libusb_get_device_descriptor (libusb_get_device (dev->device_handle),
+                                      &desc);
+  if (err != 0 ||
+      desc.idVendor != FTDI_VENDOR_ID ||
+      desc.idProduct != FTDI_FT60X_PRODUCT_ID) {
+    fprintf (stderr, "%s is not an FT601\n", path);
     return -1;
   }
 
   return 0;
 }
+#endif
+
+static bool
+ftdi_match_serial (libusb_device *device,
+                   const struct libusb_device_descriptor *desc,
+                   const char *serial,
+                   libusb_device_handle **handle)
+{
+  int err;
+  unsigned char buf[64];
+
+  err = libusb_open (device, handle);
+  if (err != 0) {
+    fprintf (stderr, "libusb_open: %s\n", libusb_strerror (err));
+    *handle = NULL;
+    return false;
+  }
+
+  err = libusb_get_string_descriptor_ascii (*handle, desc->iSerialNumber,
+                                            buf, sizeof (buf));
+  if (err > 0 && strcmp ((char *) buf, serial) == 0) {
+    return true;
+  }
+
+  libusb_close (*handle);
+  *handle = NULL;
+  return false;
+}
 
-int
-ftdi_get (unsigned long index)
+static int
+ftdi_find (ftdi_dev *dev,
+           ftdi_spec *match)
 {
   libusb_device *device;
   libusb_device **device_list;
+  libusb_device_handle *handle;
   struct libusb_device_descriptor desc;
   ssize_t device_count;
-  ft60x_config chip_config;
+  uint8_t ports[7];
+  unsigned long index;
   unsigned i;
   bool found;
   int err;
 
-  err = libusb_init (&usb_ctx);
-  if (err != 0) {
-    fprintf (stderr, "libusb_init: %s\n", libusb_strerror (err));
+#ifdef HAVE_LIBUSB_WRAP_SYS_DEVICE
+  if (match->by_location &&
+      ftdi_open_location (dev, match->bus, match->address) == 0) {
+    return 0;
+  }
+  if (dev->device_handle != NULL) {
     return -1;
   }
+#endif
 
-  device_count = libusb_get_device_list (usb_ctx, &device_list);
+  device_count = libusb_get_device_list (dev->usb_ctx, &device_list);
   if (device_count < 0) {
     fprintf (stderr, "device_count < 0\n");
     return -1;
   }
 
   found = false;
+  handle = NULL;
+  index = match->index;
   for (i = 0; i < device_count; i++) {
     device = device_list[i];
 
+    if (match->by_location &&
+        (libusb_get_bus_number (device) != match->bus ||
+         libusb_get_device_address (device) != match->address)) {
+      continue;
+    }
+
+    if (match->by_port &&
+        (libusb_get_bus_number (device) != match->bus ||
+         libusb_get_port_numbers (device, ports, sizeof (ports)) !=
+         match->port_count ||
+         memcmp (ports, match->ports, match->port_count) != 0)) {
+      continue;
+    }
+
     err = libusb_get_device_descriptor (device, &desc);
     if (err != 0) {
       fprintf (stderr, "libusb_get_device_descriptor[%d]: %s\n", i, libusb_strerror (err));
@@ -142,7 +1599,11 @@ ftdi_get (unsigned long index)
 
     if (desc.idVendor == FTDI_VENDOR_ID &&
         desc.idProduct == FTDI_FT60X_PRODUCT_ID) {
-      if (index) {
+      if (match->serial != NULL) {
+        if (!ftdi_match_serial (device, &desc, match->serial, &handle)) {
+          continue;
+        }
+      } else if (!match->by_location && index) {
         index--;
         continue;
       }
@@ -158,16 +1619,38 @@ ftdi_get (unsigned long index)
   }
 
   if (!found) {
+    libusb_free_device_list (device_list, 1);
     return -1;
   }
 
-  err = libusb_open (device, &device_handle);
+  err = 0;
+  if (handle == NULL) {
+    err = libusb_open (device, &handle);
+  }
+  libusb_free_device_list (device_list, 1);
   if (err != 0) {
     fprintf (stderr, "libusb_open: %s\n", libusb_strerror (err));
     return -1;
   }
 
-  err = libusb_kernel_driver_active (device_handle, FTDI_COMMUNICATION_INTERFACE);
+  dev->device_handle = handle;
+  return 0;
+}
+
+/*
+ * Claims the interfaces of the FT601 just opened and makes sure
+ * its chip config is what the gateware expects.
+ */
+static int
+ftdi_claim (ftdi_dev *dev,
+            bool trust_chip_config)
+{
+  ft60x_config chip_config;
+  uint64_t t;
+  int err;
+
+  t = time_now_ns ();
+  err = libusb_kernel_driver_active (dev->device_handle, FTDI_COMMUNICATION_INTERFACE);
   if (err < 0) {
     fprintf (stderr, "libusb_kernel_driver_active(FTDI_COMMUNICATION_INTERFACE): %s\n",
              libusb_strerror (err));
@@ -178,14 +1661,14 @@ ftdi_get (unsigned long index)
     return -1;
   }
 
-  err = libusb_claim_interface (device_handle, FTDI_COMMUNICATION_INTERFACE);
+  err = libusb_claim_interface (dev->device_handle, FTDI_COMMUNICATION_INTERFACE);
   if (err != 0) {
     fprintf (stderr, "libusb_claim_interface(FTDI_COMMUNICATION_INTERFACE): %s\n",
              libusb_strerror(err));
     return -1;
   }
 
-  err = libusb_kernel_driver_active (device_handle, FTDI_DATA_INTERFACE);
+  err = libusb_kernel_driver_active (dev->device_handle, FTDI_DATA_INTERFACE);
   if (err < 0) {
     fprintf (stderr, "libusb_kernel_driver_active(FTDI_DATA_INTERFACE): %s\n",
              libusb_strerror (err));
@@ -196,14 +1679,24 @@ ftdi_get (unsigned long index)
     return -1;
   }
 
-  err = libusb_claim_interface (device_handle, FTDI_DATA_INTERFACE);
+  err = libusb_claim_interface (dev->device_handle, FTDI_DATA_INTERFACE);
   if (err != 0) {
     fprintf (stderr, "libusb_claim_interface(FTDI_DATA_INTERFACE): %s\n",
              libusb_strerror(err));
     return -1;
   }
+  dev->startup_ns[FTDI_STARTUP_CLAIM] = time_now_ns () - t;
 
-  err = ftdi_get_config (&chip_config) ;
+  if (trust_chip_config) {
+    /*
+     * The FT601 keeps its config across power cycles, so once
+     * fixed it's still right.
+     */
+    return 0;
+  }
+
+  t = time_now_ns ();
+  err = ftdi_get_config (dev, &chip_config) ;
   if (err < 0) {
     fprintf (stderr, "ftdi_get_config: %s\n", libusb_strerror (err));
     return -1;
@@ -221,7 +1714,7 @@ ftdi_get (unsigned long index)
     chip_config.channel_config = CONFIGURATION_CHANNEL_CONFIG_1;
     chip_config.optional_feature_support = CONFIGURATION_OPTIONAL_FEATURE_DISABLE_ALL;
 
-    err = ftdi_set_config (&chip_config);
+    err = ftdi_set_config (dev, &chip_config);
     if (err < 0) {
       fprintf (stderr, "ftdi_set_config: %s\n", libusb_strerror (err));
       return -1;
@@ -231,6 +1724,351 @@ ftdi_get (unsigned long index)
       return -1;
     }
   }
+  dev->startup_ns[FTDI_STARTUP_CHIP_CONFIG] = time_now_ns () - t;
+
+  return 0;
+}
+
+#ifdef FTDI_USBFS
+/*
+ * Makes sure libusb works on a usbfs fd of our own (reopening
+ * the device through it if it was found some other way) and
+ * checks what that fd can do.
+ */
+static int
+ftdi_urb_open (ftdi_dev *dev)
+{
+  unsigned bus;
+  unsigned address;
+  libusb_device *device;
+
+  if (dev->sys_fd < 0) {
+    device = libusb_get_device (dev->device_handle);
+    bus = libusb_get_bus_number (device);
+    address = libusb_get_device_address (device);
+    libusb_close (dev->device_handle);
+    dev->device_handle = NULL;
+    if (ftdi_open_location (dev, bus, address) != 0) {
+      fprintf (stderr, "Couldn't open the FT601 through usbfs\n");
+      return -1;
+    }
+  }
+
+  if (ioctl (dev->sys_fd, USBDEVFS_GET_CAPABILITIES, &dev->caps) < 0) {
+    dev->caps = 0;
+  }
+
+  return 0;
+}
+#endif
+
+static int LIBUSB_CALL
+ftdi_hotplug_arrived (libusb_context *ctx,
+                      libusb_device *device,
+                      libusb_hotplug_event event,
+                      void *user_data)
+{
+  ftdi_dev *dev = user_data;
+
+  (void) ctx;
+  (void) device;
+  (void) event;
+
+  dev->arrived = 1;
+  return 0;
+}
+
+static int
+ftdi_get (ftdi_dev *dev,
+          const char *spec,
+          bool trust_chip_config)
+{
+  ftdi_spec match;
+  libusb_device *device;
+  uint64_t t;
+  int err;
+
+  t = time_now_ns ();
+  if (ftdi_parse_spec (spec, &match) != 0) {
+    return -1;
+  }
+
+  err = libusb_init (&dev->usb_ctx);
+  if (err != 0) {
+    fprintf (stderr, "libusb_init: %s\n", libusb_strerror (err));
+    dev->usb_ctx = NULL;
+    return -1;
+  }
+  dev->startup_ns[FTDI_STARTUP_LIBUSB] = time_now_ns () - t;
+
+  t = time_now_ns ();
+  if (ftdi_find (dev, &match) != 0) {
+    return -1;
+  }
+  dev->startup_ns[FTDI_STARTUP_OPEN] = time_now_ns () - t;
+
+  device = libusb_get_device (dev->device_handle);
+  dev->bus = libusb_get_bus_number (device);
+  dev->port_count = libusb_get_port_numbers (device, dev->ports,
+                                             sizeof (dev->ports));
+#ifdef FTDI_USBFS
+  if (dev->usbfs && ftdi_urb_open (dev) != 0) {
+    return -1;
+  }
+#endif
+
+  /*
+   * Only to wake up a reconnect as soon as it's back; without
+   * hotplug support, reconnecting polls.
+   */
+  if (libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG) &&
+      libusb_hotplug_register_callback (dev->usb_ctx,
+                                        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                        LIBUSB_HOTPLUG_NO_FLAGS,
+                                        FTDI_VENDOR_ID,
+                                        FTDI_FT60X_PRODUCT_ID,
+                                        LIBUSB_HOTPLUG_MATCH_ANY,
+                                        ftdi_hotplug_arrived, dev,
+                                        &dev->hotplug_handle) == 0) {
+    dev->hotplug = true;
+  }
+
+  return ftdi_claim (dev, trust_chip_config);
+}
+
+/*
+ * Closes the handle and the usbfs fd under it, if any, so that a
+ * failed reconnect leaves nothing stale for the next one.
+ */
+static void
+ftdi_drop_handle (ftdi_dev *dev)
+{
+  if (dev->device_handle != NULL) {
+    libusb_close (dev->device_handle);
+    dev->device_handle = NULL;
+  }
+#ifdef FTDI_USBFS
+  if (dev->sys_fd == dev->map_fd) {
+    /*
+     * The RX buffers are mapped from it, so it stays open.
+     * URBs on the new fd can still use them, only the kernel
+     * copies rather than the controller DMAing into them.
+     */
+    dev->sys_fd = -1;
+  }
+#endif
+  if (dev->sys_fd >= 0) {
+    close (dev->sys_fd);
+    dev->sys_fd = -1;
+  }
+}
+
+/*
+ * Gives up on the handle of an FT601 that dropped off the bus
+ * (target reboot, USB reset), finds it again at the same port
+ * and restarts RX on the new one. Waits up to
+ * FTDI_RECONNECT_WAIT_MS for it to show up. RX slots still held
+ * by the consumer keep their buffers and are resubmitted once
+ * released.
+ */
+static int
+ftdi_reopen (transport_t *t)
+{
+  int err;
+  unsigned i;
+  uint64_t start;
+  ftdi_spec match;
+  ftdi_rx_slot *slot;
+  struct timeval tv;
+  ftdi_dev *dev = t->priv;
+
+  if (dev->device_handle != NULL) {
+    fprintf (stderr, "FT601 lost, waiting for it to come back\n");
+    ftdi_rx_cancel (dev);
+    if (dev->ev_base != NULL && ftdi_usbfs (dev)) {
+      ftdi_pollfd_removed (dev->sys_fd, dev);
+    }
+    ftdi_drop_handle (dev);
+  }
+
+  memset (&match, 0, sizeof (match));
+  match.by_port = true;
+  match.bus = dev->bus;
+  match.ports = dev->ports;
+  match.port_count = dev->port_count;
+
+  start = time_now_ns ();
+  dev->arrived = 0;
+  while (ftdi_find (dev, &match) != 0) {
+    if (time_now_ns () - start > FTDI_RECONNECT_WAIT_MS * 1000000ull) {
+      return -1;
+    }
+
+    /*
+     * Opening may still fail for a bit after it arrives (udev
+     * fixing permissions), so check back often regardless.
+     */
+    tv.tv_sec = 0;
+    tv.tv_usec = 10000;
+    if (dev->hotplug) {
+      libusb_handle_events_timeout_completed (dev->usb_ctx, &tv,
+                                              &dev->arrived);
+    } else {
+      usleep (tv.tv_usec);
+    }
+  }
+
+#ifdef FTDI_USBFS
+  if (dev->usbfs && ftdi_urb_open (dev) != 0) {
+    ftdi_drop_handle (dev);
+    return -1;
+  }
+#endif
+
+  err = ftdi_claim (dev, t->params.trust_chip_config);
+  if (err != 0) {
+    ftdi_drop_handle (dev);
+    return -1;
+  }
+  if (dev->ev_base != NULL && ftdi_usbfs (dev)) {
+    ftdi_pollfd_added (dev->sys_fd, POLLOUT, dev);
+  }
+
+  for (i = 0; i < dev->rx_slot_count; i++) {
+    slot = &dev->rx_slots[i];
+    slot->cmd_transfer->dev_handle = dev->device_handle;
+    slot->in_transfer->dev_handle = dev->device_handle;
+  }
+
+  dev->lost = false;
+  dev->rx_errors = 0;
+
+  /*
+   * Everything not handed out was cancelled above.
+   */
+  for (i = dev->rx_out; i < dev->rx_slot_count; i++) {
+    slot = &dev->rx_slots[(dev->rx_head + i - dev->rx_out) % dev->rx_slot_count];
+    if (ftdi_rx_submit (slot) != 0) {
+      return -1;
+    }
+  }
+
+  ftdi_rx_refill (dev);
+
+  fprintf (stderr, "FT601 back after %.1f ms\n",
+           (time_now_ns () - start) / 1e6);
+  return 0;
+}
+
+/*
+ * ftdi_reopen, with writes held off: they'd go to the handle
+ * being replaced.
+ */
+static int
+ftdi_reconnect (transport_t *t)
+{
+  int err;
+  ftdi_dev *dev = t->priv;
+
+  pthread_mutex_lock (&dev->tx_lock);
+  err = ftdi_reopen (t);
+  pthread_mutex_unlock (&dev->tx_lock);
+  return err;
+}
+
+/*
+ * spec is the index of the FT601 among those attached, its
+ * bus:address (as in lsusb -s) or serial:number.
+ */
+static int
+ftdi_open (transport_t *t,
+           const char *spec)
+{
+  int err;
+  uint64_t start;
+  ftdi_dev *dev;
+
+  dev = calloc (1, sizeof (*dev));
+  if (dev == NULL) {
+    return -1;
+  }
+  dev->sys_fd = -1;
+  pthread_mutex_init (&dev->tx_lock, NULL);
+  t->priv = dev;
+
+#ifdef FTDI_USBFS
+  dev->usbfs = t->params.usbfs;
+  dev->map_fd = -1;
+  pthread_mutex_init (&dev->reap_lock, NULL);
+  pthread_cond_init (&dev->reap_cond, NULL);
+#else
+  if (t->params.usbfs) {
+    fprintf (stderr, "The usbfs data path needs Linux and "
+             "libusb_wrap_sys_device\n");
+    pthread_mutex_destroy (&dev->tx_lock);
+    free (dev);
+    return -1;
+  }
+#endif
+
+  if (t->params.rx_size == 0 || t->params.rx_size > FTDI_MAX_RX_SIZE ||
+      (t->params.rx_size % FTDI_RX_ALIGN) != 0) {
+    fprintf (stderr, "RX transfers of %u bytes: need a multiple of %u, "
+             "up to %u\n", t->params.rx_size, FTDI_RX_ALIGN,
+             FTDI_MAX_RX_SIZE);
+    ftdi_close (t);
+    return -1;
+  }
+
+  err = ftdi_get (dev, spec, t->params.trust_chip_config);
+#ifdef FTDI_USBFS
+  if (err == 0 && dev->usbfs && t->params.rx_size > FTDI_URB_MAX_SIZE &&
+      (dev->caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM) == 0) {
+    fprintf (stderr, "usbfs here limits bulk URBs to %u KiB\n",
+             FTDI_URB_MAX_SIZE / 1024);
+    err = -1;
+  }
+#endif
+  if (err == 0) {
+    /*
+     * RX transfers are in flight before the caller's fpga_init,
+     * so whatever the FPGA sends meanwhile is kept.
+     */
+    start = time_now_ns ();
+    err = ftdi_rx_start (dev, t->params.rx_count, t->params.rx_size);
+    dev->startup_ns[FTDI_STARTUP_RX] = time_now_ns () - start;
+  }
+
+  if (err != 0) {
+    ftdi_close (t);
+    return -1;
+  }
 
+#ifdef FTDI_USBFS
+  if (dev->usbfs) {
+    printf ("FT601 data path: usbfs URBs, RX buffers %s\n",
+            dev->rx_slots[0].mapped ? "mapped" : "copied");
+  }
+#endif
+  printf ("FT601 up: libusb %.1f ms, open %.1f ms, claim %.1f ms, "
+          "chip config %.1f ms%s, RX start %.1f ms\n",
+          dev->startup_ns[FTDI_STARTUP_LIBUSB] / 1e6,
+          dev->startup_ns[FTDI_STARTUP_OPEN] / 1e6,
+          dev->startup_ns[FTDI_STARTUP_CLAIM] / 1e6,
+          dev->startup_ns[FTDI_STARTUP_CHIP_CONFIG] / 1e6,
+          t->params.trust_chip_config ? " (skipped)" : "",
+          dev->startup_ns[FTDI_STARTUP_RX] / 1e6);
   return 0;
 }
+
+const transport_ops ftdi_transport_ops = {
+  .name = "ftdi",
+  .open = ftdi_open,
+  .close = ftdi_close,
+  .read = ftdi_read,
+  .release = ftdi_release,
+  .write = ftdi_write,
+  .wait = ftdi_wait,
+  .config = ftdi_config,
+  .watch = ftdi_watch,
+};
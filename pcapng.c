@@ -0,0 +1,455 @@
+/*
+ * pcapng capture writer.
+ *
+ * One section per file: a section header, an interface
+ * description per device (LINKTYPE_USER0, nanosecond timestamps,
+ * see wireshark/pcietlp.lua), then an enhanced packet block per
+ * TLP, with its bytes as received. Receive timestamps are host
+ * monotonic time, moved to the epoch by the offset between the
+ * two clocks when the capture starts, or when a replay was
+ * recorded.
+ *
+ * Blocks are copied into a window of the file mapped shared. The
+ * file is grown ahead of them a MiB at a time with
+ * posix_fallocate, so a full disk shows up as an error rather
+ * than SIGBUS, and cut down to what was written when it's
+ * closed. Once a file reaches a size or an age, the capture goes
+ * on in the next one, deleting the oldest if there's a limit to
+ * how many are kept.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define PCAPNG_WINDOW_BYTES     (64u << 20)
+#define PCAPNG_RESERVE_BYTES    (1u << 20)
+
+#define PCAPNG_SHB              0x0a0d0d0a
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_LINKTYPE_USER0   147
+
+#define PCAPNG_OPT_END          0
+#define PCAPNG_OPT_COMMENT      1
+#define PCAPNG_SHB_USERAPPL     4
+#define PCAPNG_IF_NAME          2
+#define PCAPNG_IF_DESCRIPTION   3
+#define PCAPNG_IF_TSRESOL       9
+
+/*
+ * Largest block: an EPB with the largest TLP and a comment.
+ */
+#define PCAPNG_MAX_BLOCK        (TLP_MAX_DWS * 4 + 128)
+
+struct pcapng {
+  /*
+   * Files are path itself, or with rotation stem_NNNNN plus the
+   * extension path had.
+   */
+  char *path;
+  char *stem;
+  const char *ext;
+  uint64_t max_bytes;
+  uint64_t max_ns;
+  unsigned max_files;
+  char **if_descs;
+  unsigned if_count;
+  uint64_t epoch_offset_ns;
+
+  int fd;
+  unsigned seq;
+  uint64_t len;
+  uint64_t first_ns;
+  uint8_t *map;
+  uint64_t map_off;
+  uint64_t reserved;
+
+  uint64_t packets;
+  uint64_t bytes;
+  unsigned files;
+};
+
+static char *
+pcapng_name (pcapng_t *p,
+             unsigned seq)
+{
+  char *name;
+  size_t n;
+
+  if (p->max_bytes == 0 && p->max_ns == 0) {
+    return strdup (p->path);
+  }
+
+  n = strlen (p->stem) + strlen (p->ext) + 16;
+  name = malloc (n);
+  if (name != NULL) {
+    snprintf (name, n, "%s_%05u%s", p->stem, seq, p->ext);
+  }
+  return name;
+}
+
+/*
+ * Makes file offsets [p->len, p->len + need) writable at p->map.
+ */
+static int
+pcapng_map (pcapng_t *p,
+            unsigned need)
+{
+  int err;
+  uint64_t off;
+
+  if (p->len + need > p->reserved) {
+    err = posix_fallocate (p->fd, p->reserved, PCAPNG_RESERVE_BYTES);
+    if (err != 0) {
+      fprintf (stderr, "pcapng: %s\n", strerror (err));
+      return -1;
+    }
+    p->reserved += PCAPNG_RESERVE_BYTES;
+  }
+
+  if (p->map != NULL &&
+      p->len + need <= p->map_off + PCAPNG_WINDOW_BYTES) {
+    return 0;
+  }
+
+  if (p->map != NULL) {
+    munmap (p->map, PCAPNG_WINDOW_BYTES);
+    p->map = NULL;
+  }
+
+  off = p->len & ~((uint64_t) sysconf (_SC_PAGESIZE) - 1);
+  p->map = mmap (NULL, PCAPNG_WINDOW_BYTES, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, p->fd, off);
+  if (p->map == MAP_FAILED) {
+    p->map = NULL;
+    fprintf (stderr, "pcapng: mmap: %s\n", strerror (errno));
+    return -1;
+  }
+  p->map_off = off;
+
+  return 0;
+}
+
+static inline uint8_t *
+pcapng_put (uint8_t *d,
+            const void *data,
+            unsigned n)
+{
+  memcpy (d, data, n);
+  return d + n;
+}
+
+static inline uint8_t *
+pcapng_put32 (uint8_t *d,
+              uint32_t v)
+{
+  return pcapng_put (d, &v, sizeof (v));
+}
+
+/*
+ * Option code with n bytes of value, padded to 32 bits.
+ */
+static uint8_t *
+pcapng_option (uint8_t *d,
+               uint16_t code,
+               const void *value,
+               unsigned n)
+{
+  uint16_t h[2] = { code, n };
+
+  d = pcapng_put (d, h, sizeof (h));
+  d = pcapng_put (d, value, n);
+  memset (d, 0, -n & 3);
+  return d + (-n & 3);
+}
+
+/*
+ * Fills in the block started at b (type already there) up to d:
+ * end of options, and the total length at both ends.
+ */
+static uint8_t *
+pcapng_block_end (uint8_t *b,
+                  uint8_t *d,
+                  bool options)
+{
+  uint32_t n;
+
+  if (options) {
+    d = pcapng_option (d, PCAPNG_OPT_END, NULL, 0);
+  }
+  n = d + 4 - b;
+  memcpy (b + 4, &n, sizeof (n));
+  return pcapng_put32 (d, n);
+}
+
+static int
+pcapng_headers (pcapng_t *p)
+{
+  unsigned i;
+  uint8_t *b;
+  uint8_t *d;
+  char name[32];
+  uint8_t tsresol = 9;
+  uint16_t linktype[2] = { PCAPNG_LINKTYPE_USER0, 0 };
+  uint16_t version[2] = { 1, 0 };
+  int64_t section_len = -1;
+  const char *appl = PACKAGE_STRING;
+
+  if (pcapng_map (p, PCAPNG_MAX_BLOCK) != 0) {
+    return -1;
+  }
+  b = d = p->map + (p->len - p->map_off);
+  d = pcapng_put32 (d, PCAPNG_SHB);
+  d += 4;
+  d = pcapng_put32 (d, PCAPNG_BYTE_ORDER_MAGIC);
+  d = pcapng_put (d, version, sizeof (version));
+  d = pcapng_put (d, &section_len, sizeof (section_len));
+  d = pcapng_option (d, PCAPNG_SHB_USERAPPL, appl, strlen (appl));
+  d = pcapng_block_end (b, d, true);
+  p->len += d - b;
+
+  for (i = 0; i < p->if_count; i++) {
+    if (pcapng_map (p, PCAPNG_MAX_BLOCK) != 0) {
+      return -1;
+    }
+    snprintf (name, sizeof (name), "screamer%u", i);
+    b = d = p->map + (p->len - p->map_off);
+    d = pcapng_put32 (d, PCAPNG_IDB);
+    d += 4;
+    d = pcapng_put (d, linktype, sizeof (linktype));
+    d = pcapng_put32 (d, 0);
+    d = pcapng_option (d, PCAPNG_IF_NAME, name, strlen (name));
+    d = pcapng_option (d, PCAPNG_IF_DESCRIPTION, p->if_descs[i],
+                       strlen (p->if_descs[i]));
+    d = pcapng_option (d, PCAPNG_IF_TSRESOL, &tsresol, 1);
+    d = pcapng_block_end (b, d, true);
+    p->len += d - b;
+  }
+
+  return 0;
+}
+
+static void
+pcapng_close_file (pcapng_t *p)
+{
+  if (p->fd < 0) {
+    return;
+  }
+
+  if (p->map != NULL) {
+    munmap (p->map, PCAPNG_WINDOW_BYTES);
+    p->map = NULL;
+  }
+  if (ftruncate (p->fd, p->len) != 0) {
+    fprintf (stderr, "pcapng: ftruncate: %s\n", strerror (errno));
+  }
+  close (p->fd);
+  p->fd = -1;
+}
+
+static int
+pcapng_open_file (pcapng_t *p)
+{
+  char *name;
+
+  if (p->max_files != 0 && p->seq >= p->max_files) {
+    name = pcapng_name (p, p->seq - p->max_files);
+    if (name != NULL) {
+      unlink (name);
+      free (name);
+    }
+  }
+
+  name = pcapng_name (p, p->seq);
+  if (name == NULL) {
+    return -1;
+  }
+
+  p->fd = open (name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (p->fd < 0) {
+    fprintf (stderr, "Couldn't create %s: %s\n", name, strerror (errno));
+    free (name);
+    return -1;
+  }
+  free (name);
+
+  p->seq++;
+  p->files++;
+  p->len = 0;
+  p->reserved = 0;
+  p->first_ns = 0;
+  return pcapng_headers (p);
+}
+
+/*
+ * Starts a capture to path, with one interface per device
+ * (if_descs say what each is). Goes on to the next file once one
+ * has max_bytes or spans max_ns (0 for no limit), keeping the
+ * last max_files of them (0 to keep all).
+ */
+pcapng_t *
+pcapng_open (const char *path,
+             char *const *if_descs,
+             unsigned if_count,
+             uint64_t max_bytes,
+             uint64_t max_ns,
+             unsigned max_files)
+{
+  unsigned i;
+  size_t n;
+  pcapng_t *p;
+
+  p = calloc (1, sizeof (*p));
+  if (p == NULL) {
+    return NULL;
+  }
+
+  p->fd = -1;
+  p->max_bytes = max_bytes;
+  p->max_ns = max_ns;
+  p->max_files = max_files;
+  p->path = strdup (path);
+  p->stem = strdup (path);
+  p->if_descs = calloc (if_count, sizeof (*p->if_descs));
+  p->if_count = if_count;
+  if (p->path == NULL || p->stem == NULL || p->if_descs == NULL) {
+    goto err;
+  }
+
+  n = strlen (path);
+  p->ext = "";
+  if (n > 7 && strcmp (path + n - 7, ".pcapng") == 0) {
+    p->stem[n - 7] = '\0';
+    p->ext = ".pcapng";
+  }
+
+  for (i = 0; i < if_count; i++) {
+    p->if_descs[i] = strdup (if_descs[i]);
+    if (p->if_descs[i] == NULL) {
+      goto err;
+    }
+  }
+
+  p->epoch_offset_ns = time_epoch_offset_ns ();
+
+  if (pcapng_open_file (p) != 0) {
+    goto err;
+  }
+
+  return p;
+
+ err:
+  pcapng_close (p);
+  return NULL;
+}
+
+/*
+ * Appends desc as an EPB on its device's interface. -1 if the
+ * capture can't go on (the file couldn't be grown or rotated).
+ */
+int
+pcapng_write (pcapng_t *p,
+              const tlp_desc_t *desc)
+{
+  uint8_t *b;
+  uint8_t *d;
+  uint64_t ts;
+  uint32_t hdr[5];
+  const char *comment = NULL;
+
+  if (p->fd < 0) {
+    return -1;
+  }
+
+  if ((p->max_bytes != 0 && p->len >= p->max_bytes) ||
+      (p->max_ns != 0 && p->first_ns != 0 &&
+       desc->ts_ns - p->first_ns >= p->max_ns)) {
+    pcapng_close_file (p);
+    if (pcapng_open_file (p) != 0) {
+      pcapng_close_file (p);
+      return -1;
+    }
+  }
+
+  if (pcapng_map (p, PCAPNG_MAX_BLOCK) != 0) {
+    pcapng_close_file (p);
+    return -1;
+  }
+
+  if (p->first_ns == 0) {
+    p->first_ns = desc->ts_ns;
+  }
+
+  if ((desc->flags & TLP_DESC_RECONNECT) != 0) {
+    comment = "device reconnected before this TLP";
+  } else if ((desc->flags & TLP_DESC_RESYNC) != 0) {
+    comment = "stream lost sync before this TLP";
+  }
+
+  ts = desc->ts_ns + p->epoch_offset_ns;
+  hdr[0] = desc->dev;
+  hdr[1] = ts >> 32;
+  hdr[2] = (uint32_t) ts;
+  hdr[3] = desc->size;
+  hdr[4] = desc->size;
+
+  b = d = p->map + (p->len - p->map_off);
+  d = pcapng_put32 (d, PCAPNG_EPB);
+  d += 4;
+  d = pcapng_put (d, hdr, sizeof (hdr));
+  d = pcapng_put (d, desc->data, desc->size);
+  memset (d, 0, -desc->size & 3);
+  d += -desc->size & 3;
+  if (comment != NULL) {
+    d = pcapng_option (d, PCAPNG_OPT_COMMENT, comment, strlen (comment));
+  }
+  d = pcapng_block_end (b, d, comment != NULL);
+  p->len += d - b;
+
+  p->packets++;
+  p->bytes += desc->size;
+  return 0;
+}
+
+/*
+ * For TLPs stamped with some other clock than time_now_ns (): what
+ * to add to their ts_ns for ns since the epoch (0 if that's what
+ * they already are).
+ */
+void
+pcapng_set_epoch_offset (pcapng_t *p,
+                         uint64_t offset_ns)
+{
+  p->epoch_offset_ns = offset_ns;
+}
+
+void
+pcapng_print_stats (pcapng_t *p,
+                    FILE *f)
+{
+  fprintf (f, "pcapng: %" PRIu64 " TLPs, %" PRIu64 " bytes of TLPs in "
+           "%u files\n", p->packets, p->bytes, p->files);
+}
+
+void
+pcapng_close (pcapng_t *p)
+{
+  unsigned i;
+
+  if (p == NULL) {
+    return;
+  }
+
+  pcapng_close_file (p);
+  for (i = 0; p->if_descs != NULL && i < p->if_count; i++) {
+    free (p->if_descs[i]);
+  }
+  free (p->if_descs);
+  free (p->stem);
+  free (p->path);
+  free (p);
+}
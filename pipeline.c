@@ -0,0 +1,519 @@
+/*
+ * Pipelined receive: USB reads, deframing and whatever the tool
+ * does with the TLPs each get a thread, so a slow consumer (hex
+ * dumps, a congested socket) no longer holds up the reads and
+ * lets the FT601 FIFO overflow.
+ *
+ *   reader --raw--> deframer --tlps--> consumer
+ *      ^                |
+ *      +----release-----+
+ *
+ * The deframer runs fpga_tlp_receive_batch on top of a "pipe"
+ * transport that pops raw buffers off the raw ring. Buffers it
+ * is done with go back to the reader over the release ring, as
+ * only the reader may touch the real transport's RX state.
+ * Descriptor batches are reclaimed by the deframer itself once
+ * the consumer has moved past their slot, for the same reason.
+ *
+ * With several devices, each gets its own pipeline and a single
+ * consumer merges their TLPs by receive timestamp.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+#include <pthread.h>
+
+#define PIPELINE_BATCH 256
+
+/*
+ * A transport read: a buffer, or (status) the end of the
+ * stream or a reconnect.
+ */
+typedef struct {
+  void *data;
+  int len;
+  int status;
+  uint64_t ts_ns;
+} pipe_raw;
+
+typedef struct {
+  int count;
+  tlp_desc_t descs[PIPELINE_BATCH];
+} pipe_batch;
+
+struct pipeline {
+  transport_t *src;
+  transport_t pipe;
+  spsc_ring raw;
+  spsc_ring release;
+  spsc_ring tlps;
+  /*
+   * Reader: buffers handed out and not released yet, and the
+   * most it may hold (the transport's RX ring size, if its
+   * buffers get reused).
+   */
+  unsigned held;
+  unsigned held_max;
+  /*
+   * Deframer: next tlps slot to reclaim.
+   */
+  unsigned reclaim;
+  volatile bool stop;
+  bool reader_started;
+  bool deframer_started;
+  pthread_t reader;
+  pthread_t deframer;
+  tlp_receive_context context;
+};
+
+static void
+pipeline_drain_release (pipeline_t *p)
+{
+  void **slot;
+
+  while ((slot = spsc_pop_slot (&p->release)) != NULL) {
+    transport_release (p->src, *slot);
+    spsc_pop_commit (&p->release);
+    p->held--;
+  }
+}
+
+static void *
+pipeline_reader (void *opaque)
+{
+  int err;
+  pipe_raw *slot;
+  pipeline_t *p = opaque;
+
+  while (!p->stop) {
+    pipeline_drain_release (p);
+    if (p->held_max != 0 && p->held >= p->held_max) {
+      /*
+       * Everything is still being looked at downstream.
+       */
+      if (spsc_pop_wait (&p->release, &p->stop, NULL, NULL) == NULL) {
+        break;
+      }
+      continue;
+    }
+
+    slot = spsc_push_wait (&p->raw, &p->stop, NULL, NULL);
+    if (slot == NULL) {
+      break;
+    }
+
+    slot->len = 0;
+    err = transport_read (p->src, &slot->data, &slot->len);
+    if (err == TRANSPORT_EOF || err == TRANSPORT_RECONNECTED) {
+      slot->len = 0;
+      slot->status = err;
+      spsc_push_commit (&p->raw);
+      if (err == TRANSPORT_EOF) {
+        break;
+      }
+      continue;
+    }
+    if (err != 0) {
+      continue;
+    }
+
+    slot->status = 0;
+    slot->ts_ns = p->src->rx_ns;
+    p->held++;
+    spsc_push_commit (&p->raw);
+  }
+
+  return NULL;
+}
+
+/*
+ * Drops the descriptors of every batch the consumer is done with.
+ */
+static void
+pipeline_reclaim (void *opaque)
+{
+  unsigned done;
+  pipe_batch *b;
+  pipeline_t *p = opaque;
+
+  done = spsc_consumed (&p->tlps);
+  while (p->reclaim != done) {
+    b = spsc_slot (&p->tlps, p->reclaim++);
+    if (b->count > 0) {
+      fpga_tlp_release (b->descs, b->count);
+      b->count = 0;
+    }
+  }
+}
+
+static int
+pipe_open (transport_t *t,
+           const char *spec)
+{
+  (void) t;
+  (void) spec;
+  return 0;
+}
+
+static void
+pipe_close (transport_t *t)
+{
+  (void) t;
+}
+
+static int
+pipe_read (transport_t *t,
+           void **data,
+           int *transferred)
+{
+  int status;
+  pipe_raw *slot;
+  pipeline_t *p = t->priv;
+
+  slot = spsc_pop_wait (&p->raw, &p->stop, pipeline_reclaim, p);
+  if (slot == NULL) {
+    return TRANSPORT_EOF;
+  }
+
+  status = slot->status;
+  *data = slot->data;
+  *transferred = slot->len;
+  t->rx_ns = slot->ts_ns;
+  spsc_pop_commit (&p->raw);
+
+  return status;
+}
+
+static void
+pipe_release (transport_t *t,
+              void *data)
+{
+  void **slot;
+  pipeline_t *p = t->priv;
+
+  /*
+   * Sized to hold every buffer there can be, so this only waits
+   * if we're shutting down anyway.
+   */
+  slot = spsc_push_wait (&p->release, &p->stop, NULL, NULL);
+  if (slot == NULL) {
+    return;
+  }
+
+  *slot = data;
+  spsc_push_commit (&p->release);
+}
+
+static const transport_ops pipe_transport_ops = {
+  .name = "pipe",
+  .open = pipe_open,
+  .close = pipe_close,
+  .read = pipe_read,
+  .release = pipe_release,
+};
+
+static void *
+pipeline_deframer (void *opaque)
+{
+  pipe_batch *b;
+  pipeline_t *p = opaque;
+
+  while (!p->stop) {
+    b = spsc_push_wait (&p->tlps, &p->stop, pipeline_reclaim, p);
+    if (b == NULL) {
+      break;
+    }
+
+    /*
+     * The consumer may have freed up this slot after the last
+     * reclaim; drop what it still points to before reusing it.
+     */
+    pipeline_reclaim (p);
+
+    b->count = fpga_tlp_receive_batch (&p->context, b->descs,
+                                       PIPELINE_BATCH);
+    if (b->count == 0) {
+      continue;
+    }
+
+    spsc_push_commit (&p->tlps);
+    if (b->count < 0) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static unsigned
+pipeline_pow2 (unsigned n)
+{
+  unsigned r = 1;
+
+  while (r < n) {
+    r <<= 1;
+  }
+
+  return r;
+}
+
+/*
+ * depth is the number of slots in the raw and tlps rings. Call
+ * after any synchronous setup (fpga_init) is done, since the
+ * reader takes over the transport's RX side.
+ */
+pipeline_t *
+pipeline_start (fpga_dev_t *f,
+                unsigned depth)
+{
+  int err;
+  pipeline_t *p;
+  transport_t *t = fpga_transport (f);
+
+  p = calloc (1, sizeof (*p));
+  if (p == NULL) {
+    return NULL;
+  }
+
+  depth = pipeline_pow2 (depth);
+  p->src = t;
+  p->held_max = t->ops->release != NULL ? t->params.rx_count : 0;
+
+  p->pipe.ops = &pipe_transport_ops;
+  p->pipe.params = t->params;
+  p->pipe.priv = p;
+  fpga_rx_context_init (&p->context, f, &p->pipe);
+
+  if (spsc_init (&p->raw, depth, sizeof (pipe_raw)) != 0 ||
+      spsc_init (&p->release, pipeline_pow2 (depth + FPGA_RX_BUFS + 1),
+                 sizeof (void *)) != 0 ||
+      spsc_init (&p->tlps, depth, sizeof (pipe_batch)) != 0) {
+    goto err;
+  }
+
+  err = pthread_create (&p->reader, NULL, pipeline_reader, p);
+  if (err != 0) {
+    fprintf (stderr, "pthread_create: %s\n", strerror (err));
+    goto err;
+  }
+  p->reader_started = true;
+
+  err = pthread_create (&p->deframer, NULL, pipeline_deframer, p);
+  if (err != 0) {
+    fprintf (stderr, "pthread_create: %s\n", strerror (err));
+    goto err;
+  }
+  p->deframer_started = true;
+
+  return p;
+
+ err:
+  pipeline_free (p);
+  return NULL;
+}
+
+/*
+ * Runs the consumer stage in the calling thread until the end
+ * of the stream or pipeline_stop. idle is called whenever there
+ * is nothing to consume.
+ */
+int
+pipeline_run (pipeline_t *p,
+              pipeline_consume_fn consume,
+              void (*idle) (void *),
+              void *opaque)
+{
+  pipe_batch *b;
+
+  while (1) {
+    b = spsc_pop_wait (&p->tlps, &p->stop, idle, opaque);
+    if (b == NULL) {
+      return -1;
+    }
+
+    if (b->count < 0) {
+      spsc_pop_commit (&p->tlps);
+      return 0;
+    }
+
+    consume (opaque, b->descs, b->count);
+    spsc_pop_commit (&p->tlps);
+  }
+}
+
+typedef struct {
+  pipeline_t *p;
+  pipe_batch *b;
+  unsigned pos;
+  bool ended;
+} merge_src;
+
+static inline uint64_t
+merge_head_ns (merge_src *s)
+{
+  return s->b->descs[s->pos].ts_ns;
+}
+
+/*
+ * Consumer stage for several pipelines at once, handing their
+ * TLPs to consume in receive timestamp order. A TLP goes out
+ * once every other stream has something later queued or has
+ * ended, or, with window_ns set, once it is that old, so that
+ * an idle device doesn't hold up the rest. The latter assumes
+ * live time_now_ns () timestamps; use 0 for replays. Returns 0
+ * once all streams have ended, -1 if stopped.
+ */
+int
+pipeline_run_merged (pipeline_t **p,
+                     unsigned count,
+                     uint64_t window_ns,
+                     pipeline_consume_fn consume,
+                     void (*idle) (void *),
+                     void *opaque)
+{
+  int ret;
+  unsigned i;
+  unsigned n;
+  unsigned live;
+  unsigned ready;
+  unsigned spins;
+  uint64_t now;
+  uint64_t limit;
+  merge_src *s;
+  merge_src *first;
+  merge_src *srcs;
+
+  srcs = calloc (count, sizeof (*srcs));
+  if (srcs == NULL) {
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    srcs[i].p = p[i];
+  }
+
+  spins = 0;
+  while (1) {
+    live = 0;
+    ready = 0;
+    first = NULL;
+    for (i = 0; i < count; i++) {
+      s = &srcs[i];
+      if (s->p->stop) {
+        ret = -1;
+        goto out;
+      }
+      if (s->ended) {
+        continue;
+      }
+
+      if (s->b == NULL) {
+        s->b = spsc_pop_slot (&s->p->tlps);
+        s->pos = 0;
+        if (s->b != NULL && s->b->count < 0) {
+          spsc_pop_commit (&s->p->tlps);
+          s->b = NULL;
+          s->ended = true;
+          continue;
+        }
+      }
+
+      live++;
+      if (s->b == NULL) {
+        continue;
+      }
+
+      ready++;
+      if (first == NULL || merge_head_ns (s) < merge_head_ns (first)) {
+        first = s;
+      }
+    }
+
+    if (live == 0) {
+      ret = 0;
+      goto out;
+    }
+
+    limit = UINT64_MAX;
+    for (i = 0; i < count; i++) {
+      s = &srcs[i];
+      if (s != first && s->b != NULL && merge_head_ns (s) < limit) {
+        limit = merge_head_ns (s);
+      }
+    }
+
+    if (first != NULL && ready < live && window_ns != 0) {
+      now = time_now_ns ();
+      if (now - window_ns < limit) {
+        limit = now - window_ns;
+      }
+    }
+
+    if (first == NULL ||
+        (ready < live && (window_ns == 0 || merge_head_ns (first) > limit))) {
+      if (idle != NULL) {
+        idle (opaque);
+      }
+      spsc_backoff (spins++);
+      continue;
+    }
+    spins = 0;
+
+    n = 0;
+    while (first->pos + n < (unsigned) first->b->count &&
+           first->b->descs[first->pos + n].ts_ns <= limit) {
+      n++;
+    }
+
+    consume (opaque, first->b->descs + first->pos, n);
+    first->pos += n;
+    if (first->pos == (unsigned) first->b->count) {
+      spsc_pop_commit (&first->p->tlps);
+      first->b = NULL;
+    }
+  }
+
+ out:
+  free (srcs);
+  return ret;
+}
+
+/*
+ * Sets a flag and wakes whoever is parked on the rings, both
+ * async-signal-safe, so it can be called from a signal handler.
+ */
+void
+pipeline_stop (pipeline_t *p)
+{
+  p->stop = true;
+  spsc_wake (&p->raw);
+  spsc_wake (&p->tlps);
+  spsc_wake (&p->release);
+}
+
+void
+pipeline_print_stats (pipeline_t *p,
+                      FILE *f)
+{
+  spsc_print_stats (&p->raw, "reader->deframer", f);
+  spsc_print_stats (&p->tlps, "deframer->consumer", f);
+  spsc_print_stats (&p->release, "release", f);
+}
+
+void
+pipeline_free (pipeline_t *p)
+{
+  pipeline_stop (p);
+  if (p->deframer_started) {
+    pthread_join (p->deframer, NULL);
+  }
+  if (p->reader_started) {
+    pthread_join (p->reader, NULL);
+  }
+
+  pipeline_drain_release (p);
+  spsc_free (&p->raw);
+  spsc_free (&p->release);
+  spsc_free (&p->tlps);
+  free (p);
+}
@@ -0,0 +1,423 @@
+/*
+ * Raw FT601 stream recorder: every USB IN transfer as read,
+ * before any deframing, in the format the replay transport
+ * reads (see screamer.h).
+ *
+ * Records are copied into chunks aligned for O_DIRECT, and a
+ * writer thread puts the full ones on disk, so neither the page
+ * cache nor the disk's latency gets in the way of the USB reads.
+ * Nothing is dropped: once every chunk is queued for the disk,
+ * the reads wait, and how long is counted. The last chunk is
+ * padded out to the alignment and the file cut back to the
+ * recorded length at the end. Filesystems that don't take
+ * O_DIRECT (tmpfs) get written through the page cache instead.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#define _GNU_SOURCE
+#include "screamer.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+#define RAWREC_ALIGN        4096
+#define RAWREC_CHUNK_BYTES  (4u << 20)
+#define RAWREC_MIN_CHUNKS   4
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+} rawrec_chunk;
+
+struct rawrec {
+  char *path;
+  int fd;
+  bool direct;
+  /*
+   * Full chunks go to the writer, empty ones come back. The
+   * chunk being filled is cur.
+   */
+  spsc_ring full;
+  spsc_ring empty;
+  unsigned chunk_count;
+  uint8_t **chunks;
+  uint8_t *cur;
+  size_t cur_len;
+  volatile bool done;
+  volatile bool failed;
+  bool writer_started;
+  pthread_t writer;
+  /*
+   * Reading side.
+   */
+  uint64_t transfers;
+  uint64_t bytes;
+  uint64_t reconnects;
+  uint64_t length;
+  /*
+   * Writer.
+   */
+  uint64_t offset;
+  uint64_t writes;
+  uint64_t write_ns;
+  uint64_t write_max_ns;
+};
+
+/*
+ * Writes len bytes at the end of the file. Should the
+ * filesystem turn O_DIRECT down only now, goes on without it.
+ */
+static int
+rawrec_pwrite (rawrec_t *r,
+               const uint8_t *data,
+               size_t len)
+{
+  ssize_t n;
+  uint64_t start;
+  uint64_t ns;
+
+  start = time_now_ns ();
+  while (len != 0) {
+    n = pwrite (r->fd, data, len, r->offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EINVAL && r->direct) {
+      fprintf (stderr, "%s: O_DIRECT refused, writing through the page "
+               "cache\n", r->path);
+      r->direct = false;
+      if (fcntl (r->fd, F_SETFL, fcntl (r->fd, F_GETFL) & ~O_DIRECT) < 0) {
+        fprintf (stderr, "fcntl(%s): %s\n", r->path, strerror (errno));
+        return -1;
+      }
+      continue;
+    }
+    if (n < 0) {
+      fprintf (stderr, "Couldn't write %s: %s\n", r->path, strerror (errno));
+      return -1;
+    }
+
+    data += n;
+    len -= n;
+    r->offset += n;
+  }
+
+  ns = time_now_ns () - start;
+  r->writes++;
+  r->write_ns += ns;
+  if (ns > r->write_max_ns) {
+    r->write_max_ns = ns;
+  }
+  return 0;
+}
+
+static void *
+rawrec_writer (void *opaque)
+{
+  rawrec_chunk *c;
+  rawrec_chunk *e;
+  rawrec_t *r = opaque;
+
+  while (1) {
+    c = spsc_pop_wait (&r->full, &r->done, NULL, NULL);
+    if (c == NULL) {
+      /*
+       * The last chunk may have gone in right before done.
+       */
+      c = spsc_pop_slot (&r->full);
+      if (c == NULL) {
+        break;
+      }
+    }
+
+    if (rawrec_pwrite (r, c->data, c->len) != 0) {
+      __atomic_store_n (&r->failed, true, __ATOMIC_RELEASE);
+      spsc_wake (&r->empty);
+      spsc_pop_commit (&r->full);
+      break;
+    }
+
+    /*
+     * There's room for every chunk there is.
+     */
+    e = spsc_push_slot (&r->empty);
+    e->data = c->data;
+    e->len = 0;
+    spsc_push_commit (&r->empty);
+    spsc_pop_commit (&r->full);
+  }
+
+  return NULL;
+}
+
+/*
+ * Hands cur to the writer, len bytes of it, and takes the next
+ * empty chunk, waiting for the disk if there's none.
+ */
+static int
+rawrec_push (rawrec_t *r,
+             size_t len)
+{
+  rawrec_chunk *c;
+
+  c = spsc_push_wait (&r->full, &r->failed, NULL, NULL);
+  if (c == NULL) {
+    return -1;
+  }
+  c->data = r->cur;
+  c->len = len;
+  spsc_push_commit (&r->full);
+
+  r->cur = NULL;
+  r->cur_len = 0;
+  c = spsc_pop_wait (&r->empty, &r->failed, NULL, NULL);
+  if (c == NULL) {
+    return -1;
+  }
+  r->cur = c->data;
+  spsc_pop_commit (&r->empty);
+  return 0;
+}
+
+/*
+ * Appends len bytes of data to the recording, or zeroes if data
+ * is NULL.
+ */
+static int
+rawrec_copy (rawrec_t *r,
+             const void *data,
+             size_t len)
+{
+  size_t n;
+  const uint8_t *p = data;
+
+  while (len != 0) {
+    if (r->cur_len == RAWREC_CHUNK_BYTES &&
+        rawrec_push (r, RAWREC_CHUNK_BYTES) != 0) {
+      return -1;
+    }
+
+    n = RAWREC_CHUNK_BYTES - r->cur_len;
+    if (n > len) {
+      n = len;
+    }
+    if (p != NULL) {
+      memcpy (r->cur + r->cur_len, p, n);
+      p += n;
+    } else {
+      memset (r->cur + r->cur_len, 0, n);
+    }
+    r->cur_len += n;
+    r->length += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/*
+ * queue_bytes of chunks are kept, at least RAWREC_MIN_CHUNKS.
+ */
+rawrec_t *
+rawrec_open (const char *path,
+             size_t queue_bytes)
+{
+  unsigned i;
+  unsigned count;
+  rawrec_t *r;
+  rawrec_chunk *c;
+  raw_rec_file_hdr hdr;
+
+  r = calloc (1, sizeof (*r));
+  if (r == NULL) {
+    return NULL;
+  }
+  r->fd = -1;
+
+  r->path = strdup (path);
+  if (r->path == NULL) {
+    goto err;
+  }
+
+  r->direct = true;
+  r->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if (r->fd < 0 && errno == EINVAL) {
+    fprintf (stderr, "%s: no O_DIRECT, writing through the page cache\n",
+             path);
+    r->direct = false;
+    r->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if (r->fd < 0) {
+    fprintf (stderr, "Couldn't open %s: %s\n", path, strerror (errno));
+    goto err;
+  }
+
+  count = RAWREC_MIN_CHUNKS;
+  while (count < queue_bytes / RAWREC_CHUNK_BYTES) {
+    count <<= 1;
+  }
+  r->chunks = calloc (count, sizeof (*r->chunks));
+  if (r->chunks == NULL ||
+      spsc_init (&r->full, count, sizeof (rawrec_chunk)) != 0 ||
+      spsc_init (&r->empty, count, sizeof (rawrec_chunk)) != 0) {
+    goto err;
+  }
+  for (i = 0; i < count; i++) {
+    if (posix_memalign ((void **) &r->chunks[i], RAWREC_ALIGN,
+                        RAWREC_CHUNK_BYTES) != 0) {
+      r->chunks[i] = NULL;
+      fprintf (stderr, "Couldn't allocate %u MiB of chunks\n",
+               count * (RAWREC_CHUNK_BYTES >> 20));
+      goto err;
+    }
+    r->chunk_count++;
+    if (i != 0) {
+      c = spsc_push_slot (&r->empty);
+      c->data = r->chunks[i];
+      spsc_push_commit (&r->empty);
+    }
+  }
+  r->cur = r->chunks[0];
+
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, RAW_REC_MAGIC, sizeof (hdr.magic));
+  hdr.version = RAW_REC_VERSION;
+  hdr.epoch_offset_ns = time_epoch_offset_ns ();
+  rawrec_copy (r, &hdr, sizeof (hdr));
+
+  i = pthread_create (&r->writer, NULL, rawrec_writer, r);
+  if (i != 0) {
+    fprintf (stderr, "pthread_create: %s\n", strerror (i));
+    goto err;
+  }
+  r->writer_started = true;
+
+  return r;
+
+ err:
+  rawrec_close (r);
+  return NULL;
+}
+
+/*
+ * Records a transfer of len bytes received at ts_ns. From the
+ * one thread that reads the transport.
+ */
+int
+rawrec_write (rawrec_t *r,
+              const void *data,
+              unsigned len,
+              uint64_t ts_ns,
+              uint32_t flags)
+{
+  raw_rec_hdr rec;
+
+  if (r->failed) {
+    return -1;
+  }
+
+  rec.ts_ns = ts_ns;
+  rec.len = len;
+  rec.flags = flags;
+  if (rawrec_copy (r, &rec, sizeof (rec)) != 0 ||
+      rawrec_copy (r, data, len) != 0 ||
+      rawrec_copy (r, NULL, RAW_REC_ALIGN (len) - len) != 0) {
+    return -1;
+  }
+
+  r->transfers++;
+  r->bytes += len;
+  if ((flags & RAW_REC_RECONNECT) != 0) {
+    r->reconnects++;
+  }
+  return 0;
+}
+
+/*
+ * Puts what's left on disk, once the transport is no longer
+ * read.
+ */
+int
+rawrec_finish (rawrec_t *r)
+{
+  int err = 0;
+  size_t len;
+  rawrec_chunk *c;
+
+  if (!r->writer_started) {
+    return -1;
+  }
+
+  if (r->cur != NULL && r->cur_len != 0 && !r->failed) {
+    len = (r->cur_len + RAWREC_ALIGN - 1) & ~(size_t) (RAWREC_ALIGN - 1);
+    memset (r->cur + r->cur_len, 0, len - r->cur_len);
+    c = spsc_push_wait (&r->full, &r->failed, NULL, NULL);
+    if (c != NULL) {
+      c->data = r->cur;
+      c->len = len;
+      spsc_push_commit (&r->full);
+      r->cur = NULL;
+    }
+  }
+
+  __atomic_store_n (&r->done, true, __ATOMIC_RELEASE);
+  spsc_wake (&r->full);
+  pthread_join (r->writer, NULL);
+  r->writer_started = false;
+
+  if (r->failed) {
+    err = -1;
+  } else if (ftruncate (r->fd, r->length) < 0 || fdatasync (r->fd) < 0) {
+    fprintf (stderr, "Couldn't write %s: %s\n", r->path, strerror (errno));
+    err = -1;
+  }
+
+  return err;
+}
+
+void
+rawrec_print_stats (rawrec_t *r,
+                    FILE *f)
+{
+  fprintf (f, "Raw recording: %" PRIu64 " transfers, %" PRIu64 " bytes",
+           r->transfers, r->bytes);
+  if (r->reconnects != 0) {
+    fprintf (f, ", %" PRIu64 " reconnects", r->reconnects);
+  }
+  fprintf (f, " into %s\n", r->path);
+  fprintf (f, "Raw recording: %" PRIu64 " writes of %u MiB%s, %.1f ms "
+           "average, %.1f ms slowest, %" PRIu64 " ms waiting for the disk\n",
+           r->writes, RAWREC_CHUNK_BYTES >> 20,
+           r->direct ? " (O_DIRECT)" : "",
+           r->writes != 0 ? r->write_ns / 1e6 / r->writes : 0.0,
+           r->write_max_ns / 1e6, r->empty.c.stall_ns / 1000000);
+}
+
+void
+rawrec_close (rawrec_t *r)
+{
+  unsigned i;
+
+  if (r == NULL) {
+    return;
+  }
+
+  if (r->writer_started) {
+    __atomic_store_n (&r->failed, true, __ATOMIC_RELEASE);
+    __atomic_store_n (&r->done, true, __ATOMIC_RELEASE);
+    spsc_wake (&r->full);
+    pthread_join (r->writer, NULL);
+  }
+  if (r->fd >= 0) {
+    close (r->fd);
+  }
+
+  for (i = 0; i < r->chunk_count; i++) {
+    free (r->chunks[i]);
+  }
+  free (r->chunks);
+  spsc_free (&r->full);
+  spsc_free (&r->empty);
+  free (r->path);
+  free (r);
+}
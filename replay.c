@@ -0,0 +1,300 @@
+/*
+ * Replays a recorded FT601 IN stream from a file, so the
+ * deframer and the tools can run without a Screamer attached.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <event2/event.h>
+
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  size_t off;
+  bool records;
+  /*
+   * Pacing: recorded time of the first record, and our own
+   * time when it was handed out.
+   */
+  bool started;
+  uint64_t rec_t0;
+  uint64_t t0;
+  /*
+   * Watched: fires the ready cb when reading may go on, right
+   * away or once the next record is due.
+   */
+  struct event *ready;
+  transport_ready_cb ready_cb;
+  void *ready_opaque;
+} replay_dev;
+
+static void
+replay_close (transport_t *t)
+{
+  replay_dev *dev = t->priv;
+
+  if (dev->ready != NULL) {
+    event_free (dev->ready);
+  }
+  if (dev->base != NULL) {
+    munmap (dev->base, dev->size);
+  }
+
+  free (dev);
+  t->priv = NULL;
+}
+
+static int
+replay_open (transport_t *t,
+             const char *spec)
+{
+  int fd;
+  struct stat st;
+  replay_dev *dev;
+  raw_rec_file_hdr *hdr;
+
+  dev = calloc (1, sizeof (*dev));
+  if (dev == NULL) {
+    return -1;
+  }
+  t->priv = dev;
+
+  fd = open (spec, O_RDONLY);
+  if (fd < 0) {
+    fprintf (stderr, "open(%s): %s\n", spec, strerror (errno));
+    goto err;
+  }
+
+  if (fstat (fd, &st) < 0) {
+    fprintf (stderr, "fstat(%s): %s\n", spec, strerror (errno));
+    close (fd);
+    goto err;
+  }
+
+  dev->size = st.st_size;
+  if (dev->size == 0) {
+    fprintf (stderr, "%s is empty\n", spec);
+    close (fd);
+    goto err;
+  }
+
+  dev->base = mmap (NULL, dev->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (dev->base == MAP_FAILED) {
+    dev->base = NULL;
+    fprintf (stderr, "mmap(%s): %s\n", spec, strerror (errno));
+    goto err;
+  }
+  madvise (dev->base, dev->size, MADV_SEQUENTIAL);
+
+  hdr = (void *) dev->base;
+  if (dev->size >= offsetof (raw_rec_file_hdr, epoch_offset_ns) &&
+      memcmp (hdr->magic, RAW_REC_MAGIC, sizeof (hdr->magic)) == 0) {
+    dev->records = true;
+    if (hdr->version >= 2 && dev->size >= sizeof (*hdr)) {
+      dev->off = sizeof (*hdr);
+      t->epoch_offset_ns = hdr->epoch_offset_ns;
+    } else {
+      /*
+       * The recording's clock is unknown: its timestamps stay
+       * monotonic time.
+       */
+      fprintf (stderr, "%s predates epoch offsets, timestamps are "
+               "the recording host's monotonic time\n", spec);
+      dev->off = offsetof (raw_rec_file_hdr, epoch_offset_ns);
+      t->epoch_offset_ns = 0;
+    }
+  } else {
+    if (t->params.paced) {
+      fprintf (stderr, "%s has no timestamps, replaying at full speed\n",
+               spec);
+    }
+    if ((dev->size % sizeof (uint32_t)) != 0) {
+      fprintf (stderr, "%s: ignoring trailing partial DWORD\n", spec);
+      dev->size &= ~(sizeof (uint32_t) - 1);
+    }
+  }
+
+  return 0;
+
+ err:
+  replay_close (t);
+  return -1;
+}
+
+/*
+ * Returns how long to wait before handing out the record
+ * stamped rec_ts.
+ */
+static uint64_t
+replay_pace (replay_dev *dev,
+             uint64_t rec_ts)
+{
+  uint64_t now;
+  uint64_t due;
+
+  now = time_now_ns ();
+  if (!dev->started) {
+    dev->started = true;
+    dev->rec_t0 = rec_ts;
+    dev->t0 = now;
+    return 0;
+  }
+
+  due = dev->t0 + (rec_ts - dev->rec_t0);
+  return due > now ? due - now : 0;
+}
+
+/*
+ * Hands out pointers straight into the mapping.
+ */
+static int
+replay_read (transport_t *t,
+             void **data,
+             int *transferred)
+{
+  size_t len;
+  uint64_t delay;
+  raw_rec_hdr *rec;
+  struct timeval tv;
+  struct timespec ts;
+  replay_dev *dev = t->priv;
+
+  *transferred = 0;
+  if (dev->off >= dev->size) {
+    return TRANSPORT_EOF;
+  }
+
+  if (!dev->records) {
+    len = dev->size - dev->off;
+    if (len > t->params.rx_size) {
+      len = t->params.rx_size;
+    }
+
+    *data = dev->base + dev->off;
+    *transferred = len;
+    dev->off += len;
+    t->rx_ns = time_now_ns ();
+    return 0;
+  }
+
+  if (dev->size - dev->off < sizeof (*rec)) {
+    fprintf (stderr, "Truncated record header at 0x%zx\n", dev->off);
+    dev->off = dev->size;
+    return TRANSPORT_EOF;
+  }
+
+  rec = (void *) (dev->base + dev->off);
+  if (rec->len > dev->size - dev->off - sizeof (*rec)) {
+    fprintf (stderr, "Truncated record at 0x%zx\n", dev->off);
+    dev->off = dev->size;
+    return TRANSPORT_EOF;
+  }
+
+  delay = t->params.paced ? replay_pace (dev, rec->ts_ns) : 0;
+  if (delay != 0 && t->nonblock) {
+    tv.tv_sec = delay / 1000000000ull;
+    tv.tv_usec = (delay % 1000000000ull) / 1000;
+    evtimer_add (dev->ready, &tv);
+    return TRANSPORT_AGAIN;
+  }
+  if (delay != 0) {
+    ts.tv_sec = delay / 1000000000ull;
+    ts.tv_nsec = delay % 1000000000ull;
+    nanosleep (&ts, NULL);
+  }
+
+  *data = rec + 1;
+  *transferred = rec->len;
+  t->rx_ns = rec->ts_ns;
+  dev->off += sizeof (*rec) + RAW_REC_ALIGN (rec->len);
+  if ((rec->flags & RAW_REC_RECONNECT) != 0) {
+    *transferred = 0;
+    return TRANSPORT_RECONNECTED;
+  }
+  return 0;
+}
+
+/*
+ * There's nobody on the other end, so writes complete
+ * right away.
+ */
+static int
+replay_write (transport_t *t,
+              void *data,
+              int size,
+              transport_write_cb cb,
+              void *opaque)
+{
+  (void) t;
+  (void) data;
+  (void) size;
+
+  if (cb != NULL) {
+    cb (opaque, 0);
+  }
+
+  return 0;
+}
+
+static int
+replay_wait (transport_t *t,
+             int *completed)
+{
+  (void) t;
+
+  return *completed ? 0 : -1;
+}
+
+static void
+replay_ready (evutil_socket_t fd,
+              short what,
+              void *opaque)
+{
+  replay_dev *dev = opaque;
+
+  (void) fd;
+  (void) what;
+
+  dev->ready_cb (dev->ready_opaque);
+}
+
+/*
+ * A file is always readable, so the first cb comes on the next
+ * loop iteration; after that only pacing makes reads wait.
+ */
+static int
+replay_watch (transport_t *t,
+              struct event_base *base,
+              transport_ready_cb cb,
+              void *opaque)
+{
+  replay_dev *dev = t->priv;
+
+  dev->ready = evtimer_new (base, replay_ready, dev);
+  if (dev->ready == NULL) {
+    fprintf (stderr, "Couldn't create replay event\n");
+    return -1;
+  }
+
+  dev->ready_cb = cb;
+  dev->ready_opaque = opaque;
+  event_active (dev->ready, EV_TIMEOUT, 0);
+  return 0;
+}
+
+const transport_ops replay_transport_ops = {
+  .name = "replay",
+  .open = replay_open,
+  .close = replay_close,
+  .read = replay_read,
+  .write = replay_write,
+  .wait = replay_wait,
+  .watch = replay_watch,
+};
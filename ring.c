@@ -0,0 +1,308 @@
+/*
+ * Single-producer/single-consumer ring with preallocated slots.
+ *
+ * The producer owns head and the consumer owns tail; each side
+ * caches the other's index and only rereads it (acquire) when
+ * the ring looks full/empty, so the fast path touches no shared
+ * cache line besides the slot itself.
+ *
+ * A side that has waited a while parks on a futex instead of
+ * polling; the other side wakes it when it next commits, so an
+ * idle pipeline doesn't wake up at all.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+#include <sched.h>
+#include <time.h>
+#if defined(__linux__)
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * Retries spent in spsc_backoff before a wait parks, and how
+ * long it parks for at most: briefly if there's an idle callback
+ * to run (export flushes are due every millisecond), otherwise
+ * just long enough to notice a stop flag nobody woke us for.
+ */
+#define SPSC_SPINS          128
+#define SPSC_IDLE_PARK_US   1000
+#define SPSC_PARK_US        100000
+
+/*
+ * Sleeps while *word is 1, for up to us.
+ */
+static void
+spsc_park (unsigned *word,
+           unsigned us)
+{
+  struct timespec ts;
+
+#if defined(__linux__)
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  syscall (SYS_futex, word, FUTEX_WAIT_PRIVATE, 1, &ts, NULL, 0);
+#else
+  (void) word;
+  (void) us;
+  ts.tv_sec = 0;
+  ts.tv_nsec = 20000;
+  nanosleep (&ts, NULL);
+#endif
+}
+
+static void
+spsc_unpark (unsigned *word)
+{
+  /*
+   * Pairs with the fence in the waits: either they see what was
+   * just committed, or we see them parked.
+   */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (word, __ATOMIC_RELAXED) != 0) {
+    __atomic_store_n (word, 0, __ATOMIC_RELAXED);
+#if defined(__linux__)
+    syscall (SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+  }
+}
+
+int
+spsc_init (spsc_ring *r,
+           unsigned count,
+           size_t slot_size)
+{
+  assert (count != 0 && (count & (count - 1)) == 0);
+
+  memset (r, 0, sizeof (*r));
+
+  /*
+   * Keep slots from sharing cache lines too.
+   */
+  slot_size = (slot_size + SPSC_CACHE_LINE - 1) & ~(size_t) (SPSC_CACHE_LINE - 1);
+  if (posix_memalign ((void **) &r->slots, SPSC_CACHE_LINE,
+                      count * slot_size) != 0) {
+    r->slots = NULL;
+    return -1;
+  }
+  memset (r->slots, 0, count * slot_size);
+
+  r->count = count;
+  r->mask = count - 1;
+  r->slot_size = slot_size;
+  return 0;
+}
+
+void
+spsc_free (spsc_ring *r)
+{
+  free (r->slots);
+  r->slots = NULL;
+}
+
+void *
+spsc_push_slot (spsc_ring *r)
+{
+  if (r->p.head - r->p.tail_cache == r->count) {
+    r->p.tail_cache = __atomic_load_n (&r->c.tail, __ATOMIC_ACQUIRE);
+    if (r->p.head - r->p.tail_cache == r->count) {
+      return NULL;
+    }
+  }
+
+  return spsc_slot (r, r->p.head);
+}
+
+/*
+ * Free slots, for producers that fill several before committing
+ * them: spsc_slot (r, r->p.head + i) for i up to the count.
+ */
+unsigned
+spsc_push_free (spsc_ring *r)
+{
+  r->p.tail_cache = __atomic_load_n (&r->c.tail, __ATOMIC_ACQUIRE);
+  return r->count - (r->p.head - r->p.tail_cache);
+}
+
+void
+spsc_push_commit (spsc_ring *r)
+{
+  unsigned used;
+
+  /*
+   * tail_cache can be well behind; a relaxed look at the real
+   * tail once per item is cheap enough for honest numbers.
+   */
+  used = r->p.head + 1 - __atomic_load_n (&r->c.tail, __ATOMIC_RELAXED);
+  r->p.items++;
+  r->p.occupancy_sum += used;
+  if (used > r->p.occupancy_max) {
+    r->p.occupancy_max = used;
+  }
+
+  __atomic_store_n (&r->p.head, r->p.head + 1, __ATOMIC_RELEASE);
+  spsc_unpark (&r->w.pop_parked);
+}
+
+void *
+spsc_pop_slot (spsc_ring *r)
+{
+  if (r->c.head_cache == r->c.tail) {
+    r->c.head_cache = __atomic_load_n (&r->p.head, __ATOMIC_ACQUIRE);
+    if (r->c.head_cache == r->c.tail) {
+      return NULL;
+    }
+  }
+
+  return spsc_slot (r, r->c.tail);
+}
+
+void
+spsc_pop_commit (spsc_ring *r)
+{
+  __atomic_store_n (&r->c.tail, r->c.tail + 1, __ATOMIC_RELEASE);
+  spsc_unpark (&r->w.push_parked);
+}
+
+/*
+ * Index just past the last slot the consumer is done with, for
+ * producers that reclaim what the slots point to.
+ */
+unsigned
+spsc_consumed (spsc_ring *r)
+{
+  return __atomic_load_n (&r->c.tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Spin briefly, then yield, then sleep, longer each time: the
+ * other side is usually a few microseconds away, but may be
+ * stuck on USB for much longer. For waits that can't park on a
+ * single ring.
+ */
+void
+spsc_backoff (unsigned n)
+{
+  struct timespec ts;
+
+  if (n < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause ();
+#endif
+  } else if (n < SPSC_SPINS) {
+    sched_yield ();
+  } else {
+    ts.tv_sec = 0;
+    ts.tv_nsec = 20000 << (n - SPSC_SPINS < 5 ? n - SPSC_SPINS : 5);
+    nanosleep (&ts, NULL);
+  }
+}
+
+/*
+ * Wakes both sides, for whoever sets their stop flag.
+ */
+void
+spsc_wake (spsc_ring *r)
+{
+  spsc_unpark (&r->w.pop_parked);
+  spsc_unpark (&r->w.push_parked);
+}
+
+/*
+ * Blocking variants. They give up and return NULL once *stop
+ * is set; idle (if any) is run on every retry.
+ */
+void *
+spsc_push_wait (spsc_ring *r,
+                volatile bool *stop,
+                void (*idle) (void *),
+                void *opaque)
+{
+  void *slot;
+  unsigned n;
+  uint64_t start;
+
+  slot = spsc_push_slot (r);
+  if (slot != NULL) {
+    return slot;
+  }
+
+  r->p.stalls++;
+  start = time_now_ns ();
+  for (n = 0; slot == NULL && !*stop; n++) {
+    if (idle != NULL) {
+      idle (opaque);
+    }
+    if (n < SPSC_SPINS) {
+      spsc_backoff (n);
+    } else {
+      __atomic_store_n (&r->w.push_parked, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+      if (spsc_push_slot (r) == NULL && !*stop) {
+        spsc_park (&r->w.push_parked,
+                   idle != NULL ? SPSC_IDLE_PARK_US : SPSC_PARK_US);
+      }
+      __atomic_store_n (&r->w.push_parked, 0, __ATOMIC_RELAXED);
+    }
+    slot = spsc_push_slot (r);
+  }
+  r->p.stall_ns += time_now_ns () - start;
+
+  return slot;
+}
+
+void *
+spsc_pop_wait (spsc_ring *r,
+               volatile bool *stop,
+               void (*idle) (void *),
+               void *opaque)
+{
+  void *slot;
+  unsigned n;
+  uint64_t start;
+
+  slot = spsc_pop_slot (r);
+  if (slot != NULL) {
+    return slot;
+  }
+
+  r->c.stalls++;
+  start = time_now_ns ();
+  for (n = 0; slot == NULL && !*stop; n++) {
+    if (idle != NULL) {
+      idle (opaque);
+    }
+    if (n < SPSC_SPINS) {
+      spsc_backoff (n);
+    } else {
+      __atomic_store_n (&r->w.pop_parked, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+      if (spsc_pop_slot (r) == NULL && !*stop) {
+        spsc_park (&r->w.pop_parked,
+                   idle != NULL ? SPSC_IDLE_PARK_US : SPSC_PARK_US);
+      }
+      __atomic_store_n (&r->w.pop_parked, 0, __ATOMIC_RELAXED);
+    }
+    slot = spsc_pop_slot (r);
+  }
+  r->c.stall_ns += time_now_ns () - start;
+
+  return slot;
+}
+
+void
+spsc_print_stats (spsc_ring *r,
+                  const char *name,
+                  FILE *f)
+{
+  fprintf (f, "%-18s %10" PRIu64 " items  occupancy avg %5.1f max %4u/%u  "
+           "full %" PRIu64 " (%" PRIu64 " ms)  empty %" PRIu64 " (%" PRIu64 " ms)\n",
+           name, r->p.items,
+           r->p.items != 0 ? (double) r->p.occupancy_sum / r->p.items : 0.0,
+           r->p.occupancy_max, r->count,
+           r->p.stalls, r->p.stall_ns / 1000000,
+           r->c.stalls, r->c.stall_ns / 1000000);
+}
@@ -7,6 +7,8 @@
  * for a UEFI driver that exposes an EFI_SERIAL_IO_PROTOCOL
  * over the PCI device.
  *
+ * Ctrl-] quits.
+ *
  * SPDX-License-Identifier: GPL-3.0
  */
 
@@ -16,33 +18,75 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <event2/event.h>
+
+/*
+ * TLPs answered per go before the keyboard and timers get a
+ * turn, how many keys are buffered for CfgRds, and the key
+ * that quits (Ctrl-], as in telnet).
+ */
+#define SAC_RX_BUDGET 64
+#define SAC_KEY_BUF 256
+#define SAC_QUIT_KEY 0x1d
+#define SAC_STATS_POLL_MS 100
 
 static bool verbose;
 static bool remote_dump;
+static char *replay_path;
+static unsigned pipeline_depth;
+static bool trust_chip_config;
+static bool usbfs;
+static long tx_deadline_us = -1;
+static fpga_dev_t *fpga;
 static struct termios termios_orig;
+static tlp_receive_context context;
+static struct event_base *ev_base;
+static struct event *rx_ev;
+static struct event *stdin_ev;
+static uint8_t key_buf[SAC_KEY_BUF];
+static unsigned key_head;
+static unsigned key_len;
+static bool quit;
 
 static int
 parse_opts (int argc,
             char **argv,
-            unsigned long *device_index,
+            char **device_spec,
             char **remote_ip,
             in_port_t *remote_port)
 {
   int opt;
 
-  while ((opt = getopt(argc, argv, "dn:v")) != -1) {
+  while ((opt = getopt(argc, argv, "dl:n:t:vFUR:")) != -1) {
     switch (opt) {
+    case 'l':
+      tx_deadline_us = strtoul (optarg, NULL, 10);
+      break;
     case 'n':
-      *device_index = strtoul (optarg, NULL, 10);
+      *device_spec = optarg;
+      break;
+    case 't':
+      pipeline_depth = strtoul (optarg, NULL, 10);
       break;
     case 'v':
       verbose = true;
       break;
+    case 'F':
+      trust_chip_config = true;
+      break;
+    case 'U':
+      usbfs = true;
+      break;
     case 'd':
       remote_dump = true;
       break;
+    case 'R':
+      replay_path = optarg;
+      break;
     default: /* '?' */
-      fprintf(stderr, "Usage: %s [-n device_index] [-v] [-d [remote server] [port]]\n",
+      fprintf(stderr, "Usage: %s [-n index|bus:address|serial:number] [-F] [-U] "
+              "[-l tx_deadline_us] [-t pipeline_depth] [-v] "
+              "[-R replay_file] [-d [remote server] [port]]\n",
               argv[0]);
       return -1;
     }
@@ -61,6 +105,22 @@ parse_opts (int argc,
   return 0;
 }
 
+static void
+cpl_sent (void *opaque,
+          int status,
+          uint64_t queued_ns,
+          uint64_t done_ns)
+{
+  (void) opaque;
+
+  if (status != 0) {
+    fprintf (stderr, "Failed to send completion\r\n");
+  } else if (verbose) {
+    fprintf (stderr, "Completion reached FPGA after %" PRIu64 " us\r\n",
+             (done_ns - queued_ns) / 1000);
+  }
+}
+
 static void
 term_restore (void)
 {
@@ -101,20 +161,344 @@ term_raw (void)
   }
 }
 
+/*
+ * Reads whatever has been typed into key_buf. Returns false
+ * once there's no more room.
+ */
+static bool
+sac_key_fill (void)
+{
+  ssize_t i;
+  ssize_t n;
+  unsigned tail;
+  unsigned room;
+  uint8_t *keys;
+
+  while (key_len < SAC_KEY_BUF) {
+    tail = (key_head + key_len) % SAC_KEY_BUF;
+    room = SAC_KEY_BUF - key_len;
+    if (room > SAC_KEY_BUF - tail) {
+      room = SAC_KEY_BUF - tail;
+    }
+
+    keys = key_buf + tail;
+    n = read (STDIN_FILENO, keys, room);
+    if (n <= 0) {
+      if (n == 0 && stdin_ev != NULL && !isatty (STDIN_FILENO)) {
+        /*
+         * End of piped input.
+         */
+        event_del (stdin_ev);
+      }
+      return true;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (keys[i] == SAC_QUIT_KEY) {
+        quit = true;
+        if (ev_base != NULL) {
+          event_base_loopbreak (ev_base);
+        }
+      }
+    }
+    key_len += n;
+  }
+
+  return false;
+}
+
+/*
+ * Next key for a CfgRd of register 0x200, or EOF.
+ */
+static int
+sac_key_get (void)
+{
+  uint8_t key;
+
+  if (key_len == 0) {
+    sac_key_fill ();
+  }
+  if (key_len == 0) {
+    return EOF;
+  }
+
+  key = key_buf[key_head];
+  key_head = (key_head + 1) % SAC_KEY_BUF;
+  if (key_len-- == SAC_KEY_BUF && stdin_ev != NULL) {
+    event_add (stdin_ev, NULL);
+  }
+
+  return key;
+}
+
+/*
+ * Answers config accesses to register 0x200.
+ */
+static void
+sac_handle_tlp (void *rx_tlp_data,
+                uint32_t rx_tlp_size)
+{
+  tlp_view tlp;
+  uint32_t fmt_type;
+  uint32_t status = TLP_CPL_STATUS_SC;
+  unsigned cpl_dws = 0;
+  uint32_t tx_tlp_data[TLP_MAX_HEADER_DWS + 1];
+  uint32_t tx_tlp_size;
+  uint32_t *tx_payload;
+  const uint32_t *payload;
+
+  payload = tlp_view_init (&tlp, rx_tlp_data,
+                           rx_tlp_size / sizeof (uint32_t));
+  if (payload == NULL) {
+    return;
+  }
+  fmt_type = tlp_view_fmt_type (&tlp);
+  if (fmt_type != TLP_CfgWr0 && fmt_type != TLP_CfgRd0) {
+    return;
+  }
+
+  if (tlp_view_reg (&tlp) != 0x200) {
+    status = TLP_CPL_STATUS_UR;
+  } else if (fmt_type == TLP_CfgWr0 && tlp_view_payload_dws (&tlp) == 1) {
+    putchar ((uint8_t) *payload);
+  } else if (fmt_type == TLP_CfgRd0) {
+    cpl_dws = 1;
+  }
+
+  tx_payload = tlp_encode_cpl (&tlp, tlp_view_target (&tlp), status, 4, 0,
+                               cpl_dws, tx_tlp_data);
+  tx_tlp_size = (tx_payload - tx_tlp_data) * sizeof (uint32_t);
+  if (cpl_dws != 0) {
+    *tx_payload = sac_key_get ();
+    tx_tlp_size += sizeof (uint32_t);
+  }
+
+  if (fpga_tlp_send_async (fpga, tx_tlp_data, tx_tlp_size,
+                           cpl_sent, NULL) != 0) {
+    fprintf (stderr, "Failed to queue completion\r\n");
+  }
+}
+
+static void
+sac_consume (void *opaque,
+             tlp_desc_t *descs,
+             unsigned count)
+{
+  unsigned i;
+
+  (void) opaque;
+
+  stats_poll ();
+  for (i = 0; i < count; i++) {
+    if ((descs[i].flags & TLP_DESC_RECONNECT) != 0) {
+      fprintf (stderr, "FPGA reconnected\r\n");
+    }
+    if (verbose && (descs[i].flags & TLP_DESC_RESYNC) != 0) {
+      fprintf (stderr, "FPGA out of sync\r\n");
+    }
+
+    if ((descs[i].flags & TLP_DESC_CORRUPT) != 0) {
+      if (verbose) {
+        fprintf (stderr, "Corrupt TLP received\r\n");
+      }
+      net_dump ((void *) descs[i].data, descs[i].size);
+      continue;
+    }
+
+    sac_handle_tlp ((void *) descs[i].data, descs[i].size);
+  }
+
+  /*
+   * The ring may never drain under load, so sac_idle can't be
+   * relied on to send what's been queued.
+   */
+  fpga_tx_poll (fpga);
+}
+
+static void
+sac_idle (void *opaque)
+{
+  static uint64_t keys_ns;
+
+  /*
+   * Nothing left to answer right now.
+   */
+  fpga_tx_flush (fpga);
+  stats_poll ();
+  if (time_now_ns () - keys_ns > SAC_STATS_POLL_MS * 1000000ull) {
+    keys_ns = time_now_ns ();
+    sac_key_fill ();
+  }
+  if (quit) {
+    pipeline_stop (opaque);
+  }
+}
+
+/*
+ * Answers what came in, SAC_RX_BUDGET TLPs at a time.
+ */
+static void
+sac_rx (void *opaque)
+{
+  unsigned i;
+  void *rx_tlp_data;
+  uint32_t rx_tlp_size;
+  tlp_receive_result_t state;
+
+  (void) opaque;
+
+  for (i = 0; i < SAC_RX_BUDGET; i++) {
+    state = fpga_tlp_receive (&context, &rx_tlp_data,
+                              &rx_tlp_size);
+    if (state == TLP_NO_DATA) {
+      /*
+       * Until the transport calls back; the TX batch went out
+       * before the read that came up empty.
+       */
+      return;
+    } else if (state == TLP_END_OF_STREAM) {
+      event_base_loopbreak (ev_base);
+      return;
+    } else if (state == TLP_CORRUPT) {
+      if (verbose) {
+        fprintf (stderr, "Corrupt TLP received\r\n");
+      }
+      net_dump (rx_tlp_data, rx_tlp_size);
+    } else if (state == TLP_RECONNECTED) {
+      fprintf (stderr, "FPGA reconnected\r\n");
+    } else if (state == TLP_OUT_OF_SYNC) {
+      if (verbose) {
+        fprintf (stderr, "FPGA out of sync\r\n");
+      }
+    } else if (state == TLP_COMPLETE) {
+      sac_handle_tlp (rx_tlp_data, rx_tlp_size);
+    }
+  }
+
+  /*
+   * More to do, once the rest of the loop had its turn.
+   */
+  event_active (rx_ev, EV_TIMEOUT, 0);
+}
+
+static void
+sac_rx_event (evutil_socket_t fd,
+              short what,
+              void *opaque)
+{
+  (void) fd;
+  (void) what;
+
+  sac_rx (opaque);
+}
+
+static void
+sac_stdin_event (evutil_socket_t fd,
+                 short what,
+                 void *opaque)
+{
+  (void) fd;
+  (void) what;
+  (void) opaque;
+
+  if (!sac_key_fill ()) {
+    /*
+     * Full; picked up again once a CfgRd takes a key.
+     */
+    event_del (stdin_ev);
+  }
+}
+
+static void
+sac_stats_event (evutil_socket_t fd,
+                 short what,
+                 void *opaque)
+{
+  (void) fd;
+  (void) what;
+  (void) opaque;
+
+  stats_poll ();
+}
+
+/*
+ * Single-threaded receive: FT601 transfers, the keyboard and
+ * timers all from one libevent loop, which sleeps when none of
+ * them has anything.
+ */
+static int
+sac_loop (transport_t *transport)
+{
+  int err;
+  struct stat st;
+  struct timeval tv;
+  struct event *stats_ev;
+
+  ev_base = event_base_new ();
+  if (ev_base == NULL) {
+    fprintf (stderr, "Couldn't create event loop\r\n");
+    return -1;
+  }
+
+  fpga_rx_context_init (&context, fpga, NULL);
+  rx_ev = event_new (ev_base, -1, 0, sac_rx_event, NULL);
+  stdin_ev = event_new (ev_base, STDIN_FILENO, EV_READ | EV_PERSIST,
+                        sac_stdin_event, NULL);
+  stats_ev = event_new (ev_base, -1, EV_PERSIST, sac_stats_event, NULL);
+  if (rx_ev == NULL || stdin_ev == NULL || stats_ev == NULL) {
+    fprintf (stderr, "Couldn't create events\r\n");
+    return -1;
+  }
+
+  tv.tv_sec = 0;
+  tv.tv_usec = MS_TO_US (SAC_STATS_POLL_MS);
+  event_add (stats_ev, &tv);
+
+  /*
+   * Files and /dev/null can't be polled (and never block);
+   * CfgRds read them directly.
+   */
+  if (fstat (STDIN_FILENO, &st) == 0 &&
+      (isatty (STDIN_FILENO) || S_ISFIFO (st.st_mode) ||
+       S_ISSOCK (st.st_mode))) {
+    event_add (stdin_ev, NULL);
+  } else {
+    event_free (stdin_ev);
+    stdin_ev = NULL;
+  }
+
+  err = transport_watch (transport, ev_base, sac_rx, NULL);
+  if (err == 0) {
+    err = event_base_dispatch (ev_base);
+  }
+
+  event_free (stats_ev);
+  if (stdin_ev != NULL) {
+    event_free (stdin_ev);
+    stdin_ev = NULL;
+  }
+  event_free (rx_ev);
+  return err;
+}
+
 int
 main (int argc,
       char **argv)
 {
   int err;
-  unsigned long device_index;
-  tlp_receive_context context;
+  char *device_spec;
+  uint64_t start_ns;
+  uint64_t init_ns;
   char *remote_addr;
   in_port_t remote_port;
+  transport_params params;
+  transport_t *transport;
 
-  device_index = 0;
+  start_ns = time_now_ns ();
+  device_spec = "0";
   remote_addr = "127.0.0.1";
   remote_port = 9999;
-  err = parse_opts (argc, argv, &device_index,
+  err = parse_opts (argc, argv, &device_spec,
                     &remote_addr, &remote_port);
   if (err != 0) {
     return -1;
@@ -128,93 +512,76 @@ main (int argc,
     }
   }
 
-  err = ftdi_get (device_index);
-  if (err != 0) {
-    fprintf (stderr, "No FTDI device found\n");
-    return -1;
+  memset (&params, 0, sizeof (params));
+  params.rx_count = 4;
+  params.rx_size = 64 * 1024;
+  params.trust_chip_config = trust_chip_config;
+  params.usbfs = usbfs;
+  if (replay_path != NULL) {
+    transport = transport_open (&replay_transport_ops,
+                                replay_path, &params);
+    if (transport == NULL) {
+      fprintf (stderr, "Couldn't open %s\n", replay_path);
+      return -1;
+    }
+  } else {
+    transport = transport_open (&ftdi_transport_ops,
+                                device_spec, &params);
+    if (transport == NULL) {
+      fprintf (stderr, "No FTDI device found\n");
+      return -1;
+    }
   }
 
-  err = fpga_init ();
-  if (err != 0) {
-    fprintf (stderr, "FPGA init failed\n");
+  fpga = fpga_attach (transport, 0);
+  if (fpga == NULL) {
     return -1;
   }
+  if (tx_deadline_us >= 0) {
+    fpga_tx_set_deadline (fpga, tx_deadline_us);
+  }
 
-  term_raw ();
-
-  memset (&context, 0, sizeof (context));
-  while (1) {
-    tlp_t tlp;
-    tlp_t cpl_tlp;
-    void *rx_tlp_data;
-    uint32_t rx_tlp_size;
-    uint8_t tx_tlp_data[sizeof (tlp_cpl_t) + sizeof(uint32_t)];
-    uint32_t tx_tlp_size;
-    uint32_t *payload;
-    tlp_receive_result_t state;
-    int payload_len_dws = 0;
-
-    state = fpga_tlp_receive (&context, &rx_tlp_data,
-                              &rx_tlp_size);
-    if (state != TLP_COMPLETE) {
-      if (state == TLP_CORRUPT) {
-        if (verbose) {
-          fprintf (stderr, "Corrupt TLP received\n");
-        }
-        net_dump (rx_tlp_data, rx_tlp_size);
-      } else if (state == TLP_OUT_OF_SYNC) {
-        if (verbose) {
-          fprintf (stderr, "FPGA out of sync\n");
-        }
-      }
-      continue;
+  if (replay_path == NULL) {
+    init_ns = time_now_ns ();
+    err = fpga_init (fpga);
+    if (err != 0) {
+      fprintf (stderr, "FPGA init failed\n");
+      return -1;
     }
+    printf ("FPGA init %.1f ms, %.1f ms since start\n",
+            (time_now_ns () - init_ns) / 1e6,
+            (time_now_ns () - start_ns) / 1e6);
+  }
 
-    payload = tlp_packet_to_host (rx_tlp_data, &tlp,
-                                  &payload_len_dws);
-
-    memset (&cpl_tlp, 0, sizeof (cpl_tlp.cpl));
-    cpl_tlp.hdr.attr = tlp.hdr.attr;
-    cpl_tlp.hdr.tc = tlp.hdr.tc;
-    cpl_tlp.hdr._fmt_type = TLP_Cpl;
-
-    if ((tlp.hdr._fmt_type == TLP_CfgWr0 ||
-         tlp.hdr._fmt_type == TLP_CfgRd0)) {
-      cpl_tlp.cpl._cid = tlp.cfg._cid;
-      cpl_tlp.cpl.tag = tlp.cfg.tag;
-      cpl_tlp.cpl._rid = tlp.cfg._rid;
-      cpl_tlp.cpl.byte_count = 4;
-      tx_tlp_size = sizeof (tlp_cpl_t);
-
-      if (tlp_cfg_reg (&tlp.cfg) != 0x200) {
-        cpl_tlp.cpl.status = TLP_CPL_STATUS_UR;
-
-        tlp_host_to_packet (&cpl_tlp, &tx_tlp_data,
-                            tx_tlp_size);
-      } else {
-        if (tlp.hdr._fmt_type == TLP_CfgWr0 &&
-            payload_len_dws == 1) {
-
-          putchar ((uint8_t) *payload);
-
-          tlp_host_to_packet (&cpl_tlp, &tx_tlp_data,
-                              tx_tlp_size);
-        } else if (tlp.hdr._fmt_type == TLP_CfgRd0 &&
-                   payload_len_dws == 0) {
+  /*
+   * Before term_raw, so the exit dump comes after the terminal
+   * is restored.
+   */
+  stats_init (stderr);
+  term_raw ();
 
-          cpl_tlp.hdr._fmt_type = TLP_CplD;
-          cpl_tlp.hdr.length = 1;
+  if (pipeline_depth != 0) {
+    pipeline_t *pipeline;
 
-          tx_tlp_size += 4;
-          payload = tlp_host_to_packet (&cpl_tlp, &tx_tlp_data,
-                                        tx_tlp_size);
-          *payload = getchar();
-        }
-      }
+    pipeline = pipeline_start (fpga, pipeline_depth);
+    if (pipeline == NULL) {
+      fprintf (stderr, "Couldn't start pipeline\r\n");
+      return -1;
+    }
 
-      if (fpga_tlp_send (tx_tlp_data, tx_tlp_size) != 0) {
-        fprintf (stderr, "Failed to send completion\n");
-      }
+    pipeline_run (pipeline, sac_consume, sac_idle, pipeline);
+    if (verbose) {
+      pipeline_print_stats (pipeline, stderr);
     }
+    pipeline_free (pipeline);
+  } else {
+    err = sac_loop (transport);
+  }
+  fpga_tx_flush (fpga);
+  fpga_detach (fpga);
+  transport_close (transport);
+  if (ev_base != NULL) {
+    event_base_free (ev_base);
   }
+  return err < 0 ? -1 : 0;
 }
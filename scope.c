@@ -1,6 +1,32 @@
 /*
  * Dumps incoming TLPs to console (or to remote UDP
- * socket). Also see wireshark/pcietlp.lua.
+ * socket, several to a datagram, see export.c). Also see
+ * wireshark/pcietlp.lua.
+ *
+ * -f takes a filter expression (see filter.c), e.g.
+ * "type CfgWr0 and reg 0x10-0x24 and bus 0"; other TLPs are
+ * dropped as they're deframed.
+ *
+ * -T pairs non-posted requests with their completions (see
+ * tracker.c), giving up on them after the given number of ms,
+ * and prints latencies at exit.
+ *
+ * -o writes TLPs to a pcapng file instead of UDP (unless a remote
+ * server is given too), going on to name_00001.pcapng and so on
+ * every -C MB or -G seconds, and keeping the last -W of them.
+ *
+ * -E streams them to a collector instead (tcp:host:port or
+ * unix:path, screamer_collect -t or -u), nothing lost unless -O
+ * says what to give up when it falls behind: drop (the oldest
+ * queued) or headers (only), once -Q MB are queued.
+ *
+ * -D records every USB IN transfer, as read and before any
+ * deframing, for replay with -R later (one file per device, see
+ * rawrec.c); with -N that's all that's done with them.
+ *
+ * Given several devices (-n, or -R, more than once), captures
+ * from all of them at once and merges their TLPs by receive
+ * time; each exported TLP carries its device's number.
  *
  * Requires the pcileech gateware.
  *
@@ -8,22 +34,246 @@
  */
 
 #include "screamer.h"
+#include <signal.h>
+#include <pthread.h>
+#include <event2/event.h>
+
+#define SCOPE_BATCH 256
+#define SCOPE_MAX_DEVICES 8
+#define SCOPE_MERGE_DEPTH 16
+#define SCOPE_STATS_POLL_MS 100
+#define SCOPE_EXPORT_MTU 1472
+#define SCOPE_EXPORT_FLUSH_MS 1
+#define SCOPE_RAW_QUEUE_MB 256
 
 static bool verbose;
+static char *device_specs[SCOPE_MAX_DEVICES];
+static unsigned device_count;
+static char *replay_paths[SCOPE_MAX_DEVICES];
+static unsigned replay_count;
+static char *raw_paths[SCOPE_MAX_DEVICES];
+static unsigned raw_count;
+static rawrec_t *recorders[SCOPE_MAX_DEVICES];
+static bool record_only;
+static unsigned pipeline_depth;
+static unsigned merge_window_ms = 20;
+static tlp_filter *filter;
+static tracker_t *tracker;
+static char *capture_path;
+static uint64_t capture_bytes;
+static uint64_t capture_ns;
+static unsigned capture_files;
+static pcapng_t *capture;
+static bool udp = true;
+static export_t *exporter;
+static char *export_spec;
+static unsigned export_queue_mb = 64;
+static export_policy export_overload = EXPORT_BLOCK;
+static pipeline_t *pipelines[SCOPE_MAX_DEVICES];
+static unsigned pipeline_count;
+static volatile bool stop;
+static uint64_t tlp_count;
+static uint64_t tlp_bytes;
+static uint64_t launch_ns;
+static uint64_t last_ts_ns[SCOPE_MAX_DEVICES];
+static tlp_receive_context context;
+static tlp_desc_t descs[SCOPE_BATCH];
+static struct event_base *ev_base;
+static struct event *rx_ev;
+
+/*
+ * From the consumer, unlike on_sigint.
+ */
+static void
+scope_stop (void)
+{
+  unsigned i;
+
+  stop = true;
+  for (i = 0; i < pipeline_count; i++) {
+    pipeline_stop (pipelines[i]);
+  }
+  if (exporter != NULL) {
+    export_stop (exporter);
+  }
+  if (ev_base != NULL) {
+    event_base_loopbreak (ev_base);
+  }
+}
+
+static void
+scope_consume (void *opaque,
+               tlp_desc_t *descs,
+               unsigned count)
+{
+  unsigned i;
+  tlp_desc_t *desc;
+
+  (void) opaque;
+
+  stats_poll ();
+  for (i = 0; i < count; i++) {
+    desc = &descs[i];
+    if ((desc->flags & TLP_DESC_RECONNECT) != 0) {
+      printf ("Device %u reconnected, %.1f ms gap\n", desc->dev,
+              (desc->ts_ns - last_ts_ns[desc->dev]) / 1e6);
+    }
+    last_ts_ns[desc->dev] = desc->ts_ns;
+    if ((desc->flags & TLP_DESC_RESYNC) != 0) {
+      fprintf (stderr, "Lost sync, resumed at the next frame\n");
+    }
+    if ((desc->flags & TLP_DESC_CORRUPT) != 0) {
+      fprintf (stderr, "Bad PCIe TLP received\n");
+      if (exporter != NULL) {
+        export_tlp (exporter, desc);
+      }
+      continue;
+    }
+
+    if (tlp_count++ == 0) {
+      printf ("First TLP %.1f ms after start\n",
+              (time_now_ns () - launch_ns) / 1e6);
+    }
+    tlp_bytes += desc->size;
+    if (tracker != NULL) {
+      tracker_tlp (tracker, desc);
+    }
+    if (verbose) {
+      if (pipeline_count > 1) {
+        printf ("Device %u, %" PRIu64 ".%06" PRIu64 " ms: ", desc->dev,
+                desc->ts_ns / 1000000, desc->ts_ns % 1000000);
+      }
+      printf ("TLP of 0x%x bytes\n", desc->size);
+      hex_dump ((uint8_t *) desc->data, desc->size, 16);
+    }
+
+    if (capture != NULL && pcapng_write (capture, desc) != 0) {
+      fprintf (stderr, "Capture file failed, stopping\n");
+      pcapng_print_stats (capture, stdout);
+      pcapng_close (capture);
+      capture = NULL;
+      scope_stop ();
+    }
+    if (exporter != NULL) {
+      export_tlp (exporter, desc);
+    }
+  }
+
+  if (exporter != NULL) {
+    export_poll (exporter, time_now_ns ());
+  }
+}
+
+/*
+ * Nothing to consume for now.
+ */
+static void
+scope_idle (void *opaque)
+{
+  (void) opaque;
+
+  stats_poll ();
+  if (exporter != NULL) {
+    export_poll (exporter, time_now_ns ());
+  }
+}
+
+static void
+on_sigint (int sig)
+{
+  unsigned i;
+
+  (void) sig;
+
+  stop = true;
+  for (i = 0; i < pipeline_count; i++) {
+    pipeline_stop (pipelines[i]);
+  }
+  if (exporter != NULL) {
+    export_stop (exporter);
+  }
+}
 
 static int
 parse_opts(int argc,
            char **argv,
-           unsigned long *device_index,
            char **remote_ip,
-           in_port_t *remote_port)
+           in_port_t *remote_port,
+           transport_params *params)
 {
   int opt;
+  unsigned long size;
 
-  while ((opt = getopt(argc, argv, "n:p:v")) != -1) {
+  while ((opt = getopt(argc, argv, "f:n:o:p:r:s:t:vw:C:D:E:FG:NO:Q:R:PT:UW:")) != -1) {
     switch (opt) {
+    case 'f':
+      tlp_filter_free (filter);
+      filter = tlp_filter_compile (optarg);
+      if (filter == NULL) {
+        return -1;
+      }
+      break;
     case 'n':
-      *device_index = strtoul (optarg, NULL, 10);
+      if (device_count == SCOPE_MAX_DEVICES) {
+        fprintf (stderr, "At most %u devices\n", SCOPE_MAX_DEVICES);
+        return -1;
+      }
+      device_specs[device_count++] = optarg;
+      break;
+    case 'o':
+      capture_path = optarg;
+      break;
+    case 'C':
+      capture_bytes = strtoull (optarg, NULL, 10) * 1000000;
+      break;
+    case 'G':
+      capture_ns = strtoull (optarg, NULL, 10) * 1000000000;
+      break;
+    case 'W':
+      capture_files = strtoul (optarg, NULL, 10);
+      break;
+    case 'D':
+      if (raw_count == SCOPE_MAX_DEVICES) {
+        fprintf (stderr, "At most %u devices\n", SCOPE_MAX_DEVICES);
+        return -1;
+      }
+      raw_paths[raw_count++] = optarg;
+      break;
+    case 'N':
+      record_only = true;
+      break;
+    case 'E':
+      export_spec = optarg;
+      break;
+    case 'Q':
+      export_queue_mb = strtoul (optarg, NULL, 10);
+      break;
+    case 'O':
+      if (strcmp (optarg, "block") == 0) {
+        export_overload = EXPORT_BLOCK;
+      } else if (strcmp (optarg, "drop") == 0) {
+        export_overload = EXPORT_DROP_OLDEST;
+      } else if (strcmp (optarg, "headers") == 0) {
+        export_overload = EXPORT_HEADERS;
+      } else {
+        fprintf (stderr, "Overload policy is block, drop or headers\n");
+        return -1;
+      }
+      break;
+    case 'r':
+      params->rx_count = strtoul (optarg, NULL, 10);
+      break;
+    case 's':
+      size = strtoul (optarg, NULL, 10);
+      if (size == 0 || size > FTDI_MAX_RX_SIZE / 1024) {
+        fprintf (stderr, "RX transfers are 1 to %u KiB\n",
+                 FTDI_MAX_RX_SIZE / 1024);
+        return -1;
+      }
+      params->rx_size = size * 1024;
+      break;
+    case 't':
+      pipeline_depth = strtoul (optarg, NULL, 10);
       break;
     case 'p':
       *remote_port = (in_port_t) strtoul (optarg, NULL, 10);
@@ -31,81 +281,478 @@ parse_opts(int argc,
     case 'v':
       verbose = true;
       break;
+    case 'w':
+      merge_window_ms = strtoul (optarg, NULL, 10);
+      break;
+    case 'F':
+      params->trust_chip_config = true;
+      break;
+    case 'R':
+      if (replay_count == SCOPE_MAX_DEVICES) {
+        fprintf (stderr, "At most %u devices\n", SCOPE_MAX_DEVICES);
+        return -1;
+      }
+      replay_paths[replay_count++] = optarg;
+      break;
+    case 'P':
+      params->paced = true;
+      break;
+    case 'T':
+      tracker_free (tracker);
+      tracker = tracker_new (strtoull (optarg, NULL, 10) * 1000000);
+      if (tracker == NULL) {
+        fprintf (stderr, "Couldn't allocate tracker\n");
+        return -1;
+      }
+      break;
+    case 'U':
+      params->usbfs = true;
+      break;
     default: /* '?' */
-      fprintf(stderr, "Usage: %s [-n device_index] [-p port] [-v] [remote server]\n",
+      fprintf(stderr, "Usage: %s [-n index|bus:address|serial:number]... [-F] [-U] [-p port] "
+              "[-r rx_transfers] [-s rx_transfer_KiB] "
+              "[-t pipeline_depth] [-w merge_window_ms] [-f filter] "
+              "[-T completion_timeout_ms] [-v] "
+              "[-o file.pcapng [-C MB] [-G seconds] [-W files]] "
+              "[-E tcp:host:port|unix:path [-O block|drop|headers] [-Q queue_MB]] "
+              "[-D raw_file... [-N]] "
+              "[-R replay_file... [-P]] [remote server]\n",
               argv[0]);
       return -1;
     }
   }
 
+  if (params->rx_count == 0 || params->rx_size == 0) {
+    fprintf (stderr, "Bad RX ring configuration\n");
+    return -1;
+  }
+
+  if (device_count != 0 && replay_count != 0) {
+    fprintf (stderr, "Either devices or replays, not both\n");
+    return -1;
+  }
+
+  if (optind < argc && export_spec != NULL) {
+    fprintf (stderr, "Either a remote server or -E, not both\n");
+    return -1;
+  }
+
+  if (record_only &&
+      (raw_count == 0 || optind < argc || capture_path != NULL ||
+       export_spec != NULL || tracker != NULL || verbose)) {
+    fprintf (stderr, "-N only records raw transfers (-D)\n");
+    return -1;
+  }
+
   if (optind < argc) {
     *remote_ip = argv[optind];
+  } else if (capture_path != NULL || export_spec != NULL || record_only) {
+    udp = false;
   }
 
   return 0;
 }
 
+/*
+ * One batch per go, so a busy link doesn't keep SIGINT and the
+ * timers waiting.
+ */
+static void
+scope_rx (void *opaque)
+{
+  int n;
+
+  (void) opaque;
+
+  n = fpga_tlp_receive_batch (&context, descs, SCOPE_BATCH);
+  if (n < 0) {
+    event_base_loopbreak (ev_base);
+    return;
+  }
+  if (n == 0) {
+    /*
+     * Until the transport calls back, so send what's buffered.
+     */
+    if (exporter != NULL) {
+      export_flush (exporter);
+    }
+    return;
+  }
+
+  scope_consume (NULL, descs, n);
+  fpga_tlp_release (descs, n);
+  event_active (rx_ev, EV_TIMEOUT, 0);
+}
+
+static void
+scope_rx_event (evutil_socket_t fd,
+                short what,
+                void *opaque)
+{
+  (void) fd;
+  (void) what;
+
+  scope_rx (opaque);
+}
+
+static void
+scope_stats_event (evutil_socket_t fd,
+                   short what,
+                   void *opaque)
+{
+  (void) fd;
+  (void) what;
+  (void) opaque;
+
+  if (stop) {
+    event_base_loopbreak (ev_base);
+    return;
+  }
+
+  stats_poll ();
+  if (exporter != NULL) {
+    export_poll (exporter, time_now_ns ());
+  }
+}
+
+/*
+ * Single-threaded capture from one device: USB completions and
+ * timers from one libevent loop, which sleeps while the link is
+ * quiet. SIGINT stays with on_sigint, which can stop an export
+ * blocked inside a callback; the stats timer ends the loop.
+ */
+static int
+scope_loop (fpga_dev_t *f,
+            transport_t *transport)
+{
+  int err;
+  struct timeval tv;
+  struct event *stats_ev;
+
+  ev_base = event_base_new ();
+  if (ev_base == NULL) {
+    fprintf (stderr, "Couldn't create event loop\n");
+    return -1;
+  }
+
+  fpga_rx_context_init (&context, f, NULL);
+  rx_ev = event_new (ev_base, -1, 0, scope_rx_event, NULL);
+  stats_ev = event_new (ev_base, -1, EV_PERSIST, scope_stats_event, NULL);
+  if (rx_ev == NULL || stats_ev == NULL) {
+    fprintf (stderr, "Couldn't create events\n");
+    return -1;
+  }
+
+  tv.tv_sec = 0;
+  tv.tv_usec = MS_TO_US (SCOPE_STATS_POLL_MS);
+  event_add (stats_ev, &tv);
+
+  err = transport_watch (transport, ev_base, scope_rx, NULL);
+  if (err == 0) {
+    err = event_base_dispatch (ev_base);
+  }
+
+  event_free (stats_ev);
+  event_free (rx_ev);
+  return err;
+}
+
+/*
+ * -N: reads and records, nothing else.
+ */
+static void *
+scope_record (void *opaque)
+{
+  int err;
+  int len;
+  void *data;
+  transport_t *t = opaque;
+
+  while (!stop) {
+    stats_poll ();
+    len = 0;
+    err = transport_read (t, &data, &len);
+    if (err == TRANSPORT_EOF) {
+      break;
+    }
+    if (err == 0) {
+      transport_release (t, data);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * A reader thread per device, until SIGINT or the end of the
+ * stream.
+ */
+static int
+scope_record_all (transport_t **transports,
+                  unsigned count)
+{
+  int err = 0;
+  unsigned i;
+  pthread_t readers[SCOPE_MAX_DEVICES];
+
+  for (i = 0; i < count; i++) {
+    err = pthread_create (&readers[i], NULL, scope_record, transports[i]);
+    if (err != 0) {
+      fprintf (stderr, "pthread_create: %s\n", strerror (err));
+      stop = true;
+      break;
+    }
+  }
+
+  count = i;
+  for (i = 0; i < count; i++) {
+    pthread_join (readers[i], NULL);
+  }
+
+  return err != 0 ? -1 : 0;
+}
+
+/*
+ * Opens source i (device or replay) as FPGA device i.
+ */
+static fpga_dev_t *
+scope_open (unsigned i,
+            transport_params *params,
+            transport_t **transport)
+{
+  int err;
+  uint64_t init_ns;
+  fpga_dev_t *f;
+
+  if (replay_count != 0) {
+    *transport = transport_open (&replay_transport_ops,
+                                 replay_paths[i], params);
+    if (*transport == NULL) {
+      fprintf (stderr, "Couldn't open %s\n", replay_paths[i]);
+      return NULL;
+    }
+  } else {
+    *transport = transport_open (&ftdi_transport_ops,
+                                 device_specs[i], params);
+    if (*transport == NULL) {
+      fprintf (stderr, "No FTDI device %s found\n", device_specs[i]);
+      return NULL;
+    }
+  }
+
+  f = fpga_attach (*transport, i);
+  if (f == NULL) {
+    transport_close (*transport);
+    return NULL;
+  }
+
+  if (replay_count == 0) {
+    init_ns = time_now_ns ();
+    err = fpga_init (f);
+    if (err != 0) {
+      fprintf (stderr, "FPGA init failed\n");
+      fpga_detach (f);
+      transport_close (*transport);
+      return NULL;
+    }
+    printf ("FPGA init %.1f ms, %.1f ms since start\n",
+            (time_now_ns () - init_ns) / 1e6,
+            (time_now_ns () - launch_ns) / 1e6);
+  }
+
+  return f;
+}
+
 int
 main (int argc,
       char **argv)
 {
   int err;
-  unsigned long device_index;
+  unsigned i;
+  unsigned count;
   char *remote_addr;
   in_port_t remote_port;
-  tlp_receive_context context;
+  transport_params params;
+  fpga_dev_t *fpgas[SCOPE_MAX_DEVICES];
+  transport_t *transports[SCOPE_MAX_DEVICES];
+  uint64_t start_ns;
+  uint64_t elapsed_ns;
 
-  device_index = 0;
+  launch_ns = time_now_ns ();
   remote_addr = "127.0.0.1";
   remote_port = 9999;
-  err = parse_opts (argc, argv, &device_index,
-                    &remote_addr, &remote_port);
+  memset (&params, 0, sizeof (params));
+  params.rx_count = 8;
+  params.rx_size = 256 * 1024;
+  err = parse_opts (argc, argv,
+                    &remote_addr, &remote_port,
+                    &params);
   if (err != 0) {
     return -1;
   };
 
-  printf ("UDP server is %s:%u\n", remote_addr, remote_port);
-  err = net_dump_init (remote_addr, remote_port);
-  if (err < 0) {
-    fprintf(stderr, "net_dump_init: %s\n", strerror (errno));
+  if (replay_count == 0 && device_count == 0) {
+    device_specs[device_count++] = "0";
+  }
+  count = replay_count != 0 ? replay_count : device_count;
+  if (raw_count != 0 && raw_count != count) {
+    fprintf (stderr, "One -D file per device\n");
     return -1;
   }
+  if (count > 1 && pipeline_depth == 0) {
+    /*
+     * Every device needs its own reader and deframer.
+     */
+    pipeline_depth = SCOPE_MERGE_DEPTH;
+  }
 
-  err = ftdi_get (device_index);
-  if (err != 0) {
-    fprintf (stderr, "No FTDI device found\n");
-    return -1;
+  if (udp) {
+    printf ("UDP server is %s:%u\n", remote_addr, remote_port);
+    exporter = export_udp_open (remote_addr, remote_port, SCOPE_EXPORT_MTU,
+                                SCOPE_EXPORT_FLUSH_MS * 1000000ull);
+    if (exporter == NULL) {
+      return -1;
+    }
   }
 
-  err = fpga_init ();
-  if (err != 0) {
-    fprintf (stderr, "FPGA init failed\n");
-    return -1;
+  if (export_spec != NULL) {
+    printf ("Streaming to %s\n", export_spec);
+    exporter = export_stream_open (export_spec,
+                                   (size_t) export_queue_mb << 20,
+                                   export_overload,
+                                   SCOPE_EXPORT_FLUSH_MS * 1000000ull);
+    if (exporter == NULL) {
+      return -1;
+    }
   }
 
-  memset (&context, 0, sizeof (context));
-  while (1) {
-    void *tlp_data;
-    uint32_t tlp_size;
-    tlp_receive_result_t state;
+  if (capture_path != NULL) {
+    capture = pcapng_open (capture_path,
+                           replay_count != 0 ? replay_paths : device_specs,
+                           count, capture_bytes, capture_ns,
+                           capture_files);
+    if (capture == NULL) {
+      return -1;
+    }
+  }
 
-    state = fpga_tlp_receive (&context, &tlp_data, &tlp_size);
-    if (state == TLP_OUT_OF_SYNC) {
-      fprintf (stderr, "Missing header\n");
-    } else if (state == TLP_CORRUPT) {
-      fprintf (stderr, "Bad PCIe TLP received\n");
-    } else if (state == TLP_COMPLETE) {
-      if (verbose) {
-        printf ("TLP of 0x%x bytes\n", tlp_size);
-        hex_dump (tlp_data, tlp_size, 16);
+  /*
+   * All devices are up before any of them is captured from, so
+   * the merged stream starts out complete.
+   */
+  for (i = 0; i < count; i++) {
+    fpgas[i] = scope_open (i, &params, &transports[i]);
+    if (fpgas[i] == NULL) {
+      return -1;
+    }
+    fpga_set_filter (fpgas[i], filter);
+
+    /*
+     * From here on: replays start where fpga_init left off.
+     */
+    if (raw_count != 0) {
+      recorders[i] = rawrec_open (raw_paths[i],
+                                  (size_t) SCOPE_RAW_QUEUE_MB << 20);
+      if (recorders[i] == NULL) {
+        return -1;
       }
+      transports[i]->rec = recorders[i];
+    }
+  }
+
+  /*
+   * Replays are stamped with the recording host's clock.
+   */
+  if (capture != NULL && replay_count != 0) {
+    pcapng_set_epoch_offset (capture, transports[0]->epoch_offset_ns);
+  }
 
-      net_dump (tlp_data, tlp_size);
-      if (err < 0)  {
-        fprintf (stderr, "sendto: %s\n", strerror (errno));
+  signal (SIGINT, on_sigint);
+  signal (SIGPIPE, SIG_IGN);
+  stats_init (stderr);
+
+  start_ns = time_now_ns ();
+  if (record_only) {
+    err = scope_record_all (transports, count);
+  } else if (pipeline_depth != 0) {
+    /*
+     * USB reads and deframing on their own threads, so slow
+     * output doesn't hold up the FT601.
+     */
+    for (i = 0; i < count; i++) {
+      pipelines[i] = pipeline_start (fpgas[i], pipeline_depth);
+      if (pipelines[i] == NULL) {
+        fprintf (stderr, "Couldn't start pipeline\n");
+        return -1;
       }
+      pipeline_count++;
+    }
+
+    if (count == 1) {
+      pipeline_run (pipelines[0], scope_consume, scope_idle, NULL);
+    } else {
+      pipeline_run_merged (pipelines, count,
+                           replay_count != 0 ? 0 :
+                           merge_window_ms * 1000000ull,
+                           scope_consume, scope_idle, NULL);
     }
+  } else {
+    err = scope_loop (fpgas[0], transports[0]);
   }
 
-  return 0;
+  elapsed_ns = time_now_ns () - start_ns;
+  if (!record_only) {
+    printf ("%" PRIu64 " TLPs, %" PRIu64 " bytes in %" PRIu64 " ms",
+            tlp_count, tlp_bytes, elapsed_ns / 1000000);
+    if (elapsed_ns != 0) {
+      printf (" (%.1f kTLP/s)", tlp_count * 1e6 / elapsed_ns);
+    }
+    putchar ('\n');
+  }
+  if (tracker != NULL) {
+    tracker_print (tracker, stdout);
+  }
+  if (capture != NULL) {
+    pcapng_print_stats (capture, stdout);
+    pcapng_close (capture);
+  }
+  if (exporter != NULL) {
+    export_finish (exporter);
+    export_print_stats (exporter, stdout);
+    export_close (exporter);
+  }
+
+  for (i = 0; i < pipeline_count; i++) {
+    if (pipeline_count > 1) {
+      printf ("Device %u:\n", i);
+    }
+    pipeline_print_stats (pipelines[i], stdout);
+    pipeline_free (pipelines[i]);
+  }
+
+  /*
+   * Only once nothing reads the transports any more.
+   */
+  for (i = 0; i < count && recorders[i] != NULL; i++) {
+    if (count > 1) {
+      printf ("Device %u:\n", i);
+    }
+    if (rawrec_finish (recorders[i]) != 0) {
+      err = -1;
+    }
+    rawrec_print_stats (recorders[i], stdout);
+    rawrec_close (recorders[i]);
+    transports[i]->rec = NULL;
+  }
+
+  for (i = 0; i < count; i++) {
+    fpga_detach (fpgas[i]);
+    transport_close (transports[i]);
+  }
+  if (ev_base != NULL) {
+    event_base_free (ev_base);
+  }
+  tlp_filter_free (filter);
+  tracker_free (tracker);
+  return err < 0 ? -1 : 0;
 }
@@ -6,6 +6,10 @@
 
 #pragma once
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <inttypes.h>
@@ -43,65 +47,556 @@
 
 #define MS_TO_US(x) ((x) * 1000)
 
-int
-ftdi_set_config (ft60x_config *config);
+/*
+ * A transport moves raw LeechCore frames between us and the
+ * FPGA. read hands out the next received buffer and sets rx_ns
+ * to when it arrived; the buffer stays valid until it is given
+ * back with release (transports without release never reuse
+ * their buffers). write with a cb is async, with cb invoked
+ * from inside read or wait; without one it blocks. config is
+ * optional (FT601 chip config). A transport that lost its
+ * device and got it back returns TRANSPORT_RECONNECTED from
+ * read, once, with no data and rx_ns set to when; the stream
+ * starts over after it.
+ *
+ * watch (optional) hooks the transport into a libevent loop:
+ * from then on read never blocks, returning TRANSPORT_AGAIN
+ * instead, and the async write callbacks run from the loop.
+ * The ready cb is run whenever a read might get further; it is
+ * up to the reader to read until TRANSPORT_AGAIN, or to come
+ * back by itself if it stops early.
+ */
+#define TRANSPORT_EOF 1
+#define TRANSPORT_RECONNECTED 2
+#define TRANSPORT_AGAIN 3
 
-int
-ftdi_get_config (ft60x_config *config);
+struct event_base;
+
+typedef struct transport transport_t;
+typedef struct rawrec rawrec_t;
+
+typedef void (*transport_write_cb) (void *opaque,
+                                    int status);
+
+typedef void (*transport_ready_cb) (void *opaque);
+
+typedef struct {
+  const char *name;
+  int (*open) (transport_t *t,
+               const char *spec);
+  void (*close) (transport_t *t);
+  int (*read) (transport_t *t,
+               void **data,
+               int *transferred);
+  void (*release) (transport_t *t,
+                   void *data);
+  int (*write) (transport_t *t,
+                void *data,
+                int size,
+                transport_write_cb cb,
+                void *opaque);
+  int (*wait) (transport_t *t,
+               int *completed);
+  int (*config) (transport_t *t,
+                 ft60x_config *config,
+                 bool set);
+  int (*watch) (transport_t *t,
+                struct event_base *base,
+                transport_ready_cb cb,
+                void *opaque);
+} transport_ops;
+
+typedef struct {
+  /*
+   * RX transfers kept in flight and the size of each. For
+   * replay of a bare stream, rx_size is the read chunk size.
+   */
+  unsigned rx_count;
+  unsigned rx_size;
+  /*
+   * Replay at the recorded pace instead of full speed.
+   */
+  bool paced;
+  /*
+   * Skip reading back (and fixing) the FT601 chip config.
+   */
+  bool trust_chip_config;
+  /*
+   * FT601 bulk transfers as usbfs URBs rather than through
+   * libusb (Linux only).
+   */
+  bool usbfs;
+} transport_params;
+
+struct transport {
+  const transport_ops *ops;
+  transport_params params;
+  uint64_t rx_ns;
+  /*
+   * What to add to rx_ns for ns since the epoch: ours for a
+   * device, the recording's for a replay.
+   */
+  uint64_t epoch_offset_ns;
+  /*
+   * Set once watched: read returns TRANSPORT_AGAIN rather than
+   * wait.
+   */
+  bool nonblock;
+  /*
+   * Every transfer transport_read returns is recorded here,
+   * if set.
+   */
+  rawrec_t *rec;
+  void *priv;
+};
+
+static inline void
+transport_release (transport_t *t,
+                   void *data)
+{
+  if (t->ops->release != NULL) {
+    t->ops->release (t, data);
+  }
+}
+
+static inline int
+transport_watch (transport_t *t,
+                 struct event_base *base,
+                 transport_ready_cb cb,
+                 void *opaque)
+{
+  if (t->ops->watch == NULL) {
+    fprintf (stderr, "The %s transport can't be watched\n", t->ops->name);
+    return -1;
+  }
+
+  t->nonblock = true;
+  if (t->ops->watch (t, base, cb, opaque) != 0) {
+    t->nonblock = false;
+    return -1;
+  }
+
+  return 0;
+}
+
+extern const transport_ops ftdi_transport_ops;
+extern const transport_ops replay_transport_ops;
+
+transport_t *
+transport_open (const transport_ops *ops,
+                const char *spec,
+                transport_params *params);
+
+void
+transport_close (transport_t *t);
 
 int
-ftdi_send_cmd_read (int size);
+transport_read (transport_t *t,
+                void **data,
+                int *transferred);
+
+/*
+ * Recorded raw stream format, as read by the replay transport:
+ * a raw_rec_file_hdr followed by raw_rec_hdr records, each
+ * followed by len bytes of FT601 IN data, padded to 8 bytes.
+ * A file without the header is taken as a bare byte stream.
+ * RAW_REC_RECONNECT records (no data) mark where the device was
+ * reconnected. Version 1 headers end before epoch_offset_ns.
+ */
+#define RAW_REC_MAGIC "SCRMRAW1"
+#define RAW_REC_VERSION 2
+#define RAW_REC_RECONNECT 0x1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  /*
+   * The recording host's time_epoch_offset_ns ().
+   */
+  uint64_t epoch_offset_ns;
+} raw_rec_file_hdr;
+
+typedef struct {
+  uint64_t ts_ns;
+  uint32_t len;
+  uint32_t flags;
+} raw_rec_hdr;
+
+#define RAW_REC_ALIGN(x) (((x) + 7) & ~7ull)
+
+/*
+ * Raw stream recorder (see rawrec.c).
+ */
+rawrec_t *
+rawrec_open (const char *path,
+             size_t queue_bytes);
 
 int
-ftdi_write (void *data,
-            int size,
-            int *transferred);
+rawrec_write (rawrec_t *r,
+              const void *data,
+              unsigned len,
+              uint64_t ts_ns,
+              uint32_t flags);
 
 int
-ftdi_read (void *data,
-           int size,
-           int *transferred);
+rawrec_finish (rawrec_t *r);
+
+void
+rawrec_print_stats (rawrec_t *r,
+                    FILE *f);
+
+void
+rawrec_close (rawrec_t *r);
+
+/*
+ * Lock-free single-producer/single-consumer ring of fixed-size
+ * slots (see ring.c). Producer and consumer state live on
+ * separate cache lines.
+ */
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+  struct {
+    unsigned head;
+    unsigned tail_cache;
+    uint64_t items;
+    uint64_t occupancy_sum;
+    unsigned occupancy_max;
+    uint64_t stalls;
+    uint64_t stall_ns;
+  } p __attribute__ ((aligned (SPSC_CACHE_LINE)));
+  struct {
+    unsigned tail;
+    unsigned head_cache;
+    uint64_t stalls;
+    uint64_t stall_ns;
+  } c __attribute__ ((aligned (SPSC_CACHE_LINE)));
+  struct {
+    unsigned pop_parked;
+    unsigned push_parked;
+  } w __attribute__ ((aligned (SPSC_CACHE_LINE)));
+  unsigned count __attribute__ ((aligned (SPSC_CACHE_LINE)));
+  unsigned mask;
+  size_t slot_size;
+  uint8_t *slots;
+} spsc_ring;
+
+static inline void *
+spsc_slot (spsc_ring *r,
+           unsigned index)
+{
+  return r->slots + (index & r->mask) * r->slot_size;
+}
 
 int
-ftdi_get (unsigned long index);
+spsc_init (spsc_ring *r,
+           unsigned count,
+           size_t slot_size);
+
+void
+spsc_free (spsc_ring *r);
+
+void *
+spsc_push_slot (spsc_ring *r);
+
+unsigned
+spsc_push_free (spsc_ring *r);
+
+void
+spsc_push_commit (spsc_ring *r);
+
+void *
+spsc_pop_slot (spsc_ring *r);
+
+void
+spsc_pop_commit (spsc_ring *r);
+
+unsigned
+spsc_consumed (spsc_ring *r);
+
+void *
+spsc_push_wait (spsc_ring *r,
+                volatile bool *stop,
+                void (*idle) (void *),
+                void *opaque);
+
+void
+spsc_backoff (unsigned n);
+
+void
+spsc_wake (spsc_ring *r);
+
+void *
+spsc_pop_wait (spsc_ring *r,
+               volatile bool *stop,
+               void (*idle) (void *),
+               void *opaque);
+
+void
+spsc_print_stats (spsc_ring *r,
+                  const char *name,
+                  FILE *f);
+
+/*
+ * An FPGA behind a transport: its TX queue, register access
+ * state and the receive context first used on it. Any number
+ * can be attached, each driven from one thread at a time.
+ */
+typedef struct fpga_dev fpga_dev_t;
+
+fpga_dev_t *
+fpga_attach (transport_t *transport,
+             unsigned id);
+
+void
+fpga_detach (fpga_dev_t *f);
+
+transport_t *
+fpga_transport (fpga_dev_t *f);
 
 int
-fpga_init (void);
+fpga_init (fpga_dev_t *f);
 
 int
-fpga_config_write (uint16_t address,
+fpga_config_write (fpga_dev_t *f,
+                   uint16_t address,
                    void *data,
                    uint16_t count,
                    uint16_t flags);
 
 int
-fpga_config_read (uint16_t address,
+fpga_config_read (fpga_dev_t *f,
+                  uint16_t address,
                   void *data,
                   uint16_t count,
                   uint16_t flags);
 
-typedef enum {
-  STATE_STATUS,
-  STATE_DATA,
-  STATE_REM,
-  STATE_TLP_COMPLETE,
-} tlp_receive_state_t;
+/*
+ * One register access for fpga_reg_batch; address, count and
+ * flags as for fpga_config_read/write. Writes only change the
+ * bits set in mask (count bytes), or all of them if it's NULL.
+ */
+typedef struct {
+  uint16_t address;
+  uint16_t count;
+  uint16_t flags;
+  bool write;
+  void *data;
+  const void *mask;
+} fpga_reg_op;
+
+/*
+ * Issues all ops in order, in as few USB transfers as the FPGA
+ * allows, and returns once every read has been answered (-1 on
+ * timeout).
+ */
+int
+fpga_reg_batch (fpga_dev_t *f,
+                fpga_reg_op *ops,
+                unsigned count);
 
+/*
+ * With a watched transport (see transport_watch), TLP_NO_DATA
+ * means the transport has nothing more until its ready cb.
+ */
 typedef enum {
   TLP_NO_DATA,
   TLP_OUT_OF_SYNC,
   TLP_COMPLETE,
   TLP_CORRUPT,
+  TLP_END_OF_STREAM,
+  TLP_RECONNECTED,
 } tlp_receive_result_t;
 
+typedef enum {
+  DEFRAME_DONE,
+  DEFRAME_OUT_OF_SYNC,
+  DEFRAME_FULL,
+} deframe_result;
+
+typedef enum {
+  DEFRAME_AUTO,
+  DEFRAME_SCALAR,
+  DEFRAME_SSE2,
+  DEFRAME_AVX2,
+} deframe_kind;
+
+#define DEFRAME_OUT_DWORDS          8192
+#define DEFRAME_MAX_ENDS            2048
+#define DEFRAME_END_TRUNCATED       0x80000000
+
+/*
+ * Non-TLP frame DWORDs, by slot type. Each type gets an SPSC
+ * queue (deframer in, register access out) that drops on
+ * overflow. A reset moves flush up to head; the consumer skips
+ * its tail ahead to flush, so each side only stores its own
+ * index.
+ */
+#define DEFRAME_PCIE_CFG            1
+#define DEFRAME_LOOPBACK            2
+#define DEFRAME_CORE_CFG            3
+#define DEFRAME_QUEUE_DWORDS        1024
+
+typedef struct {
+  uint32_t dws[DEFRAME_QUEUE_DWORDS];
+  unsigned head;
+  unsigned flush;
+  unsigned tail;
+  uint64_t drops;
+} deframe_queue;
+
+#define DEFRAME_QUEUE(d, type) (&(d)->queues[(type) - 1])
+
+typedef struct {
+  /*
+   * TLP DWORDs in arrival order, and for each completed TLP
+   * the out index just past its LAST DWORD (possibly with
+   * DEFRAME_END_TRUNCATED). tlp_start is where the TLP being
+   * assembled begins. src is where a completed TLP can also be
+   * found intact in the input, or NULL if it was split up.
+   */
+  uint32_t out[DEFRAME_OUT_DWORDS];
+  unsigned out_len;
+  uint32_t ends[DEFRAME_MAX_ENDS];
+  const uint32_t *src[DEFRAME_MAX_ENDS];
+  unsigned ends_len;
+  unsigned tlp_start;
+  unsigned max_tlp_dws;
+  bool truncated;
+
+  /*
+   * Resync state. lost: no frame boundary found yet since a bad
+   * status DWORD. verify: the TLP being assembled is the first
+   * since, and is dropped unless it agrees with its header. cut:
+   * the TLP in progress was dropped when sync was lost, so a
+   * dropped first TLP is likely its tail.
+   */
+  bool lost;
+  bool verify;
+  bool cut;
+
+  /*
+   * Frame split across two RX buffers.
+   */
+  uint32_t carry[8];
+  unsigned carry_len;
+
+  deframe_queue queues[3];
+
+  uint64_t frames;
+  uint64_t fillers;
+  uint64_t other_dws;
+  uint64_t out_of_sync;
+  /*
+   * DWORDs skipped and TLPs dropped to get back in sync.
+   */
+  uint64_t resync_dws;
+  uint64_t resync_tlps;
+} deframe_t;
+
+const char *
+deframe_select (deframe_kind kind);
+
+deframe_result
+deframe_run (deframe_t *d,
+             const uint32_t **pp,
+             const uint32_t *e);
+
+void
+deframe_compact (deframe_t *d);
+
+void
+deframe_reset (deframe_t *d);
+
+bool
+deframe_queue_pop (deframe_queue *q,
+                   uint32_t *dw);
+
+typedef struct tlp_receive_context tlp_receive_context;
+
+/*
+ * A transport RX buffer as seen by the batch receive API, plus
+ * an arena for the TLPs that weren't contiguous in it. Held by
+ * the receive context while being deframed and by every TLP
+ * descriptor pointing into it.
+ */
+typedef struct fpga_rx_buf fpga_rx_buf;
+
+struct fpga_rx_buf {
+  tlp_receive_context *owner;
+  void *data;
+  unsigned refs;
+  uint64_t ts_ns;
+  uint32_t *arena;
+  unsigned arena_len;
+  unsigned arena_size;
+  fpga_rx_buf *next;
+};
+
+#define TLP_DESC_COPIED     0x01    /* data is in the arena */
+#define TLP_DESC_CORRUPT    0x02    /* size disagrees with header */
+#define TLP_DESC_TRUNCATED  0x04    /* longer than the max TLP size */
+#define TLP_DESC_RESYNC     0x08    /* stream lost sync before it */
+#define TLP_DESC_RECONNECT  0x10    /* device reconnected before it */
+
 typedef struct {
-  uint32_t *p;
-  uint32_t *e;
-  tlp_receive_state_t state;
-  uint32_t status_field;
-  int status_index;
-} tlp_receive_context;
+  const uint32_t *data;
+  uint32_t size;
+  uint32_t flags;
+  uint64_t ts_ns;
+  /*
+   * id of the fpga_dev_t it came from.
+   */
+  unsigned dev;
+  fpga_rx_buf *buf;
+} tlp_desc_t;
+
+#define FPGA_RX_BUFS        64
+
+struct tlp_receive_context {
+  const uint32_t *p;
+  const uint32_t *e;
+  /*
+   * Next completed TLP to hand out (index into d.ends) and
+   * where it starts in d.out. A loss of sync is reported
+   * before the TLP at d.ends[oos_end].
+   */
+  unsigned next;
+  unsigned start;
+  bool out_of_sync;
+  unsigned oos_end;
+  /*
+   * The transport reconnected; reported before the next TLP.
+   * reinit_attempts counts down the fpga_init retries left.
+   */
+  bool reconnected;
+  unsigned reinit_attempts;
+  /*
+   * Transport buffer being deframed: held as raw data by
+   * fpga_tlp_receive, wrapped in an fpga_rx_buf from the pool
+   * once fpga_tlp_receive_batch is used (batch).
+   */
+  bool batch;
+  void *buf;
+  /*
+   * The FPGA the TLPs come from, and where to read them from;
+   * NULL for its own transport. TX is only flushed from the
+   * receive path for the latter.
+   */
+  fpga_dev_t *dev;
+  transport_t *transport;
+  fpga_rx_buf *cur;
+  fpga_rx_buf *pool;
+  fpga_rx_buf *free_bufs;
+  deframe_t d;
+};
 
+/*
+ * fmt/type bytes (DWORD 0 bits 31:24). Msg/MsgD take the routing
+ * subfield in their low three bits, prefixes their type in the low
+ * four.
+ */
 #define TLP_MRd32       0x00
 #define TLP_MRd64       0x20
 #define TLP_MRdLk32     0x01
@@ -114,149 +609,745 @@ typedef struct {
 #define TLP_CfgRd1      0x05
 #define TLP_CfgWr0      0x44
 #define TLP_CfgWr1      0x45
+#define TLP_Msg         0x30
+#define TLP_MsgD        0x70
+#define TLP_FetchAdd32  0x4C
+#define TLP_FetchAdd64  0x6C
+#define TLP_Swap32      0x4D
+#define TLP_Swap64      0x6D
+#define TLP_CAS32       0x4E
+#define TLP_CAS64       0x6E
+#define TLP_DMWr32      0x5B
+#define TLP_DMWr64      0x7B
 #define TLP_Cpl         0x0A
 #define TLP_CplD        0x4A
 #define TLP_CplLk       0x0B
 #define TLP_CplDLk      0x4B
+#define TLP_LPrfx       0x80
+#define TLP_EPrfx       0x90
 
-typedef union {
-  uint32_t _dw;
-  struct {
-    uint16_t length : 10;
-    uint16_t at : 2;
-    uint16_t attr : 2;
-    uint16_t ep : 1;
-    uint16_t td : 1;
-    uint8_t r1 : 4;
-    uint8_t tc : 3;
-    uint8_t r2 : 1;
-    union {
-      uint8_t _fmt_type;
-      struct {
-        uint8_t type : 5;
-        uint8_t fmt : 3;
-      };
-    };
-  };
-} tlp_header_t;
+#define TLP_CPL_STATUS_SC 0
+#define TLP_CPL_STATUS_UR 1
+#define TLP_CPL_STATUS_CA 4
 
-typedef struct {
-  tlp_header_t hdr;
-  uint8_t first_be : 4;
-  uint8_t last_be : 4;
-  uint8_t tag;
-  union {
-    uint16_t _rid;
-    struct {
-      uint8_t rid_fn : 3;
-      uint8_t rid_dev : 5;
-      uint8_t rid_bus;
-    };
-  };
-  uint8_t r1 : 2;
-  uint8_t reg_num : 6;
-  uint8_t ext_reg_num : 4;
-  uint8_t r2 : 4;
-  union {
-    uint16_t _cid;
-    struct {
-      uint8_t cid_fn : 3;
-      uint8_t cid_dev : 5;
-      uint8_t cid_bus;
-    };
-  };
-} tlp_cfg_t;
+/*
+ * Largest legal TLP: up to four local and four end-to-end
+ * prefixes, a 4 DW header, a 1024 DW (4 KiB) payload and the
+ * ECRC digest. The receive path reassembles TLPs up to this size
+ * and flags anything longer as truncated.
+ */
+#define TLP_MAX_PREFIX_DWS          8
+#define TLP_MAX_HEADER_DWS          4
+#define TLP_MAX_PAYLOAD_DWS         0x400
+#define TLP_MAX_DWS                 (TLP_MAX_PREFIX_DWS + TLP_MAX_HEADER_DWS + \
+                                     TLP_MAX_PAYLOAD_DWS + 1)
+
+/*
+ * Header layouts, each decoded and encoded by its own case in
+ * tlp.c.
+ */
+typedef enum {
+  TLP_LAYOUT_RESERVED,
+  TLP_LAYOUT_MEM32,   /* also IO */
+  TLP_LAYOUT_MEM64,
+  TLP_LAYOUT_CFG,
+  TLP_LAYOUT_MSG,
+  TLP_LAYOUT_CPL,
+  TLP_LAYOUT_PREFIX,
+  TLP_LAYOUT_COUNT,
+} tlp_layout;
 
+/*
+ * What a fmt/type byte is. hdr_dws is 0 for reserved encodings
+ * and 1 for prefixes. The rest is precomputed for
+ * tlp_packet_len_dws: hdr_dws plus data, the mask for the length
+ * field (0 without data) and for the TD bit (0 for prefixes).
+ */
 typedef struct {
-  tlp_header_t hdr;
-  uint8_t first_be : 4;
-  uint8_t last_be : 4;
-  uint8_t tag;
-  union {
-    uint16_t _rid;
-    struct {
-      uint8_t rid_fn : 3;
-      uint8_t rid_dev : 5;
-      uint8_t rid_bus;
-    };
-  };
-  uint32_t address;
-} tlp_mrd32_t;
+  const char *name;
+  uint8_t layout;
+  uint8_t hdr_dws;
+  bool data;
+  uint8_t len_base;
+  uint16_t len_mask;
+  uint8_t td_mask;
+} tlp_type_info;
 
+extern const tlp_type_info tlp_types[256];
+
+/*
+ * A decoded header. Members a layout doesn't have are 0.
+ * length is the raw field (0 means 1024 DWORDs, see
+ * tlp_hdr_payload_dws), tag includes the 10-bit tag bits, and reg
+ * is the config space byte offset.
+ */
 typedef struct {
-  tlp_header_t hdr;
-  uint16_t byte_count : 12;
-  uint16_t bcm : 1;
-#define TLP_CPL_STATUS_SC 0
-#define TLP_CPL_STATUS_UR 1
-#define TLP_CPL_STATUS_CA 4
-  uint16_t status : 3;
-  union {
-    uint16_t _cid;
-    struct {
-      uint8_t cid_fn : 3;
-      uint8_t cid_dev : 5;
-      uint8_t cid_bus;
-    };
-  };
-  uint8_t lower_address : 7;
-  uint8_t r1 : 1;
-  uint8_t tag;
-  union {
-    uint16_t _rid;
-    struct {
-      uint8_t rid_fn : 3;
-      uint8_t rid_dev : 5;
-      uint8_t rid_bus;
-    };
-  };
-} tlp_cpl_t;
-
-typedef union {
-  tlp_header_t hdr;
-  tlp_cfg_t    cfg;
-  tlp_cpl_t    cpl;
-  tlp_mrd32_t  mrd32;
-} tlp_t;
-
-_Static_assert (sizeof (tlp_header_t) == sizeof (uint32_t),
-                "sizeof (tlp_header)");
+  uint32_t fmt_type;
+  uint32_t tc;
+  uint32_t attr;
+  uint32_t th;
+  uint32_t td;
+  uint32_t ep;
+  uint32_t at;
+  uint32_t length;
+  uint32_t requester;
+  uint32_t tag;
+  uint32_t first_be;
+  uint32_t last_be;
+  uint32_t address_lo;
+  uint32_t address_hi;
+  uint32_t ph;
+  uint32_t target;
+  uint32_t reg;
+  uint32_t msg_code;
+  uint32_t msg_dw2;
+  uint32_t msg_dw3;
+  uint32_t completer;
+  uint32_t status;
+  uint32_t bcm;
+  uint32_t byte_count;
+  uint32_t lower_address;
+  /*
+   * Prefixes ahead of the header, as host-order DWORDs.
+   */
+  uint32_t prefix_count;
+  uint32_t prefixes[TLP_MAX_PREFIX_DWS];
+} tlp_hdr;
 
+static inline unsigned
+tlp_hdr_payload_dws (const tlp_hdr *h)
+{
+  return tlp_types[h->fmt_type & 0xff].data ? ((h->length - 1) & 0x3ff) + 1 : 0;
+}
 
-int
-tlp_hdr_len_dws (tlp_header_t *tlp_header,
-                 int *payload_len_dws);
+static inline uint64_t
+tlp_hdr_address (const tlp_hdr *h)
+{
+  return ((uint64_t) h->address_hi << 32) | h->address_lo;
+}
 
-int
+/*
+ * Header, payload and digest DWORDs of the TLP whose header starts
+ * with raw_leader (as received), 1 for a prefix, 0 for a reserved
+ * fmt/type.
+ */
+static inline int
 tlp_packet_len_dws (uint32_t raw_leader,
-                    int *payload_len_dws);
+                    int *payload_len_dws)
+{
+  uint32_t dw = be32toh (raw_leader);
+  const tlp_type_info *t = &tlp_types[dw >> 24];
 
-void *
-tlp_packet_to_host (void *data,
-                    tlp_t *tlp,
-                    int *payload_len_dws);
+  /*
+   * Masked rather than branched on: data and no-data types are
+   * mixed about evenly in real traffic.
+   */
+  if (payload_len_dws != NULL) {
+    *payload_len_dws = (int) (((dw - 1) & t->len_mask) + t->data);
+  }
 
-void *
-tlp_host_to_packet (tlp_t *tlp,
-                    void *out,
-                    int out_size);
+  return t->len_base + ((dw - 1) & t->len_mask) + ((dw >> 15) & t->td_mask);
+}
+
+static inline bool
+tlp_dw_is_prefix (uint32_t raw)
+{
+  return tlp_types[be32toh (raw) >> 24].layout == TLP_LAYOUT_PREFIX;
+}
 
 unsigned
-tlp_cfg_reg (tlp_cfg_t *cfg);
+tlp_len_dws (const uint32_t *dws,
+             unsigned count);
+
+const uint32_t *
+tlp_decode (const void *data,
+            unsigned count,
+            tlp_hdr *h);
+
+uint32_t *
+tlp_encode (const tlp_hdr *h,
+            void *out,
+            unsigned out_dws);
+
+/*
+ * A header left as received, for hot paths that only look at a
+ * few of its fields: tlp_view_init finds it and its type, and
+ * each accessor extracts one field when asked. Accessors for
+ * fields the layout doesn't have return whatever is in their
+ * place. id is the DWORD with the requester ID and tag (2 for
+ * completions, 1 otherwise).
+ */
+typedef struct {
+  const uint32_t *dws;
+  const tlp_type_info *type;
+  unsigned prefix_count;
+  unsigned id;
+} tlp_view;
+
+static inline uint32_t
+tlp_view_dw (const tlp_view *v,
+             unsigned i)
+{
+  return be32toh (v->dws[i]);
+}
+
+#define TLP_VIEW_FIELD(name, dw, shift, mask)   \
+  static inline uint32_t                        \
+  tlp_view_##name (const tlp_view *v)           \
+  {                                             \
+    return (tlp_view_dw (v, dw) >> shift) & mask; \
+  }
+
+TLP_VIEW_FIELD (fmt_type, 0, 24, 0xff)
+TLP_VIEW_FIELD (tc, 0, 20, 0x7)
+TLP_VIEW_FIELD (th, 0, 16, 0x1)
+TLP_VIEW_FIELD (td, 0, 15, 0x1)
+TLP_VIEW_FIELD (ep, 0, 14, 0x1)
+TLP_VIEW_FIELD (at, 0, 10, 0x3)
+TLP_VIEW_FIELD (length, 0, 0, 0x3ff)
+TLP_VIEW_FIELD (first_be, 1, 0, 0xf)
+TLP_VIEW_FIELD (last_be, 1, 4, 0xf)
+TLP_VIEW_FIELD (msg_code, 1, 0, 0xff)
+TLP_VIEW_FIELD (completer, 1, 16, 0xffff)
+TLP_VIEW_FIELD (status, 1, 13, 0x7)
+TLP_VIEW_FIELD (bcm, 1, 12, 0x1)
+TLP_VIEW_FIELD (byte_count, 1, 0, 0xfff)
+TLP_VIEW_FIELD (target, 2, 16, 0xffff)
+TLP_VIEW_FIELD (reg, 2, 0, 0xffc)
+TLP_VIEW_FIELD (lower_address, 2, 0, 0x7f)
+
+static inline uint32_t
+tlp_view_attr (const tlp_view *v)
+{
+  uint32_t dw = tlp_view_dw (v, 0);
+
+  return ((dw >> 16) & 0x4) | ((dw >> 12) & 0x3);
+}
+
+static inline uint32_t
+tlp_view_requester (const tlp_view *v)
+{
+  return tlp_view_dw (v, v->id) >> 16;
+}
+
+static inline uint32_t
+tlp_view_tag (const tlp_view *v)
+{
+  uint32_t dw = tlp_view_dw (v, 0);
+
+  return ((dw >> 14) & 0x200) | ((dw >> 11) & 0x100) |
+    ((tlp_view_dw (v, v->id) >> 8) & 0xff);
+}
+
+/*
+ * Memory and IO requests.
+ */
+static inline uint64_t
+tlp_view_address (const tlp_view *v)
+{
+  uint64_t lo = tlp_view_dw (v, v->type->hdr_dws - 1) & ~0x3u;
+
+  return v->type->hdr_dws == 4 ? ((uint64_t) tlp_view_dw (v, 2) << 32) | lo :
+    lo;
+}
+
+static inline unsigned
+tlp_view_payload_dws (const tlp_view *v)
+{
+  return ((tlp_view_dw (v, 0) - 1) & v->type->len_mask) + v->type->data;
+}
+
+/*
+ * Points v at the header of the TLP in data (as received, count
+ * DWORDs long). Returns where its payload starts, or NULL if the
+ * header is reserved or doesn't fit.
+ */
+static inline const uint32_t *
+tlp_view_init (tlp_view *v,
+               const void *data,
+               unsigned count)
+{
+  unsigned n = 0;
+  const uint32_t *s = data;
+  const tlp_type_info *t;
+
+  if (count == 0) {
+    return NULL;
+  }
+
+  t = &tlp_types[be32toh (s[0]) >> 24];
+  while (t->layout == TLP_LAYOUT_PREFIX) {
+    if (++n > TLP_MAX_PREFIX_DWS || n == count) {
+      return NULL;
+    }
+    t = &tlp_types[be32toh (s[n]) >> 24];
+  }
+
+  if (t->hdr_dws == 0 || t->hdr_dws > count - n) {
+    return NULL;
+  }
+
+  v->dws = s + n;
+  v->type = t;
+  v->prefix_count = n;
+  v->id = t->layout == TLP_LAYOUT_CPL ? 2 : 1;
+  return v->dws + t->hdr_dws;
+}
+
+/*
+ * Encodes a completion to req into out, which has room for a
+ * 3-DWORD header: Cpl, or CplD with payload_dws of data to follow.
+ * Traffic class, attributes, requester ID and tag are req's.
+ * Returns where the payload goes.
+ */
+static inline uint32_t *
+tlp_encode_cpl (const tlp_view *req,
+                uint32_t completer,
+                uint32_t status,
+                uint32_t byte_count,
+                uint32_t lower_address,
+                unsigned payload_dws,
+                uint32_t *out)
+{
+  uint32_t dw0 = tlp_view_dw (req, 0);
+
+  /*
+   * TC, the high tag bits and the attributes sit in the same
+   * DWORD 0 bits for every layout.
+   */
+  out[0] = htobe32 (((payload_dws != 0 ? TLP_CplD : TLP_Cpl) << 24) |
+                    (dw0 & 0x00fc3000) | (payload_dws & 0x3ff));
+  out[1] = htobe32 (((completer & 0xffff) << 16) | ((status & 0x7) << 13) |
+                    (byte_count & 0xfff));
+  out[2] = htobe32 ((tlp_view_dw (req, req->id) & 0xffffff00) |
+                    (lower_address & 0x7f));
+  return out + 3;
+}
+
+/*
+ * TLP filters (see filter.c), matched against TLPs as received.
+ */
+typedef struct tlp_filter tlp_filter;
+
+tlp_filter *
+tlp_filter_compile (const char *expr);
+
+void
+tlp_filter_free (tlp_filter *f);
 
 bool
-tlp_dw_is_prefix (uint32_t dw);
+tlp_filter_match (const tlp_filter *f,
+                  const uint32_t *dws,
+                  unsigned count);
+
 
+/*
+ * TLPs not matching filter (NULL for none) are dropped as soon as
+ * they're deframed, before any receive context hands them out or
+ * copies them. Set it before receiving; it must outlive f.
+ */
+void
+fpga_set_filter (fpga_dev_t *f,
+                 const tlp_filter *filter);
 
 tlp_receive_result_t
 fpga_tlp_receive (tlp_receive_context *c,
                   void **tlp_data,
                   uint32_t *tlp_size);
 
+void
+fpga_rx_context_init (tlp_receive_context *c,
+                      fpga_dev_t *f,
+                      transport_t *t);
+
 int
-fpga_tlp_send (void *tlp_data,
+fpga_tlp_receive_batch (tlp_receive_context *c,
+                        tlp_desc_t *descs,
+                        unsigned max);
+
+void
+fpga_tlp_release (tlp_desc_t *descs,
+                  unsigned count);
+
+/*
+ * Called once the TLP has been handed to the FPGA (status 0)
+ * or the transfer carrying it failed. Times are time_now_ns ().
+ */
+typedef void (*fpga_tx_done_cb) (void *opaque,
+                                 int status,
+                                 uint64_t queued_ns,
+                                 uint64_t done_ns);
+
+typedef struct {
+  uint64_t tlps;
+  uint64_t batches;
+  uint64_t bytes;
+  uint64_t errors;
+  uint64_t latency_ns_total;
+  uint64_t latency_ns_max;
+} fpga_tx_stats;
+
+int
+fpga_tlp_send (fpga_dev_t *f,
+               void *tlp_data,
                uint32_t tlp_size);
 
+int
+fpga_tlp_send_async (fpga_dev_t *f,
+                     void *tlp_data,
+                     uint32_t tlp_size,
+                     fpga_tx_done_cb cb,
+                     void *opaque);
+
+int
+fpga_tx_flush (fpga_dev_t *f);
+
+int
+fpga_tx_poll (fpga_dev_t *f);
+
+void
+fpga_tx_set_deadline (fpga_dev_t *f,
+                      unsigned deadline_us);
+
+void
+fpga_tx_get_stats (fpga_dev_t *f,
+                   fpga_tx_stats *stats);
+
+/*
+ * TX command DWORD following a loopback data DWORD: 0x77 magic,
+ * then the same slot type as in received frames.
+ */
+#define FPGA_TX_LOOPBACK    0x77020000
+
+unsigned
+fpga_loopback_encode (uint32_t *cmd,
+                      const uint32_t *dws,
+                      unsigned count);
+
+/*
+ * Pipelined receive (see pipeline.c): a reader thread doing
+ * transport reads, a deframer thread running the batch receive,
+ * and the consumer in the caller's thread, connected by SPSC
+ * rings.
+ */
+typedef struct pipeline pipeline_t;
+
+typedef void (*pipeline_consume_fn) (void *opaque,
+                                     tlp_desc_t *descs,
+                                     unsigned count);
+
+pipeline_t *
+pipeline_start (fpga_dev_t *f,
+                unsigned depth);
+
+int
+pipeline_run (pipeline_t *p,
+              pipeline_consume_fn consume,
+              void (*idle) (void *),
+              void *opaque);
+
+int
+pipeline_run_merged (pipeline_t **p,
+                     unsigned count,
+                     uint64_t window_ns,
+                     pipeline_consume_fn consume,
+                     void (*idle) (void *),
+                     void *opaque);
+
+void
+pipeline_stop (pipeline_t *p);
+
+void
+pipeline_print_stats (pipeline_t *p,
+                      FILE *f);
+
+void
+pipeline_free (pipeline_t *p);
+
+uint64_t
+time_now_ns (void);
+
+uint64_t
+time_epoch_offset_ns (void);
+
+/*
+ * Request/completion tracker (see tracker.c): pairs non-posted
+ * requests with their completions and keeps latency histograms.
+ */
+typedef struct tracker tracker_t;
+
+tracker_t *
+tracker_new (uint64_t timeout_ns);
+
+void
+tracker_free (tracker_t *t);
+
+void
+tracker_tlp (tracker_t *t,
+             const tlp_desc_t *desc);
+
+void
+tracker_expire (tracker_t *t,
+                uint64_t now_ns);
+
+void
+tracker_print (tracker_t *t,
+               FILE *f);
+
+/*
+ * pcapng capture files (see pcapng.c), one interface per device,
+ * rotated by size or age.
+ */
+typedef struct pcapng pcapng_t;
+
+pcapng_t *
+pcapng_open (const char *path,
+             char *const *if_descs,
+             unsigned if_count,
+             uint64_t max_bytes,
+             uint64_t max_ns,
+             unsigned max_files);
+
+int
+pcapng_write (pcapng_t *p,
+              const tlp_desc_t *desc);
+
+void
+pcapng_set_epoch_offset (pcapng_t *p,
+                         uint64_t offset_ns);
+
+void
+pcapng_print_stats (pcapng_t *p,
+                    FILE *f);
+
+void
+pcapng_close (pcapng_t *p);
+
+/*
+ * Batched TLP export (see export.c).
+ */
+typedef struct export export_t;
+
+/*
+ * Export wire format: an export_dgram per datagram (or stream),
+ * then per TLP an export_rec and its bytes. Big-endian.
+ * Record flags are the TLP_DESC_ ones, plus EXPORT_REC_HEADERS
+ * when only the TLP's header was kept (size is what's left).
+ */
+#define EXPORT_MAGIC        0x53544c50      /* "STLP" */
+#define EXPORT_VERSION      1
+#define EXPORT_REC_HEADERS  0x80
+
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t reserved;
+  uint16_t count;
+} export_dgram;
+
+typedef struct __attribute__((packed)) {
+  uint32_t seq;
+  uint64_t ts_ns;
+  uint8_t dev;
+  uint8_t flags;
+  uint16_t size;
+} export_rec;
+
+/*
+ * What stream export does with TLPs the collector can't keep up
+ * with.
+ */
+typedef enum {
+  EXPORT_BLOCK,
+  EXPORT_DROP_OLDEST,
+  EXPORT_HEADERS,
+} export_policy;
+
+export_t *
+export_udp_open (const char *remote_addr,
+                 in_port_t remote_port,
+                 unsigned mtu,
+                 uint64_t flush_ns);
+
+export_t *
+export_stream_open (const char *spec,
+                    size_t queue_bytes,
+                    export_policy policy,
+                    uint64_t flush_ns);
+
+int
+export_tlp (export_t *e,
+            const tlp_desc_t *desc);
+
+int
+export_flush (export_t *e);
+
+void
+export_poll (export_t *e,
+             uint64_t now_ns);
+
+void
+export_stop (export_t *e);
+
+void
+export_finish (export_t *e);
+
+void
+export_print_stats (export_t *e,
+                    FILE *f);
+
+void
+export_close (export_t *e);
+
+/*
+ * Instrumentation (see stats.c). Histograms are log-linear:
+ * exact below 2^STATS_HIST_SUB_BITS, then that many buckets per
+ * power of two.
+ */
+#define STATS_HIST_SUB_BITS 3
+#define STATS_HIST_BUCKETS  ((64 - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS)
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[STATS_HIST_BUCKETS];
+} stats_hist;
+
+typedef struct {
+  /*
+   * ftdi.c, RX (reader thread).
+   */
+  uint64_t usb_rx_transfers;
+  uint64_t usb_rx_bytes;
+  uint64_t usb_rx_short;
+  uint64_t usb_rx_errors;
+  stats_hist usb_rx_latency_us;
+  stats_hist usb_rx_wait_us;
+  stats_hist usb_rx_size;
+
+  /*
+   * ftdi.c, TX.
+   */
+  uint64_t usb_tx_transfers;
+  uint64_t usb_tx_bytes;
+  uint64_t usb_tx_errors;
+  stats_hist usb_tx_latency_us;
+  stats_hist usb_tx_size;
+
+  /*
+   * fpga.c (deframer thread).
+   */
+  uint64_t deframe_ns;
+  uint64_t deframe_bytes;
+  uint64_t rx_filler_dws;
+  uint64_t rx_tlps;
+  uint64_t rx_corrupt;
+  uint64_t rx_out_of_sync;
+  uint64_t rx_resync_bytes;
+  uint64_t rx_resync_tlps;
+  uint64_t rx_filtered;
+} screamer_stats_t;
+
+static inline unsigned
+stats_hist_index (uint64_t v)
+{
+  unsigned e;
+
+  if (v < (1u << STATS_HIST_SUB_BITS)) {
+    return v;
+  }
+
+  e = 63 - __builtin_clzll (v);
+  return ((e - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS) |
+         ((v >> (e - STATS_HIST_SUB_BITS)) &
+          ((1u << STATS_HIST_SUB_BITS) - 1));
+}
+
+static inline void
+stats_hist_add (stats_hist *h,
+                uint64_t v)
+{
+  h->buckets[stats_hist_index (v)]++;
+  h->count++;
+  h->sum += v;
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+/*
+ * As stats_hist_add, for a histogram several threads update.
+ */
+static inline void
+stats_hist_add_shared (stats_hist *h,
+                       uint64_t v)
+{
+  uint64_t max;
+
+  __atomic_fetch_add (&h->buckets[stats_hist_index (v)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->sum, v, __ATOMIC_RELAXED);
+  max = __atomic_load_n (&h->max, __ATOMIC_RELAXED);
+  while (v > max &&
+         !__atomic_compare_exchange_n (&h->max, &max, v, true,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+uint64_t
+stats_hist_percentile (const stats_hist *h,
+                       unsigned pct);
+
+void
+stats_print_hist (FILE *f,
+                  const char *name,
+                  const char *unit,
+                  const stats_hist *h);
+
+#ifndef SCREAMER_NO_STATS
+
+extern screamer_stats_t screamer_stats;
+
+#define STATS_INC(field, n) \
+  ((void) __atomic_fetch_add (&screamer_stats.field, (n), __ATOMIC_RELAXED))
+#define STATS_HIST(field, v) stats_hist_add_shared (&screamer_stats.field, (v))
+#define STATS_NOW() time_now_ns ()
+
+void
+stats_dump (FILE *f);
+
+void
+stats_init (FILE *f);
+
+void
+stats_poll (void);
+
+#else
+
+#define STATS_INC(field, n) ((void) sizeof (n))
+#define STATS_HIST(field, v) ((void) sizeof (v))
+#define STATS_NOW() ((uint64_t) 0)
+
+static inline void
+stats_dump (FILE *f)
+{
+  (void) f;
+}
+
+static inline void
+stats_init (FILE *f)
+{
+  (void) f;
+}
+
+static inline void
+stats_poll (void)
+{
+}
+
+#endif
+
 void hex_dump(uint8_t *buffer,
               int num_bytes,
               int line_length);
@@ -0,0 +1,177 @@
+/*
+ * Link and receive path instrumentation: plain counters and
+ * log-linear histograms, bumped with relaxed atomics by whichever
+ * thread owns that part of the path, and dumped on SIGUSR1 and
+ * at exit. They cover all devices together, so with several the
+ * per-device threads all add to the same counters.
+ * Configure with --disable-stats to compile it all out, but for
+ * the histogram helpers, which the transaction tracker uses too.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+#include <signal.h>
+
+/*
+ * Smallest value that lands in bucket index.
+ */
+static uint64_t
+stats_bucket_value (unsigned index)
+{
+  unsigned e;
+  uint64_t m;
+
+  if (index < (1u << STATS_HIST_SUB_BITS)) {
+    return index;
+  }
+
+  e = (index >> STATS_HIST_SUB_BITS) + STATS_HIST_SUB_BITS - 1;
+  m = index & ((1u << STATS_HIST_SUB_BITS) - 1);
+  return (1ull << e) | (m << (e - STATS_HIST_SUB_BITS));
+}
+
+uint64_t
+stats_hist_percentile (const stats_hist *h,
+                       unsigned pct)
+{
+  unsigned i;
+  uint64_t seen;
+  uint64_t want;
+
+  if (h->count == 0) {
+    return 0;
+  }
+  if (pct >= 100) {
+    return h->max;
+  }
+
+  want = (h->count * pct + 99) / 100;
+  seen = 0;
+  for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= want && seen != 0) {
+      return stats_bucket_value (i);
+    }
+  }
+
+  return h->max;
+}
+
+void
+stats_print_hist (FILE *f,
+                  const char *name,
+                  const char *unit,
+                  const stats_hist *h)
+{
+  if (h->count == 0) {
+    return;
+  }
+
+  fprintf (f, "  %-18s %10" PRIu64 " samples  avg %10.1f  p50 %8" PRIu64
+           "  p90 %8" PRIu64 "  p99 %8" PRIu64 "  max %8" PRIu64 " %s\n",
+           name, h->count, (double) h->sum / h->count,
+           stats_hist_percentile (h, 50), stats_hist_percentile (h, 90),
+           stats_hist_percentile (h, 99), h->max, unit);
+}
+
+#ifndef SCREAMER_NO_STATS
+
+screamer_stats_t screamer_stats;
+
+static volatile sig_atomic_t dump_requested;
+static FILE *dump_file;
+
+/*
+ * Everything in screamer_stats_t is a uint64_t; copy it a word at
+ * a time so the dump doesn't race the threads bumping it.
+ */
+static void
+stats_snapshot (screamer_stats_t *s)
+{
+  uint64_t *src = (uint64_t *) &screamer_stats;
+  uint64_t *dst = (uint64_t *) s;
+  size_t i;
+
+  for (i = 0; i < sizeof (*s) / sizeof (uint64_t); i++) {
+    dst[i] = __atomic_load_n (&src[i], __ATOMIC_RELAXED);
+  }
+}
+
+void
+stats_dump (FILE *f)
+{
+  screamer_stats_t snap;
+  screamer_stats_t *s = &snap;
+
+  stats_snapshot (s);
+
+  fprintf (f, "USB RX: %" PRIu64 " transfers, %" PRIu64 " bytes, "
+           "%" PRIu64 " short, %" PRIu64 " failed\n",
+           s->usb_rx_transfers, s->usb_rx_bytes, s->usb_rx_short,
+           s->usb_rx_errors);
+  stats_print_hist (f, "transfer latency", "us", &s->usb_rx_latency_us);
+  stats_print_hist (f, "read wait", "us", &s->usb_rx_wait_us);
+  stats_print_hist (f, "bytes per read", "B", &s->usb_rx_size);
+
+  fprintf (f, "USB TX: %" PRIu64 " transfers, %" PRIu64 " bytes, "
+           "%" PRIu64 " failed\n",
+           s->usb_tx_transfers, s->usb_tx_bytes, s->usb_tx_errors);
+  stats_print_hist (f, "transfer latency", "us", &s->usb_tx_latency_us);
+  stats_print_hist (f, "bytes per write", "B", &s->usb_tx_size);
+
+  fprintf (f, "Deframer: %" PRIu64 " bytes in %" PRIu64 " ms (%.0f ns/MB), "
+           "%" PRIu64 " filler DWORDs (%.2f%%), %" PRIu64 " TLPs, "
+           "%" PRIu64 " corrupt, %" PRIu64 " out of sync "
+           "(%" PRIu64 " bytes skipped, %" PRIu64 " TLPs dropped), "
+           "%" PRIu64 " filtered out\n",
+           s->deframe_bytes, s->deframe_ns / 1000000,
+           s->deframe_bytes != 0 ?
+           s->deframe_ns * 1e6 / s->deframe_bytes : 0.0,
+           s->rx_filler_dws,
+           s->deframe_bytes != 0 ?
+           s->rx_filler_dws * 4 * 100.0 / s->deframe_bytes : 0.0,
+           s->rx_tlps, s->rx_corrupt, s->rx_out_of_sync,
+           s->rx_resync_bytes, s->rx_resync_tlps, s->rx_filtered);
+  fflush (f);
+}
+
+static void
+stats_on_sigusr1 (int sig)
+{
+  (void) sig;
+
+  dump_requested = 1;
+}
+
+static void
+stats_at_exit (void)
+{
+  stats_dump (dump_file);
+}
+
+/*
+ * Dumps go to f: when asked for with SIGUSR1 (the next time
+ * stats_poll runs) and at exit.
+ */
+void
+stats_init (FILE *f)
+{
+  dump_file = f;
+  signal (SIGUSR1, stats_on_sigusr1);
+  atexit (stats_at_exit);
+}
+
+/*
+ * Safe to call from several threads; only one of them dumps.
+ */
+void
+stats_poll (void)
+{
+  if (dump_requested &&
+      __atomic_exchange_n (&dump_requested, 0, __ATOMIC_RELAXED)) {
+    stats_dump (dump_file);
+  }
+}
+
+#endif
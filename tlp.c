@@ -1,150 +1,314 @@
+/*
+ * TLP header codec.
+ *
+ * tlp_types says, for each fmt/type byte, which header layout it
+ * uses, how many header DWORDs it has and whether it carries data,
+ * so header lengths are one table lookup. Decoding and encoding
+ * switch on the layout once, then each layout is a straight line
+ * of shifts and masks on host-order DWORDs. Nothing depends on
+ * how the compiler lays out bitfields.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
 #include "screamer.h"
 
-bool
-tlp_dw_is_prefix (uint32_t dw)
+#define TLP_TYPE(n, l, h, d) { .name = n, .layout = TLP_LAYOUT_##l, \
+                               .hdr_dws = h, .data = d,           \
+                               .len_base = h + d,                 \
+                               .len_mask = d ? 0x3ff : 0,         \
+                               .td_mask = h > 1 }
+
+const tlp_type_info tlp_types[256] = {
+  [TLP_MRd32] = TLP_TYPE ("MRd32", MEM32, 3, false),
+  [TLP_MRd64] = TLP_TYPE ("MRd64", MEM64, 4, false),
+  [TLP_MRdLk32] = TLP_TYPE ("MRdLk32", MEM32, 3, false),
+  [TLP_MRdLk64] = TLP_TYPE ("MRdLk64", MEM64, 4, false),
+  [TLP_MWr32] = TLP_TYPE ("MWr32", MEM32, 3, true),
+  [TLP_MWr64] = TLP_TYPE ("MWr64", MEM64, 4, true),
+  [TLP_IORd] = TLP_TYPE ("IORd", MEM32, 3, false),
+  [TLP_IOWr] = TLP_TYPE ("IOWr", MEM32, 3, true),
+  [TLP_CfgRd0] = TLP_TYPE ("CfgRd0", CFG, 3, false),
+  [TLP_CfgRd1] = TLP_TYPE ("CfgRd1", CFG, 3, false),
+  [TLP_CfgWr0] = TLP_TYPE ("CfgWr0", CFG, 3, true),
+  [TLP_CfgWr1] = TLP_TYPE ("CfgWr1", CFG, 3, true),
+  [TLP_Msg ... TLP_Msg + 7] = TLP_TYPE ("Msg", MSG, 4, false),
+  [TLP_MsgD ... TLP_MsgD + 7] = TLP_TYPE ("MsgD", MSG, 4, true),
+  [TLP_FetchAdd32] = TLP_TYPE ("FetchAdd32", MEM32, 3, true),
+  [TLP_FetchAdd64] = TLP_TYPE ("FetchAdd64", MEM64, 4, true),
+  [TLP_Swap32] = TLP_TYPE ("Swap32", MEM32, 3, true),
+  [TLP_Swap64] = TLP_TYPE ("Swap64", MEM64, 4, true),
+  [TLP_CAS32] = TLP_TYPE ("CAS32", MEM32, 3, true),
+  [TLP_CAS64] = TLP_TYPE ("CAS64", MEM64, 4, true),
+  [TLP_DMWr32] = TLP_TYPE ("DMWr32", MEM32, 3, true),
+  [TLP_DMWr64] = TLP_TYPE ("DMWr64", MEM64, 4, true),
+  [TLP_Cpl] = TLP_TYPE ("Cpl", CPL, 3, false),
+  [TLP_CplD] = TLP_TYPE ("CplD", CPL, 3, true),
+  [TLP_CplLk] = TLP_TYPE ("CplLk", CPL, 3, false),
+  [TLP_CplDLk] = TLP_TYPE ("CplDLk", CPL, 3, true),
+  [TLP_LPrfx ... TLP_LPrfx + 15] = TLP_TYPE ("LPrfx", PREFIX, 1, false),
+  [TLP_EPrfx ... TLP_EPrfx + 15] = TLP_TYPE ("EPrfx", PREFIX, 1, false),
+};
+
+/*
+ * Length of the TLP at dws (prefixes, header, payload and digest)
+ * as claimed by its header, looking at no more than count DWORDs
+ * for the header. 0 if there's no header, or it's reserved.
+ */
+unsigned
+tlp_len_dws (const uint32_t *dws,
+             unsigned count)
 {
-  uint8_t dw0 = (uint8_t) dw;
-  uint8_t fmt = dw0 >> 5;
-
-  if (fmt == 4) {
-    /*
-     * Prefix.
-     */
-    return true;
+  unsigned i;
+
+  for (i = 0; i < count && i <= TLP_MAX_PREFIX_DWS; i++) {
+    if (!tlp_dw_is_prefix (dws[i])) {
+      return tlp_types[be32toh (dws[i]) >> 24].hdr_dws != 0 ?
+        i + tlp_packet_len_dws (dws[i], NULL) : 0;
+    }
   }
 
-  return false;
+  return 0;
 }
 
-unsigned
-tlp_cfg_reg (tlp_cfg_t *cfg)
+/*
+ * DWORD 0, shared by every layout but prefixes. T9 and T8 (bits
+ * 23 and 19) are the top bits of a 10-bit tag, and bit 18 is attr
+ * bit 2, ID-based ordering.
+ */
+static inline void
+tlp_dw0_get (tlp_hdr *h,
+             uint32_t dw)
+{
+  h->fmt_type = dw >> 24;
+  h->tc = (dw >> 20) & 0x7;
+  h->attr = ((dw >> 16) & 0x4) | ((dw >> 12) & 0x3);
+  h->th = (dw >> 16) & 0x1;
+  h->td = (dw >> 15) & 0x1;
+  h->ep = (dw >> 14) & 0x1;
+  h->at = (dw >> 10) & 0x3;
+  h->length = dw & 0x3ff;
+  h->tag = ((dw >> 14) & 0x200) | ((dw >> 11) & 0x100);
+}
+
+static inline uint32_t
+tlp_dw0_put (const tlp_hdr *h)
 {
-  return ((unsigned) cfg->ext_reg_num << 8) +
-    ((unsigned) cfg->reg_num << 2);
+  return ((h->fmt_type & 0xff) << 24) | ((h->tag & 0x200) << 14) |
+    ((h->tc & 0x7) << 20) | ((h->tag & 0x100) << 11) |
+    ((h->attr & 0x4) << 16) | ((h->th & 0x1) << 16) |
+    ((h->td & 0x1) << 15) | ((h->ep & 0x1) << 14) |
+    ((h->attr & 0x3) << 12) | ((h->at & 0x3) << 10) | (h->length & 0x3ff);
 }
 
-int
-tlp_hdr_len_dws (tlp_header_t *tlp_header,
-                 int *payload_len_dws)
+/*
+ * Requester ID, tag and byte enables, as in requests.
+ */
+static inline void
+tlp_req_get (tlp_hdr *h,
+             uint32_t dw)
 {
-  int len;
-  int count;
-
-  if (tlp_header->fmt == 4) {
-    /*
-     * Prefix, which we ignore here.
-     */
-    if (payload_len_dws != NULL) {
-      *payload_len_dws = 0;
+  h->requester = dw >> 16;
+  h->tag |= (dw >> 8) & 0xff;
+  h->last_be = (dw >> 4) & 0xf;
+  h->first_be = dw & 0xf;
+}
+
+static inline uint32_t
+tlp_req_put (const tlp_hdr *h)
+{
+  return ((h->requester & 0xffff) << 16) | ((h->tag & 0xff) << 8) |
+    ((h->last_be & 0xf) << 4) | (h->first_be & 0xf);
+}
+
+/*
+ * Decodes the header of the TLP in data (as received, count
+ * DWORDs long) into h. Returns where its payload starts, or NULL
+ * if the header is reserved or doesn't fit. Each layout is decoded
+ * in a straight line, every member it doesn't have set to 0;
+ * prefixes past prefix_count are left alone.
+ */
+const uint32_t *
+tlp_decode (const void *data,
+            unsigned count,
+            tlp_hdr *h)
+{
+  unsigned n = 0;
+  uint32_t dw0;
+  uint32_t dw1;
+  uint32_t dw2;
+  const uint32_t *s = data;
+  const tlp_type_info *t;
+
+  while (count != 0 && tlp_dw_is_prefix (*s)) {
+    if (n == TLP_MAX_PREFIX_DWS) {
+      return NULL;
     }
-    return 1;
+    h->prefixes[n++] = be32toh (*s++);
+    count--;
   }
+  h->prefix_count = n;
 
-  count = 0;
-  len = tlp_header->length;
-  if (len == 0) {
-    len = 0x400;
+  if (count == 0) {
+    return NULL;
   }
 
-  switch (tlp_header->fmt) {
-  case 0:
-    count = 3;
-    if (payload_len_dws != NULL) {
-      *payload_len_dws = 0;
-    }
+  dw0 = be32toh (s[0]);
+  t = &tlp_types[dw0 >> 24];
+  if (t->hdr_dws == 0 || t->hdr_dws > count) {
+    return NULL;
+  }
+
+  tlp_dw0_get (h, dw0);
+  dw1 = be32toh (s[1]);
+  dw2 = be32toh (s[2]);
+  switch (t->layout) {
+  case TLP_LAYOUT_MEM32:
+    tlp_req_get (h, dw1);
+    h->address_lo = dw2 & ~0x3u;
+    h->address_hi = 0;
+    h->ph = dw2 & 0x3;
+    h->target = 0;
+    h->reg = 0;
+    h->msg_code = 0;
+    h->msg_dw2 = 0;
+    h->msg_dw3 = 0;
+    h->completer = 0;
+    h->status = 0;
+    h->bcm = 0;
+    h->byte_count = 0;
+    h->lower_address = 0;
     break;
-  case 1:
-    count = 4;
-    if (payload_len_dws != NULL) {
-      *payload_len_dws = 0;
-    }
+  case TLP_LAYOUT_MEM64:
+    tlp_req_get (h, dw1);
+    h->address_hi = dw2;
+    dw2 = be32toh (s[3]);
+    h->address_lo = dw2 & ~0x3u;
+    h->ph = dw2 & 0x3;
+    h->target = 0;
+    h->reg = 0;
+    h->msg_code = 0;
+    h->msg_dw2 = 0;
+    h->msg_dw3 = 0;
+    h->completer = 0;
+    h->status = 0;
+    h->bcm = 0;
+    h->byte_count = 0;
+    h->lower_address = 0;
     break;
-  case 2:
-    count = 3 + len;
-    if (payload_len_dws != NULL) {
-      *payload_len_dws = len;
-    }
+  case TLP_LAYOUT_CFG:
+    tlp_req_get (h, dw1);
+    h->address_lo = 0;
+    h->address_hi = 0;
+    h->ph = 0;
+    h->target = dw2 >> 16;
+    h->reg = dw2 & 0xffc;
+    h->msg_code = 0;
+    h->msg_dw2 = 0;
+    h->msg_dw3 = 0;
+    h->completer = 0;
+    h->status = 0;
+    h->bcm = 0;
+    h->byte_count = 0;
+    h->lower_address = 0;
+    break;
+  case TLP_LAYOUT_MSG:
+    h->requester = dw1 >> 16;
+    h->tag |= (dw1 >> 8) & 0xff;
+    h->first_be = 0;
+    h->last_be = 0;
+    h->address_lo = 0;
+    h->address_hi = 0;
+    h->ph = 0;
+    h->target = 0;
+    h->reg = 0;
+    h->msg_code = dw1 & 0xff;
+    h->msg_dw2 = dw2;
+    h->msg_dw3 = be32toh (s[3]);
+    h->completer = 0;
+    h->status = 0;
+    h->bcm = 0;
+    h->byte_count = 0;
+    h->lower_address = 0;
+    break;
+  case TLP_LAYOUT_CPL:
+    h->completer = dw1 >> 16;
+    h->status = (dw1 >> 13) & 0x7;
+    h->bcm = (dw1 >> 12) & 0x1;
+    h->byte_count = dw1 & 0xfff;
+    h->requester = dw2 >> 16;
+    h->tag |= (dw2 >> 8) & 0xff;
+    h->lower_address = dw2 & 0x7f;
+    h->first_be = 0;
+    h->last_be = 0;
+    h->address_lo = 0;
+    h->address_hi = 0;
+    h->ph = 0;
+    h->target = 0;
+    h->reg = 0;
+    h->msg_code = 0;
+    h->msg_dw2 = 0;
+    h->msg_dw3 = 0;
     break;
-  case 3:
-    count = 4 + len;
-    if (payload_len_dws != NULL) {
-      *payload_len_dws = len;
-    }
   }
 
-  return count + tlp_header->td;
+  return s + t->hdr_dws;
 }
 
-int
-tlp_packet_len_dws (uint32_t raw_leader,
-                    int *payload_len_dws)
+/*
+ * Encodes h (prefixes and header) into out, which has room for
+ * out_dws DWORDs. Returns where the payload goes, or NULL if
+ * fmt_type is reserved or out is too small. Fields are truncated
+ * to their width.
+ */
+uint32_t *
+tlp_encode (const tlp_hdr *h,
+            void *out,
+            unsigned out_dws)
 {
-  tlp_header_t tlp_header;
-
-  tlp_header._dw = be32toh (raw_leader);
-  return tlp_hdr_len_dws (&tlp_header, payload_len_dws);
-}
-
-void *
-tlp_host_to_packet (tlp_t *tlp,
-                    void *out,
-                    int out_size)
-{
-  int i;
-  int len_dws;
-  int payload_len_dws;
-  uint32_t *s = (void *) tlp;
+  unsigned i;
   uint32_t *d = out;
+  const tlp_type_info *t;
 
-  len_dws = tlp_hdr_len_dws (&(tlp->hdr), &payload_len_dws);
-  /*
-   * tlp begins with a header, not a prefix.
-   */
-  assert (len_dws != 1);
-
-  len_dws -= payload_len_dws;
-  assert (len_dws <= (out_size * (int) sizeof (uint32_t)));
-  assert (len_dws <= (int) sizeof (tlp_t));
-
-  /*
-   * Only swap the packet, not payload.
-   */
-  for (i = 0; i < len_dws; i++) {
-    *d++ = htobe32 (*s++);
+  t = &tlp_types[h->fmt_type & 0xff];
+  if (t->hdr_dws < 3 || h->prefix_count > TLP_MAX_PREFIX_DWS ||
+      h->prefix_count + t->hdr_dws > out_dws) {
+    return NULL;
   }
 
-  /*
-   * Pointer to payload bytes, if any.
-   */
-  return d;
-}
-
-void *
-tlp_packet_to_host (void *data,
-                    tlp_t *tlp,
-                    int *payload_len_dws)
-{
-  int i;
-  int len_dws;
-  uint32_t *s = data;
-  uint32_t *d = (void *) tlp;
-
-  *payload_len_dws = 0;
-  while ((len_dws =
-          tlp_packet_len_dws (*s, payload_len_dws)) == 1) {
-    s++;
+  for (i = 0; i < h->prefix_count; i++) {
+    *d++ = htobe32 (h->prefixes[i]);
   }
 
-  /*
-   * s now points to the TLP header raw data.
-   */
-  len_dws -= *payload_len_dws;
-  assert (len_dws <= (int) sizeof (tlp_t));
-
-  for (i = 0; i < len_dws; i++) {
-    *d++ = be32toh (*s++);
+  d[0] = htobe32 (tlp_dw0_put (h));
+  switch (t->layout) {
+  case TLP_LAYOUT_MEM32:
+    d[1] = htobe32 (tlp_req_put (h));
+    d[2] = htobe32 ((h->address_lo & ~0x3u) | (h->ph & 0x3));
+    break;
+  case TLP_LAYOUT_MEM64:
+    d[1] = htobe32 (tlp_req_put (h));
+    d[2] = htobe32 (h->address_hi);
+    d[3] = htobe32 ((h->address_lo & ~0x3u) | (h->ph & 0x3));
+    break;
+  case TLP_LAYOUT_CFG:
+    d[1] = htobe32 (tlp_req_put (h));
+    d[2] = htobe32 (((h->target & 0xffff) << 16) | (h->reg & 0xffc));
+    break;
+  case TLP_LAYOUT_MSG:
+    d[1] = htobe32 (((h->requester & 0xffff) << 16) |
+                    ((h->tag & 0xff) << 8) | (h->msg_code & 0xff));
+    d[2] = htobe32 (h->msg_dw2);
+    d[3] = htobe32 (h->msg_dw3);
+    break;
+  case TLP_LAYOUT_CPL:
+    d[1] = htobe32 (((h->completer & 0xffff) << 16) |
+                    ((h->status & 0x7) << 13) | ((h->bcm & 0x1) << 12) |
+                    (h->byte_count & 0xfff));
+    d[2] = htobe32 (((h->requester & 0xffff) << 16) |
+                    ((h->tag & 0xff) << 8) | (h->lower_address & 0x7f));
+    break;
   }
 
-  return s;
+  return d + t->hdr_dws;
 }
-
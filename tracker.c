@@ -0,0 +1,526 @@
+/*
+ * Request/completion tracker.
+ *
+ * Non-posted requests (reads, IO and config accesses, atomics,
+ * DMWr) wait in a fixed pool of entries until completions with
+ * the same device, requester ID and tag come in. Reads may be
+ * completed in several parts; each part's byte count must pick
+ * up where the last one left off, and the last one ends the
+ * transaction. Entries are found through an open-addressed index
+ * (linear probing, backward-shift deletion) and also kept on a
+ * list in request order, so timeouts are found by looking at the
+ * oldest ones only. Nothing is allocated after tracker_new; with
+ * the pool exhausted, the oldest request is given up on.
+ *
+ * Latency is from the request's receive timestamp to the final
+ * completion's, so its resolution is that of the transport
+ * buffers they came in.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+
+#define TRACKER_ENTRIES             8192
+#define TRACKER_INDEX_BITS          14
+#define TRACKER_INDEX_SLOTS         (1u << TRACKER_INDEX_BITS)
+#define TRACKER_NONE                0xffffffffu
+
+/*
+ * Requesters beyond the first TRACKER_REQUESTERS share one
+ * histogram.
+ */
+#define TRACKER_REQUESTERS          64
+
+#define TRACKER_DEPTH_INTERVAL_NS   (100 * 1000000ull)
+#define TRACKER_DEPTH_SAMPLES       64
+
+_Static_assert (TRACKER_INDEX_SLOTS >= 2 * TRACKER_ENTRIES,
+                "tracker index at most half full");
+
+/*
+ * Non-posted request types, one latency histogram each.
+ */
+static const uint8_t tracker_types[] = {
+  TLP_MRd32, TLP_MRd64, TLP_MRdLk32, TLP_MRdLk64,
+  TLP_IORd, TLP_IOWr,
+  TLP_CfgRd0, TLP_CfgRd1, TLP_CfgWr0, TLP_CfgWr1,
+  TLP_FetchAdd32, TLP_FetchAdd64, TLP_Swap32, TLP_Swap64,
+  TLP_CAS32, TLP_CAS64,
+  TLP_DMWr32, TLP_DMWr64,
+};
+
+#define TRACKER_TYPES (sizeof (tracker_types) / sizeof (tracker_types[0]))
+
+typedef struct {
+  uint32_t key;
+  uint8_t type;
+  uint8_t requester;
+  uint16_t parts;
+  /*
+   * Byte count the next completion should have, or 0 if it
+   * isn't checked.
+   */
+  uint32_t expect_bc;
+  uint64_t ts_ns;
+  /*
+   * Request order, or the free list (next only).
+   */
+  uint32_t prev;
+  uint32_t next;
+} tracker_entry;
+
+typedef struct {
+  uint64_t requests;
+  uint64_t timeouts;
+  stats_hist latency_ns;
+} tracker_class;
+
+struct tracker {
+  uint64_t timeout_ns;
+
+  uint32_t index[TRACKER_INDEX_SLOTS];
+  tracker_entry entries[TRACKER_ENTRIES];
+  uint32_t oldest;
+  uint32_t newest;
+  uint32_t free;
+  unsigned outstanding;
+  unsigned peak;
+
+  /*
+   * Index into types + 1 by fmt/type byte, 0 for posted.
+   */
+  uint8_t type_of[256];
+  tracker_class types[TRACKER_TYPES];
+
+  /*
+   * Index into requesters + 1 by requester ID, 0 if not seen
+   * yet. The last one is everybody else.
+   */
+  uint8_t requester_of[65536];
+  uint16_t requester_ids[TRACKER_REQUESTERS];
+  unsigned requester_count;
+  tracker_class requesters[TRACKER_REQUESTERS + 1];
+
+  uint64_t requests;
+  uint64_t completions;
+  uint64_t done;
+  uint64_t split;
+  uint64_t timeouts;
+  uint64_t unexpected;
+  uint64_t bad_byte_counts;
+  uint64_t tags_reused;
+  uint64_t dropped;
+  uint64_t status[8];
+
+  /*
+   * Outstanding requests: sampled at every request, and the
+   * peak of each TRACKER_DEPTH_INTERVAL_NS (a ring of the last
+   * TRACKER_DEPTH_SAMPLES).
+   */
+  stats_hist depth;
+  uint64_t window_ns;
+  unsigned window_peak;
+  unsigned depth_peaks[TRACKER_DEPTH_SAMPLES];
+  unsigned depth_count;
+};
+
+/*
+ * Completions go back to the device the request came from.
+ */
+static inline uint32_t
+tracker_key (unsigned dev,
+             uint32_t requester,
+             uint32_t tag)
+{
+  return (dev << 26) | (requester << 10) | tag;
+}
+
+static inline uint32_t
+tracker_hash (uint32_t key)
+{
+  return (key * 0x9e3779b1u) >> (32 - TRACKER_INDEX_BITS);
+}
+
+/*
+ * Index slot of the entry for key, or TRACKER_NONE.
+ */
+static uint32_t
+tracker_find (tracker_t *t,
+              uint32_t key)
+{
+  uint32_t i;
+
+  for (i = tracker_hash (key); t->index[i] != TRACKER_NONE;
+       i = (i + 1) & (TRACKER_INDEX_SLOTS - 1)) {
+    if (t->entries[t->index[i]].key == key) {
+      return i;
+    }
+  }
+
+  return TRACKER_NONE;
+}
+
+/*
+ * Frees the entry at index slot i, moving up whichever entries
+ * after it probed past it so that lookups still find them.
+ */
+static void
+tracker_remove (tracker_t *t,
+                uint32_t i)
+{
+  uint32_t j;
+  uint32_t k;
+  uint32_t n = t->index[i];
+  tracker_entry *e = &t->entries[n];
+
+  if (e->prev != TRACKER_NONE) {
+    t->entries[e->prev].next = e->next;
+  } else {
+    t->oldest = e->next;
+  }
+  if (e->next != TRACKER_NONE) {
+    t->entries[e->next].prev = e->prev;
+  } else {
+    t->newest = e->prev;
+  }
+  e->next = t->free;
+  t->free = n;
+  t->outstanding--;
+
+  t->index[i] = TRACKER_NONE;
+  for (j = (i + 1) & (TRACKER_INDEX_SLOTS - 1); t->index[j] != TRACKER_NONE;
+       j = (j + 1) & (TRACKER_INDEX_SLOTS - 1)) {
+    k = tracker_hash (t->entries[t->index[j]].key);
+    /*
+     * Stays unless its home slot k is cyclically in (i, j].
+     */
+    if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+      t->index[i] = t->index[j];
+      t->index[j] = TRACKER_NONE;
+      i = j;
+    }
+  }
+}
+
+tracker_t *
+tracker_new (uint64_t timeout_ns)
+{
+  unsigned i;
+  tracker_t *t;
+
+  t = calloc (1, sizeof (*t));
+  if (t == NULL) {
+    return NULL;
+  }
+
+  t->timeout_ns = timeout_ns;
+  for (i = 0; i < TRACKER_INDEX_SLOTS; i++) {
+    t->index[i] = TRACKER_NONE;
+  }
+  for (i = 0; i < TRACKER_ENTRIES; i++) {
+    t->entries[i].next = i + 1 < TRACKER_ENTRIES ? i + 1 : TRACKER_NONE;
+  }
+  t->free = 0;
+  t->oldest = TRACKER_NONE;
+  t->newest = TRACKER_NONE;
+  for (i = 0; i < TRACKER_TYPES; i++) {
+    t->type_of[tracker_types[i]] = i + 1;
+  }
+
+  return t;
+}
+
+void
+tracker_free (tracker_t *t)
+{
+  free (t);
+}
+
+static tracker_class *
+tracker_requester (tracker_t *t,
+                   uint16_t id)
+{
+  if (t->requester_of[id] == 0) {
+    if (t->requester_count == TRACKER_REQUESTERS) {
+      return &t->requesters[TRACKER_REQUESTERS];
+    }
+    t->requester_ids[t->requester_count] = id;
+    t->requester_of[id] = ++t->requester_count;
+  }
+
+  return &t->requesters[t->requester_of[id] - 1];
+}
+
+static void
+tracker_give_up (tracker_t *t,
+                 uint32_t n)
+{
+  tracker_remove (t, tracker_find (t, t->entries[n].key));
+}
+
+/*
+ * Times out requests older than timeout_ns as of now_ns.
+ */
+void
+tracker_expire (tracker_t *t,
+                uint64_t now_ns)
+{
+  while (t->oldest != TRACKER_NONE &&
+         t->entries[t->oldest].ts_ns + t->timeout_ns < now_ns) {
+    t->timeouts++;
+    t->types[t->entries[t->oldest].type].timeouts++;
+    t->requesters[t->entries[t->oldest].requester].timeouts++;
+    tracker_give_up (t, t->oldest);
+  }
+}
+
+static void
+tracker_sample (tracker_t *t,
+                uint64_t now_ns)
+{
+  if (t->window_ns == 0) {
+    t->window_ns = now_ns;
+  }
+
+  while (now_ns >= t->window_ns + TRACKER_DEPTH_INTERVAL_NS) {
+    t->depth_peaks[t->depth_count++ % TRACKER_DEPTH_SAMPLES] = t->window_peak;
+    t->window_ns += TRACKER_DEPTH_INTERVAL_NS;
+    t->window_peak = t->outstanding;
+  }
+
+  if (t->outstanding > t->window_peak) {
+    t->window_peak = t->outstanding;
+  }
+}
+
+/*
+ * Bytes a memory read asks for, which is what its first
+ * completion's byte count says is left.
+ */
+static uint32_t
+tracker_read_bytes (const tlp_hdr *h)
+{
+  unsigned dws = ((h->length - 1) & 0x3ff) + 1;
+
+  if (dws == 1) {
+    if (h->first_be == 0) {
+      return 1;
+    }
+    return 32 - __builtin_clz (h->first_be) - __builtin_ctz (h->first_be);
+  }
+
+  if (h->first_be == 0 || h->last_be == 0) {
+    return 0;
+  }
+  return dws * 4 - __builtin_ctz (h->first_be) -
+    (__builtin_clz (h->last_be) - 28);
+}
+
+static void
+tracker_request (tracker_t *t,
+                 const tlp_hdr *h,
+                 unsigned dev,
+                 uint64_t now_ns)
+{
+  uint32_t i;
+  uint32_t n;
+  uint32_t key;
+  tracker_entry *e;
+  tracker_class *r;
+
+  key = tracker_key (dev, h->requester, h->tag);
+  i = tracker_find (t, key);
+  if (i != TRACKER_NONE) {
+    /*
+     * The earlier request with this tag must have been lost.
+     */
+    t->tags_reused++;
+    tracker_give_up (t, t->index[i]);
+  }
+
+  if (t->free == TRACKER_NONE) {
+    t->dropped++;
+    tracker_give_up (t, t->oldest);
+  }
+
+  n = t->free;
+  e = &t->entries[n];
+  t->free = e->next;
+
+  r = tracker_requester (t, h->requester);
+  e->key = key;
+  e->type = t->type_of[h->fmt_type] - 1;
+  e->requester = r - t->requesters;
+  e->parts = 0;
+  e->expect_bc = 0;
+  if (h->fmt_type == TLP_MRd32 || h->fmt_type == TLP_MRd64 ||
+      h->fmt_type == TLP_MRdLk32 || h->fmt_type == TLP_MRdLk64) {
+    e->expect_bc = tracker_read_bytes (h);
+  } else if (tlp_types[h->fmt_type & 0xff].layout == TLP_LAYOUT_CFG ||
+             h->fmt_type == TLP_IORd || h->fmt_type == TLP_IOWr) {
+    e->expect_bc = 4;
+  }
+  e->ts_ns = now_ns;
+
+  e->prev = t->newest;
+  e->next = TRACKER_NONE;
+  if (t->newest != TRACKER_NONE) {
+    t->entries[t->newest].next = n;
+  } else {
+    t->oldest = n;
+  }
+  t->newest = n;
+
+  for (i = tracker_hash (key); t->index[i] != TRACKER_NONE;
+       i = (i + 1) & (TRACKER_INDEX_SLOTS - 1)) {
+  }
+  t->index[i] = n;
+
+  t->requests++;
+  t->types[e->type].requests++;
+  r->requests++;
+  t->outstanding++;
+  if (t->outstanding > t->peak) {
+    t->peak = t->outstanding;
+  }
+  stats_hist_add (&t->depth, t->outstanding);
+}
+
+static void
+tracker_completion (tracker_t *t,
+                    const tlp_hdr *h,
+                    unsigned dev,
+                    uint64_t now_ns)
+{
+  uint32_t i;
+  uint32_t bc;
+  uint32_t bytes;
+  tracker_entry *e;
+
+  t->completions++;
+  i = tracker_find (t, tracker_key (dev, h->requester, h->tag));
+  if (i == TRACKER_NONE) {
+    t->unexpected++;
+    return;
+  }
+
+  e = &t->entries[t->index[i]];
+  e->parts++;
+
+  /*
+   * Byte count is what's left including this part (0 means
+   * 4096); only the first part may start mid-DWORD.
+   */
+  bc = h->byte_count != 0 ? h->byte_count : 4096;
+  bytes = tlp_hdr_payload_dws (h) * 4;
+  if (e->parts == 1 && bytes != 0) {
+    bytes -= h->lower_address & 3;
+  }
+  if (e->expect_bc != 0 && h->status == TLP_CPL_STATUS_SC &&
+      bc != e->expect_bc) {
+    t->bad_byte_counts++;
+  }
+
+  if (h->status == TLP_CPL_STATUS_SC && bytes != 0 && bc > bytes) {
+    if (e->expect_bc != 0) {
+      e->expect_bc = bc - bytes;
+    }
+    return;
+  }
+
+  t->status[h->status & 7]++;
+  t->done++;
+  if (e->parts > 1) {
+    t->split++;
+  }
+  now_ns = now_ns > e->ts_ns ? now_ns - e->ts_ns : 0;
+  stats_hist_add (&t->types[e->type].latency_ns, now_ns);
+  stats_hist_add (&t->requesters[e->requester].latency_ns, now_ns);
+  tracker_remove (t, i);
+}
+
+/*
+ * Feeds one received TLP to t. TLPs are expected in receive
+ * order (as merged, with several devices).
+ */
+void
+tracker_tlp (tracker_t *t,
+             const tlp_desc_t *desc)
+{
+  tlp_hdr h;
+
+  tracker_expire (t, desc->ts_ns);
+  if (tlp_decode (desc->data, desc->size / sizeof (uint32_t), &h) != NULL) {
+    if (t->type_of[h.fmt_type] != 0) {
+      tracker_request (t, &h, desc->dev, desc->ts_ns);
+    } else if (tlp_types[h.fmt_type].layout == TLP_LAYOUT_CPL) {
+      tracker_completion (t, &h, desc->dev, desc->ts_ns);
+    }
+  }
+  tracker_sample (t, desc->ts_ns);
+}
+
+void
+tracker_print (tracker_t *t,
+               FILE *f)
+{
+  unsigned i;
+  unsigned n;
+  char name[16];
+
+  fprintf (f, "Transactions: %" PRIu64 " requests, %" PRIu64 " completions "
+           "ending %" PRIu64 " of them (%" PRIu64 " split), %u outstanding "
+           "(peak %u), %" PRIu64 " timed out, %" PRIu64 " unexpected "
+           "completions, %" PRIu64 " bad byte counts, %" PRIu64 " tags "
+           "reused, %" PRIu64 " given up (tracker full)\n",
+           t->requests, t->completions, t->done, t->split, t->outstanding,
+           t->peak, t->timeouts, t->unexpected, t->bad_byte_counts,
+           t->tags_reused, t->dropped);
+  fprintf (f, "Completion status: %" PRIu64 " SC, %" PRIu64 " UR, "
+           "%" PRIu64 " CRS, %" PRIu64 " CA, %" PRIu64 " other\n",
+           t->status[TLP_CPL_STATUS_SC], t->status[TLP_CPL_STATUS_UR],
+           t->status[2], t->status[TLP_CPL_STATUS_CA],
+           t->done - t->status[TLP_CPL_STATUS_SC] -
+           t->status[TLP_CPL_STATUS_UR] - t->status[2] -
+           t->status[TLP_CPL_STATUS_CA]);
+
+  fprintf (f, "Latency by type:\n");
+  for (i = 0; i < TRACKER_TYPES; i++) {
+    if (t->types[i].timeouts != 0) {
+      fprintf (f, "  %-18s %10" PRIu64 " timed out\n",
+               tlp_types[tracker_types[i]].name, t->types[i].timeouts);
+    }
+    stats_print_hist (f, tlp_types[tracker_types[i]].name, "ns",
+                      &t->types[i].latency_ns);
+  }
+
+  fprintf (f, "Latency by requester:\n");
+  for (i = 0; i <= t->requester_count && i <= TRACKER_REQUESTERS; i++) {
+    if (i < t->requester_count) {
+      snprintf (name, sizeof (name), "%02x:%02x.%x",
+                t->requester_ids[i] >> 8, (t->requester_ids[i] >> 3) & 0x1f,
+                t->requester_ids[i] & 7);
+    } else {
+      snprintf (name, sizeof (name), "others");
+    }
+    if (t->requesters[i].timeouts != 0) {
+      fprintf (f, "  %-18s %10" PRIu64 " timed out\n", name,
+               t->requesters[i].timeouts);
+    }
+    stats_print_hist (f, name, "ns", &t->requesters[i].latency_ns);
+  }
+
+  fprintf (f, "Outstanding requests:\n");
+  stats_print_hist (f, "at each request", "", &t->depth);
+  n = t->depth_count < TRACKER_DEPTH_SAMPLES ?
+    t->depth_count : TRACKER_DEPTH_SAMPLES;
+  if (n != 0) {
+    fprintf (f, "  peak per %llu ms, last %u:",
+             TRACKER_DEPTH_INTERVAL_NS / 1000000, n);
+    for (i = t->depth_count - n; i < t->depth_count; i++) {
+      fprintf (f, " %u", t->depth_peaks[i % TRACKER_DEPTH_SAMPLES]);
+    }
+    fputc ('\n', f);
+  }
+}
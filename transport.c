@@ -0,0 +1,74 @@
+/*
+ * Part of screamer_tools.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "screamer.h"
+
+transport_t *
+transport_open (const transport_ops *ops,
+                const char *spec,
+                transport_params *params)
+{
+  int err;
+  transport_t *t;
+
+  t = calloc (1, sizeof (*t));
+  if (t == NULL) {
+    return NULL;
+  }
+
+  t->ops = ops;
+  t->params = *params;
+  t->epoch_offset_ns = time_epoch_offset_ns ();
+
+  err = ops->open (t, spec);
+  if (err != 0) {
+    free (t);
+    return NULL;
+  }
+
+  return t;
+}
+
+void
+transport_close (transport_t *t)
+{
+  t->ops->close (t);
+  free (t);
+}
+
+/*
+ * Reads the next transfer, recording it first if there's a
+ * recorder. Should recording fail, so does the stream.
+ */
+int
+transport_read (transport_t *t,
+                void **data,
+                int *transferred)
+{
+  int err;
+  int rec_err;
+
+  err = t->ops->read (t, data, transferred);
+  if (t->rec == NULL || (err != 0 && err != TRANSPORT_RECONNECTED)) {
+    return err;
+  }
+
+  if (err == 0) {
+    rec_err = rawrec_write (t->rec, *data, *transferred, t->rx_ns, 0);
+  } else {
+    rec_err = rawrec_write (t->rec, NULL, 0, t->rx_ns, RAW_REC_RECONNECT);
+  }
+  if (rec_err != 0) {
+    fprintf (stderr, "Raw recording failed, stopping\n");
+    if (err == 0) {
+      transport_release (t, *data);
+    }
+    *transferred = 0;
+    return TRANSPORT_EOF;
+  }
+
+  return err;
+}
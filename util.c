@@ -5,6 +5,7 @@
  */
 
 #include "screamer.h"
+#include <time.h>
 
 static int socket_fd = -1;
 static struct sockaddr_in sa;
@@ -43,6 +44,27 @@ net_dump(void *buffer,
   }
 }
 
+uint64_t
+time_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * What to add to time_now_ns () for ns since the epoch.
+ */
+uint64_t
+time_epoch_offset_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec - time_now_ns ();
+}
+
 void
 hex_dump(uint8_t *buffer,
          int num_bytes,
@@ -306,4 +306,96 @@ function tlp_proto.dissector(buffer, pinfo, tree)
 	-- End: pinfo
 end
 
-DissectorTable.get("udp.port"):add("9999", tlp_proto)
+-- screamer_scope export datagrams (export.c): a header, then per
+-- TLP a record header followed by the TLP
+-- |       0       |       1       |       2       |       3       |
+-- +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+-- |                        Magic ("STLP")                         |
+-- +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+-- |    Version    |       R       |           TLP Count           |
+-- +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+--
+-- +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+-- |                        Sequence Number                        |
+-- +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+-- |                   Timestamp (ns since epoch)                  |
+-- +                                                               +
+-- |                                                               |
+-- +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+-- |    Device     |     Flags     |         TLP Length            |
+-- +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+local export_proto = Proto("ScreamerTLP", "Screamer TLP Export")
+
+local export_f = export_proto.fields
+
+export_f.magic = ProtoField.uint32("screamer.magic", "Magic", base.HEX)
+export_f.version = ProtoField.uint8("screamer.version", "Version")
+export_f.count = ProtoField.uint16("screamer.count", "TLP Count")
+export_f.seq = ProtoField.uint32("screamer.seq", "Sequence Number")
+export_f.ts = ProtoField.absolute_time("screamer.ts", "Timestamp", base.UTC)
+export_f.dev = ProtoField.uint8("screamer.dev", "Device")
+export_f.flags = ProtoField.uint8("screamer.flags", "Flags", base.HEX)
+export_f.corrupt = ProtoField.bool("screamer.corrupt", "Corrupt", 8, nil, 0x02)
+export_f.truncated = ProtoField.bool("screamer.truncated", "Truncated", 8, nil, 0x04)
+export_f.resync = ProtoField.bool("screamer.resync", "Lost sync before", 8, nil, 0x08)
+export_f.reconnect = ProtoField.bool("screamer.reconnect", "Reconnected before", 8, nil, 0x10)
+export_f.headers = ProtoField.bool("screamer.headers", "Header only", 8, nil, 0x80)
+export_f.size = ProtoField.uint16("screamer.size", "TLP Length")
+
+local EXPORT_MAGIC = 0x53544c50
+
+function export_proto.dissector(buffer, pinfo, tree)
+	-- Bare TLPs, as screamer_sac still sends them
+	if buffer:len() < 8 or buffer(0,4):uint() ~= EXPORT_MAGIC then
+		return tlp_proto.dissector(buffer, pinfo, tree)
+	end
+
+	local count = buffer(6,2):uint()
+	local subtree = tree:add(export_proto, buffer(0,8))
+	subtree:add(export_f.magic, buffer(0,4))
+	subtree:add(export_f.version, buffer(4,1))
+	subtree:add(export_f.count, buffer(6,2))
+
+	local offset = 8
+	local first_seq = nil
+	local last_seq = nil
+	for i = 1, count do
+		if offset + 16 > buffer:len() then break end
+		local seq = buffer(offset,4):uint()
+		local size = buffer(offset + 14,2):uint()
+		if offset + 16 + size > buffer:len() then break end
+		local ts = buffer(offset + 4,8):uint64()
+		local ns = NSTime.new((ts / 1000000000):tonumber(), (ts % 1000000000):tonumber())
+
+		local rec_subtree = tree:add(export_proto, buffer(offset, 16 + size), string.format("TLP %u, device %u", seq, buffer(offset + 12,1):uint()))
+		rec_subtree:add(export_f.seq, buffer(offset,4))
+		rec_subtree:add(export_f.ts, buffer(offset + 4,8), ns)
+		rec_subtree:add(export_f.dev, buffer(offset + 12,1))
+		local flags_subtree = rec_subtree:add(export_f.flags, buffer(offset + 13,1))
+			flags_subtree:add(export_f.corrupt, buffer(offset + 13,1))
+			flags_subtree:add(export_f.truncated, buffer(offset + 13,1))
+			flags_subtree:add(export_f.resync, buffer(offset + 13,1))
+			flags_subtree:add(export_f.reconnect, buffer(offset + 13,1))
+			flags_subtree:add(export_f.headers, buffer(offset + 13,1))
+		rec_subtree:add(export_f.size, buffer(offset + 14,2))
+		if size > 0 then
+			tlp_proto.dissector(buffer(offset + 16, size):tvb(), pinfo, rec_subtree)
+		end
+
+		first_seq = first_seq or seq
+		last_seq = seq
+		offset = offset + 16 + size
+	end
+
+	pinfo.cols.protocol = "ScreamerTLP"
+	if first_seq ~= nil then
+		pinfo.cols.info = string.format("%u TLPs, seq %u-%u", count, first_seq, last_seq)
+	end
+end
+
+-- screamer_scope exports to 9999 (older versions sent device N of
+-- a merged capture to 9999 + N, one bare TLP per datagram)
+DissectorTable.get("udp.port"):add("9999-10006", export_proto)
+-- and pcapng captures (-o) as USER0, TLPs bare
+DissectorTable.get("wtap_encap"):add(wtap_encaps and wtap_encaps.USER0 or wtap.USER0, tlp_proto)